@@ -11,6 +11,15 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 TARGET = FaceScanKinect
 TEMPLATE = app
 
+# std::from_chars and std::to_chars for floats (text point clouds) and std::invoke_result need C++17 and
+# Visual Studio 2019 16.4 (MSVC 19.24) or newer. The v140 (Visual Studio 2015) builds of the OpenFace
+# dependencies below link unchanged, Visual Studio 2015 to 2019 share one binary interface.
+CONFIG += c++17
+
+msvc:lessThan(QMAKE_MSC_VER, 1924) {
+    error("FaceScanKinect needs Visual Studio 2019 16.4 or newer, a Qt kit for MSVC 2019 64-bit")
+}
+
 # The following define makes your compiler emit warnings if you use
 # any feature of Qt which has been marked as deprecated (the exact warnings
 # depend on your compiler). Please consult the documentation of the
@@ -22,6 +31,9 @@ DEFINES += QT_DEPRECATED_WARNINGS
 # You can also select to disable deprecated APIs only up to a certain version of Qt.
 DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
+# SIMD kernels use SSE2 on every x64 build. Uncomment to also use AVX2 (needs a Haswell or newer CPU).
+#QMAKE_CXXFLAGS += /arch:AVX2
+
 
 SOURCES += \
     src/KinectGrabber.cpp \
@@ -33,6 +45,17 @@ SOURCES += \
     src/ScanSession.cpp \
     src/SnapshotGrid.cpp\
     src/OpenCVWebcamGrabber.cpp\
+    src/Benchmark.cpp\
+    src/TaskScheduler.cpp\
+    src/FrameSource.cpp\
+    src/FrameRecording.cpp\
+    src/ReplayFrameSource.cpp\
+    src/CoordinateMapper.cpp\
+    src/SnapshotQueue.cpp\
+    src/SnapshotImages.cpp\
+    src/SessionIndex.cpp\
+    src/SnapshotThumbnails.cpp\
+    src/PointCloudCompression.cpp\
 
 HEADERS += \
     src/KinectGrabber.h \
@@ -48,6 +71,19 @@ HEADERS += \
     src/ScanSession.h\
     src/SnapshotGrid.h\
     src/OpenCVWebcamGrabber.h\
+    src/Benchmark.h\
+    src/TaskScheduler.h\
+    src/FrameSource.h\
+    src/FrameRecording.h\
+    src/ReplayFrameSource.h\
+    src/CoordinateMapper.h\
+    src/DepthConversion.h\
+    src/CapturePipeline.h\
+    src/SnapshotQueue.h\
+    src/SnapshotImages.h\
+    src/SessionIndex.h\
+    src/SnapshotThumbnails.h\
+    src/PointCloudCompression.h\
 
 FORMS += \
     mainwindow.ui
@@ -0,0 +1,1103 @@
+#include "Benchmark.h"
+
+#include <QElapsedTimer>
+#include <QDebug>
+#include <QtMath>
+#include <QTemporaryDir>
+#include <QDir>
+#include <QFileInfo>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "CoordinateMapper.h"
+#include "DepthConversion.h"
+#include "FrameRecording.h"
+#include "MemoryPool.h"
+#include "PointCloud.h"
+#include "PointCloudCompression.h"
+#include "SnapshotImages.h"
+
+QString Benchmark::NormalEstimation(int numPoints)
+{
+    PointCloudBuffer buf;
+    PointCloudHelpers::GenerateRandomHemiSphere(&buf, numPoints);
+
+    // Reference result from the general solver
+    QElapsedTimer timer;
+    timer.start();
+    PointCloudHelpers::ComputeNormals(&buf, PointCloudHelpers::NORMALS_GENERAL_EIGEN);
+    qint64 generalTime = timer.elapsed();
+
+    Vec3f* referenceNormals = new Vec3f[buf.numPoints];
+    memcpy(referenceNormals, buf.normals, buf.numPoints * sizeof(Vec3f));
+
+    timer.restart();
+    PointCloudHelpers::ComputeNormals(&buf, PointCloudHelpers::NORMALS_SYMMETRIC_3X3);
+    qint64 symmetricTime = timer.elapsed();
+
+    // Both normals are oriented towards the sensor, so they should point in the same direction
+    float minCosine = 1.0f;
+    for (size_t i = 0; i < buf.numPoints; ++i) {
+        Vec3f a = referenceNormals[i];
+        Vec3f b = buf.normals[i];
+        float cosine = a.X * b.X + a.Y * b.Y + a.Z * b.Z;
+        if (cosine < minCosine) { minCosine = cosine; }
+    }
+    float maxAngle = qRadiansToDegrees(acosf(qBound(-1.0f, minCosine, 1.0f)));
+
+    delete [] referenceNormals;
+
+    float speedup = symmetricTime > 0 ? (float)generalTime / (float)symmetricTime : 0.0f;
+
+    qInfo() << "Normal estimation on" << buf.numPoints << "points:"
+            << "general solver" << generalTime << "ms,"
+            << "symmetric solver" << symmetricTime << "ms,"
+            << "speedup" << speedup << ","
+            << "max angle deviation" << maxAngle << "degrees";
+
+    return QString("Normals (%1 points): general %2 ms, symmetric %3 ms, speedup %4x, max deviation %5 deg")
+            .arg(buf.numPoints)
+            .arg(generalTime)
+            .arg(symmetricTime)
+            .arg(speedup, 0, 'f', 2)
+            .arg(maxAngle, 0, 'f', 3);
+}
+
+//
+// Accessors for the coordinates of a point in both layouts
+//
+static inline void GetPoint(const PointCloudBuffer& cloud, size_t index, float* point) {
+    point[0] = cloud.points[index].X;
+    point[1] = cloud.points[index].Y;
+    point[2] = cloud.points[index].Z;
+}
+
+static inline void GetPoint(const PointCloudPlanes& cloud, size_t index, float* point) {
+    point[0] = cloud.X[index];
+    point[1] = cloud.Y[index];
+    point[2] = cloud.Z[index];
+}
+
+struct LayoutTimings {
+    qint64 filterTime;
+    qint64 normalTime;
+    double checksum;
+};
+
+//
+// Same neighbor searches and point accesses as Filter() and ComputeNormals(), without the parts
+// that do not depend on the layout (compaction, eigen solver)
+//
+template<typename Cloud>
+static LayoutTimings RunNeighborWorkload(const Cloud& cloud, size_t numPoints)
+{
+    typedef nanoflann::KDTreeSingleIndexAdaptor<
+            nanoflann::L2_Simple_Adaptor<float, Cloud>,
+            Cloud,
+            3> Tree;
+
+    LayoutTimings result = { 0, 0, 0.0 };
+    QElapsedTimer timer;
+
+    // Filter: build the index and average the distance to the 10 nearest neighbors
+    timer.start();
+    Tree tree(3, cloud, nanoflann::KDTreeSingleIndexAdaptorParams());
+    tree.buildIndex();
+
+    {
+        const size_t k = 10;
+        std::vector<size_t> indices(k);
+        std::vector<float>  squaredDistances(k);
+        float queryPoint[3];
+
+        for (size_t pointIndex = 0; pointIndex < numPoints; ++pointIndex) {
+            GetPoint(cloud, pointIndex, queryPoint);
+            size_t numResults = tree.knnSearch(queryPoint, k, &indices[0], &squaredDistances[0]);
+
+            float meanDistance = 0.0f;
+            for (size_t i = 0; i < numResults; ++i) {
+                meanDistance += sqrtf(squaredDistances[i]);
+            }
+            result.checksum += meanDistance / numResults;
+        }
+    }
+    result.filterTime = timer.elapsed();
+
+    // Normals: covariance of the 15 nearest neighbors
+    timer.restart();
+    {
+        const size_t k = 15;
+        std::vector<size_t> indices(k);
+        std::vector<float>  squaredDistances(k);
+        float queryPoint[3];
+        float neighbor[3];
+
+        for (size_t pointIndex = 0; pointIndex < numPoints; ++pointIndex) {
+            GetPoint(cloud, pointIndex, queryPoint);
+            size_t numResults = tree.knnSearch(queryPoint, k, &indices[0], &squaredDistances[0]);
+
+            float centroid[3] = { 0.0f, 0.0f, 0.0f };
+            for (size_t i = 0; i < numResults; ++i) {
+                GetPoint(cloud, indices[i], neighbor);
+                centroid[0] += neighbor[0];
+                centroid[1] += neighbor[1];
+                centroid[2] += neighbor[2];
+            }
+            centroid[0] /= numResults;
+            centroid[1] /= numResults;
+            centroid[2] /= numResults;
+
+            float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+            for (size_t i = 0; i < numResults; ++i) {
+                GetPoint(cloud, indices[i], neighbor);
+                float dx = neighbor[0] - centroid[0];
+                float dy = neighbor[1] - centroid[1];
+                float dz = neighbor[2] - centroid[2];
+                covariance[0] += dx * dx;
+                covariance[1] += dx * dy;
+                covariance[2] += dx * dz;
+                covariance[3] += dy * dy;
+                covariance[4] += dy * dz;
+                covariance[5] += dz * dz;
+            }
+            result.checksum += covariance[0] + covariance[3] + covariance[5];
+        }
+    }
+    result.normalTime = timer.elapsed();
+
+    return result;
+}
+
+QString Benchmark::MemoryLayout(int numPoints)
+{
+    PointCloudBuffer buf;
+    PointCloudHelpers::GenerateRandomHemiSphere(&buf, numPoints);
+
+    PointCloudPlanes planes(buf.numPoints);
+    CopyPointCloudBufferToPlanes(&buf, &planes);
+
+    LayoutTimings aos = RunNeighborWorkload(buf,    buf.numPoints);
+    LayoutTimings soa = RunNeighborWorkload(planes, planes.numPoints);
+
+    // Both layouts hold the same points, so the results have to be identical
+    bool resultsMatch = aos.checksum == soa.checksum;
+
+    qInfo() << "Memory layout on" << buf.numPoints << "points:"
+            << "filter AoS" << aos.filterTime << "ms, SoA" << soa.filterTime << "ms,"
+            << "normals AoS" << aos.normalTime << "ms, SoA" << soa.normalTime << "ms,"
+            << "results" << (resultsMatch ? "match" : "DIFFER");
+
+    return QString("Layout (%1 points): filter AoS %2 ms / SoA %3 ms, normals AoS %4 ms / SoA %5 ms%6")
+            .arg(buf.numPoints)
+            .arg(aos.filterTime)
+            .arg(soa.filterTime)
+            .arg(aos.normalTime)
+            .arg(soa.normalTime)
+            .arg(resultsMatch ? "" : ", results differ!");
+}
+
+QString Benchmark::ReplayThroughput(const QString& recordingFile, int maxFrames)
+{
+    std::unique_ptr<FrameRecording> recording = FrameRecording::Open(recordingFile.toStdString());
+    if (!recording) {
+        return QString("Replay throughput: could not open recording %1").arg(recordingFile);
+    }
+
+    QTemporaryDir snapshotDirectory;
+    if (!snapshotDirectory.isValid()) {
+        return QString("Replay throughput: could not create a temporary directory");
+    }
+    QString snapshotPath = snapshotDirectory.path() + "/";
+
+    size_t numFrames = recording->NumFrames();
+    if (maxFrames > 0 && (size_t)maxFrames < numFrames) { numFrames = (size_t)maxFrames; }
+
+    if (numFrames == 0) {
+        return QString("Replay throughput: recording has no frames");
+    }
+
+    FrameBuffer frame;
+    PointCloudBuffer filtered;
+
+    // Same steps as SaveSnapshot(), timed one by one
+    qint64 createTime  = 0;
+    qint64 filterTime  = 0;
+    qint64 normalTime  = 0;
+    qint64 writeTime   = 0;
+    size_t totalPoints = 0;
+    size_t keptPoints  = 0;
+
+    QElapsedTimer timer;
+    for (size_t i = 0; i < numFrames; ++i) {
+        timer.start();
+        LoadRecordedFrame(recording->Frame(i), &frame);
+        createTime += timer.nsecsElapsed();
+
+        timer.start();
+        PointCloudHelpers::Filter(frame.pointCloudBuffer, &filtered, 10, 1.0f, PointCloudHelpers::ALL_CORES);
+        filterTime += timer.nsecsElapsed();
+
+        timer.start();
+        PointCloudHelpers::ComputeNormals(&filtered);
+        normalTime += timer.nsecsElapsed();
+
+        totalPoints += frame.pointCloudBuffer->numPoints;
+        keptPoints  += filtered.numPoints;
+
+        timer.start();
+        PointCloudHelpers::WriteSnapshot(&frame, &filtered, snapshotPath, (int)i);
+        writeTime += timer.nsecsElapsed();
+    }
+
+    double totalMs = (createTime + filterTime + normalTime + writeTime) / 1e6;
+    double fps = totalMs > 0.0 ? numFrames * 1000.0 / totalMs : 0.0;
+
+    auto perFrameMs = [&](qint64 time) { return time / 1e6 / numFrames; };
+
+    qInfo() << "Replay throughput on" << numFrames << "frames of" << recordingFile << ":"
+            << "create" << perFrameMs(createTime) << "ms,"
+            << "filter" << perFrameMs(filterTime) << "ms,"
+            << "normals" << perFrameMs(normalTime) << "ms,"
+            << "write" << perFrameMs(writeTime) << "ms per frame,"
+            << totalPoints / numFrames << "points per frame," << keptPoints / numFrames << "after filtering,"
+            << fps << "fps";
+
+    return QString("Replay (%1 frames, %2 points): create %3 ms, filter %4 ms, normals %5 ms, write %6 ms per frame, %7 fps")
+            .arg(numFrames)
+            .arg(totalPoints / numFrames)
+            .arg(perFrameMs(createTime), 0, 'f', 1)
+            .arg(perFrameMs(filterTime), 0, 'f', 1)
+            .arg(perFrameMs(normalTime), 0, 'f', 1)
+            .arg(perFrameMs(writeTime),  0, 'f', 1)
+            .arg(fps, 0, 'f', 1);
+}
+
+QString Benchmark::CoordinateMapping(const QString& recordingFile, int repetitions)
+{
+    std::unique_ptr<FrameRecording> recording = FrameRecording::Open(recordingFile.toStdString());
+    if (!recording) {
+        return QString("Coordinate mapping: could not open recording %1").arg(recordingFile);
+    }
+
+    // The first frame that sees enough of the scene
+    CameraCalibration calibration;
+    float depthError = 0.0f;
+    float colorError = 0.0f;
+    size_t frameIndex = 0;
+    qint64 fitTime = 0;
+
+    QElapsedTimer timer;
+    for (; frameIndex < recording->NumFrames(); ++frameIndex) {
+        RecordedFrame recorded = recording->Frame(frameIndex);
+
+        timer.start();
+        bool fitted = FitCameraCalibration(recorded.depthToCamera, recorded.depthToColor, &calibration, &depthError, &colorError);
+        fitTime = timer.nsecsElapsed();
+
+        if (fitted) { break; }
+    }
+
+    if (frameIndex == recording->NumFrames()) {
+        return QString("Coordinate mapping: no frame of the recording has enough valid pixels for a calibration");
+    }
+
+    RecordedFrame recorded = recording->Frame(frameIndex);
+
+    timer.start();
+    CoordinateMapper mapper(calibration);
+    qint64 tableTime = timer.nsecsElapsed();
+
+    std::vector<Vec3f> scalarPositions(NUM_DEPTH_PIXELS);
+    std::vector<Vec2f> scalarColors(NUM_DEPTH_PIXELS);
+    std::vector<Vec3f> positions(NUM_DEPTH_PIXELS);
+    std::vector<Vec2f> colors(NUM_DEPTH_PIXELS);
+
+    timer.start();
+    for (int i = 0; i < repetitions; ++i) {
+        mapper.MapDepthFrameScalar(recorded.depthBuffer16, scalarPositions.data(), scalarColors.data());
+    }
+    qint64 scalarTime = timer.nsecsElapsed();
+
+    timer.start();
+    for (int i = 0; i < repetitions; ++i) {
+        mapper.MapDepthFrame(recorded.depthBuffer16, positions.data(), colors.data());
+    }
+    qint64 simdTime = timer.nsecsElapsed();
+
+    bool identical = memcmp(positions.data(), scalarPositions.data(), NUM_DEPTH_PIXELS * sizeof(Vec3f)) == 0 &&
+                     memcmp(colors.data(),    scalarColors.data(),    NUM_DEPTH_PIXELS * sizeof(Vec2f)) == 0;
+
+    // Deviation from the SDK on the pixels that both consider valid
+    std::vector<Vec3f> validPoints;
+    double maxPositionError = 0.0, sumPositionError = 0.0;
+    double maxColorError    = 0.0, sumColorError    = 0.0;
+    size_t numValidColors   = 0;
+
+    for (int pixel = 0; pixel < NUM_DEPTH_PIXELS; ++pixel) {
+        Vec3f p = recorded.depthToCamera[pixel];
+        if (recorded.depthBuffer16[pixel] == 0 || !std::isfinite(p.Z)) { continue; }
+
+        Vec3f q = positions[pixel];
+        double positionError = std::sqrt((p.X - q.X) * (p.X - q.X) + (p.Y - q.Y) * (p.Y - q.Y) + (p.Z - q.Z) * (p.Z - q.Z));
+        maxPositionError = std::max(maxPositionError, positionError);
+        sumPositionError += positionError;
+        validPoints.push_back(p);
+
+        Vec2f c = recorded.depthToColor[pixel];
+        if (!std::isfinite(c.X) || !std::isfinite(c.Y)) { continue; }
+
+        Vec2f d = colors[pixel];
+        double colorDeviation = std::sqrt((c.X - d.X) * (c.X - d.X) + (c.Y - d.Y) * (c.Y - d.Y));
+        maxColorError = std::max(maxColorError, colorDeviation);
+        sumColorError += colorDeviation;
+        ++numValidColors;
+    }
+
+    size_t numPoints = validPoints.size();
+    if (numPoints == 0) {
+        return QString("Coordinate mapping: frame %1 has no valid depth pixels").arg(frameIndex);
+    }
+
+    // Mesh vertices: one call per point against one call for all of them
+    std::vector<Vec2f> pointColors(numPoints);
+
+    timer.start();
+    for (int i = 0; i < repetitions; ++i) {
+        for (size_t point = 0; point < numPoints; ++point) {
+            pointColors[point] = mapper.MapCameraPointToColorSpace(validPoints[point]);
+        }
+    }
+    qint64 perPointTime = timer.nsecsElapsed();
+
+    timer.start();
+    for (int i = 0; i < repetitions; ++i) {
+        mapper.MapCameraPointsToColorSpace(validPoints.data(), numPoints, pointColors.data());
+    }
+    qint64 batchTime = timer.nsecsElapsed();
+
+    auto perRunMs = [&](qint64 time) { return time / 1e6 / repetitions; };
+
+    qInfo() << "Coordinate mapping on frame" << frameIndex << "of" << recordingFile << ":"
+            << "fit" << fitTime / 1e6 << "ms (RMS" << depthError << "depth px," << colorError << "color px),"
+            << "ray table" << tableTime / 1e6 << "ms,"
+            << "depth frame scalar" << perRunMs(scalarTime) << "ms, SIMD" << perRunMs(simdTime) << "ms,"
+            << (identical ? "identical results," : "results differ,")
+            << numPoints << "points per point" << perRunMs(perPointTime) << "ms, batched" << perRunMs(batchTime) << "ms,"
+            << "deviation from SDK: camera max" << maxPositionError * 1000.0 << "mm mean" << sumPositionError * 1000.0 / numPoints << "mm,"
+            << "color max" << maxColorError << "px mean" << (numValidColors > 0 ? sumColorError / numValidColors : 0.0) << "px";
+
+    return QString("Coordinate mapping: depth frame %1 ms scalar, %2 ms SIMD; %3 points %4 ms per point, %5 ms batched; "
+                   "max deviation from SDK %6 mm, %7 px")
+            .arg(perRunMs(scalarTime), 0, 'f', 2)
+            .arg(perRunMs(simdTime), 0, 'f', 2)
+            .arg(numPoints)
+            .arg(perRunMs(perPointTime), 0, 'f', 2)
+            .arg(perRunMs(batchTime), 0, 'f', 2)
+            .arg(maxPositionError * 1000.0, 0, 'f', 2)
+            .arg(maxColorError, 0, 'f', 2);
+}
+
+QString Benchmark::DepthConversion(int repetitions)
+{
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> depthDistribution(0, 8000);
+
+    std::vector<uint16_t> depth(NUM_DEPTH_PIXELS);
+    for (auto& d : depth) { d = (uint16_t)depthDistribution(random); }
+
+    // Every value once, so the full input range is covered
+    for (int i = 0; i < 65536; ++i) { depth[i] = (uint16_t)i; }
+
+    std::vector<uint8_t> scalarResult(NUM_DEPTH_PIXELS);
+    std::vector<uint8_t> result(NUM_DEPTH_PIXELS);
+
+    // Reliable range of the kinect, the whole 16 bit range, a tiny one and a reversed one.
+    // An odd pixel count exercises the scalar remainder of the SIMD loop.
+    const uint16_t ranges[][2] = { {500, 4500}, {0, 65535}, {1000, 1001}, {4500, 500} };
+    const int pixelCounts[] = { NUM_DEPTH_PIXELS, NUM_DEPTH_PIXELS - 7 };
+
+    size_t numMismatches = 0;
+    for (auto& range : ranges) {
+        for (int numPixels : pixelCounts) {
+            ConvertDepthTo8BitScalar(depth.data(), scalarResult.data(), numPixels, range[0], range[1]);
+            ConvertDepthTo8Bit(depth.data(), result.data(), numPixels, range[0], range[1]);
+
+            for (int pixel = 0; pixel < numPixels; ++pixel) {
+                if (result[pixel] != scalarResult[pixel]) { ++numMismatches; }
+            }
+        }
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < repetitions; ++i) {
+        ConvertDepthTo8BitScalar(depth.data(), scalarResult.data(), NUM_DEPTH_PIXELS, 500, 4500);
+    }
+    qint64 scalarTime = timer.nsecsElapsed();
+
+    timer.start();
+    for (int i = 0; i < repetitions; ++i) {
+        ConvertDepthTo8Bit(depth.data(), result.data(), NUM_DEPTH_PIXELS, 500, 4500);
+    }
+    qint64 simdTime = timer.nsecsElapsed();
+
+#if defined(DEPTH_CONVERSION_AVX2)
+    const char* instructionSet = "AVX2";
+#elif defined(DEPTH_CONVERSION_SSE2)
+    const char* instructionSet = "SSE2";
+#else
+    const char* instructionSet = "scalar";
+#endif
+
+    double scalarUs = scalarTime / 1e3 / repetitions;
+    double simdUs   = simdTime   / 1e3 / repetitions;
+
+    qInfo() << "Depth conversion of" << NUM_DEPTH_PIXELS << "pixels:"
+            << "scalar" << scalarUs << "us," << instructionSet << simdUs << "us,"
+            << "speedup" << (simdUs > 0.0 ? scalarUs / simdUs : 0.0) << ","
+            << numMismatches << "pixels differ from the scalar version";
+
+    return QString("Depth conversion: scalar %1 us, %2 %3 us per frame, %4")
+            .arg(scalarUs, 0, 'f', 1)
+            .arg(instructionSet)
+            .arg(simdUs, 0, 'f', 1)
+            .arg(numMismatches == 0 ? QString("bit-exact") : QString("%1 pixels differ").arg(numMismatches));
+}
+
+QString Benchmark::PointCloudExtraction(const QString& recordingFile, int repetitions, int maxFrames)
+{
+    std::unique_ptr<FrameRecording> recording = FrameRecording::Open(recordingFile.toStdString());
+    if (!recording) {
+        return QString("Point cloud extraction: could not open recording %1").arg(recordingFile);
+    }
+
+    size_t numFrames = recording->NumFrames();
+    if (maxFrames > 0 && (size_t)maxFrames < numFrames) { numFrames = (size_t)maxFrames; }
+
+    if (numFrames == 0) {
+        return QString("Point cloud extraction: recording has no frames");
+    }
+
+    PointCloudBuffer reference;
+    PointCloudBuffer result;
+
+    qint64 scalarTime   = 0;
+    qint64 simdTime     = 0;
+    size_t totalPoints  = 0;
+    size_t numDifferent = 0;
+
+    QElapsedTimer timer;
+    for (size_t i = 0; i < numFrames; ++i) {
+        RecordedFrame f = recording->Frame(i);
+
+        timer.start();
+        for (int r = 0; r < repetitions; ++r) {
+            PointCloudHelpers::CreatePointCloudScalar(f.colorBuffer, f.depthToCamera, f.depthToColor,
+                                                      f.bodyIndexBuffer, f.header.cutoffHeight, &reference);
+        }
+        scalarTime += timer.nsecsElapsed();
+
+        timer.start();
+        for (int r = 0; r < repetitions; ++r) {
+            PointCloudHelpers::CreatePointCloud(f.colorBuffer, f.depthToCamera, f.depthToColor,
+                                                f.bodyIndexBuffer, f.header.cutoffHeight, &result);
+        }
+        simdTime += timer.nsecsElapsed();
+
+        size_t n = reference.numPoints;
+        bool identical = result.numPoints == n &&
+                         memcmp(result.points, reference.points, n * sizeof(Vec3f)) == 0 &&
+                         memcmp(result.colors, reference.colors, n * sizeof(RGB3f)) == 0 &&
+                         memcmp(result.depthPixelIndices, reference.depthPixelIndices, n * sizeof(int32_t)) == 0;
+
+        if (!identical) { ++numDifferent; }
+        totalPoints += n;
+    }
+
+    double scalarMs = scalarTime / 1e6 / (numFrames * repetitions);
+    double simdMs   = simdTime   / 1e6 / (numFrames * repetitions);
+
+    qInfo() << "Point cloud extraction on" << numFrames << "frames of" << recordingFile << ":"
+            << "scalar" << scalarMs << "ms, SIMD mask and compaction" << simdMs << "ms per frame,"
+            << totalPoints / numFrames << "points per frame," << numDifferent << "frames differ";
+
+    return QString("Point cloud extraction (%1 points): scalar %2 ms, SIMD %3 ms per frame, %4")
+            .arg(totalPoints / numFrames)
+            .arg(scalarMs, 0, 'f', 2)
+            .arg(simdMs, 0, 'f', 2)
+            .arg(numDifferent == 0 ? QString("identical results") : QString("%1 frames differ").arg(numDifferent));
+}
+
+QString Benchmark::LandmarkLookup(const QString& recordingFile, int maxFrames)
+{
+    std::unique_ptr<FrameRecording> recording = FrameRecording::Open(recordingFile.toStdString());
+    if (!recording) {
+        return QString("Landmark lookup: could not open recording %1").arg(recordingFile);
+    }
+
+    size_t numFrames = recording->NumFrames();
+    if (maxFrames > 0 && (size_t)maxFrames < numFrames) { numFrames = (size_t)maxFrames; }
+
+    PointCloudBuffer cloud;
+    ColorPointRaster raster;
+
+    qint64 createTime       = 0;
+    qint64 createRasterTime = 0;
+    qint64 rasterLookupTime = 0;
+    qint64 mappingTime      = 0;
+    qint64 treeLookupTime   = 0;
+    double distanceSum      = 0.0;
+    size_t numCompared      = 0;
+    size_t numMeasured      = 0;
+
+    QElapsedTimer timer;
+    for (size_t i = 0; i < numFrames; ++i) {
+        RecordedFrame f = recording->Frame(i);
+
+        // Warm up the caches, the raster fill is the difference of the next two runs
+        PointCloudHelpers::CreatePointCloud(f.colorBuffer, f.depthToCamera, f.depthToColor,
+                                            f.bodyIndexBuffer, f.header.cutoffHeight, &cloud);
+
+        timer.start();
+        PointCloudHelpers::CreatePointCloud(f.colorBuffer, f.depthToCamera, f.depthToColor,
+                                            f.bodyIndexBuffer, f.header.cutoffHeight, &cloud);
+        createTime += timer.nsecsElapsed();
+
+        timer.start();
+        PointCloudHelpers::CreatePointCloud(f.colorBuffer, f.depthToCamera, f.depthToColor,
+                                            f.bodyIndexBuffer, f.header.cutoffHeight, &cloud, &raster);
+        createRasterTime += timer.nsecsElapsed();
+
+        if (cloud.numPoints < (size_t)NUM_LANDMARKS) { continue; }
+        ++numMeasured;
+
+        // Landmarks between the color pixels of points spread over the cloud
+        Vec2f landmarks[NUM_LANDMARKS];
+        for (int l = 0; l < NUM_LANDMARKS; ++l) {
+            Vec2f c = f.depthToColor[cloud.depthPixelIndices[(l * 2 + 1) * cloud.numPoints / (2 * NUM_LANDMARKS)]];
+            landmarks[l] = Vec2f(c.X + 1.3f, c.Y - 0.7f);
+        }
+
+        int32_t rasterPoints[NUM_LANDMARKS];
+        timer.start();
+        for (int l = 0; l < NUM_LANDMARKS; ++l) {
+            rasterPoints[l] = PointCloudHelpers::FindPointAtColorPixel(&raster, landmarks[l]);
+        }
+        rasterLookupTime += timer.nsecsElapsed();
+
+        // The previous per frame path: map the pixels, build a tree, search it
+        Vec3f cameraPoints[NUM_LANDMARKS];
+        timer.start();
+        MapColorPixelsToCameraSpace(f.depthToCamera, f.depthToColor, landmarks, NUM_LANDMARKS, cameraPoints);
+        mappingTime += timer.nsecsElapsed();
+
+        size_t treePoints[NUM_LANDMARKS];
+        bool   treeFound[NUM_LANDMARKS];
+        timer.start();
+        {
+            cloud.MarkPointsModified();
+            std::shared_ptr<const PointCloudHelpers::SpatialIndex> index = PointCloudHelpers::GetSpatialIndex(&cloud);
+
+            for (int l = 0; l < NUM_LANDMARKS; ++l) {
+                float squaredDistance;
+                treeFound[l] = !std::isinf(cameraPoints[l].Z) &&
+                               index->tree.knnSearch(&cameraPoints[l].X, 1, &treePoints[l], &squaredDistance) != 0;
+            }
+        }
+        treeLookupTime += timer.nsecsElapsed();
+
+        for (int l = 0; l < NUM_LANDMARKS; ++l) {
+            if (rasterPoints[l] < 0 || !treeFound[l]) { continue; }
+
+            Vec3f a = cloud.points[rasterPoints[l]];
+            Vec3f b = cloud.points[treePoints[l]];
+            distanceSum += std::sqrt((a.X - b.X) * (a.X - b.X) + (a.Y - b.Y) * (a.Y - b.Y) + (a.Z - b.Z) * (a.Z - b.Z));
+            ++numCompared;
+        }
+    }
+
+    if (numMeasured == 0) {
+        return QString("Landmark lookup: no frame of the recording has enough points");
+    }
+
+    double rasterFillMs = (createRasterTime - createTime) / 1e6 / numFrames;
+    double rasterMs     = rasterFillMs + rasterLookupTime / 1e6 / numMeasured;
+    double mappingMs    = mappingTime / 1e6 / numMeasured;
+    double treeMs       = treeLookupTime / 1e6 / numMeasured;
+    double savedMs      = mappingMs + treeMs - rasterMs;
+    double meanDistance = numCompared > 0 ? distanceSum * 1000.0 / numCompared : 0.0;
+
+    qInfo() << "Landmark lookup on" << numMeasured << "frames of" << recordingFile << ":"
+            << "raster fill" << rasterFillMs << "ms, raster lookup" << rasterLookupTime / 1e3 / numMeasured << "us,"
+            << "sparse mapping" << mappingMs << "ms, KD-tree build and search" << treeMs << "ms per frame,"
+            << "saves" << savedMs << "ms,"
+            << "mean distance between the found points" << meanDistance << "mm";
+
+    return QString("Landmark lookup: raster %1 ms, mapping %2 ms + KD-tree %3 ms per frame (saves %4 ms), "
+                   "points %5 mm apart on average")
+            .arg(rasterMs, 0, 'f', 2)
+            .arg(mappingMs, 0, 'f', 2)
+            .arg(treeMs, 0, 'f', 2)
+            .arg(savedMs, 0, 'f', 2)
+            .arg(meanDistance, 0, 'f', 1);
+}
+
+QString Benchmark::SnapshotImageEncoding(const QString& recordingFile, int maxFrames)
+{
+    std::unique_ptr<FrameRecording> recording = FrameRecording::Open(recordingFile.toStdString());
+    if (!recording) {
+        return QString("Snapshot image encoding: could not open recording %1").arg(recordingFile);
+    }
+
+    QTemporaryDir imageDirectory;
+    if (!imageDirectory.isValid()) {
+        return QString("Snapshot image encoding: could not create a temporary directory");
+    }
+
+    size_t numFrames = recording->NumFrames();
+    if (maxFrames > 0 && (size_t)maxFrames < numFrames) { numFrames = (size_t)maxFrames; }
+
+    if (numFrames == 0) {
+        return QString("Snapshot image encoding: recording has no frames");
+    }
+
+    auto imageFile = [&](const char* name) { return QDir(imageDirectory.path()).filePath(name).toStdString(); };
+    auto fileSize  = [](const std::string& file) { return QFileInfo(QString::fromStdString(file)).size(); };
+
+    std::string bmpColorFile = imageFile("color.bmp");
+    std::string bmpDepthFile = imageFile("depth.bmp");
+    std::string qoiColorFile = imageFile("color.qoi");
+    std::string pngDepthFile = imageFile("depth.png");
+
+    FrameBuffer frame;
+    std::vector<uint32_t> loadedColors;
+    std::vector<uint16_t> loadedDepth;
+
+    qint64 bmpColorTime = 0, bmpDepthTime = 0, qoiColorTime = 0, pngDepthTime = 0;
+    qint64 bmpColorSize = 0, bmpDepthSize = 0, qoiColorSize = 0, pngDepthSize = 0;
+    size_t numFailed    = 0;
+    size_t numDifferent = 0;
+
+    QElapsedTimer timer;
+    for (size_t i = 0; i < numFrames; ++i) {
+        LoadRecordedFrame(recording->Frame(i), &frame);
+
+        bool written = true;
+
+        timer.start();
+        written &= SaveColorImage(bmpColorFile, frame.colorBuffer);
+        bmpColorTime += timer.nsecsElapsed();
+
+        timer.start();
+        written &= SaveDepthImage(bmpDepthFile, frame.depthBuffer8);
+        bmpDepthTime += timer.nsecsElapsed();
+
+        timer.start();
+        written &= SaveColorImageQoi(qoiColorFile, frame.colorBuffer, COLOR_WIDTH, COLOR_HEIGHT);
+        qoiColorTime += timer.nsecsElapsed();
+
+        timer.start();
+        written &= SaveDepthImagePng16(pngDepthFile, frame.depthBuffer16, DEPTH_WIDTH, DEPTH_HEIGHT);
+        pngDepthTime += timer.nsecsElapsed();
+
+        if (!written) {
+            ++numFailed;
+            continue;
+        }
+
+        bmpColorSize += fileSize(bmpColorFile);
+        bmpDepthSize += fileSize(bmpDepthFile);
+        qoiColorSize += fileSize(qoiColorFile);
+        pngDepthSize += fileSize(pngDepthFile);
+
+        int colorWidth = 0, colorHeight = 0, depthWidth = 0, depthHeight = 0;
+        bool identical = LoadColorImageQoi(qoiColorFile, &loadedColors, &colorWidth, &colorHeight) &&
+                         LoadDepthImagePng16(pngDepthFile, &loadedDepth, &depthWidth, &depthHeight) &&
+                         colorWidth == COLOR_WIDTH && colorHeight == COLOR_HEIGHT &&
+                         depthWidth == DEPTH_WIDTH && depthHeight == DEPTH_HEIGHT &&
+                         memcmp(loadedColors.data(), frame.colorBuffer, NUM_COLOR_PIXELS * sizeof(uint32_t)) == 0 &&
+                         memcmp(loadedDepth.data(), frame.depthBuffer16, NUM_DEPTH_PIXELS * sizeof(uint16_t)) == 0;
+
+        if (!identical) { ++numDifferent; }
+    }
+
+    size_t numWritten = numFrames - numFailed;
+    if (numWritten == 0) {
+        return QString("Snapshot image encoding: could not write the images");
+    }
+
+    auto perFrameMs = [&](qint64 time) { return time / 1e6 / numFrames; };
+    auto perFrameKb = [&](qint64 size) { return size / 1024.0 / numWritten; };
+
+    qInfo() << "Snapshot image encoding on" << numFrames << "frames of" << recordingFile << ":"
+            << "BMP color" << perFrameMs(bmpColorTime) << "ms" << perFrameKb(bmpColorSize) << "KB,"
+            << "BMP 8-bit depth" << perFrameMs(bmpDepthTime) << "ms" << perFrameKb(bmpDepthSize) << "KB,"
+            << "QOI color" << perFrameMs(qoiColorTime) << "ms" << perFrameKb(qoiColorSize) << "KB,"
+            << "PNG 16-bit depth" << perFrameMs(pngDepthTime) << "ms" << perFrameKb(pngDepthSize) << "KB per frame,"
+            << numFailed << "frames failed," << numDifferent << "frames differ after reading back";
+
+    return QString("Snapshot images (%1 frames): BMP %2 ms, %3 KB; QOI + PNG16 %4 ms, %5 KB per frame, %6")
+            .arg(numFrames)
+            .arg(perFrameMs(bmpColorTime + bmpDepthTime), 0, 'f', 1)
+            .arg(perFrameKb(bmpColorSize + bmpDepthSize), 0, 'f', 0)
+            .arg(perFrameMs(qoiColorTime + pngDepthTime), 0, 'f', 1)
+            .arg(perFrameKb(qoiColorSize + pngDepthSize), 0, 'f', 0)
+            .arg(numFailed + numDifferent == 0 ? QString("lossless")
+                                               : QString("%1 frames failed, %2 differ").arg(numFailed).arg(numDifferent));
+}
+
+//
+// Random hemisphere for the text point cloud benchmarks. Normals point away from the center, colors vary,
+// so every field has digits to format and parse.
+//
+static void GenerateTextBenchmarkCloud(PointCloudBuffer* cloud, int numPoints)
+{
+    Vec3f center(0.0f, 0.0f, 1.0f);
+    float radius = 0.1f;
+
+    PointCloudHelpers::GenerateRandomHemiSphere(cloud, numPoints, center, radius);
+    for (size_t i = 0; i < cloud->numPoints; ++i) {
+        Vec3f p = cloud->points[i];
+        cloud->normals[i] = Vec3f((p.X - center.X) / radius, (p.Y - center.Y) / radius, (p.Z - center.Z) / radius);
+        cloud->colors[i]  = RGB3f((i % 256) / 255.0f, ((i / 256) % 256) / 255.0f, 0.5f);
+    }
+}
+
+QString Benchmark::TextPointCloudLoading(int numPoints, int repetitions)
+{
+    QTemporaryDir pointCloudDirectory;
+    if (!pointCloudDirectory.isValid()) {
+        return QString("Text point cloud loading: could not create a temporary directory");
+    }
+    std::string pointCloudFile = QDir(pointCloudDirectory.path()).filePath("pointcloud.pc").toStdString();
+
+    PointCloudBuffer written;
+    GenerateTextBenchmarkCloud(&written, numPoints);
+
+    if (!SavePointCloud(pointCloudFile, written.points, written.colors, written.normals, written.numPoints)) {
+        return QString("Text point cloud loading: could not write the point cloud");
+    }
+    double fileMb = QFileInfo(QString::fromStdString(pointCloudFile)).size() / (1024.0 * 1024.0);
+
+    PointCloudBuffer reference;
+    PointCloudBuffer result;
+    int referencePoints = 0;
+    int resultPoints    = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int r = 0; r < repetitions; ++r) {
+        referencePoints = PointCloudHelpers::LoadPointCloudTextStream(pointCloudFile, &reference);
+    }
+    qint64 streamTime = timer.nsecsElapsed();
+
+    timer.start();
+    for (int r = 0; r < repetitions; ++r) {
+        resultPoints = PointCloudHelpers::LoadPointCloudText(pointCloudFile, &result);
+    }
+    qint64 parallelTime = timer.nsecsElapsed();
+
+    size_t n = referencePoints > 0 ? (size_t)referencePoints : 0;
+    bool identical = resultPoints == referencePoints && n == written.numPoints &&
+                     memcmp(result.points,  reference.points,  n * sizeof(Vec3f)) == 0 &&
+                     memcmp(result.colors,  reference.colors,  n * sizeof(RGB3f)) == 0 &&
+                     memcmp(result.normals, reference.normals, n * sizeof(Vec3f)) == 0;
+
+    double streamMs   = streamTime   / 1e6 / repetitions;
+    double parallelMs = parallelTime / 1e6 / repetitions;
+    double speedup    = parallelMs > 0.0 ? streamMs / parallelMs : 0.0;
+
+    qInfo() << "Text point cloud loading of" << written.numPoints << "points," << fileMb << "MB:"
+            << "ifstream" << streamMs << "ms," << (streamMs > 0.0 ? fileMb * 1000.0 / streamMs : 0.0) << "MB/s,"
+            << "mapped from_chars" << parallelMs << "ms," << (parallelMs > 0.0 ? fileMb * 1000.0 / parallelMs : 0.0) << "MB/s,"
+            << "speedup" << speedup << "," << (identical ? "identical points" : "points differ");
+
+    return QString("Text point cloud (%1 points): ifstream %2 ms, from_chars %3 ms, speedup %4x, %5")
+            .arg(written.numPoints)
+            .arg(streamMs, 0, 'f', 1)
+            .arg(parallelMs, 0, 'f', 1)
+            .arg(speedup, 0, 'f', 1)
+            .arg(identical ? QString("identical points") : QString("points differ"));
+}
+
+QString Benchmark::TextPointCloudWriting(int numPoints, int repetitions)
+{
+    QTemporaryDir pointCloudDirectory;
+    if (!pointCloudDirectory.isValid()) {
+        return QString("Text point cloud writing: could not create a temporary directory");
+    }
+    std::string streamFile = QDir(pointCloudDirectory.path()).filePath("stream.pc").toStdString();
+    std::string blockFile  = QDir(pointCloudDirectory.path()).filePath("blocks.pc").toStdString();
+
+    PointCloudBuffer written;
+    GenerateTextBenchmarkCloud(&written, numPoints);
+
+    bool allWritten = true;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int r = 0; r < repetitions; ++r) {
+        allWritten &= SavePointCloudStream(streamFile, written.points, written.colors, written.normals, written.numPoints);
+    }
+    qint64 streamTime = timer.nsecsElapsed();
+
+    timer.start();
+    for (int r = 0; r < repetitions; ++r) {
+        allWritten &= SavePointCloud(blockFile, written.points, written.colors, written.normals, written.numPoints, false);
+    }
+    qint64 blockTime = timer.nsecsElapsed();
+
+    timer.start();
+    for (int r = 0; r < repetitions; ++r) {
+        allWritten &= SavePointCloud(blockFile, written.points, written.colors, written.normals, written.numPoints, true);
+    }
+    qint64 backgroundTime = timer.nsecsElapsed();
+
+    if (!allWritten) {
+        return QString("Text point cloud writing: could not write the point cloud");
+    }
+
+    // Positions and normals come back exactly, colors as the integers they were written as
+    PointCloudBuffer loaded;
+    int numLoaded = PointCloudHelpers::LoadPointCloudText(blockFile, &loaded);
+
+    size_t numDifferent = 0;
+    for (size_t i = 0; numLoaded == (int)written.numPoints && i < written.numPoints; ++i) {
+        RGB3f c = written.colors[i];
+        RGB3f expectedColor((int)(c.R * 255.0f) / 255.0f, (int)(c.G * 255.0f) / 255.0f, (int)(c.B * 255.0f) / 255.0f);
+
+        bool same = memcmp(&loaded.points[i],  &written.points[i],  sizeof(Vec3f)) == 0 &&
+                    memcmp(&loaded.normals[i], &written.normals[i], sizeof(Vec3f)) == 0 &&
+                    memcmp(&loaded.colors[i],  &expectedColor,      sizeof(RGB3f)) == 0;
+        if (!same) { ++numDifferent; }
+    }
+    bool roundTrip = numLoaded == (int)written.numPoints && numDifferent == 0;
+
+    double fileMb       = QFileInfo(QString::fromStdString(blockFile)).size() / (1024.0 * 1024.0);
+    double streamMs     = streamTime     / 1e6 / repetitions;
+    double blockMs      = blockTime      / 1e6 / repetitions;
+    double backgroundMs = backgroundTime / 1e6 / repetitions;
+
+    qInfo() << "Text point cloud writing of" << written.numPoints << "points," << fileMb << "MB:"
+            << "iostream" << streamMs << "ms,"
+            << "to_chars blocks" << blockMs << "ms,"
+            << "to_chars blocks written in the background" << backgroundMs << "ms,"
+            << (roundTrip ? "exact round trip" : "round trip differs") << "(" << numDifferent << "points differ )";
+
+    return QString("Text point cloud writing (%1 points): iostream %2 ms, blocks %3 ms, background %4 ms, %5")
+            .arg(written.numPoints)
+            .arg(streamMs, 0, 'f', 1)
+            .arg(blockMs, 0, 'f', 1)
+            .arg(backgroundMs, 0, 'f', 1)
+            .arg(roundTrip ? QString("exact round trip") : QString("round trip differs"));
+}
+
+QString Benchmark::CompressedPointCloudStorage(const QString& recordingFile, int maxFrames)
+{
+    std::unique_ptr<FrameRecording> recording = FrameRecording::Open(recordingFile.toStdString());
+    if (!recording) {
+        return QString("Compressed point clouds: could not open recording %1").arg(recordingFile);
+    }
+
+    QTemporaryDir pointCloudDirectory;
+    if (!pointCloudDirectory.isValid()) {
+        return QString("Compressed point clouds: could not create a temporary directory");
+    }
+
+    size_t numFrames = recording->NumFrames();
+    if (maxFrames > 0 && (size_t)maxFrames < numFrames) { numFrames = (size_t)maxFrames; }
+
+    if (numFrames == 0) {
+        return QString("Compressed point clouds: recording has no frames");
+    }
+
+    auto pointCloudFile = [&](const char* name) { return QDir(pointCloudDirectory.path()).filePath(name).toStdString(); };
+    auto fileSize       = [](const std::string& file) { return QFileInfo(QString::fromStdString(file)).size(); };
+
+    std::string binaryFile    = pointCloudFile("pointcloud.pcb");
+    std::string quantizedFile = pointCloudFile("quantized.pcz");
+    std::string entropyFile   = pointCloudFile("entropy.pcz");
+
+    FrameBuffer frame;
+    PointCloudBuffer filtered;
+    PointCloudBuffer loaded;
+
+    // Binary, quantized only, quantized and entropy coded
+    qint64 writeTime[3] = {}, readTime[3] = {}, size[3] = {};
+    size_t numFailed = 0;
+    size_t numDifferent = 0;
+    PointCloudCompressionError maxError = { 0.0f, 0.0f, 0.0f };
+
+    QElapsedTimer timer;
+    for (size_t i = 0; i < numFrames; ++i) {
+        LoadRecordedFrame(recording->Frame(i), &frame);
+        PointCloudHelpers::Filter(frame.pointCloudBuffer, &filtered, 10, 1.0f, PointCloudHelpers::ALL_CORES);
+        PointCloudHelpers::ComputeNormals(&filtered);
+
+        bool written = true;
+
+        timer.start();
+        written &= SavePointCloudBinary(binaryFile, &filtered);
+        writeTime[0] += timer.nsecsElapsed();
+
+        timer.start();
+        written &= SavePointCloudCompressed(quantizedFile, &filtered, false);
+        writeTime[1] += timer.nsecsElapsed();
+
+        timer.start();
+        written &= SavePointCloudCompressed(entropyFile, &filtered, true);
+        writeTime[2] += timer.nsecsElapsed();
+
+        if (!written) {
+            ++numFailed;
+            continue;
+        }
+
+        size[0] += fileSize(binaryFile);
+        size[1] += fileSize(quantizedFile);
+        size[2] += fileSize(entropyFile);
+
+        // The way LoadSnapshot() reads binary point clouds
+        timer.start();
+        std::unique_ptr<PointCloudHelpers::MappedPointCloud> mapped = PointCloudHelpers::MappedPointCloud::Open(binaryFile);
+        if (mapped) { CopyPointCloudBuffer(mapped->Buffer(), &loaded); }
+        readTime[0] += timer.nsecsElapsed();
+        mapped.reset();
+
+        const std::string* compressedFiles[] = { &quantizedFile, &entropyFile };
+        for (int format = 1; format <= 2; ++format) {
+            timer.start();
+            int numLoaded = LoadPointCloudCompressed(*compressedFiles[format - 1], &loaded);
+            readTime[format] += timer.nsecsElapsed();
+
+            PointCloudCompressionError error = MeasureCompressionError(&filtered, &loaded);
+            maxError.maxPositionError      = std::max(maxError.maxPositionError,      error.maxPositionError);
+            maxError.maxColorError         = std::max(maxError.maxColorError,         error.maxColorError);
+            maxError.maxNormalErrorDegrees = std::max(maxError.maxNormalErrorDegrees, error.maxNormalErrorDegrees);
+
+            // Everything but positions, colors and normals comes back exactly
+            bool same = numLoaded == (int)filtered.numPoints &&
+                        loaded.isOrganized == filtered.isOrganized &&
+                        loaded.numLandmarks == filtered.numLandmarks &&
+                        std::equal(loaded.landmarkIndices, loaded.landmarkIndices + loaded.numLandmarks, filtered.landmarkIndices) &&
+                        (!filtered.isOrganized ||
+                         std::equal(loaded.depthPixelIndices, loaded.depthPixelIndices + loaded.numPoints, filtered.depthPixelIndices));
+            if (!same) { ++numDifferent; }
+        }
+    }
+
+    size_t numWritten = numFrames - numFailed;
+    if (numWritten == 0) {
+        return QString("Compressed point clouds: could not write the point clouds");
+    }
+
+    bool withinBounds = maxError.maxPositionError      <= POINTCLOUD_MAX_POSITION_ERROR &&
+                        maxError.maxColorError         <= POINTCLOUD_MAX_COLOR_ERROR &&
+                        maxError.maxNormalErrorDegrees <= POINTCLOUD_MAX_NORMAL_ERROR_DEGREES;
+    bool roundTrip = withinBounds && numDifferent == 0;
+
+    auto perFrameMs = [&](qint64 time)  { return time / 1e6 / numWritten; };
+    auto perFrameKb = [&](qint64 bytes) { return bytes / 1024.0 / numWritten; };
+    auto ratio      = [&](qint64 bytes) { return bytes > 0 ? (double)size[0] / bytes : 0.0; };
+
+    qInfo() << "Compressed point clouds on" << numFrames << "frames of" << recordingFile << ":"
+            << "binary write" << perFrameMs(writeTime[0]) << "ms read" << perFrameMs(readTime[0]) << "ms" << perFrameKb(size[0]) << "KB,"
+            << "quantized write" << perFrameMs(writeTime[1]) << "ms read" << perFrameMs(readTime[1]) << "ms" << perFrameKb(size[1]) << "KB,"
+            << "entropy coded write" << perFrameMs(writeTime[2]) << "ms read" << perFrameMs(readTime[2]) << "ms" << perFrameKb(size[2]) << "KB per frame,"
+            << "max position error" << maxError.maxPositionError * 1000.0f << "mm,"
+            << "max color error" << maxError.maxColorError * 255.0f << "/ 255,"
+            << "max normal error" << maxError.maxNormalErrorDegrees << "degrees,"
+            << numFailed << "frames failed," << numDifferent << "point clouds differ";
+
+    return QString("Point clouds (%1 frames): binary %2 KB, read %3 ms; quantized %4x, read %5 ms; entropy coded %6x, read %7 ms; %8")
+            .arg(numFrames)
+            .arg(perFrameKb(size[0]), 0, 'f', 0)
+            .arg(perFrameMs(readTime[0]), 0, 'f', 2)
+            .arg(ratio(size[1]), 0, 'f', 1)
+            .arg(perFrameMs(readTime[1]), 0, 'f', 2)
+            .arg(ratio(size[2]), 0, 'f', 1)
+            .arg(perFrameMs(readTime[2]), 0, 'f', 2)
+            .arg(roundTrip ? QString("within error bounds") : QString("round trip exceeds error bounds"));
+}
+
+QString Benchmark::PointCloudCloning(int numPoints, int numRequests)
+{
+    PointCloudBuffer source;
+    PointCloudHelpers::GenerateRandomHemiSphere(&source, numPoints);
+
+    MemoryPool memory;
+    BufferPoolCounters framesBefore = memory.gatherFrames.PoolCounters();
+
+    qint64 cloneTime     = 0;
+    qint64 copyTime      = 0;
+    uint64_t cloneBytes  = 0;
+    uint64_t copyBytes   = 0;
+    int numFailedPins    = 0;
+    int numFailedClouds  = 0;
+
+    QElapsedTimer timer;
+    for (int i = 0; i < numRequests; ++i) {
+        CopyPointCloudBuffer(&source, memory.gatherFrames.BackBuffer()->pointCloudBuffer);
+        memory.gatherFrames.Publish();
+        FrameBuffer* frame = memory.gatherFrames.AcquireLatest();
+
+        // Overlapping snapshot, filter and normal jobs use all slots of the pool in turn. The pool hands out
+        // slots in the same order every time all of them are given back in reverse.
+        std::vector<PointCloudHandle> clouds;
+        while (PointCloudHandle cloud = memory.pointClouds.Acquire()) { clouds.push_back(std::move(cloud)); }
+        if (clouds.size() < 2) { ++numFailedClouds; continue; }
+
+        PointCloudHandle cloned = std::move(clouds[i % clouds.size()]);
+        PointCloudHandle copied = std::move(clouds[(i + 1) % clouds.size()]);
+        while (!clouds.empty()) { clouds.pop_back(); }
+
+        FrameHandle pinned = memory.gatherFrames.PinCurrent();
+        if (!pinned) { ++numFailedPins; continue; }
+
+        uint64_t bytesBefore = PointCloudBytesCopied();
+        timer.start();
+        ClonePointCloudBuffer(frame->pointCloudBuffer, cloned.Get(), std::make_shared<FrameHandle>(pinned));
+        cloned->PrepareWrite(POINTCLOUD_NORMALS);
+        std::fill(cloned->normals, cloned->normals + cloned->numPoints, Vec3f(0.0f, 0.0f, 1.0f));
+        cloneTime += timer.nsecsElapsed();
+        cloneBytes += PointCloudBytesCopied() - bytesBefore;
+
+        // Only the clone keeps the frame pinned now
+        pinned.Reset();
+
+        bytesBefore = PointCloudBytesCopied();
+        timer.start();
+        CopyPointCloudBuffer(frame->pointCloudBuffer, copied.Get());
+        std::fill(copied->normals, copied->normals + copied->numPoints, Vec3f(0.0f, 0.0f, 1.0f));
+        copyTime += timer.nsecsElapsed();
+        copyBytes += PointCloudBytesCopied() - bytesBefore;
+    }
+
+    // All handles are gone, so the pools have to be back where they started
+    BufferPoolCounters framesAfter = memory.gatherFrames.PoolCounters();
+    BufferPoolCounters cloudsAfter = memory.pointClouds.Counters();
+    bool slotsReturned = framesAfter.inUse == framesBefore.inUse && cloudsAfter.inUse == 0;
+
+    // Requests that did not get two point clouds or a pinned frame measured nothing
+    int numCloned  = numRequests - numFailedPins - numFailedClouds;
+    double cloneUs = numCloned > 0 ? cloneTime / 1e3 / numCloned : 0.0;
+    double copyUs  = numCloned > 0 ? copyTime  / 1e3 / numCloned : 0.0;
+
+    qInfo() << "Point cloud cloning of" << source.numPoints << "points," << numRequests << "requests on"
+            << FRAME_POOL_SIZE << "frame and" << POINTCLOUD_POOL_SIZE << "point cloud slots:"
+            << "clone" << cloneUs << "us," << (numCloned > 0 ? cloneBytes / numCloned : 0) << "bytes copied,"
+            << "copy" << copyUs << "us," << (numCloned > 0 ? copyBytes / numCloned : 0) << "bytes copied per request,"
+            << numFailedPins << "pins and" << numFailedClouds << "point clouds failed,"
+            << "slots" << (slotsReturned ? "returned" : "NOT RETURNED") << "to the pools";
+
+    return QString("Cloning (%1 points, %2 requests): clone %3 us / copy %4 us, %5 failed pins%6")
+            .arg(source.numPoints)
+            .arg(numRequests)
+            .arg(cloneUs, 0, 'f', 1)
+            .arg(copyUs, 0, 'f', 1)
+            .arg(numFailedPins)
+            .arg(slotsReturned ? "" : ", slots not returned!");
+}
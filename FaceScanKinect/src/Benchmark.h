@@ -0,0 +1,106 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QString>
+
+//
+// Benchmarks for the point cloud processing that can be started from the Tools menu.
+//
+// Every benchmark writes its detailed results to the log and returns a one line
+// summary that can be shown in the status bar.
+//
+namespace Benchmark {
+
+//
+// Times the general and the symmetric eigen solver for normal estimation on a random
+// hemisphere with numPoints points and reports the largest angle between both results.
+//
+QString NormalEstimation(int numPoints = 60000);
+
+//
+// Compares the array of structures layout of PointCloudBuffer with the structure of arrays
+// layout of PointCloudPlanes on the work done by Filter() (KD-tree build and 10 nearest
+// neighbors per point) and ComputeNormals() (15 nearest neighbors and their covariance).
+//
+QString MemoryLayout(int numPoints = 60000);
+
+//
+// Runs the frames of a recording (see FrameRecording.h) through the snapshot pipeline as fast as possible:
+// CreatePointCloud(), Filter(), ComputeNormals() and writing the snapshot files into a temporary directory.
+// Reports the time of each stage and the frames per second. maxFrames <= 0 uses all frames.
+//
+QString ReplayThroughput(const QString& recordingFile, int maxFrames = 0);
+
+//
+// Fits a CameraCalibration to the SDK mappings stored in a recording and times the software CoordinateMapper
+// on one of its frames: the SIMD and the scalar depth frame kernel, and projecting the valid camera points one
+// call per point (the way the mesh vertices were mapped through the SDK) against one batched call.
+// Reports the deviation of the mapped frame from the recorded SDK results.
+//
+QString CoordinateMapping(const QString& recordingFile, int repetitions = 20);
+
+//
+// Times ConvertDepthTo8Bit() against ConvertDepthTo8BitScalar() on random depth frames and checks that both
+// give exactly the same result, also for unusual reliable depth ranges and frame sizes that leave a remainder.
+//
+QString DepthConversion(int repetitions = 200);
+
+//
+// Times CreatePointCloud() against CreatePointCloudScalar() on the frames of a recording and checks that both
+// extract the same points, pixels and colors. maxFrames <= 0 uses all frames.
+//
+QString PointCloudExtraction(const QString& recordingFile, int repetitions = 20, int maxFrames = 0);
+
+//
+// Per frame cost of attaching 68 landmarks to the point cloud of the frames of a recording. The landmarks are
+// placed on color pixels of the face region. Compares the lookup in the color point raster filled by
+// CreatePointCloud() with mapping the landmark pixels to camera space and searching them in a freshly built
+// KD-tree, and reports the time saved per frame and how far apart the points found by both are.
+//
+QString LandmarkLookup(const QString& recordingFile, int maxFrames = 0);
+
+//
+// Writes the color and depth images of the frames of a recording the way snapshots used to (BMP, 8-bit depth)
+// and the way they are written now (QOI color, 16-bit depth PNG). Reports the encode time and file size per
+// frame of both and checks that the new files read back to exactly the frame buffers. maxFrames <= 0 uses
+// all frames.
+//
+QString SnapshotImageEncoding(const QString& recordingFile, int maxFrames = 0);
+
+//
+// Writes a random hemisphere with numPoints points in the text point cloud format and times reading it back
+// with std::ifstream (LoadPointCloudTextStream()) against the mapped, parallel from_chars parser
+// (LoadPointCloudText()). Checks that both read exactly the same points.
+//
+QString TextPointCloudLoading(int numPoints = 200000, int repetitions = 5);
+
+//
+// Times writing a random hemisphere with numPoints points (by default MAX_POINTCLOUD_SIZE, the largest cloud
+// a buffer holds) in the text point cloud format: the previous iostream writer (SavePointCloudStream())
+// against the block writer of SavePointCloud(), with and without writing in the background. Checks that
+// LoadPointCloudText() reads back exactly the written points.
+//
+QString TextPointCloudWriting(int numPoints = 262144, int repetitions = 3);
+
+//
+// Filters the frames of a recording and computes their normals like SaveSnapshot(), then writes the point
+// clouds in the binary format and in the compressed format, with and without entropy coding. Reports file
+// size, write and read time per frame, reading the way LoadSnapshot() does, and checks that the compressed
+// point clouds read back within the error bounds of the format (see PointCloudCompression.h).
+// maxFrames <= 0 uses all frames.
+//
+QString CompressedPointCloudStorage(const QString& recordingFile, int maxFrames = 0);
+
+//
+// Hands a random hemisphere with numPoints points to a normal request numRequests times the way FrameReady()
+// does: publishes it as a frame, pins the frame and clones its point cloud into a pooled buffer, whose normals
+// are then written. Every request gives its buffer and frame back before the next one. The requests use the
+// point cloud slots in turn and the default makes more requests than both pools have slots, so slots that keep
+// their frame pinned after they went back to the pool make the later pins fail.
+// Times the clone against copying the point cloud and reports the bytes of point data both copy.
+//
+QString PointCloudCloning(int numPoints = 60000, int numRequests = 24);
+
+}
+
+#endif // BENCHMARK_H
@@ -0,0 +1,228 @@
+#ifndef CAPTUREPIPELINE_H
+#define CAPTUREPIPELINE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+//
+// What a full BoundedQueue does with a new item
+//
+enum QueuePolicy {
+    QUEUE_BLOCK,        // The producer waits until the consumer took an item
+    QUEUE_DROP_OLDEST,  // The oldest queued item is handed back to the producer to make room
+};
+
+struct BoundedQueueCounters {
+    size_t capacity;
+
+    // Items queued right now and at most so far
+    size_t occupancy;
+    size_t maxOccupancy;
+
+    // Occupancy right after every push
+    double averageOccupancy;
+
+    uint64_t pushed;
+
+    // Items replaced by newer ones under QUEUE_DROP_OLDEST
+    uint64_t dropped;
+
+    // Time producers waited for room under QUEUE_BLOCK
+    int64_t blockedUs;
+};
+
+static int64_t PipelineNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief The BoundedQueue class connects two stages of a pipeline, each running on its own thread.
+ *
+ * At most capacity items are queued, a full queue either blocks the producer or drops the oldest item,
+ * see QueuePolicy. The policy can be changed while the stages run.
+ *
+ * Close() wakes up both sides and makes every further Push() and Pop() fail, Reset() opens the queue again.
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(size_t capacity, QueuePolicy policy = QUEUE_BLOCK)
+        : capacity_(capacity),
+          policy_(policy),
+          closed_(false),
+          maxOccupancy_(0),
+          totalOccupancy_(0),
+          pushed_(0),
+          dropped_(0),
+          blockedNs_(0)
+    { }
+
+    //
+    // Queues item. Returns false if the queue was closed, item was not queued then.
+    // If the oldest item was dropped to make room for item, it is moved to dropped and *hasDropped is set, so
+    // the producer can reuse it.
+    //
+    bool Push(T item, T* dropped = nullptr, bool* hasDropped = nullptr) {
+        if (hasDropped != nullptr) { *hasDropped = false; }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (items_.size() >= capacity_ && policy_ == QUEUE_BLOCK && !closed_) {
+            int64_t waitStart = PipelineNowNs();
+            notFull_.wait(lock, [this]() { return items_.size() < capacity_ || policy_ != QUEUE_BLOCK || closed_; });
+            blockedNs_ += PipelineNowNs() - waitStart;
+        }
+
+        if (closed_) { return false; }
+
+        if (items_.size() >= capacity_) {
+            if (dropped != nullptr) { *dropped = std::move(items_.front()); }
+            if (hasDropped != nullptr) { *hasDropped = true; }
+            items_.pop_front();
+            ++dropped_;
+        }
+
+        items_.push_back(std::move(item));
+
+        ++pushed_;
+        totalOccupancy_ += items_.size();
+        if (items_.size() > maxOccupancy_) { maxOccupancy_ = items_.size(); }
+
+        lock.unlock();
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    //
+    // Takes the oldest item, waits until there is one. Returns false once the queue is closed.
+    //
+    bool Pop(T* item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notEmpty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+
+        if (closed_) { return false; }
+
+        *item = std::move(items_.front());
+        items_.pop_front();
+
+        lock.unlock();
+        notFull_.notify_one();
+        return true;
+    }
+
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
+
+    //
+    // Removes all items and opens the queue again, only call while no stage uses the queue
+    //
+    void Reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        items_.clear();
+        closed_ = false;
+    }
+
+    void SetPolicy(QueuePolicy policy) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            policy_ = policy;
+        }
+        notFull_.notify_all();
+    }
+
+    BoundedQueueCounters Counters() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        BoundedQueueCounters result;
+        result.capacity         = capacity_;
+        result.occupancy        = items_.size();
+        result.maxOccupancy     = maxOccupancy_;
+        result.averageOccupancy = pushed_ > 0 ? (double)totalOccupancy_ / pushed_ : 0.0;
+        result.pushed           = pushed_;
+        result.dropped          = dropped_;
+        result.blockedUs        = blockedNs_ / 1000;
+        return result;
+    }
+
+private:
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+
+    mutable std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::deque<T> items_;
+
+    size_t capacity_;
+    QueuePolicy policy_;
+    bool closed_;
+
+    size_t   maxOccupancy_;
+    uint64_t totalOccupancy_;
+    uint64_t pushed_;
+    uint64_t dropped_;
+    int64_t  blockedNs_;
+};
+
+struct PipelineStageCounters {
+    uint64_t frames;
+
+    // Time a frame spent in the stage
+    int64_t lastLatencyUs;
+    int64_t maxLatencyUs;
+    int64_t averageLatencyUs;
+};
+
+/**
+ * @brief The PipelineStageMetrics class collects the latencies of the frames that went through a stage.
+ *
+ * Written and read from any thread, e.g. by all workers that save snapshots.
+ */
+class PipelineStageMetrics
+{
+public:
+    PipelineStageMetrics()
+        : frames_(0),
+          lastLatencyUs_(0),
+          maxLatencyUs_(0),
+          totalLatencyUs_(0)
+    { }
+
+    void Record(int64_t startNs, int64_t endNs) {
+        int64_t latencyUs = (endNs - startNs) / 1000;
+        lastLatencyUs_ = latencyUs;
+        int64_t maxLatencyUs = maxLatencyUs_.load();
+        while (latencyUs > maxLatencyUs && !maxLatencyUs_.compare_exchange_weak(maxLatencyUs, latencyUs)) { }
+        totalLatencyUs_ += latencyUs;
+        frames_++;
+    }
+
+    PipelineStageCounters Counters() const {
+        PipelineStageCounters result;
+        result.frames           = frames_.load();
+        result.lastLatencyUs    = lastLatencyUs_.load();
+        result.maxLatencyUs     = maxLatencyUs_.load();
+        result.averageLatencyUs = result.frames > 0 ? totalLatencyUs_.load() / (int64_t)result.frames : 0;
+        return result;
+    }
+
+private:
+    std::atomic<uint64_t> frames_;
+    std::atomic<int64_t>  lastLatencyUs_;
+    std::atomic<int64_t>  maxLatencyUs_;
+    std::atomic<int64_t>  totalLatencyUs_;
+};
+
+#endif // CAPTUREPIPELINE_H
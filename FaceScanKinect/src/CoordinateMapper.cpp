@@ -0,0 +1,594 @@
+#include "CoordinateMapper.h"
+
+#include <QDebug>
+
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <vector>
+
+#include <Core>
+#include <Cholesky>
+#include <Eigenvalues>
+#include <LU>
+#include <QR>
+
+#include "MemoryPool.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COORDINATE_MAPPER_SSE2
+#include <emmintrin.h>
+#endif
+
+// Depth values are in millimeters, camera space in meters
+static const float DEPTH_TO_METERS = 0.001f;
+
+// Every n-th pixel in both directions is used for fitting the calibration
+static const int FIT_PIXEL_STRIDE = 2;
+static const size_t MIN_FIT_SAMPLES = 1000;
+
+// Fixed point iterations for removing the radial distortion, the kinect's distortion is small
+static const int UNDISTORT_ITERATIONS = 20;
+
+static bool IsValidMapping(Vec3f p) {
+    return std::isfinite(p.X) && std::isfinite(p.Y) && std::isfinite(p.Z) && p.Z > 0.0f;
+}
+
+static bool IsValidMapping(Vec2f c) {
+    return std::isfinite(c.X) && std::isfinite(c.Y);
+}
+
+static float RadialDistortion(const CameraCalibration& calibration, float squaredRadius) {
+    float r2 = squaredRadius;
+    return 1.0f + r2 * (calibration.depthRadialDistortion2 +
+                  r2 * (calibration.depthRadialDistortion4 +
+                  r2 *  calibration.depthRadialDistortion6));
+}
+
+static void MakeProjection(const CameraCalibration& calibration, float* projection) {
+    const float* R = calibration.rotation;
+    const float* t = calibration.translation;
+    float fx = calibration.colorFocalLengthX;
+    float fy = calibration.colorFocalLengthY;
+    float cx = calibration.colorPrincipalPointX;
+    float cy = calibration.colorPrincipalPointY;
+
+    // K * [R | t]
+    for (int col = 0; col < 4; ++col) {
+        float r0 = col < 3 ? R[0 * 3 + col] : t[0];
+        float r1 = col < 3 ? R[1 * 3 + col] : t[1];
+        float r2 = col < 3 ? R[2 * 3 + col] : t[2];
+
+        projection[0 * 4 + col] = fx * r0 + cx * r2;
+        projection[1 * 4 + col] = fy * r1 + cy * r2;
+        projection[2 * 4 + col] = r2;
+    }
+}
+
+static inline Vec2f Project(const float* P, float X, float Y, float Z) {
+    float w = P[8] * X + P[9] * Y + P[10] * Z + P[11];
+    float u = P[0] * X + P[1] * Y + P[2] * Z + P[3];
+    float v = P[4] * X + P[5] * Y + P[6] * Z + P[7];
+    return Vec2f(u / w, v / w);
+}
+
+//
+// Calibration fitting
+//
+
+//
+// Fits pixel = principalPoint + focalLength * ray * radialDistortion(ray) to the valid pixels. With the
+// distortion coefficients multiplied by the focal length, the column is linear in the unknowns. The row
+// is fitted afterwards with the distortion from the column fit.
+//
+static bool FitDepthIntrinsics(const Vec3f* depthToCamera, CameraCalibration* calibration, float* error) {
+    Eigen::Matrix<double, 5, 5> AtA = Eigen::Matrix<double, 5, 5>::Zero();
+    Eigen::Matrix<double, 5, 1> Atb = Eigen::Matrix<double, 5, 1>::Zero();
+    size_t numSamples = 0;
+
+    for (int row = 0; row < DEPTH_HEIGHT; row += FIT_PIXEL_STRIDE) {
+        for (int col = 0; col < DEPTH_WIDTH; col += FIT_PIXEL_STRIDE) {
+            Vec3f p = depthToCamera[row * DEPTH_WIDTH + col];
+            if (!IsValidMapping(p)) { continue; }
+
+            double x = p.X / p.Z;
+            double y = p.Y / p.Z;
+            double r2 = x * x + y * y;
+
+            Eigen::Matrix<double, 5, 1> a;
+            a << x, x * r2, x * r2 * r2, x * r2 * r2 * r2, 1.0;
+            AtA += a * a.transpose();
+            Atb += a * (double)col;
+            ++numSamples;
+        }
+    }
+
+    if (numSamples < MIN_FIT_SAMPLES) { return false; }
+
+    Eigen::Matrix<double, 5, 1> columnFit = AtA.ldlt().solve(Atb);
+    calibration->depthFocalLengthX      = (float)columnFit(0);
+    calibration->depthRadialDistortion2 = (float)(columnFit(1) / columnFit(0));
+    calibration->depthRadialDistortion4 = (float)(columnFit(2) / columnFit(0));
+    calibration->depthRadialDistortion6 = (float)(columnFit(3) / columnFit(0));
+    calibration->depthPrincipalPointX   = (float)columnFit(4);
+
+    Eigen::Matrix2d BtB = Eigen::Matrix2d::Zero();
+    Eigen::Vector2d Btb = Eigen::Vector2d::Zero();
+    for (int row = 0; row < DEPTH_HEIGHT; row += FIT_PIXEL_STRIDE) {
+        for (int col = 0; col < DEPTH_WIDTH; col += FIT_PIXEL_STRIDE) {
+            Vec3f p = depthToCamera[row * DEPTH_WIDTH + col];
+            if (!IsValidMapping(p)) { continue; }
+
+            float x = p.X / p.Z;
+            float y = p.Y / p.Z;
+            Eigen::Vector2d b(y * RadialDistortion(*calibration, x * x + y * y), 1.0);
+            BtB += b * b.transpose();
+            Btb += b * (double)row;
+        }
+    }
+
+    Eigen::Vector2d rowFit = BtB.ldlt().solve(Btb);
+    calibration->depthFocalLengthY    = (float)rowFit(0);
+    calibration->depthPrincipalPointY = (float)rowFit(1);
+
+    double squaredErrorSum = 0.0;
+    for (int row = 0; row < DEPTH_HEIGHT; row += FIT_PIXEL_STRIDE) {
+        for (int col = 0; col < DEPTH_WIDTH; col += FIT_PIXEL_STRIDE) {
+            Vec3f p = depthToCamera[row * DEPTH_WIDTH + col];
+            if (!IsValidMapping(p)) { continue; }
+
+            float x = p.X / p.Z;
+            float y = p.Y / p.Z;
+            float distortion = RadialDistortion(*calibration, x * x + y * y);
+            double du = calibration->depthPrincipalPointX + calibration->depthFocalLengthX * x * distortion - col;
+            double dv = calibration->depthPrincipalPointY + calibration->depthFocalLengthY * y * distortion - row;
+            squaredErrorSum += du * du + dv * dv;
+        }
+    }
+    *error = (float)std::sqrt(squaredErrorSum / numSamples);
+
+    return true;
+}
+
+//
+// Direct linear transform: the 3x4 projection into the color image is the null space of the (normalized)
+// point correspondences. It is decomposed into the color intrinsics and the extrinsics afterwards.
+//
+static bool FitColorCamera(const Vec3f* depthToCamera, const Vec2f* depthToColor, CameraCalibration* calibration, float* error) {
+    std::vector<Eigen::Vector3d> points;
+    std::vector<Eigen::Vector2d> pixels;
+
+    for (int row = 0; row < DEPTH_HEIGHT; row += FIT_PIXEL_STRIDE) {
+        for (int col = 0; col < DEPTH_WIDTH; col += FIT_PIXEL_STRIDE) {
+            int pixel = row * DEPTH_WIDTH + col;
+            if (!IsValidMapping(depthToCamera[pixel]) || !IsValidMapping(depthToColor[pixel])) { continue; }
+
+            Vec3f p = depthToCamera[pixel];
+            Vec2f c = depthToColor[pixel];
+            points.push_back(Eigen::Vector3d(p.X, p.Y, p.Z));
+            pixels.push_back(Eigen::Vector2d(c.X, c.Y));
+        }
+    }
+
+    size_t numSamples = points.size();
+    if (numSamples < MIN_FIT_SAMPLES) { return false; }
+
+    // Move both point sets to the origin and scale them to an average distance of sqrt(dimension) for a well
+    // conditioned system
+    Eigen::Vector3d pointCenter = Eigen::Vector3d::Zero();
+    Eigen::Vector2d pixelCenter = Eigen::Vector2d::Zero();
+    for (size_t i = 0; i < numSamples; ++i) { pointCenter += points[i]; pixelCenter += pixels[i]; }
+    pointCenter /= (double)numSamples;
+    pixelCenter /= (double)numSamples;
+
+    double pointDistance = 0.0;
+    double pixelDistance = 0.0;
+    for (size_t i = 0; i < numSamples; ++i) {
+        pointDistance += (points[i] - pointCenter).norm();
+        pixelDistance += (pixels[i] - pixelCenter).norm();
+    }
+    double pointScale = std::sqrt(3.0) * numSamples / pointDistance;
+    double pixelScale = std::sqrt(2.0) * numSamples / pixelDistance;
+
+    Eigen::Matrix<double, 12, 12> AtA = Eigen::Matrix<double, 12, 12>::Zero();
+    for (size_t i = 0; i < numSamples; ++i) {
+        Eigen::Vector4d X;
+        X << (points[i] - pointCenter) * pointScale, 1.0;
+        Eigen::Vector2d x = (pixels[i] - pixelCenter) * pixelScale;
+
+        Eigen::Matrix<double, 12, 1> rowU, rowV;
+        rowU << X, Eigen::Vector4d::Zero(), -x(0) * X;
+        rowV << Eigen::Vector4d::Zero(), X, -x(1) * X;
+        AtA += rowU * rowU.transpose() + rowV * rowV.transpose();
+    }
+
+    // Eigenvalues are sorted ascending, the first eigenvector minimizes the algebraic error
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 12, 12>> solver(AtA);
+    Eigen::Matrix<double, 12, 1> solution = solver.eigenvectors().col(0);
+
+    Eigen::Matrix<double, 3, 4> normalizedProjection;
+    normalizedProjection << solution.segment<4>(0).transpose(),
+                            solution.segment<4>(4).transpose(),
+                            solution.segment<4>(8).transpose();
+
+    Eigen::Matrix3d pixelNormalization;
+    pixelNormalization << pixelScale, 0.0, -pixelScale * pixelCenter(0),
+                          0.0, pixelScale, -pixelScale * pixelCenter(1),
+                          0.0, 0.0, 1.0;
+
+    Eigen::Matrix4d pointNormalization = Eigen::Matrix4d::Identity();
+    pointNormalization.topLeftCorner<3, 3>() *= pointScale;
+    pointNormalization.topRightCorner<3, 1>() = -pointScale * pointCenter;
+
+    Eigen::Matrix<double, 3, 4> projection = pixelNormalization.inverse() * normalizedProjection * pointNormalization;
+
+    // The projection is only defined up to scale, pick the sign that gives a proper rotation
+    Eigen::Matrix3d M = projection.leftCols<3>();
+    if (M.determinant() < 0.0) {
+        projection = -projection;
+        M = -M;
+    }
+
+    // RQ decomposition M = K * R, from the QR decomposition of the flipped matrix
+    Eigen::Matrix3d flip;
+    flip << 0.0, 0.0, 1.0,
+            0.0, 1.0, 0.0,
+            1.0, 0.0, 0.0;
+
+    Eigen::HouseholderQR<Eigen::Matrix3d> qr((flip * M).transpose());
+    Eigen::Matrix3d Q = qr.householderQ();
+    Eigen::Matrix3d upper = qr.matrixQR().triangularView<Eigen::Upper>();
+
+    Eigen::Matrix3d K = flip * upper.transpose() * flip;
+    Eigen::Matrix3d R = flip * Q.transpose();
+
+    // Focal lengths are positive
+    for (int i = 0; i < 3; ++i) {
+        if (K(i, i) < 0.0) {
+            K.col(i) = -K.col(i);
+            R.row(i) = -R.row(i);
+        }
+    }
+
+    Eigen::Vector3d t = K.inverse() * projection.col(3);
+    K /= K(2, 2);
+
+    calibration->colorFocalLengthX    = (float)K(0, 0);
+    calibration->colorFocalLengthY    = (float)K(1, 1);
+    calibration->colorPrincipalPointX = (float)K(0, 2);
+    calibration->colorPrincipalPointY = (float)K(1, 2);
+    for (int i = 0; i < 9; ++i) { calibration->rotation[i] = (float)R(i / 3, i % 3); }
+    for (int i = 0; i < 3; ++i) { calibration->translation[i] = (float)t(i); }
+
+    // Error of the model that is actually stored, i.e. without skew
+    float P[12];
+    MakeProjection(*calibration, P);
+
+    double squaredErrorSum = 0.0;
+    for (size_t i = 0; i < numSamples; ++i) {
+        Vec2f c = Project(P, (float)points[i](0), (float)points[i](1), (float)points[i](2));
+        double du = c.X - pixels[i](0);
+        double dv = c.Y - pixels[i](1);
+        squaredErrorSum += du * du + dv * dv;
+    }
+    *error = (float)std::sqrt(squaredErrorSum / numSamples);
+
+    return true;
+}
+
+bool FitCameraCalibration(const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                          CameraCalibration* calibration, float* depthError, float* colorError)
+{
+    float fittedDepthError = 0.0f;
+    float fittedColorError = 0.0f;
+
+    CameraCalibration result;
+    if (!FitDepthIntrinsics(depthToCamera, &result, &fittedDepthError)) { return false; }
+    if (!FitColorCamera(depthToCamera, depthToColor, &result, &fittedColorError)) { return false; }
+
+    *calibration = result;
+    if (depthError != nullptr) { *depthError = fittedDepthError; }
+    if (colorError != nullptr) { *colorError = fittedColorError; }
+
+    return true;
+}
+
+bool SaveCameraCalibration(const std::string& fileName, const CameraCalibration& calibration)
+{
+    std::ofstream file(fileName);
+    if (!file.is_open()) {
+        qCritical() << "Cannot open camera calibration file for writing to" << QString::fromStdString(fileName);
+        return false;
+    }
+
+    // Enough digits to read back the exact floats
+    file << std::setprecision(9);
+
+    file << "depth_intrinsics "
+         << calibration.depthFocalLengthX      << " " << calibration.depthFocalLengthY << " "
+         << calibration.depthPrincipalPointX   << " " << calibration.depthPrincipalPointY << " "
+         << calibration.depthRadialDistortion2 << " " << calibration.depthRadialDistortion4 << " "
+         << calibration.depthRadialDistortion6 << "\n";
+
+    file << "color_intrinsics "
+         << calibration.colorFocalLengthX    << " " << calibration.colorFocalLengthY << " "
+         << calibration.colorPrincipalPointX << " " << calibration.colorPrincipalPointY << "\n";
+
+    file << "rotation";
+    for (int i = 0; i < 9; ++i) { file << " " << calibration.rotation[i]; }
+    file << "\n";
+
+    file << "translation";
+    for (int i = 0; i < 3; ++i) { file << " " << calibration.translation[i]; }
+    file << "\n";
+
+    file.close();
+    return !file.fail();
+}
+
+bool LoadCameraCalibration(const std::string& fileName, CameraCalibration* calibration)
+{
+    std::ifstream file(fileName);
+    if (!file.is_open()) { return false; }
+
+    CameraCalibration result;
+    std::string key;
+    int entriesRead = 0;
+
+    while (file >> key) {
+        if (key == "depth_intrinsics") {
+            file >> result.depthFocalLengthX      >> result.depthFocalLengthY
+                 >> result.depthPrincipalPointX   >> result.depthPrincipalPointY
+                 >> result.depthRadialDistortion2 >> result.depthRadialDistortion4
+                 >> result.depthRadialDistortion6;
+        } else if (key == "color_intrinsics") {
+            file >> result.colorFocalLengthX    >> result.colorFocalLengthY
+                 >> result.colorPrincipalPointX >> result.colorPrincipalPointY;
+        } else if (key == "rotation") {
+            for (int i = 0; i < 9; ++i) { file >> result.rotation[i]; }
+        } else if (key == "translation") {
+            for (int i = 0; i < 3; ++i) { file >> result.translation[i]; }
+        } else {
+            qWarning() << "Unknown entry" << QString::fromStdString(key) << "in camera calibration" << QString::fromStdString(fileName);
+            return false;
+        }
+
+        if (file.fail()) { return false; }
+        ++entriesRead;
+    }
+
+    if (entriesRead != 4) { return false; }
+
+    *calibration = result;
+    return true;
+}
+
+//
+// Sparse color to camera mapping
+//
+
+// Depth pixels are about three color pixels apart, so every color pixel has a hit within this distance
+static const int COLOR_PIXEL_SEARCH_RADIUS = 4;
+
+struct ColorPixelRect {
+    int left, top, right, bottom;   // inclusive
+
+    bool Contains(int col, int row) const { return col >= left && col <= right && row >= top && row <= bottom; }
+    int  Width()  const { return right - left + 1; }
+    int  Height() const { return bottom - top + 1; }
+};
+
+static inline int RoundColorCoordinate(float c) {
+    return (int)std::floor(c + 0.5f);
+}
+
+// Also false for infinity and NaN, so the coordinates can be rounded to int afterwards
+static inline bool IsNearColorFrame(Vec2f c) {
+    return c.X > -COLOR_PIXEL_SEARCH_RADIUS && c.X < COLOR_WIDTH  + COLOR_PIXEL_SEARCH_RADIUS &&
+           c.Y > -COLOR_PIXEL_SEARCH_RADIUS && c.Y < COLOR_HEIGHT + COLOR_PIXEL_SEARCH_RADIUS;
+}
+
+int MapColorPixelsToCameraSpace(const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                                const Vec2f* colorPixels, int numColorPixels, Vec3f* cameraPoints)
+{
+    const float invalid = -std::numeric_limits<float>::infinity();
+
+    ColorPixelRect roi = { COLOR_WIDTH, COLOR_HEIGHT, -1, -1 };
+    for (int i = 0; i < numColorPixels; ++i) {
+        cameraPoints[i] = Vec3f(invalid, invalid, invalid);
+        if (!IsNearColorFrame(colorPixels[i])) { continue; }
+
+        int col = RoundColorCoordinate(colorPixels[i].X);
+        int row = RoundColorCoordinate(colorPixels[i].Y);
+        roi.left   = std::min(roi.left,   col - COLOR_PIXEL_SEARCH_RADIUS);
+        roi.top    = std::min(roi.top,    row - COLOR_PIXEL_SEARCH_RADIUS);
+        roi.right  = std::max(roi.right,  col + COLOR_PIXEL_SEARCH_RADIUS);
+        roi.bottom = std::max(roi.bottom, row + COLOR_PIXEL_SEARCH_RADIUS);
+    }
+
+    roi.left   = std::max(roi.left,   0);
+    roi.top    = std::max(roi.top,    0);
+    roi.right  = std::min(roi.right,  COLOR_WIDTH  - 1);
+    roi.bottom = std::min(roi.bottom, COLOR_HEIGHT - 1);
+
+    if (roi.left > roi.right || roi.top > roi.bottom) { return 0; }
+
+    // Depth pixel seen at every color pixel of the region, -1 where none maps to
+    std::vector<int32_t> depthPixels(roi.Width() * roi.Height(), -1);
+
+    // Coordinates that round into the region, most depth pixels are rejected before rounding
+    const float left   = roi.left   - 0.5f;
+    const float right  = roi.right  + 0.5f;
+    const float top    = roi.top    - 0.5f;
+    const float bottom = roi.bottom + 0.5f;
+
+    for (int pixel = 0; pixel < NUM_DEPTH_PIXELS; ++pixel) {
+        Vec2f c = depthToColor[pixel];
+        if (!(c.X >= left && c.X < right && c.Y >= top && c.Y < bottom)) { continue; }
+
+        int col = RoundColorCoordinate(c.X);
+        int row = RoundColorCoordinate(c.Y);
+        if (!roi.Contains(col, row) || !IsValidMapping(depthToCamera[pixel])) { continue; }
+
+        int32_t& seen = depthPixels[(row - roi.top) * roi.Width() + (col - roi.left)];
+        if (seen < 0 || depthToCamera[pixel].Z < depthToCamera[seen].Z) {
+            seen = pixel;
+        }
+    }
+
+    int numMapped = 0;
+    for (int i = 0; i < numColorPixels; ++i) {
+        if (!IsNearColorFrame(colorPixels[i])) { continue; }
+
+        int col = RoundColorCoordinate(colorPixels[i].X);
+        int row = RoundColorCoordinate(colorPixels[i].Y);
+
+        int32_t nearest = -1;
+        int nearestSquaredDistance = std::numeric_limits<int>::max();
+
+        for (int dy = -COLOR_PIXEL_SEARCH_RADIUS; dy <= COLOR_PIXEL_SEARCH_RADIUS; ++dy) {
+            for (int dx = -COLOR_PIXEL_SEARCH_RADIUS; dx <= COLOR_PIXEL_SEARCH_RADIUS; ++dx) {
+                if (!roi.Contains(col + dx, row + dy)) { continue; }
+
+                int32_t seen = depthPixels[(row + dy - roi.top) * roi.Width() + (col + dx - roi.left)];
+                int squaredDistance = dx * dx + dy * dy;
+                if (seen >= 0 && squaredDistance < nearestSquaredDistance) {
+                    nearest = seen;
+                    nearestSquaredDistance = squaredDistance;
+                }
+            }
+        }
+
+        if (nearest >= 0) {
+            cameraPoints[i] = depthToCamera[nearest];
+            ++numMapped;
+        }
+    }
+
+    return numMapped;
+}
+
+//
+// Mapping
+//
+
+CoordinateMapper::CoordinateMapper(const CameraCalibration& calibration)
+    : calibration_(calibration)
+{
+    MakeProjection(calibration_, projection_);
+
+    rayX_ = (float*)AllocateAligned(NUM_DEPTH_PIXELS * sizeof(float));
+    rayY_ = (float*)AllocateAligned(NUM_DEPTH_PIXELS * sizeof(float));
+
+    for (int row = 0; row < DEPTH_HEIGHT; ++row) {
+        for (int col = 0; col < DEPTH_WIDTH; ++col) {
+            float distortedX = (col - calibration_.depthPrincipalPointX) / calibration_.depthFocalLengthX;
+            float distortedY = (row - calibration_.depthPrincipalPointY) / calibration_.depthFocalLengthY;
+
+            float x = distortedX;
+            float y = distortedY;
+            for (int i = 0; i < UNDISTORT_ITERATIONS; ++i) {
+                float distortion = RadialDistortion(calibration_, x * x + y * y);
+                x = distortedX / distortion;
+                y = distortedY / distortion;
+            }
+
+            rayX_[row * DEPTH_WIDTH + col] = x;
+            rayY_[row * DEPTH_WIDTH + col] = y;
+        }
+    }
+}
+
+CoordinateMapper::~CoordinateMapper()
+{
+    FreeAligned(rayX_);
+    FreeAligned(rayY_);
+}
+
+Vec2f CoordinateMapper::MapCameraPointToColorSpace(Vec3f point) const
+{
+    return Project(projection_, point.X, point.Y, point.Z);
+}
+
+void CoordinateMapper::MapCameraPointsToColorSpace(const Vec3f* points, size_t numPoints, Vec2f* colorPoints) const
+{
+    for (size_t i = 0; i < numPoints; ++i) {
+        colorPoints[i] = Project(projection_, points[i].X, points[i].Y, points[i].Z);
+    }
+}
+
+void CoordinateMapper::MapDepthFrameScalar(const uint16_t* depthBuffer16, Vec3f* depthToCamera, Vec2f* depthToColor) const
+{
+    const float invalid = -std::numeric_limits<float>::infinity();
+
+    for (int pixel = 0; pixel < NUM_DEPTH_PIXELS; ++pixel) {
+        uint16_t depth = depthBuffer16[pixel];
+
+        if (depth == 0) {
+            if (depthToCamera) { depthToCamera[pixel] = Vec3f(invalid, invalid, invalid); }
+            if (depthToColor)  { depthToColor[pixel]  = Vec2f(invalid, invalid); }
+            continue;
+        }
+
+        float Z = depth * DEPTH_TO_METERS;
+        float X = rayX_[pixel] * Z;
+        float Y = rayY_[pixel] * Z;
+
+        if (depthToCamera) { depthToCamera[pixel] = Vec3f(X, Y, Z); }
+        if (depthToColor)  { depthToColor[pixel]  = Project(projection_, X, Y, Z); }
+    }
+}
+
+void CoordinateMapper::MapDepthFrame(const uint16_t* depthBuffer16, Vec3f* depthToCamera, Vec2f* depthToColor) const
+{
+#ifdef COORDINATE_MAPPER_SSE2
+    const float* P = projection_;
+    const __m128 toMeters = _mm_set1_ps(DEPTH_TO_METERS);
+    const __m128 invalid  = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    const __m128i zero    = _mm_setzero_si128();
+
+    // Four pixels at a time, the rays are aligned and the frame size is a multiple of four
+    int pixel = 0;
+    for (; pixel + 4 <= NUM_DEPTH_PIXELS; pixel += 4) {
+        __m128i depth = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(depthBuffer16 + pixel)), zero);
+        __m128  noDepth = _mm_castsi128_ps(_mm_cmpeq_epi32(depth, zero));
+
+        __m128 Z = _mm_mul_ps(_mm_cvtepi32_ps(depth), toMeters);
+        __m128 X = _mm_mul_ps(_mm_load_ps(rayX_ + pixel), Z);
+        __m128 Y = _mm_mul_ps(_mm_load_ps(rayY_ + pixel), Z);
+
+        // Same order of operations as Project(), so both paths give identical results
+        auto row = [&](int r) {
+            return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(P[r * 4 + 0]), X),
+                                                    _mm_mul_ps(_mm_set1_ps(P[r * 4 + 1]), Y)),
+                                         _mm_mul_ps(_mm_set1_ps(P[r * 4 + 2]), Z)),
+                              _mm_set1_ps(P[r * 4 + 3]));
+        };
+        __m128 w = row(2);
+        __m128 u = _mm_div_ps(row(0), w);
+        __m128 v = _mm_div_ps(row(1), w);
+
+        auto selectValid = [&](__m128 value) {
+            return _mm_or_ps(_mm_and_ps(noDepth, invalid), _mm_andnot_ps(noDepth, value));
+        };
+
+        alignas(16) float x[4], y[4], z[4], cu[4], cv[4];
+        _mm_store_ps(x,  selectValid(X));
+        _mm_store_ps(y,  selectValid(Y));
+        _mm_store_ps(z,  selectValid(Z));
+        _mm_store_ps(cu, selectValid(u));
+        _mm_store_ps(cv, selectValid(v));
+
+        for (int i = 0; i < 4; ++i) {
+            if (depthToCamera) { depthToCamera[pixel + i] = Vec3f(x[i], y[i], z[i]); }
+            if (depthToColor)  { depthToColor[pixel + i]  = Vec2f(cu[i], cv[i]); }
+        }
+    }
+
+    static_assert(NUM_DEPTH_PIXELS % 4 == 0, "The SIMD loop expects whole groups of four depth pixels");
+#else
+    MapDepthFrameScalar(depthBuffer16, depthToCamera, depthToColor);
+#endif
+}
@@ -0,0 +1,113 @@
+#ifndef COORDINATEMAPPER_H
+#define COORDINATEMAPPER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "Types.h"
+
+//
+// File name of the calibration that is stored with the snapshots of a scan session
+//
+const char CAMERA_CALIBRATION_FILE_NAME[] = "camera_calibration.txt";
+
+//
+// Intrinsics and extrinsics of the kinect's depth and color camera, in the conventions of the SDK:
+// camera space is in meters, depth pixels and color pixels are (column, row).
+//
+struct CameraCalibration {
+    // Depth camera, pinhole with radial distortion: pixel = principalPoint + focalLength * distort(ray)
+    float depthFocalLengthX;
+    float depthFocalLengthY;
+    float depthPrincipalPointX;
+    float depthPrincipalPointY;
+    float depthRadialDistortion2;
+    float depthRadialDistortion4;
+    float depthRadialDistortion6;
+
+    // Color camera, pinhole without distortion
+    float colorFocalLengthX;
+    float colorFocalLengthY;
+    float colorPrincipalPointX;
+    float colorPrincipalPointY;
+
+    // Depth camera space to color camera space, row major: colorPoint = rotation * cameraPoint + translation
+    float rotation[9];
+    float translation[3];
+};
+
+//
+// Estimates the calibration from the mappings of a depth frame by the kinect SDK (or read from a recording).
+// The depth intrinsics are fitted to the rays of the valid camera points, the color camera to the camera
+// point / color pixel pairs. Needs a frame with at least a few thousand valid pixels.
+//
+// Returns false if there are not enough valid pixels. On success, the root mean square reprojection errors
+// of the fitted model are written to depthError (in depth pixels) and colorError (in color pixels).
+//
+bool FitCameraCalibration(const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                          CameraCalibration* calibration, float* depthError = nullptr, float* colorError = nullptr);
+
+bool SaveCameraCalibration(const std::string& fileName, const CameraCalibration& calibration);
+bool LoadCameraCalibration(const std::string& fileName, CameraCalibration* calibration);
+
+//
+// Maps single color pixels to camera space, like ICoordinateMapper::MapColorFrameToCameraSpace() does for all
+// pixels of the color frame, from the mappings of the depth frame (depthToCamera, depthToColor).
+//
+// Only the depth pixels that map into the bounding box of the queried pixels (grown by a few pixels) are
+// projected, into a small raster that keeps the point closest to the camera per color pixel. A queried pixel
+// that no depth pixel hits directly takes the closest hit nearby. Pixels without any hit nearby are mapped to
+// -infinity. Returns the number of mapped pixels.
+//
+int MapColorPixelsToCameraSpace(const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                                const Vec2f* colorPixels, int numColorPixels, Vec3f* cameraPoints);
+
+/**
+ * @brief The CoordinateMapper class maps between depth pixels, camera space and color pixels without the
+ * kinect SDK, so it also works offline on recordings and snapshots.
+ *
+ * Results follow ICoordinateMapper: pixels without a depth value are mapped to -infinity.
+ *
+ * The ray of every depth pixel is looked up in a table that is computed once from the calibration, so mapping
+ * a depth frame is a multiplication with the depth and a projection into the color camera per pixel.
+ */
+class CoordinateMapper
+{
+public:
+    CoordinateMapper(const CameraCalibration& calibration);
+    ~CoordinateMapper();
+
+    const CameraCalibration& Calibration() const { return calibration_; }
+
+    //
+    // Maps a whole depth frame to camera space and to color pixels. Either output may be nullptr.
+    //
+    void MapDepthFrame(const uint16_t* depthBuffer16, Vec3f* depthToCamera, Vec2f* depthToColor) const;
+
+    //
+    // Projects camera points into the color image
+    //
+    Vec2f MapCameraPointToColorSpace(Vec3f point) const;
+    void MapCameraPointsToColorSpace(const Vec3f* points, size_t numPoints, Vec2f* colorPoints) const;
+
+    //
+    // Same as MapDepthFrame(), one pixel at a time without SIMD. Kept as the reference for the benchmark.
+    //
+    void MapDepthFrameScalar(const uint16_t* depthBuffer16, Vec3f* depthToCamera, Vec2f* depthToColor) const;
+
+private:
+    CoordinateMapper(const CoordinateMapper&);
+    CoordinateMapper& operator=(const CoordinateMapper&);
+
+    CameraCalibration calibration_;
+
+    // Projection from camera space to homogeneous color pixels, row major 3x4
+    float projection_[12];
+
+    // Ray of every depth pixel at a depth of 1m, as separate planes for SIMD loads
+    float* rayX_;
+    float* rayY_;
+};
+
+#endif // COORDINATEMAPPER_H
@@ -0,0 +1,98 @@
+#ifndef DEPTHCONVERSION_H
+#define DEPTHCONVERSION_H
+
+#include <stdint.h>
+#include <math.h>
+
+//
+// Conversion of 16 bit depth frames to 8 bit for display. Shared by FaceScanKinect and SequenceRecorder,
+// so this header only depends on the standard library.
+//
+// The SIMD version is chosen at compile time: AVX2 when the compiler targets it (/arch:AVX2 or -mavx2),
+// SSE2 on every x64 build, the scalar loop otherwise.
+//
+#if defined(__AVX2__)
+#define DEPTH_CONVERSION_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DEPTH_CONVERSION_SSE2
+#include <emmintrin.h>
+#endif
+
+static inline float DepthTo8BitScale(uint16_t minDistance, uint16_t maxDistance) {
+    return 255.0f / (maxDistance - minDistance);
+}
+
+//
+// Reference version, one pixel at a time: (depth - minDistance) * scale, rounded down and clamped to [0, 255]
+//
+static void ConvertDepthTo8BitScalar(const uint16_t* depth16, uint8_t* depth8, int numPixels,
+                                     uint16_t minDistance, uint16_t maxDistance) {
+    float scale = DepthTo8BitScale(minDistance, maxDistance);
+
+    for (int pixel = 0; pixel < numPixels; ++pixel) {
+        int32_t depth = (int32_t)depth16[pixel];
+        depth -= (int32_t)minDistance;
+
+        int32_t val = (int32_t)floorf(depth * scale);
+        depth8[pixel] = val > 255 ? 255 : (val < 0 ? 0 : (uint8_t)val);
+    }
+}
+
+//
+// Scales the reliable depth range [minDistance, maxDistance] of a 16 bit depth frame to 8 bit for display.
+//
+// Gives exactly the same result as ConvertDepthTo8BitScalar(): the products are computed the same way in
+// single precision. Truncation instead of rounding down only differs for negative values, which are clamped
+// to 0 anyway, and the saturating packs do the clamping.
+//
+static void ConvertDepthTo8Bit(const uint16_t* depth16, uint8_t* depth8, int numPixels,
+                               uint16_t minDistance, uint16_t maxDistance) {
+    int pixel = 0;
+
+#if defined(DEPTH_CONVERSION_AVX2)
+    const __m256  scale    = _mm256_set1_ps(DepthTo8BitScale(minDistance, maxDistance));
+    const __m256i minDepth = _mm256_set1_epi32(minDistance);
+
+    for (; pixel + 16 <= numPixels; pixel += 16) {
+        __m256i depthLow  = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(depth16 + pixel)));
+        __m256i depthHigh = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(depth16 + pixel + 8)));
+
+        __m256i valLow  = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(depthLow,  minDepth)), scale));
+        __m256i valHigh = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(depthHigh, minDepth)), scale));
+
+        // Packing works within 128 bit lanes, put the 16 bit values back in pixel order
+        __m256i val16 = _mm256_permute4x64_epi64(_mm256_packs_epi32(valLow, valHigh), 0xD8);
+        __m128i val8  = _mm_packus_epi16(_mm256_castsi256_si128(val16), _mm256_extracti128_si256(val16, 1));
+
+        _mm_storeu_si128((__m128i*)(depth8 + pixel), val8);
+    }
+#elif defined(DEPTH_CONVERSION_SSE2)
+    const __m128  scale    = _mm_set1_ps(DepthTo8BitScale(minDistance, maxDistance));
+    const __m128i minDepth = _mm_set1_epi32(minDistance);
+    const __m128i zero     = _mm_setzero_si128();
+
+    for (; pixel + 16 <= numPixels; pixel += 16) {
+        __m128i depthA = _mm_loadu_si128((const __m128i*)(depth16 + pixel));
+        __m128i depthB = _mm_loadu_si128((const __m128i*)(depth16 + pixel + 8));
+
+        __m128i depth[4] = {
+            _mm_unpacklo_epi16(depthA, zero), _mm_unpackhi_epi16(depthA, zero),
+            _mm_unpacklo_epi16(depthB, zero), _mm_unpackhi_epi16(depthB, zero)
+        };
+
+        __m128i val[4];
+        for (int i = 0; i < 4; ++i) {
+            val[i] = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(depth[i], minDepth)), scale));
+        }
+
+        __m128i val8 = _mm_packus_epi16(_mm_packs_epi32(val[0], val[1]), _mm_packs_epi32(val[2], val[3]));
+        _mm_storeu_si128((__m128i*)(depth8 + pixel), val8);
+    }
+#endif
+
+    // Remaining pixels
+    ConvertDepthTo8BitScalar(depth16 + pixel, depth8 + pixel, numPixels - pixel, minDistance, maxDistance);
+}
+
+#endif // DEPTHCONVERSION_H
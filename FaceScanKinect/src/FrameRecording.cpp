@@ -0,0 +1,211 @@
+#include "FrameRecording.h"
+
+#include <QDebug>
+
+#include <chrono>
+#include <cstring>
+
+#include "MemoryPool.h"
+#include "PointCloud.h"
+#include "util.h"
+
+//
+// Offsets of the blocks within a frame record
+//
+struct FrameRecordLayout {
+    uint64_t colorOffset;
+    uint64_t depthOffset;
+    uint64_t bodyIndexOffset;
+    uint64_t depthToCameraOffset;
+    uint64_t depthToColorOffset;
+    uint64_t size;
+};
+
+static uint64_t AlignToRecordingBlock(uint64_t offset) {
+    return (offset + FRAME_RECORDING_BLOCK_ALIGNMENT - 1) / FRAME_RECORDING_BLOCK_ALIGNMENT * FRAME_RECORDING_BLOCK_ALIGNMENT;
+}
+
+static FrameRecordLayout MakeFrameRecordLayout() {
+    FrameRecordLayout layout;
+
+    uint64_t offset = AlignToRecordingBlock(sizeof(RecordedFrameHeader));
+    layout.colorOffset         = offset;  offset = AlignToRecordingBlock(offset + COLOR_BUFFER_SIZE);
+    layout.depthOffset         = offset;  offset = AlignToRecordingBlock(offset + DEPTH_BUFFER16_SIZE);
+    layout.bodyIndexOffset     = offset;  offset = AlignToRecordingBlock(offset + NUM_DEPTH_PIXELS * sizeof(uint8_t));
+    layout.depthToCameraOffset = offset;  offset = AlignToRecordingBlock(offset + NUM_DEPTH_PIXELS * sizeof(Vec3f));
+    layout.depthToColorOffset  = offset;  offset = AlignToRecordingBlock(offset + NUM_DEPTH_PIXELS * sizeof(Vec2f));
+    layout.size = offset;
+
+    return layout;
+}
+
+static FrameRecordingHeader MakeFrameRecordingHeader() {
+    FrameRecordingHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FRAME_RECORDING_MAGIC, sizeof(header.magic));
+    header.version          = FRAME_RECORDING_VERSION;
+    header.colorWidth       = COLOR_WIDTH;
+    header.colorHeight      = COLOR_HEIGHT;
+    header.depthWidth       = DEPTH_WIDTH;
+    header.depthHeight      = DEPTH_HEIGHT;
+    header.firstFrameOffset = AlignToRecordingBlock(sizeof(FrameRecordingHeader));
+    header.frameRecordSize  = MakeFrameRecordLayout().size;
+    return header;
+}
+
+static void WriteRecordingBlock(std::ofstream& file, uint64_t offset, const void* data, uint64_t size) {
+    static const char zeros[FRAME_RECORDING_BLOCK_ALIGNMENT] = {};
+    uint64_t position = (uint64_t)file.tellp();
+    file.write(zeros, offset - position);
+    file.write((const char*)data, size);
+}
+
+//
+// Recording
+//
+
+std::unique_ptr<FrameRecorder> FrameRecorder::Create(const std::string& recordingFileName)
+{
+    std::unique_ptr<FrameRecorder> result(new FrameRecorder());
+
+    result->file_.open(recordingFileName, std::ios::binary);
+    if (!result->file_.is_open()) {
+        qCritical() << "Cannot open recording file for writing to" << QString::fromStdString(recordingFileName);
+        return nullptr;
+    }
+
+    FrameRecordingHeader header = MakeFrameRecordingHeader();
+    result->file_.write((const char*)&header, sizeof(header));
+    WriteRecordingBlock(result->file_, header.firstFrameOffset, nullptr, 0);
+
+    if (result->file_.fail()) {
+        qCritical() << "Cannot write recording header to" << QString::fromStdString(recordingFileName);
+        return nullptr;
+    }
+
+    return result;
+}
+
+bool FrameRecorder::WriteFrame(const uint32_t* colorBuffer, const uint16_t* depthBuffer16, const uint8_t* bodyIndexBuffer,
+                               const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                               float cutoffHeight, uint16_t minReliableDistance, uint16_t maxReliableDistance)
+{
+    int64_t timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (numFrames_ == 0) { firstTimestampNs_ = timestampNs; }
+
+    RecordedFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    header.timestampUs         = (uint64_t)(timestampNs - firstTimestampNs_) / 1000;
+    header.cutoffHeight        = cutoffHeight;
+    header.minReliableDistance = minReliableDistance;
+    header.maxReliableDistance = maxReliableDistance;
+
+    FrameRecordLayout layout = MakeFrameRecordLayout();
+    uint64_t recordStart = (uint64_t)file_.tellp();
+
+    file_.write((const char*)&header, sizeof(header));
+    WriteRecordingBlock(file_, recordStart + layout.colorOffset,         colorBuffer,     COLOR_BUFFER_SIZE);
+    WriteRecordingBlock(file_, recordStart + layout.depthOffset,         depthBuffer16,   DEPTH_BUFFER16_SIZE);
+    WriteRecordingBlock(file_, recordStart + layout.bodyIndexOffset,     bodyIndexBuffer, NUM_DEPTH_PIXELS * sizeof(uint8_t));
+    WriteRecordingBlock(file_, recordStart + layout.depthToCameraOffset, depthToCamera,   NUM_DEPTH_PIXELS * sizeof(Vec3f));
+    WriteRecordingBlock(file_, recordStart + layout.depthToColorOffset,  depthToColor,    NUM_DEPTH_PIXELS * sizeof(Vec2f));
+    WriteRecordingBlock(file_, recordStart + layout.size, nullptr, 0);
+
+    if (file_.fail()) { return false; }
+
+    ++numFrames_;
+    return true;
+}
+
+//
+// Replay
+//
+
+std::unique_ptr<FrameRecording> FrameRecording::Open(const std::string& recordingFileName)
+{
+    std::unique_ptr<FrameRecording> result(new FrameRecording());
+
+    result->file_.setFileName(QString::fromStdString(recordingFileName));
+    if (!result->file_.open(QIODevice::ReadOnly)) {
+        qCritical() << "Could not open recording for mapping" << result->file_.fileName();
+        return nullptr;
+    }
+
+    qint64 size = result->file_.size();
+    result->data_ = result->file_.map(0, size, QFileDevice::MapPrivateOption);
+    if (result->data_ == nullptr) {
+        qCritical() << "Could not map recording" << result->file_.fileName();
+        return nullptr;
+    }
+
+    // Frames are copied into buffers of the kinect's sizes, so the recording has to match them exactly
+    FrameRecordingHeader expected = MakeFrameRecordingHeader();
+    FrameRecordingHeader header;
+    if ((uint64_t)size < sizeof(header)) {
+        qCritical() << "Not a valid recording" << result->file_.fileName();
+        return nullptr;
+    }
+    memcpy(&header, result->data_, sizeof(header));
+
+    bool isValid = memcmp(header.magic, FRAME_RECORDING_MAGIC, sizeof(header.magic)) == 0 &&
+                   header.version          <= FRAME_RECORDING_VERSION &&
+                   header.colorWidth       == expected.colorWidth &&
+                   header.colorHeight      == expected.colorHeight &&
+                   header.depthWidth       == expected.depthWidth &&
+                   header.depthHeight      == expected.depthHeight &&
+                   header.firstFrameOffset == expected.firstFrameOffset &&
+                   header.frameRecordSize  == expected.frameRecordSize &&
+                   header.firstFrameOffset <= (uint64_t)size;
+
+    if (!isValid) {
+        qCritical() << "Not a valid recording" << result->file_.fileName();
+        return nullptr;
+    }
+
+    result->firstFrameOffset_ = header.firstFrameOffset;
+    result->frameRecordSize_  = header.frameRecordSize;
+    result->numFrames_        = (size_t)(((uint64_t)size - header.firstFrameOffset) / header.frameRecordSize);
+
+    return result;
+}
+
+FrameRecording::~FrameRecording()
+{
+    if (data_ != nullptr) {
+        file_.unmap(data_);
+    }
+}
+
+RecordedFrame FrameRecording::Frame(size_t index) const
+{
+    Q_ASSERT(index < numFrames_);
+
+    static const FrameRecordLayout layout = MakeFrameRecordLayout();
+    const uchar* record = data_ + firstFrameOffset_ + index * frameRecordSize_;
+
+    RecordedFrame frame;
+    memcpy(&frame.header, record, sizeof(frame.header));
+    frame.colorBuffer     = (const uint32_t*)(record + layout.colorOffset);
+    frame.depthBuffer16   = (const uint16_t*)(record + layout.depthOffset);
+    frame.bodyIndexBuffer = (const uint8_t*) (record + layout.bodyIndexOffset);
+    frame.depthToCamera   = (const Vec3f*)   (record + layout.depthToCameraOffset);
+    frame.depthToColor    = (const Vec2f*)   (record + layout.depthToColorOffset);
+
+    return frame;
+}
+
+void LoadRecordedFrame(const RecordedFrame& recorded, FrameBuffer* frame)
+{
+    memcpy(frame->colorBuffer,   recorded.colorBuffer,   COLOR_BUFFER_SIZE);
+    memcpy(frame->depthBuffer16, recorded.depthBuffer16, DEPTH_BUFFER16_SIZE);
+
+    ConvertDepthTo8Bit(recorded.depthBuffer16, frame->depthBuffer8, NUM_DEPTH_PIXELS,
+                       recorded.header.minReliableDistance, recorded.header.maxReliableDistance);
+
+    PointCloudHelpers::CreatePointCloud(recorded.colorBuffer, recorded.depthToCamera, recorded.depthToColor,
+                                        recorded.bodyIndexBuffer, recorded.header.cutoffHeight,
+                                        frame->pointCloudBuffer, frame->colorPointRaster);
+
+    frame->pointCloudBuffer->numLandmarks = 0;
+}
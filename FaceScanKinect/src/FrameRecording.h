@@ -0,0 +1,136 @@
+#ifndef FRAMERECORDING_H
+#define FRAMERECORDING_H
+
+#include <QFile>
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "Types.h"
+
+struct FrameBuffer;
+
+//
+// Recording file format (*.fsr)
+//
+// Raw kinect frames together with their coordinate mappings, so the point cloud pipeline runs on a recording
+// without the sensor and the SDK. The file starts with a FrameRecordingHeader, followed by frame records:
+//
+//   RecordedFrameHeader | color (RGBA8) | depth (uint16) | body index (uint8) | depth to camera (Vec3f) | depth to color (Vec2f)
+//
+// All records have the same size and every block starts at a multiple of FRAME_RECORDING_BLOCK_ALIGNMENT.
+// Frame i is found without an index, and a record that was cut off (e.g. the application crashed while
+// recording) is ignored when reading.
+//
+const char     FRAME_RECORDING_MAGIC[4]        = { 'F', 'S', 'R', 'C' };
+const uint32_t FRAME_RECORDING_VERSION         = 1;
+const uint64_t FRAME_RECORDING_BLOCK_ALIGNMENT = 64;
+
+struct FrameRecordingHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t colorWidth;
+    uint32_t colorHeight;
+    uint32_t depthWidth;
+    uint32_t depthHeight;
+    uint64_t firstFrameOffset;
+    uint64_t frameRecordSize;
+    uint8_t  reserved[24];
+};
+
+static_assert(sizeof(FrameRecordingHeader) == 64, "FrameRecordingHeader must stay 64 bytes");
+
+struct RecordedFrameHeader {
+    uint64_t timestampUs;          // Since the first frame of the recording
+    float    cutoffHeight;         // Points below this height do not belong to the point cloud
+    uint16_t minReliableDistance;  // Reliable depth range in mm, used for the 8 bit depth image
+    uint16_t maxReliableDistance;
+    uint8_t  reserved[48];
+};
+
+static_assert(sizeof(RecordedFrameHeader) == 64, "RecordedFrameHeader must stay 64 bytes");
+
+//
+// A frame of a recording. The buffers look directly into the mapped file.
+//
+struct RecordedFrame {
+    RecordedFrameHeader header;
+
+    const uint32_t* colorBuffer;
+    const uint16_t* depthBuffer16;
+    const uint8_t*  bodyIndexBuffer;
+    const Vec3f*    depthToCamera;
+    const Vec2f*    depthToColor;
+};
+
+/**
+ * @brief The FrameRecorder class appends frames to a new recording file.
+ */
+class FrameRecorder
+{
+public:
+    //
+    // Returns nullptr if the file cannot be created
+    //
+    static std::unique_ptr<FrameRecorder> Create(const std::string& recordingFileName);
+
+    //
+    // Appends a frame, the buffers have the sizes of the kinect frames. Returns false on write errors.
+    //
+    bool WriteFrame(const uint32_t* colorBuffer, const uint16_t* depthBuffer16, const uint8_t* bodyIndexBuffer,
+                    const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                    float cutoffHeight, uint16_t minReliableDistance, uint16_t maxReliableDistance);
+
+    size_t NumFrames() const { return numFrames_; }
+
+private:
+    FrameRecorder() : numFrames_(0), firstTimestampNs_(0) {}
+    FrameRecorder(const FrameRecorder&);
+    FrameRecorder& operator=(const FrameRecorder&);
+
+    std::ofstream file_;
+    size_t numFrames_;
+    int64_t firstTimestampNs_;
+};
+
+/**
+ * @brief The FrameRecording class maps a recording file into memory for reading.
+ *
+ * Frames are handed out as views of the mapping, nothing is parsed or copied. The mapping is valid as long
+ * as this object lives.
+ */
+class FrameRecording
+{
+public:
+    //
+    // Returns nullptr if the file cannot be mapped or is not a recording of frames with the kinect's sizes
+    //
+    static std::unique_ptr<FrameRecording> Open(const std::string& recordingFileName);
+
+    ~FrameRecording();
+
+    size_t NumFrames() const { return numFrames_; }
+
+    RecordedFrame Frame(size_t index) const;
+
+private:
+    FrameRecording() : data_(nullptr), numFrames_(0) {}
+    FrameRecording(const FrameRecording&);
+    FrameRecording& operator=(const FrameRecording&);
+
+    QFile file_;
+    uchar* data_;
+    uint64_t firstFrameOffset_;
+    uint64_t frameRecordSize_;
+    size_t numFrames_;
+};
+
+//
+// Fills frame like the KinectGrabber does for a live frame: copies the color and depth images, converts the
+// depth for display and creates the point cloud. Landmarks are cleared.
+//
+void LoadRecordedFrame(const RecordedFrame& recorded, FrameBuffer* frame);
+
+#endif // FRAMERECORDING_H
@@ -0,0 +1,173 @@
+#include "FrameSource.h"
+
+#include <QtDebug>
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <cfloat>
+
+#include <LandmarkCoreIncludes.h>
+#include <opencv2/opencv.hpp>
+
+#include "MemoryPool.h"
+#include "PointCloud.h"
+
+// About 8s at 30 frames per second
+const int MAX_CALIBRATION_BACKOFF_FRAMES = 256;
+
+bool FrameSource::GetCameraCalibration(CameraCalibration* calibration) const
+{
+    if (!hasCameraCalibration_) { return false; }
+
+    *calibration = cameraCalibration_;
+    return true;
+}
+
+void FrameSource::CalibrateFrom(const Vec3f* depthToCamera, const Vec2f* depthToColor)
+{
+    if (hasCameraCalibration_) { return; }
+
+    if (calibrationFramesToSkip_ > 0) {
+        --calibrationFramesToSkip_;
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    float depthError, colorError;
+    if (!FitCameraCalibration(depthToCamera, depthToColor, &cameraCalibration_, &depthError, &colorError)) {
+        calibrationBackoff_ = std::min(std::max(1, 2 * calibrationBackoff_), MAX_CALIBRATION_BACKOFF_FRAMES);
+        calibrationFramesToSkip_ = calibrationBackoff_;
+        return;
+    }
+
+    // Readers only look at the calibration once the flag is set
+    hasCameraCalibration_ = true;
+
+    qInfo() << "Fitted camera calibration in" << timer.elapsed() << "ms, RMS error"
+            << depthError << "depth pixels," << colorError << "color pixels";
+}
+
+void ScaleColorFrame(const uint32_t* colors, FrameBuffer* frame)
+{
+    cv::Mat colorImage(COLOR_HEIGHT, COLOR_WIDTH, CV_8UC4, const_cast<uint32_t*>(colors));
+    cv::Mat scaledImage(SCALED_COLOR_HEIGHT, SCALED_COLOR_WIDTH, CV_8UC4, frame->scaledColorBuffer);
+
+    cv::resize(colorImage, scaledImage, scaledImage.size());
+}
+
+//
+// Bounding box of the landmarks, grown by half its size to every side. Covers the search windows of the
+// tracker and the motion of the face between two frames.
+//
+static cv::Rect LandmarkRegion(const cv::Mat_<double>& landmarks)
+{
+    // Landmarks are stored as [x1, ... ,xn, y1, ..., yn]
+    int numLandmarks = landmarks.rows / 2;
+
+    double minX = DBL_MAX, minY = DBL_MAX;
+    double maxX = -DBL_MAX, maxY = -DBL_MAX;
+    for (int i = 0; i < numLandmarks; ++i) {
+        double x = landmarks.at<double>(i);
+        double y = landmarks.at<double>(i + numLandmarks);
+
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+    }
+
+    if (numLandmarks == 0) { return cv::Rect(); }
+
+    double marginX = (maxX - minX) / 2.0;
+    double marginY = (maxY - minY) / 2.0;
+
+    return cv::Rect(cv::Point((int)(minX - marginX), (int)(minY - marginY)),
+                    cv::Point((int)(maxX + marginX) + 1, (int)(maxY + marginY) + 1));
+}
+
+//
+// Sets all pixels of image outside of roi to 0
+//
+static void ClearOutside(cv::Mat& image, const cv::Rect& roi)
+{
+    image.rowRange(0, roi.y).setTo(0);
+    image.rowRange(roi.y + roi.height, image.rows).setTo(0);
+
+    cv::Mat rows = image.rowRange(roi.y, roi.y + roi.height);
+    rows.colRange(0, roi.x).setTo(0);
+    rows.colRange(roi.x + roi.width, image.cols).setTo(0);
+}
+
+void TrackFace(FrameBuffer* frame,
+               LandmarkDetector::CLNF* faceTrackingModel,
+               LandmarkDetector::FaceModelParameters* faceTrackingParameters,
+               bool useRoi,
+               const FaceRegion* headRegion)
+{
+    cv::Mat scaledImage(SCALED_COLOR_HEIGHT, SCALED_COLOR_WIDTH, CV_8UC4, frame->scaledColorBuffer);
+    cv::Mat_<uchar> gray(SCALED_COLOR_HEIGHT, SCALED_COLOR_WIDTH, frame->scaledGrayBuffer);
+
+    cv::Rect frameRect(0, 0, SCALED_COLOR_WIDTH, SCALED_COLOR_HEIGHT);
+    cv::Rect roi = frameRect;
+    bool initializeFromHead = false;
+
+    if (useRoi) {
+        if (faceTrackingModel->detection_success) {
+            roi = LandmarkRegion(faceTrackingModel->detected_landmarks) & frameRect;
+        } else if (headRegion != nullptr) {
+            roi = cv::Rect((int)(headRegion->x - headRegion->width / 2), (int)(headRegion->y - headRegion->height / 2),
+                           (int)(headRegion->width * 2), (int)(headRegion->height * 2)) & frameRect;
+            initializeFromHead = true;
+        }
+
+        if (roi.area() == 0) {
+            roi = frameRect;
+            initializeFromHead = false;
+        }
+    }
+
+    // The view into the gray buffer has the right size and type, so the conversion writes into the buffer
+    cv::Mat grayRoi = gray(roi);
+    cv::cvtColor(scaledImage(roi), grayRoi, CV_BGRA2GRAY);
+
+    // Once tracking fails, the tracker detects faces in the whole frame. Pixels outside of the region would
+    // still show an earlier frame, so they are blanked instead.
+    if (roi != frameRect) {
+        ClearOutside(gray, roi);
+    }
+
+    if (initializeFromHead) {
+        cv::Rect_<double> boundingBox(headRegion->x, headRegion->y, headRegion->width, headRegion->height);
+        LandmarkDetector::DetectLandmarksInVideo(gray, boundingBox, *faceTrackingModel, *faceTrackingParameters);
+    } else {
+        LandmarkDetector::DetectLandmarksInVideo(gray, *faceTrackingModel, *faceTrackingParameters);
+    }
+}
+
+void AttachLandmarks(LandmarkDetector::CLNF* faceTrackingModel,
+                     const ColorPointRaster* colorPointRaster,
+                     PointCloudBuffer* pointCloud)
+{
+    pointCloud->numLandmarks = 0;
+    if (pointCloud->numPoints == 0) { return; }
+
+    // Landmarks are stored as [x1, ... ,xn, y1, ..., yn]
+    cv::Mat_<double> landmarks = faceTrackingModel->detected_landmarks;
+    int numDetected  = landmarks.rows / 2;
+    int numLandmarks = std::min(numDetected, NUM_LANDMARKS);
+
+    int landmarkIndex = 0;
+    for (int i = 0; i < numLandmarks; ++i) {
+        // Convert back to image coordinates of the original size
+        Vec2f pixel(landmarks.at<double>(i) / FACE_TRACKING_SCALE, landmarks.at<double>(i + numDetected) / FACE_TRACKING_SCALE);
+
+        // Landmarks without a point nearby are skipped
+        int32_t point = PointCloudHelpers::FindPointAtColorPixel(colorPointRaster, pixel);
+        if (point >= 0) {
+            pointCloud->landmarkIndices[landmarkIndex++] = (size_t)point;
+        }
+    }
+    pointCloud->numLandmarks = landmarkIndex;
+}
@@ -0,0 +1,130 @@
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <QObject>
+
+#include <atomic>
+#include <cstdint>
+
+#include "CoordinateMapper.h"
+
+struct PointCloudBuffer;
+struct ColorPointRaster;
+struct FrameBuffer;
+
+namespace LandmarkDetector {
+    struct FaceModelParameters;
+    class CLNF;
+}
+
+/**
+ * @brief The FrameSource class is the interface of everything that delivers frames to the application,
+ * i.e. the kinect, a webcam or a recording.
+ *
+ * A source gathers frames on its own thread into the back buffer of a FrameExchange. Once a frame is complete,
+ * it is published and the FrameReady() Signal is emitted.
+ *
+ * The FrameExchange has a single producer, so stop the running source before another one is started.
+ */
+class FrameSource : public QObject
+{
+    Q_OBJECT
+
+public:
+    FrameSource() : hasCameraCalibration_(false), calibrationFramesToSkip_(0), calibrationBackoff_(0), faceTrackingRoi_(false) {}
+    virtual ~FrameSource() {}
+
+    //
+    // Starts delivering frames from a thread of the source
+    //
+    virtual void Start() = 0;
+
+    //
+    // Returns once the source stopped and no longer touches the FrameExchange
+    //
+    virtual void Stop() = 0;
+
+    virtual void ToggleFaceTracking() = 0;
+
+    //
+    // Calibration of the camera the frames come from, returns false as long as it is not known
+    //
+    bool GetCameraCalibration(CameraCalibration* calibration) const;
+
+    //
+    // Lets face tracking only look at the region of the frame around the face, see TrackFace()
+    //
+    void SetFaceTrackingRoi(bool enabled) { faceTrackingRoi_ = enabled; }
+
+signals:
+    void FrameReady();
+
+protected:
+    //
+    // Fits the calibration to the mappings of a depth frame, unless the source already has one.
+    // After a failed fit, e.g. while nothing is in front of the camera, the next attempts wait for twice
+    // as many frames each time, up to MAX_CALIBRATION_BACKOFF_FRAMES. Only called from the thread of the source.
+    //
+    void CalibrateFrom(const Vec3f* depthToCamera, const Vec2f* depthToColor);
+
+    bool FaceTrackingRoi() const { return faceTrackingRoi_; }
+
+private:
+    CameraCalibration cameraCalibration_;
+    std::atomic<bool> hasCameraCalibration_;
+
+    // Only touched by CalibrateFrom()
+    int calibrationFramesToSkip_;
+    int calibrationBackoff_;
+
+    std::atomic<bool> faceTrackingRoi_;
+};
+
+//
+// Rectangle in pixels of the scaled color frame
+//
+struct FaceRegion {
+    float x;
+    float y;
+    float width;
+    float height;
+};
+
+/**
+ * @brief ScaleColorFrame Scales colors down by FACE_TRACKING_SCALE into the scaledColorBuffer of frame.
+ *
+ * Face tracking and the color display both work on the scaled frame, so the full frame is only resized once.
+ */
+void ScaleColorFrame(const uint32_t* colors, FrameBuffer* frame);
+
+/**
+ * @brief TrackFace Detects the face landmarks in the scaled color frame of frame, the result is stored in
+ * faceTrackingModel. Run ScaleColorFrame() first.
+ *
+ * The frame sources run this as a PRIORITY_FACE_TRACKING task on theTaskScheduler while they process the rest
+ * of the frame.
+ *
+ * The scaled frame is converted to gray for the tracker. With useRoi, only the region around the landmarks of
+ * the previous frame is converted while a face is tracked. Until then, the headRegion (if given, e.g. from the
+ * head joint of a body) is converted and passed to the tracker as the bounding box of the face. Otherwise the
+ * whole frame is converted for the face detector. Outside of the region the gray frame is black, so a detection
+ * after the tracking failed never finds a face of an earlier frame.
+ */
+void TrackFace(FrameBuffer* frame,
+               LandmarkDetector::CLNF* faceTrackingModel,
+               LandmarkDetector::FaceModelParameters* faceTrackingParameters,
+               bool useRoi = false,
+               const FaceRegion* headRegion = nullptr);
+
+/**
+ * @brief AttachLandmarks Finds the points of pointCloud that correspond to the 2D landmarks of faceTrackingModel
+ * and stores their indices in the point cloud.
+ *
+ * Every landmark is looked up in the raster that was filled when the point cloud was created, see
+ * FindPointAtColorPixel(), so no spatial index has to be built for it.
+ */
+void AttachLandmarks(LandmarkDetector::CLNF* faceTrackingModel,
+                     const ColorPointRaster* colorPointRaster,
+                     PointCloudBuffer* pointCloud);
+
+#endif // FRAMESOURCE_H
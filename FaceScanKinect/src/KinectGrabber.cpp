@@ -2,15 +2,21 @@
 
 #include <QtDebug>
 #include <QElapsedTimer>
-#include <QThread>
+
+#include <cfloat>
+#include <utility>
 
 #include <LandmarkCoreIncludes.h>
-#include <opencv2/opencv.hpp>
 
-#include "FaceTrackingVis.h"
+#include "FrameRecording.h"
 #include "MemoryPool.h"
 #include "util.h"
 #include "PointCloud.h"
+#include "TaskScheduler.h"
+
+// The mapped frames are handed to the SDK independent code and to recordings as Vec3f and Vec2f
+static_assert(sizeof(CameraSpacePoint) == sizeof(Vec3f), "CameraSpacePoint has to match Vec3f");
+static_assert(sizeof(ColorSpacePoint)  == sizeof(Vec2f), "ColorSpacePoint has to match Vec2f");
 
 /**
  * Template function for Releasing various resources from the Kinect API
@@ -36,28 +42,56 @@ INT32 KinectFrameGrabberThread(void* params) {
     return 0;
 }
 
+CapturedFrame::CapturedFrame()
+{
+    colorBuffer     = new uint32_t[NUM_COLOR_PIXELS];
+    depthBuffer16   = new uint16_t[NUM_DEPTH_PIXELS];
+    depthBuffer8    = new uint8_t[NUM_DEPTH_PIXELS];
+    bodyIndexBuffer = new uint8_t[NUM_DEPTH_PIXELS];
+
+    depthToCamera = new CameraSpacePoint[NUM_DEPTH_PIXELS];
+    depthToColor  = new ColorSpacePoint [NUM_DEPTH_PIXELS];
+
+    minReliableDistance = 0;
+    maxReliableDistance = 0;
+    cutoffHeight = -FLT_MAX;
+    hasHeadRegion = false;
+    acquireTimeNs = 0;
+}
+
+CapturedFrame::~CapturedFrame()
+{
+    delete [] colorBuffer;
+    delete [] depthBuffer16;
+    delete [] depthBuffer8;
+    delete [] bodyIndexBuffer;
+    delete [] depthToCamera;
+    delete [] depthToColor;
+}
+
 /**
  * @brief KinectGrabber::KinectGrabber  The constructor allocates memory for all buffers.
  */
-KinectGrabber::KinectGrabber(FrameBuffer *multiFrameBuffer,
+KinectGrabber::KinectGrabber(FrameExchange *frames,
                              LandmarkDetector::CLNF *faceTrackingModel,
                              LandmarkDetector::FaceModelParameters *faceTrackingParameters) :
     faceTrackingModel_(faceTrackingModel),
-    faceTrackingParameters_(faceTrackingParameters)
+    faceTrackingParameters_(faceTrackingParameters),
+    // One frame in each stage and the queued ones
+    freeFrames(CAPTURE_QUEUE_CAPACITY + 2),
+    capturedFrames(CAPTURE_QUEUE_CAPACITY, QUEUE_BLOCK)
 {
     doFaceTracking = true;
+    doFaceTrackingToggleRequested = false;
+    stopRequested = false;
+    frameGrabberThreadHandle = NULL;
 
-    this->multiFrameBuffer = multiFrameBuffer;
-   // depthBufferSize = DEPTH_HEIGHT * DEPTH_WIDTH;
-   // depthBuffer     = new UINT16[depthBufferSize];
-
-    tmpPositions = new CameraSpacePoint[NUM_DEPTH_PIXELS];
-    tmpColors    = new ColorSpacePoint [NUM_DEPTH_PIXELS];
-
-    bodyIndexBufferSize = NUM_DEPTH_PIXELS;
-    bodyIndexBuffer     = new UINT8[bodyIndexBufferSize];
-
+    this->frames = frames;
+    this->multiFrameBuffer = frames->BackBuffer();
 
+    for (size_t i = 0; i < CAPTURE_QUEUE_CAPACITY + 2; ++i) {
+        capturedFrameSlots.push_back(std::unique_ptr<CapturedFrame>(new CapturedFrame()));
+    }
 }
 
 /**
@@ -65,6 +99,8 @@ KinectGrabber::KinectGrabber(FrameBuffer *multiFrameBuffer,
  */
 KinectGrabber::~KinectGrabber()
 {
+    Stop();
+
     reader->UnsubscribeMultiSourceFrameArrived(frameHandle);
     sensor->Close();
 
@@ -72,10 +108,6 @@ KinectGrabber::~KinectGrabber()
     SafeRelease(reader);
     SafeRelease(sensor);
 
-    // delete [] depthBuffer;
-    delete [] bodyIndexBuffer;
-    delete [] tmpPositions;
-    delete [] tmpColors;
 }
 
 /**
@@ -105,19 +137,94 @@ void KinectGrabber::ConnectToKinect() {
 
 }
 
+void KinectGrabber::Start() {
+    ConnectToKinect();
+    StartStream();
+}
+
+/**
+ * @brief KinectGrabber::Stop  Ends the capture loop and waits for the capture and processing threads to exit
+ *
+ * Frames that are still queued are not processed.
+ */
+void KinectGrabber::Stop() {
+    if (frameGrabberThreadHandle == NULL) { return; }
+
+    // Closing the queues wakes up both stages, even if they wait for each other
+    stopRequested = true;
+    freeFrames.Close();
+    capturedFrames.Close();
+
+    WaitForSingleObject(frameGrabberThreadHandle, INFINITE);
+    CloseHandle(frameGrabberThreadHandle);
+    frameGrabberThreadHandle = NULL;
+
+    if (processingThread.joinable()) {
+        processingThread.join();
+    }
+
+    stopRequested = false;
+
+    CapturePipelineCounters counters = PipelineCounters();
+    qInfo() << "Capture pipeline:" << counters.processing.frames << "frames, acquisition avg"
+            << counters.acquisition.averageLatencyUs / 1000.0 << "ms, processing avg"
+            << counters.processing.averageLatencyUs / 1000.0 << "ms, total avg"
+            << counters.total.averageLatencyUs / 1000.0 << "ms, queue avg occupancy"
+            << counters.queue.averageOccupancy << "of" << counters.queue.capacity << ","
+            << counters.queue.dropped << "dropped," << counters.queue.blockedUs / 1000.0 << "ms blocked";
+}
+
+CapturePipelineCounters KinectGrabber::PipelineCounters() const {
+    CapturePipelineCounters result;
+    result.acquisition = acquisitionMetrics.Counters();
+    result.queue       = capturedFrames.Counters();
+    result.processing  = processingMetrics.Counters();
+    result.total       = totalMetrics.Counters();
+    return result;
+}
+
+bool KinectGrabber::StartRecording(const QString& recordingFileName) {
+    std::unique_ptr<FrameRecorder> newRecorder = FrameRecorder::Create(recordingFileName.toStdString());
+    if (!newRecorder) { return false; }
+
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    recorder = std::move(newRecorder);
+    return true;
+}
+
+void KinectGrabber::StopRecording() {
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    if (recorder) {
+        qInfo() << "Recorded" << recorder->NumFrames() << "frames";
+        recorder.reset();
+    }
+}
+
 /**
- * @brief KinectGrabber::StartStream  Create and Start Capture Thread
+ * @brief KinectGrabber::StartStream  Create and Start Capture and Processing Threads
  */
 void KinectGrabber::StartStream() {
     hr = reader->SubscribeMultiSourceFrameArrived(&frameHandle);
     if (FAILED(hr)) { qCritical("Failed to create Stream Handle. Cannot Start Stream"); return; }
 
+    // All frames are free again, also after a stop that left some queued
+    freeFrames.Reset();
+    capturedFrames.Reset();
+    for (size_t i = 0; i < capturedFrameSlots.size(); ++i) {
+        freeFrames.Push(capturedFrameSlots[i].get());
+    }
+
+    processingThread = std::thread(&KinectGrabber::ProcessingLoop, this);
+
     // Start thread and pass this object as thread parameter
     frameGrabberThreadHandle =
             CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)&KinectFrameGrabberThread, this, 0, &frameGrabberThreadID);
 
     if (frameGrabberThreadHandle == NULL) {
         qCritical("Frame Grabber Thread could not be created");
+
+        capturedFrames.Close();
+        processingThread.join();
     }
 }
 
@@ -135,7 +242,7 @@ void KinectGrabber::StartFrameGrabbingLoop() {
 
     bool quit = false;
     DWORD waitStatus;
-    while(!quit) {
+    while(!quit && !stopRequested) {
         waitStatus = WaitForMultipleObjects(1, handles, FALSE, 100);
         switch(waitStatus) {
         case WAIT_TIMEOUT:
@@ -162,131 +269,58 @@ void KinectGrabber::StartFrameGrabbingLoop() {
 }
 
 /**
- * @brief KinectGrabber::ProcessMultiFrame Acquire MultiFrame and process individual elements
+ * @brief KinectGrabber::ProcessMultiFrame Acquisition stage: acquire MultiFrame, copy its individual elements
+ * into a free CapturedFrame and queue it for the processing stage
  */
 void KinectGrabber::ProcessMultiFrame() {
 
-    if (doFaceTrackingToggleRequested) {
-        doFaceTrackingToggleRequested = false;
-        doFaceTracking = !doFaceTracking;
-    }
-
+    // Waits while both stages and the queue hold a frame each, before the SDK frame is held. Fails on stop.
+    CapturedFrame* frame;
+    if (!freeFrames.Pop(&frame)) { return; }
 
     // Acquire MultiFrame
     hr = reader->AcquireLatestFrame(&multiFrame);
-    if (FAILED(hr)) { qCritical("Could not acquire frame"); return; }
+    if (FAILED(hr)) {
+        qCritical("Could not acquire frame");
+        freeFrames.Push(frame);
+        return;
+    }
+
+    int64_t acquireTimeNs = PipelineNowNs();
+    frame->acquireTimeNs = acquireTimeNs;
 
     //
     // Process individual components
     //
 
-    bool colorAvailable = ProcessColor();
-
-    FaceTrackingThread* faceTrackingThread = nullptr;
-    if (doFaceTracking) {
-        faceTrackingThread = new FaceTrackingThread(multiFrameBuffer->colorBuffer, faceTrackingModel_, faceTrackingParameters_);
-        // Start facetracking thread after we acquired the color buffer
-        faceTrackingThread->start();
-    }
-
-    bool depthAvailable = ProcessDepth();
-    bool bodyIndexAvailable = ProcessBodyIndex();
-
-    bool canComputePointCloud = colorAvailable &&
-                                depthAvailable &&
-                                bodyIndexAvailable;
-
-    if (canComputePointCloud) {
-
-       // Depth buffer is filled here
-       hr = coordinateMapper->MapColorFrameToCameraSpace(NUM_DEPTH_PIXELS, multiFrameBuffer->depthBuffer16,
-                                                         NUM_COLOR_PIXELS, (CameraSpacePoint*)multiFrameBuffer->colorToCameraMapping);
+    bool frameComplete = ProcessColor(frame) &&
+                         ProcessDepth(frame) &&
+                         ProcessBodyIndex(frame) &&
+                         ProcessBody(frame) &&
+                         MapDepthFrame(frame);
 
-       if (FAILED(hr)) { qCritical("Could not map from color to camera space"); }
+    SafeRelease(multiFrame);
 
-       canComputePointCloud = CreatePointCloud();
+    if (!frameComplete) {
+        freeFrames.Push(frame);
+        return;
     }
 
-    multiFrameBuffer->pointCloudBuffer->numLandmarks = 0;
+    acquisitionMetrics.Record(acquireTimeNs, PipelineNowNs());
 
-    if (doFaceTracking) {
-        // Wait for facetracking thread to finish
-        faceTrackingThread->wait();
-        faceTrackingThread->deleteLater();
-
-        // TODO: cleanup and factor out
-        // TODO: stop opencv/imshow visualization and only show 3D tracked points (?)
-        // TODO: Image is resized twice now. Maybe pass the resized version to the tracking thread
-
-        // Visualize results
-        /*
-        cv::Mat captured_image = cv::Mat(COLOR_HEIGHT, COLOR_WIDTH, CV_8UC4, multiFrameBuffer->colorBuffer);
-        cv::resize(captured_image, captured_image, cv::Size(), 0.6, 0.6);
-        FaceTrackingVisualization::visualise_tracking(captured_image, *faceTrackingModel_, *faceTrackingParameters_);
-
-        cv::waitKey(1);
-*/
-        if (!canComputePointCloud) {
-            SafeRelease(multiFrame);
-            return;
-        }
-
-        //
-        // Find 3D Points that correspond to the 2D Landmarks
-        //
-        //  Map landmark points to camera space and do a nearest neighbor search on the resulting point
-        //
-
-        PointCloudBuffer* pointCloudBuffer = multiFrameBuffer->pointCloudBuffer;
-        CameraSpacePoint* points = (CameraSpacePoint*)multiFrameBuffer->colorToCameraMapping;
-        PointCloudHelpers::KDTree tree(3, *pointCloudBuffer, nanoflann::KDTreeSingleIndexAdaptorParams());
-        tree.buildIndex();
-
-        // Landmarks are stored as [x1, ... ,xn, y1, ..., yn]
-        cv::Mat_<double>landmarks = faceTrackingModel_->detected_landmarks;
-        int numLandmarks = landmarks.rows / 2;
-        size_t nearestNeighborIndex = 0;
-        float  squaredDistance = -1.0f;
-
-        int landmarkIndex = 0;
-        for (int i = 0; i < landmarks.rows / 2; ++i) {
-            float x = landmarks.at<double>(i);
-            float y = landmarks.at<double>(i + numLandmarks);
-
-            // Convert back to image coordinates of the original size
-            x /= 0.6f;// captured_image.cols;
-            y /= 0.6f; // captured_image.rows;
-           // x *= COLOR_WIDTH;
-           // y *= COLOR_HEIGHT;
-
-            int ix = (int)std::round(x);
-            int iy = (int)std::round(y);
-
-            int index = LINEAR_INDEX(iy, ix, COLOR_WIDTH);
-            CameraSpacePoint p = points[index];
-            size_t result = tree.knnSearch((float*)(&p.X), 1, &nearestNeighborIndex, &squaredDistance);
-
-
-
-
-            if (result == 0) {
-                //qWarning("No nearest neighbors found");
-            } else {
-                // TODO: for visualization only, remove and only store the gathered indices
-                //pointCloudBuffer->colors[nearestNeighborIndex] = {0.1f, 1.0f, 0.1f};
-                pointCloudBuffer->landmarkIndices[landmarkIndex++] = nearestNeighborIndex;
-            }
-        }
-        pointCloudBuffer->numLandmarks = landmarkIndex;
+    // Under QUEUE_DROP_OLDEST, the oldest queued frame is replaced and can be reused right away
+    CapturedFrame* dropped;
+    bool hasDropped;
+    if (!capturedFrames.Push(frame, &dropped, &hasDropped)) {
+        return;
     }
 
-    bool frameReady = canComputePointCloud;
-    if (frameReady) { emit FrameReady(); }
-
-    SafeRelease(multiFrame);
+    if (hasDropped) {
+        freeFrames.Push(dropped);
+    }
 }
 
-bool KinectGrabber::ProcessColor() {
+bool KinectGrabber::ProcessColor(CapturedFrame* frame) {
     bool succeeded = false;
 
     hr = multiFrame->get_ColorFrameReference(&colorFrameReference);
@@ -296,7 +330,7 @@ bool KinectGrabber::ProcessColor() {
 
     if (SUCCEEDED(hr)) {
         hr = colorFrame->CopyConvertedFrameDataToArray(COLOR_BUFFER_SIZE,
-                                                       (BYTE*)multiFrameBuffer->colorBuffer,
+                                                       (BYTE*)frame->colorBuffer,
                                                        ColorImageFormat_Rgba);
 
         if (SUCCEEDED(hr)) {
@@ -316,17 +350,17 @@ bool KinectGrabber::ProcessColor() {
 
 
 /**
- * @brief KinectGrabber::ProcessDepth converts 16bit depth to 8bit and copies the data to the internal buffer
+ * @brief KinectGrabber::ProcessDepth converts 16bit depth to 8bit and copies the data to the captured frame
  * @return true on success
  */
-bool KinectGrabber::ProcessDepth() {
+bool KinectGrabber::ProcessDepth(CapturedFrame* frame) {
     bool succeeded = false;    
 
     hr = multiFrame->get_DepthFrameReference(&depthFrameReference);
     if (FAILED(hr)) { qCritical("No Depth Frame"); return succeeded; }
 
-    uint8_t* depthBuffer8Bit = multiFrameBuffer->depthBuffer8;
-    uint16_t* depthBuffer = multiFrameBuffer->depthBuffer16;
+    uint8_t* depthBuffer8Bit = frame->depthBuffer8;
+    uint16_t* depthBuffer = frame->depthBuffer16;
 
     hr = depthFrameReference->AcquireFrame(&depthFrame);
     if (SUCCEEDED(hr)) {
@@ -339,15 +373,10 @@ bool KinectGrabber::ProcessDepth() {
         hr = depthFrame->CopyFrameDataToArray(NUM_DEPTH_PIXELS, depthBuffer);
         if (SUCCEEDED(hr) && minDistanceAvailabe && maxDistanceAvailable) {
             SafeRelease(depthFrame);
-            float scale = 255.0f / (maxDistance - minDistance);
-            int numPixels = DEPTH_HEIGHT * DEPTH_WIDTH;
-
-            for (int pixel = 0; pixel < numPixels; ++pixel) {
-                INT32 depth = (INT32)depthBuffer[pixel];
-                depth -= (INT32)minDistance;
-                float val = depth * scale;
-                depthBuffer8Bit[pixel] = FloatToUINT8(val);
-            }
+            ConvertDepthTo8Bit(depthBuffer, depthBuffer8Bit, NUM_DEPTH_PIXELS, minDistance, maxDistance);
+
+            frame->minReliableDistance = minDistance;
+            frame->maxReliableDistance = maxDistance;
 
             succeeded = true;
         } else {
@@ -363,7 +392,7 @@ bool KinectGrabber::ProcessDepth() {
     return succeeded;
 }
 
-bool KinectGrabber::ProcessBodyIndex()
+bool KinectGrabber::ProcessBodyIndex(CapturedFrame* frame)
 {
     bool succeeded = false;
 
@@ -375,7 +404,7 @@ bool KinectGrabber::ProcessBodyIndex()
 
     hr = bodyIndexFrameReference->AcquireFrame(&bodyIndexFrame);
     if (SUCCEEDED(hr)) {
-        hr = bodyIndexFrame->CopyFrameDataToArray(bodyIndexBufferSize, bodyIndexBuffer);
+        hr = bodyIndexFrame->CopyFrameDataToArray(NUM_DEPTH_PIXELS, frame->bodyIndexBuffer);
         if (SUCCEEDED(hr)) {
             succeeded = true;
         } else {
@@ -391,36 +420,11 @@ bool KinectGrabber::ProcessBodyIndex()
 }
 
 /**
- * @brief KinectGrabber::CreatePointCloud uses the coordinate mapper of the kinect to gather
- * a colored 3D PointCloud
- * @return
- *
+ * @brief KinectGrabber::ProcessBody takes the cutoff height of the point cloud and the region of the face
+ * from the joints of the tracked body
+ * @return true on success
  */
-
-#include <cstdint>
-bool KinectGrabber::CreatePointCloud() {
-    QElapsedTimer timer;
-    timer.start();
-    bool succeeded = false;
-
-    // Grab buffers from framebuffer object
-    uint32_t* colorBuffer   = multiFrameBuffer->colorBuffer;
-    uint16_t* depthBuffer   = multiFrameBuffer->depthBuffer16;
-    RGB3f* pointCloudColors = multiFrameBuffer->pointCloudBuffer->colors;
-    Vec3f* pointCloudPoints = multiFrameBuffer->pointCloudBuffer->points;
-    size_t numPoints = 0;
-
-    // Temp buffers
-    // TODO: avoid allocating memory each frame
-    // CameraSpacePoint* tmpPositions = new CameraSpacePoint[NUM_DEPTH_PIXELS];
-    // ColorSpacePoint*  tmpColors    = new ColorSpacePoint [NUM_DEPTH_PIXELS];
-
-    // int32_t maxFaceX, minFaceX, maxFaceY, minFaceY;
-    // minFaceX = INT32_MAX;
-    // maxFaceX = INT32_MIN;
-    // minFaceY = INT32_MAX;
-    // maxFaceY = INT32_MIN;
-
+bool KinectGrabber::ProcessBody(CapturedFrame* frame) {
     hr = multiFrame->get_BodyFrameReference(&bodyFrameReference);
     if (FAILED(hr)) {
         // qCritical() << "Could not get Body Frame Reference";
@@ -443,12 +447,40 @@ bool KinectGrabber::CreatePointCloud() {
         return false;
     }
 
-    CameraSpacePoint cutoffPosition;
+    // Without a tracked body nothing is cut off
+    CameraSpacePoint cutoffPosition = { 0.0f, -FLT_MAX, 0.0f };
+    CameraSpacePoint headPosition = { 0.0f, 0.0f, 0.0f };
+    bool headTracked = false;
     for (int i = 0; i < 1; ++i) {
         if (bodies[i] != nullptr) {
             Joint jointBuffer[JointType_Count];
             bodies[i]->GetJoints(JointType_Count, jointBuffer);
             cutoffPosition = jointBuffer[JointType_SpineShoulder].Position;
+
+            headPosition = jointBuffer[JointType_Head].Position;
+            headTracked  = jointBuffer[JointType_Head].TrackingState == TrackingState_Tracked;
+        }
+    }
+
+    frame->cutoffHeight = cutoffPosition.Y - 0.1f;
+
+    // Face tracking starts looking for the face around the head
+    frame->hasHeadRegion = false;
+    if (headTracked) {
+        // About the size of a face, the head joint is at its center
+        const float halfFaceSize = 0.1f;
+        CameraSpacePoint topLeft     = { headPosition.X - halfFaceSize, headPosition.Y + halfFaceSize, headPosition.Z };
+        CameraSpacePoint bottomRight = { headPosition.X + halfFaceSize, headPosition.Y - halfFaceSize, headPosition.Z };
+
+        ColorSpacePoint colorTopLeft, colorBottomRight;
+        if (SUCCEEDED(coordinateMapper->MapCameraPointToColorSpace(topLeft, &colorTopLeft)) &&
+            SUCCEEDED(coordinateMapper->MapCameraPointToColorSpace(bottomRight, &colorBottomRight))) {
+            FaceRegion& headRegion = frame->headRegion;
+            headRegion.x      = colorTopLeft.X * FACE_TRACKING_SCALE;
+            headRegion.y      = colorTopLeft.Y * FACE_TRACKING_SCALE;
+            headRegion.width  = (colorBottomRight.X - colorTopLeft.X) * FACE_TRACKING_SCALE;
+            headRegion.height = (colorBottomRight.Y - colorTopLeft.Y) * FACE_TRACKING_SCALE;
+            frame->hasHeadRegion = headRegion.width > 0.0f && headRegion.height > 0.0f;
         }
     }
 
@@ -457,172 +489,148 @@ bool KinectGrabber::CreatePointCloud() {
     SafeRelease(bodyFrameReference);
     SafeRelease(bodyFrame);
 
-    hr = coordinateMapper->MapDepthFrameToCameraSpace(NUM_DEPTH_PIXELS, depthBuffer,
-                                                      NUM_DEPTH_PIXELS, tmpPositions);
-    if (SUCCEEDED(hr)) {
-        hr = coordinateMapper->MapDepthFrameToColorSpace(NUM_DEPTH_PIXELS, depthBuffer,
-                                                         NUM_DEPTH_PIXELS, tmpColors);
-        if (SUCCEEDED(hr)) {
+    return true;
+}
+
+/**
+ * @brief KinectGrabber::MapDepthFrame maps the depth frame to camera space and to color pixels with the
+ * coordinate mapper of the kinect
+ * @return true on success
+ */
+bool KinectGrabber::MapDepthFrame(CapturedFrame* frame) {
+    hr = coordinateMapper->MapDepthFrameToCameraSpace(NUM_DEPTH_PIXELS, frame->depthBuffer16,
+                                                      NUM_DEPTH_PIXELS, frame->depthToCamera);
+    if (FAILED(hr)) {
+        qWarning("Coordinate Mapper Error: Could not map from depth to camera space");
+        return false;
+    }
+
+    hr = coordinateMapper->MapDepthFrameToColorSpace(NUM_DEPTH_PIXELS, frame->depthBuffer16,
+                                                     NUM_DEPTH_PIXELS, frame->depthToColor);
+    if (FAILED(hr)) {
+        qWarning("Coordinate Mapper Error: Could not map from depth to color space");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief KinectGrabber::ProcessingLoop Processing stage: processes the captured frames in order until the
+ * grabber is stopped
+ */
+void KinectGrabber::ProcessingLoop() {
+    CapturedFrame* frame;
+    while (capturedFrames.Pop(&frame)) {
+        int64_t processStartNs = PipelineNowNs();
+
+        ProcessCapturedFrame(frame);
+
+        int64_t processEndNs = PipelineNowNs();
+        processingMetrics.Record(processStartNs, processEndNs);
+        totalMetrics.Record(frame->acquireTimeNs, processEndNs);
 
-            CameraSpacePoint p;
-            ColorSpacePoint c;
-
-//            for (int row = 0; row < DEPTH_HEIGHT; ++row) {
-//                for (int col = 0; col < DEPTH_WIDTH; ++col) {
-            for (int depthPixel = 0; depthPixel < NUM_DEPTH_PIXELS; ++depthPixel) {
-
-                //int depthPixel = LinearIndex(row, col, DEPTH_WIDTH);
-                    p = tmpPositions[depthPixel];
-
-
-
-                    UINT8 bodyIndex = bodyIndexBuffer[depthPixel];
-                    bool pointBelongsToTrackedBody = (bodyIndex != 0xFF);
-                    pointBelongsToTrackedBody = (0 <= bodyIndex && bodyIndex <= 5);
-
-                    bool isInvalidMapping = std::isinf(p.X) || std::isnan(p.X) ||
-                                            std::isinf(p.Y) || std::isnan(p.Y) ||
-                                            std::isinf(p.Z) || std::isnan(p.Z);
-
-                    if (pointBelongsToTrackedBody && !isInvalidMapping) {
-
-                        if (p.Y < (cutoffPosition.Y - 0.1f)) {
-                            continue;
-                        }
-
-                        // Store valid 3D point position
-                        //pointCloudPoints[numPoints] = Vec3f(&p.X);
-                        pointCloudPoints[numPoints] = {p.X, p.Y, p.Z};
-
-                        //pointCloudPoints[numPoints].X = p.X;
-                        //pointCloudPoints[numPoints].Y = p.Y;
-                        //pointCloudPoints[numPoints].Z = p.Z;
-
-                        // Try to get color for point
-                        c = tmpColors[depthPixel];
-
-                        // Round floating point indices to int
-                        int colorIndexCol = (int)(c.X + 0.5f);
-                        int colorIndexRow = (int)(c.Y + 0.5f);
-
-                        int colorIndex = LINEAR_INDEX(colorIndexRow, colorIndexCol, COLOR_WIDTH);
-                        bool colorIndexInvalid = (colorIndex < 0) || (colorIndex >= NUM_COLOR_PIXELS);
-
-                        // If color mapping is invalid, we just write a gray value
-                        if (!colorIndexInvalid) {
-                            // if (colorIndexCol > maxFaceX) {
-                            //     maxFaceX = colorIndexCol;
-                            // } else if (colorIndexCol < minFaceX) {
-                            //     minFaceX = colorIndexCol;
-                            // }
-                            //
-                            // if (colorIndexRow > maxFaceY) {
-                            //     maxFaceY = colorIndexRow;
-                            // } else if (colorIndexRow < minFaceY) {
-                            //     minFaceY = colorIndexRow;
-                            // }
-
-                            RGBQUAD* rgbx = (RGBQUAD*)(colorBuffer + colorIndex);
-
-                            // colors are swapped here from bgr to rgb for opengl!
-                            // pointCloudColors.push_back(RGB3f(rgbx.rgbRed, rgbx.rgbGreen, rgbx.rgbBlue));
-                            // pointCloudColors[numPoints] = RGB3f(rgbx->rgbRed, rgbx->rgbGreen, rgbx->rgbBlue);
-                            pointCloudColors[numPoints] = {rgbx->rgbBlue  / 255.0f,
-                                                           rgbx->rgbGreen / 255.0f,
-                                                           rgbx->rgbRed   / 255.0f};
-                           // pointCloudColors[numPoints].B = ((float)rgbx->rgbRed)   / 255.0f;
-                           // pointCloudColors[numPoints].G = ((float)rgbx->rgbGreen) / 255.0f;
-                           // pointCloudColors[numPoints].R = ((float)rgbx->rgbBlue)  / 255.0f;
-
-                        } else {
-                            // uint8_t gray[3] = { 100, 100, 100 };
-                            // pointCloudColors.push_back(RGB3f(gray));
-                            // pointCloudColors[numPoints] = RGB3f(0.6f, 0.6f, 0.6f);
-                            pointCloudColors[numPoints] = {0.5f, 0.5f, 0.5f};
-                        }
-
-                        numPoints++;
-                    }
+        freeFrames.Push(frame);
+    }
+}
+
+/**
+ * @brief KinectGrabber::ProcessCapturedFrame Creates the point cloud of a captured frame, tracks the face in
+ * parallel and publishes the complete frame
+ */
+void KinectGrabber::ProcessCapturedFrame(CapturedFrame* captured) {
+
+    if (doFaceTrackingToggleRequested) {
+        doFaceTrackingToggleRequested = false;
+        doFaceTracking = !doFaceTracking;
+    }
+
+    // The UI never looks at the back buffer, so it can be filled without synchronization
+    multiFrameBuffer = frames->BackBuffer();
+
+    // Hand the captured images to the back buffer without copying them, the captured frame continues with the
+    // buffers of an earlier frame, which the acquisition overwrites anyway
+    std::swap(multiFrameBuffer->colorBuffer,   captured->colorBuffer);
+    std::swap(multiFrameBuffer->depthBuffer16, captured->depthBuffer16);
+    std::swap(multiFrameBuffer->depthBuffer8,  captured->depthBuffer8);
+
+    // Scale the color frame for the display and start facetracking on it
+    std::future<void> faceTracking;
+    {
+        FrameBuffer* frame = multiFrameBuffer;
+        bool track = doFaceTracking;
+        bool useRoi = FaceTrackingRoi();
+        bool hasHead = captured->hasHeadRegion;
+        FaceRegion head = captured->headRegion;
+        LandmarkDetector::CLNF* model = faceTrackingModel_;
+        LandmarkDetector::FaceModelParameters* parameters = faceTrackingParameters_;
+        faceTracking = theTaskScheduler.Submit(PRIORITY_FACE_TRACKING, [=]() {
+            ScaleColorFrame(frame->colorBuffer, frame);
+            if (track) {
+                TrackFace(frame, model, parameters, useRoi, hasHead ? &head : nullptr);
             }
+        });
+    }
 
-            PointCloudBuffer* buf = multiFrameBuffer->pointCloudBuffer;
-            buf->numPoints = numPoints;
-            // buf->minFaceX  = minFaceX;
-            // buf->maxFaceX  = maxFaceX;
-            // buf->minFaceY  = minFaceY;
-            // buf->maxFaceY  = maxFaceY;
+    CreatePointCloud(captured);
+    RecordFrame(captured);
 
-            succeeded = true;
-        } else {
-            qWarning("Coordinate Mapper Error: Could not map from depth to color space");
-        }
-    } else {
-        qWarning("Coordinate Mapper Error: Could not map from depth to camera space");
+    multiFrameBuffer->pointCloudBuffer->numLandmarks = 0;
+
+    // Wait for scaling and facetracking to finish
+    faceTracking.wait();
+
+    if (doFaceTracking) {
+        // TODO: cleanup and factor out
+        // TODO: stop opencv/imshow visualization and only show 3D tracked points (?)
+
+        //
+        // Find 3D Points that correspond to the 2D Landmarks
+        //
+        //  The points are looked up in the raster of the point cloud by their color pixels
+        //
+        AttachLandmarks(faceTrackingModel_, multiFrameBuffer->colorPointRaster, multiFrameBuffer->pointCloudBuffer);
     }
 
-    // qInfo() << "Creating Pointcloud in " << timer.elapsed() << "ms";
-    return succeeded;
+    frames->Publish();
+    emit FrameReady();
 }
 
-void FaceTrackingThread::run()
-{
-    QElapsedTimer timer;
-    timer.start();
-    cv::Mat captured_image = cv::Mat(COLOR_HEIGHT, COLOR_WIDTH, CV_8UC4, colors);
-    cv::resize(captured_image, captured_image, cv::Size(), 0.6, 0.6);
-    cv::Mat_<uchar> gray;
-
-    cv::cvtColor(captured_image, gray, CV_BGRA2GRAY);
-
-//    PointCloudBuffer* pcbuf = memory->gatherBuffer.pointCloudBuffer;
-//    double minFaceX = (double)pcbuf->minFaceX;
-//    double minFaceY = (double)pcbuf->minFaceY;
-//    double width  = ((double)pcbuf->maxFaceX) - minFaceX;
-//    double height = ((double)pcbuf->maxFaceY) - minFaceY;
-//    cv::Rect_<double> boundingBox = cv::Rect_<double>(minFaceX, minFaceY, width, height);
-
- //   qInfo() << minFaceX << minFaceY << width << height;
-    // LandmarkDetector::DetectLandmarksInVideo(gray, boundingBox,  *faceTrackingModel, *faceTrackingParameters);
-
-
-    // bool success =
-    LandmarkDetector::DetectLandmarksInVideo(gray, *faceTrackingModel_, *faceTrackingParameters_);
-
-#if 0
-    float fx, fy, cx, cy;
-    cx = captured_image.cols / 2.0f;
-    cy = captured_image.rows / 2.0f;
-    fx = 500 * (captured_image.cols / 640.0);
-    fy = 500 * (captured_image.rows / 480.0);
-
-    fx = (fx + fy) / 2.0;
-    fy = fx;
-    FaceTrackingVisualization::visualise_tracking(captured_image, *faceTrackingModel_, *faceTrackingParameters_,
-                                                  cv::Point3f(), cv::Point3f(), 0, fx, fy, cx, cy);
-
-    cv::Mat_<double>landmarks = faceTrackingModel_->detected_landmarks;
-    int numLandmarks = landmarks.rows / 2;
-    if (success) {
-        std::vector<size_t> landmarkIndices(numLandmarks);
-        for (int i = 0; i < landmarks.rows / 2; ++i) {
-            float x = landmarks.at<double>(i);
-            float y = landmarks.at<double>(i + numLandmarks);
-
-            qInfo() << x << y;
-            // Convert back to original size image coordinates
-//            x /= captured_image.cols;
-//            y /= captured_image.rows;
-//
-//            x *= COLOR_WIDTH;
-//            y *= COLOR_WIDTH;
-//
-//            int ix = (int)std::round(x);
-//            int iy = (int)std::round(y);
-        }
-    } else {
-        qInfo("Face tracking failed");
-    }
-#endif
+/**
+ * @brief KinectGrabber::CreatePointCloud gathers the colored 3D PointCloud of a captured frame from its
+ * mapping by the coordinate mapper of the kinect
+ */
+void KinectGrabber::CreatePointCloud(const CapturedFrame* frame) {
+    PointCloudHelpers::CreatePointCloud(multiFrameBuffer->colorBuffer,
+                                        (Vec3f*)frame->depthToCamera,
+                                        (Vec2f*)frame->depthToColor,
+                                        frame->bodyIndexBuffer,
+                                        frame->cutoffHeight,
+                                        multiFrameBuffer->pointCloudBuffer,
+                                        multiFrameBuffer->colorPointRaster);
+
+    // Snapshots and textures are mapped without the SDK later on
+    CalibrateFrom((Vec3f*)frame->depthToCamera, (Vec2f*)frame->depthToColor);
+}
 
-    // qInfo() << "Facetracking took " << timer.elapsed() << "ms";
+/**
+ * @brief KinectGrabber::RecordFrame appends the current frame to the recording, if one is running
+ */
+void KinectGrabber::RecordFrame(const CapturedFrame* frame) {
+    std::lock_guard<std::mutex> lock(recorderMutex);
+    if (!recorder) { return; }
+
+    bool succeeded = recorder->WriteFrame(multiFrameBuffer->colorBuffer,
+                                          multiFrameBuffer->depthBuffer16,
+                                          frame->bodyIndexBuffer,
+                                          (Vec3f*)frame->depthToCamera,
+                                          (Vec2f*)frame->depthToColor,
+                                          frame->cutoffHeight,
+                                          frame->minReliableDistance,
+                                          frame->maxReliableDistance);
+
+    if (!succeeded) {
+        qCritical("Could not write frame to recording, recording stopped");
+        recorder.reset();
+    }
 }
@@ -1,33 +1,98 @@
 #ifndef KINECTGRABBER_H
 #define KINECTGRABBER_H
 
-#include <QObject>
+#include <QString>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <Kinect.h>
 
+#include "CapturePipeline.h"
+#include "FrameSource.h"
+
 struct FrameBuffer;
+class FrameExchange;
+class FrameRecorder;
+
+//
+// Frames that are acquired but not processed yet, more are queued or dropped depending on the QueuePolicy
+//
+const size_t CAPTURE_QUEUE_CAPACITY = 2;
+
+/**
+ * @brief The CapturedFrame struct holds everything the acquisition stage of the KinectGrabber copies out of
+ * a MultiFrame, so the SDK frame can be released before the frame is processed.
+ */
+struct CapturedFrame {
+    CapturedFrame();
+    ~CapturedFrame();
+
+    // Swapped with the buffers of the FrameExchange's back buffer by the processing stage
+    uint32_t* colorBuffer;
+    uint16_t* depthBuffer16;
+    uint8_t*  depthBuffer8;
+
+    uint8_t* bodyIndexBuffer;
+
+    // Depth frame mapped by the coordinate mapper of the SDK
+    CameraSpacePoint* depthToCamera;
+    ColorSpacePoint*  depthToColor;
 
+    // Reliable depth range of the frame
+    UINT16 minReliableDistance;
+    UINT16 maxReliableDistance;
 
-namespace LandmarkDetector {
-    struct FaceModelParameters;
-    class CLNF;
-}
+    // Points below this height are cut off from the point cloud
+    float cutoffHeight;
+
+    // Face of the tracked body in the scaled color frame, from its head joint
+    FaceRegion headRegion;
+    bool hasHeadRegion;
+
+    // When the acquisition of the frame started
+    int64_t acquireTimeNs;
+
+private:
+    CapturedFrame(const CapturedFrame&);
+    CapturedFrame& operator=(const CapturedFrame&);
+};
+
+struct CapturePipelineCounters {
+    PipelineStageCounters acquisition;
+    BoundedQueueCounters  queue;
+    PipelineStageCounters processing;
+
+    // From the start of the acquisition to publishing the frame
+    PipelineStageCounters total;
+};
 
 /**
  * @brief The KinectGrabber class is responsible for grabbing the Data from the Kinect.
  *
- * It Starts a Capture Thread which retrieves MultiFrames via the Microsoft Kinect API.
+ * Capturing is a pipeline of two stages with a thread each, connected by a BoundedQueue:
+ *
+ *  - Acquisition: the capture thread retrieves MultiFrames via the Microsoft Kinect API, copies color, depth,
+ *    body index and body data into a CapturedFrame and maps the depth frame with the coordinate mapper.
+ *  - Processing: extracts the point cloud, tracks the face and attaches the landmarks. Once a Frame is
+ *    completly gathered, it is published through the FrameExchange and the FrameReady() Signal is emitted.
  *
- * Incoming Data is copied into internal buffers and once a Frame is completly gathered,
- * the FrameReady() Signal is emitted.
+ * So frame N+1 is acquired while frame N is processed. The CapturedFrames are preallocated and recycled through
+ * a second queue, so no frame data is allocated or copied between the stages.
+ *
+ * While recording, every frame is also appended to a recording file, which a ReplayFrameSource can play back
+ * without the sensor.
  */
-class KinectGrabber : public QObject
+class KinectGrabber : public FrameSource
 {    
     Q_OBJECT
 
 public:
 
-    KinectGrabber(FrameBuffer* multiFrameBuffer,
+    KinectGrabber(FrameExchange* frames,
                   LandmarkDetector::CLNF* faceTrackingModel,
                   LandmarkDetector::FaceModelParameters* faceTrackingParameters);
     ~KinectGrabber();
@@ -36,19 +101,43 @@ public:
     void StartStream();
     void StartFrameGrabbingLoop();
 
-    inline void ToggleFaceTracking() { doFaceTrackingToggleRequested = true; }
+    //
+    // Connects to the kinect and starts the capture thread
+    //
+    virtual void Start() override;
+    virtual void Stop() override;
+
+    virtual void ToggleFaceTracking() override { doFaceTrackingToggleRequested = true; }
+
+    //
+    // What the acquisition does when the processing stage falls behind, see QueuePolicy
+    //
+    void SetQueuePolicy(QueuePolicy policy) { capturedFrames.SetPolicy(policy); }
+
+    CapturePipelineCounters PipelineCounters() const;
 
     inline ICoordinateMapper*  GetCoordinateMapper() { return coordinateMapper; }
 
-signals:
-    void FrameReady();
+    //
+    // Starts appending every complete frame to a new recording file, returns false if it cannot be created
+    //
+    bool StartRecording(const QString& recordingFileName);
+    void StopRecording();
 
 private:
+    // Acquisition stage
     void ProcessMultiFrame();
-    bool ProcessColor();
-    bool ProcessDepth();
-    bool ProcessBodyIndex();
-    bool CreatePointCloud();
+    bool ProcessColor(CapturedFrame* frame);
+    bool ProcessDepth(CapturedFrame* frame);
+    bool ProcessBodyIndex(CapturedFrame* frame);
+    bool ProcessBody(CapturedFrame* frame);
+    bool MapDepthFrame(CapturedFrame* frame);
+
+    // Processing stage
+    void ProcessingLoop();
+    void ProcessCapturedFrame(CapturedFrame* frame);
+    void CreatePointCloud(const CapturedFrame* frame);
+    void RecordFrame(const CapturedFrame* frame);
 
     LandmarkDetector::CLNF* faceTrackingModel_;
     LandmarkDetector::FaceModelParameters* faceTrackingParameters_;
@@ -58,8 +147,20 @@ private:
     HRESULT hr;
 
     // Internal storage, passed from outside
+    FrameExchange* frames;
+
+    // Back buffer of frames for the frame that is currently processed
     FrameBuffer* multiFrameBuffer;
 
+    // Owns the CapturedFrames, which are either free, queued or in one of the stages
+    std::vector<std::unique_ptr<CapturedFrame>> capturedFrameSlots;
+    BoundedQueue<CapturedFrame*> freeFrames;
+    BoundedQueue<CapturedFrame*> capturedFrames;
+
+    PipelineStageMetrics acquisitionMetrics;
+    PipelineStageMetrics processingMetrics;
+    PipelineStageMetrics totalMetrics;
+
     // Kinect API elements
     IKinectSensor* sensor;
     IMultiSourceFrameReader* reader;
@@ -74,54 +175,27 @@ private:
     IDepthFrameReference* depthFrameReference;
     IDepthFrame* depthFrame;
 
-    // We need a further buffer for depth, since depth comes as UINT16
-    // and is converted into the UINT8 for the internal framebuffer
-    //UINT16*      depthBuffer;
-    //UINT32       depthBufferSize;
-
     // BodyIndex
     IBodyIndexFrameReference* bodyIndexFrameReference;
     IBodyIndexFrame*  bodyIndexFrame;
 
-    // Body Index Buffer is only stored class-internally
-    UINT8*            bodyIndexBuffer;
-    UINT32            bodyIndexBufferSize;
-
     // Body
     IBodyFrameReference* bodyFrameReference;
     IBodyFrame* bodyFrame;
 
-    CameraSpacePoint* tmpPositions;
-    ColorSpacePoint*  tmpColors;
+    // Recording, started and stopped from the UI thread
+    std::unique_ptr<FrameRecorder> recorder;
+    std::mutex recorderMutex;
 
     bool doFaceTracking;
     bool doFaceTrackingToggleRequested;
 
     // Threading variables
+    std::atomic<bool> stopRequested;
     WAITABLE_HANDLE frameHandle;
     DWORD  frameGrabberThreadID;
     HANDLE frameGrabberThreadHandle;
-};
-
-#include <QThread>
-class FaceTrackingThread : public QThread {
-    Q_OBJECT
-
-public:
-    FaceTrackingThread(uint32_t* colorBuffer,
-                       LandmarkDetector::CLNF* faceTrackingModel,
-                       LandmarkDetector::FaceModelParameters* faceTrackingParameters)
-        : colors(colorBuffer),
-          faceTrackingModel_(faceTrackingModel),
-          faceTrackingParameters_(faceTrackingParameters)
-    { }
-
-    void run() override;
-
-private:
-    uint32_t* colors;
-    LandmarkDetector::CLNF *faceTrackingModel_;
-    LandmarkDetector::FaceModelParameters *faceTrackingParameters_;
+    std::thread processingThread;
 };
 
 #endif // KINECTGRABBER_H
@@ -1,11 +1,13 @@
 #include "MainWindow.h"
 #include "ui_mainwindow.h"
 
+#include <QFileInfo>
 #include <QLabel>
 #include <QVBoxLayout>
 
 #include <LandmarkCoreIncludes.h>
 
+#include "CoordinateMapper.h"
 #include "KinectGrabber.h"
 #include "PointCloudDisplay.h"
 #include "PointCloud.h"
@@ -13,7 +15,11 @@
 #include "FaceTrackingVis.h"
 #include "SnapshotGrid.h"
 #include "ScanSession.h"
+#include "SnapshotQueue.h"
+#include "SnapshotThumbnails.h"
 #include "OpenCVWebcamGrabber.h"
+#include "ReplayFrameSource.h"
+#include "Benchmark.h"
 #include "util.h"
 
 MainWindow::MainWindow(MemoryPool* memory,
@@ -27,8 +33,14 @@ MainWindow::MainWindow(MemoryPool* memory,
 {
     this->memory = memory;
     this->textureDisplay = nullptr;
+    this->replaySource = nullptr;
+    this->frameSource = nullptr;
 
     drawNormals = true;
+    useDepthGridNeighborhoods = false;
+    useFaceTrackingRoi = false;
+    saveTextPointClouds = false;
+    compressPointClouds = false;
 
     ui->setupUi(this);
 
@@ -38,8 +50,7 @@ MainWindow::MainWindow(MemoryPool* memory,
     createMenus();
     createToolBar();
 
-    kinectGrabber = new KinectGrabber(&memory->gatherBuffer, faceTrackingModel, faceTrackingParameters);
-    QObject::connect(kinectGrabber, SIGNAL(FrameReady()), this, SLOT(FrameReady()));
+    kinectGrabber = new KinectGrabber(&memory->gatherFrames, faceTrackingModel, faceTrackingParameters);
 
     const int CELL_SIZE = 250;
 
@@ -135,22 +146,29 @@ MainWindow::MainWindow(MemoryPool* memory,
     scanSessionStatus = new QLabel();
     scanSessionStatus->setText("Current Scan Session at: " + theScanSession.getCurrentScanSession());
 
+    frameStatus = new QLabel();
+
     QPushButton* newScanSessionButton = new QPushButton(QIcon(":/icons/data/icons/raw-svg/solid/plus-circle.svg") , "New Scansession");
     connect(newScanSessionButton, SIGNAL(clicked(bool)), this, SLOT(OnNewScanSessionRequested(bool)));
     ui->statusBar->addPermanentWidget(newScanSessionButton, 0);
     ui->statusBar->addPermanentWidget(scanSessionStatus);
+    ui->statusBar->addPermanentWidget(frameStatus);
 
     normalComputationRequested = false;
     pointCloudFilterRequested = false;
-    snapshotRequested = false;
+    numSnapshotsRequested = 0;
+    numNormalJobs = 0;
+    lastRequestBytesCopied = 0;
+    requestBytesCopied = 0;
+    numRequestFrames = 0;
+    numFilterJobs = 0;
 
     // Start Kinect Streaming
 
-//    kinectGrabber->ConnectToKinect();
-//    kinectGrabber->StartStream();
+//    SwitchFrameSource(kinectGrabber);
 
     openCVGrabber = new OpenCVWebcamGrabber(memory, faceTrackingModel, faceTrackingParameters);
-    connect(openCVGrabber, SIGNAL(FrameReady()), this, SLOT(FrameReady()));
+    SwitchFrameSource(openCVGrabber);
 
 }
 
@@ -183,6 +201,18 @@ void MainWindow::createActions()
     faceTrackingAction->setChecked(true);
     connect(faceTrackingAction, &QAction::triggered, this, &MainWindow::OnDoFaceTrackingToggled);
 
+    faceTrackingRoiAction = new QAction("Track Faces in Region of Interest");
+    faceTrackingRoiAction->setToolTip("Only prepare the region around the face of the last frame or the head of the body for face tracking");
+    faceTrackingRoiAction->setCheckable(true);
+    faceTrackingRoiAction->setChecked(useFaceTrackingRoi);
+    connect(faceTrackingRoiAction, &QAction::triggered, this, &MainWindow::OnFaceTrackingRoiToggled);
+
+    depthGridNeighborhoodsAction = new QAction("Use Depth Grid Neighborhoods");
+    depthGridNeighborhoodsAction->setToolTip("Search neighbors in a pixel window of the depth image instead of a KD-tree");
+    depthGridNeighborhoodsAction->setCheckable(true);
+    depthGridNeighborhoodsAction->setChecked(useDepthGridNeighborhoods);
+    connect(depthGridNeighborhoodsAction, &QAction::triggered, this, &MainWindow::OnDepthGridNeighborhoodsToggled);
+
     filterPointCloudAction = new QAction("Filter Pointcloud");
     connect(filterPointCloudAction, &QAction::triggered, this, &MainWindow::PointCloudFilterRequested);
 
@@ -196,6 +226,18 @@ void MainWindow::createActions()
     saveSnapshotAction->setShortcut(QKeySequence(tr("Ctrl+S")));
     connect(saveSnapshotAction, &QAction::triggered, this, &MainWindow::SnapshotRequested);
 
+    saveTextPointCloudsAction = new QAction("Save Point Clouds as Text");
+    saveTextPointCloudsAction->setToolTip("Export snapshot point clouds in the text format for external tools instead of the binary format");
+    saveTextPointCloudsAction->setCheckable(true);
+    saveTextPointCloudsAction->setChecked(saveTextPointClouds);
+    connect(saveTextPointCloudsAction, &QAction::triggered, this, &MainWindow::OnSaveTextPointCloudsToggled);
+
+    compressPointCloudsAction = new QAction("Compress Point Clouds");
+    compressPointCloudsAction->setToolTip("Save snapshot point clouds quantized to 0.1 mm and entropy coded instead of in the mappable binary format");
+    compressPointCloudsAction->setCheckable(true);
+    compressPointCloudsAction->setChecked(compressPointClouds);
+    connect(compressPointCloudsAction, &QAction::triggered, this, &MainWindow::OnCompressPointCloudsToggled);
+
     textureGenerationAction = new QAction(QIcon(":/icons/data/icons/raw-svg/brands/delicious.svg"), "Test Texture Generation");
     textureGenerationAction->setShortcut(QKeySequence(tr("Ctrl+T")));
     connect(textureGenerationAction, &QAction::triggered, this, &MainWindow::CreateTextureRequested);
@@ -208,13 +250,35 @@ void MainWindow::createActions()
     // TODO: Shortcut?
     connect(loadScanSessionAction, &QAction::triggered, this, &MainWindow::LoadScanSessionRequested);
 
+    replayRecordingAction = new QAction("Replay Recording");
+    replayRecordingAction->setToolTip("Stream the frames of a recording instead of the live frames");
+    connect(replayRecordingAction, &QAction::triggered, this, &MainWindow::ReplayRecordingRequested);
+
+    recordFramesAction = new QAction("Record Kinect Frames");
+    recordFramesAction->setToolTip("Append all kinect frames to a recording in the current scan session");
+    recordFramesAction->setCheckable(true);
+    recordFramesAction->setChecked(false);
+    connect(recordFramesAction, &QAction::triggered, this, &MainWindow::OnRecordFramesToggled);
+
+    dropOldestFramesAction = new QAction("Drop Oldest Kinect Frames");
+    dropOldestFramesAction->setToolTip("Replace the oldest queued kinect frame when processing falls behind, instead of waiting to acquire the next one");
+    dropOldestFramesAction->setCheckable(true);
+    dropOldestFramesAction->setChecked(false);
+    connect(dropOldestFramesAction, &QAction::triggered, this, &MainWindow::OnDropOldestFramesToggled);
+
 }
 
 void MainWindow::createMenus() {
     QMenu* fileMenu = ui->menuBar->addMenu("File");
     fileMenu->addAction(saveSnapshotAction);
+    fileMenu->addAction(saveTextPointCloudsAction);
+    fileMenu->addAction(compressPointCloudsAction);
     fileMenu->addAction(loadSnapshotAction);
     fileMenu->addAction(loadScanSessionAction);
+    fileMenu->addSeparator();
+    fileMenu->addAction(recordFramesAction);
+    fileMenu->addAction(dropOldestFramesAction);
+    fileMenu->addAction(replayRecordingAction);
 
     QMenu* viewMenu = ui->menuBar->addMenu("View");
     viewMenu->addAction(drawNormalsAction);
@@ -222,7 +286,9 @@ void MainWindow::createMenus() {
 
     QMenu* toolsMenu = ui->menuBar->addMenu("Tools");
     toolsMenu->addAction(faceTrackingAction);
+    toolsMenu->addAction(faceTrackingRoiAction);
     toolsMenu->addSeparator();
+    toolsMenu->addAction(depthGridNeighborhoodsAction);
     toolsMenu->addAction(filterPointCloudAction);
     toolsMenu->addAction(computeNormalsAction);
     toolsMenu->addAction(computeNormalsForHemisphereAction);
@@ -230,6 +296,20 @@ void MainWindow::createMenus() {
     toolsMenu->addAction(textureGenerationAction);
     toolsMenu->addSeparator();
     toolsMenu->addAction(createMeshesAction);
+
+    QMenu* benchmarkMenu = toolsMenu->addMenu("Benchmarks");
+    AddBenchmark(benchmarkMenu, "Benchmark Normal Estimation", NO_RECORDING, [](const QString&) { return Benchmark::NormalEstimation(); });
+    AddBenchmark(benchmarkMenu, "Benchmark Point Cloud Memory Layout", NO_RECORDING, [](const QString&) { return Benchmark::MemoryLayout(); });
+    AddBenchmark(benchmarkMenu, "Benchmark Replay Throughput", ON_RECORDING, [](const QString& recording) { return Benchmark::ReplayThroughput(recording); });
+    AddBenchmark(benchmarkMenu, "Benchmark Coordinate Mapping", ON_RECORDING, [](const QString& recording) { return Benchmark::CoordinateMapping(recording); });
+    AddBenchmark(benchmarkMenu, "Benchmark Depth Conversion", NO_RECORDING, [](const QString&) { return Benchmark::DepthConversion(); });
+    AddBenchmark(benchmarkMenu, "Benchmark Point Cloud Extraction", ON_RECORDING, [](const QString& recording) { return Benchmark::PointCloudExtraction(recording); });
+    AddBenchmark(benchmarkMenu, "Benchmark Landmark Lookup", ON_RECORDING, [](const QString& recording) { return Benchmark::LandmarkLookup(recording); });
+    AddBenchmark(benchmarkMenu, "Benchmark Snapshot Image Encoding", ON_RECORDING, [](const QString& recording) { return Benchmark::SnapshotImageEncoding(recording); });
+    AddBenchmark(benchmarkMenu, "Benchmark Text Point Cloud Loading", NO_RECORDING, [](const QString&) { return Benchmark::TextPointCloudLoading(); });
+    AddBenchmark(benchmarkMenu, "Benchmark Text Point Cloud Writing", NO_RECORDING, [](const QString&) { return Benchmark::TextPointCloudWriting(); });
+    AddBenchmark(benchmarkMenu, "Benchmark Compressed Point Cloud Storage", ON_RECORDING, [](const QString& recording) { return Benchmark::CompressedPointCloudStorage(recording); });
+    AddBenchmark(benchmarkMenu, "Benchmark Point Cloud Cloning", NO_RECORDING, [](const QString&) { return Benchmark::PointCloudCloning(); });
 }
 
 void MainWindow::createToolBar() {
@@ -243,39 +323,172 @@ void MainWindow::createToolBar() {
     ui->mainToolBar->addAction(createMeshesAction);
 }
 
+static PointCloudHelpers::NeighborSearchMethod NeighborSearch(bool useDepthGrid)
+{
+    return useDepthGrid ? PointCloudHelpers::NEIGHBORS_DEPTH_GRID : PointCloudHelpers::NEIGHBORS_KDTREE;
+}
+
+void MainWindow::SwitchFrameSource(FrameSource* source)
+{
+    // The frame exchange takes frames from a single source only
+    if (frameSource != nullptr) {
+        frameSource->Stop();
+        disconnect(frameSource, SIGNAL(FrameReady()), this, SLOT(FrameReady()));
+    }
+
+    frameSource = source;
+    connect(frameSource, SIGNAL(FrameReady()), this, SLOT(FrameReady()));
+
+    // Sources start with face tracking enabled
+    if (!faceTrackingAction->isChecked()) {
+        frameSource->ToggleFaceTracking();
+    }
+    frameSource->SetFaceTrackingRoi(useFaceTrackingRoi);
+
+    frameSource->Start();
+}
+
 void MainWindow::FrameReady()
 {
+    // FrameReady signals queue up while the UI is busy, the first one takes the newest frame and the
+    // others find nothing new
+    FrameBuffer* frame = memory->gatherFrames.AcquireLatest();
+    if (frame == nullptr) { return; }
+
     DisplayColorFrame();
     DisplayDepthFrame();
     DisplayPointCloud();
 
+    auto numPendingRequests = [this]() {
+        return (normalComputationRequested ? 1 : 0) + (pointCloudFilterRequested ? 1 : 0) + numSnapshotsRequested;
+    };
+    int numPendingBefore = numPendingRequests();
+    uint64_t bytesCopiedBefore = PointCloudBytesCopied();
+
+    // Requests that find the pools exhausted stay pending and are tried again with the next frame
     if (normalComputationRequested) {
-        CopyPointCloudBuffer(memory->gatherBuffer.pointCloudBuffer, &memory->inspectionBuffer);
-        PointCloudHelpers::CreateAndStartNormalWorker(&memory->inspectionBuffer, this);
-        normalComputationRequested = false;
+        // Normals are written into the point cloud, so it gets a clone of the frame's point cloud that shares
+        // everything but the normals with the pinned frame. Without a frame to pin, the points are copied.
+        PointCloudHandle pointCloud = memory->pointClouds.Acquire();
+        if (pointCloud) {
+            FrameHandle pinned = memory->gatherFrames.PinCurrent();
+            if (pinned) {
+                ClonePointCloudBuffer(frame->pointCloudBuffer, pointCloud.Get(), std::make_shared<FrameHandle>(pinned));
+            } else {
+                CopyPointCloudBuffer(frame->pointCloudBuffer, pointCloud.Get());
+            }
+            StartNormalWorker(pointCloud, useDepthGridNeighborhoods);
+            normalComputationRequested = false;
+        } else {
+            ReportPoolExhausted("Normal computation");
+        }
     }
 
     if (pointCloudFilterRequested) {
-        CopyPointCloudBuffer(memory->gatherBuffer.pointCloudBuffer, &memory->inspectionBuffer);
-        PointCloudHelpers::CreateAndStartFilterWorker(&memory->inspectionBuffer, &memory->filterBuffer, this);
-        pointCloudFilterRequested = false;
+        FrameHandle pinned = memory->gatherFrames.PinCurrent();
+        if (pinned) {
+            filterSource = pinned;
+        }
+        if (pinned && StartFilterWorker(10, 1.0f)) {
+            pointCloudFilterRequested = false;
+        } else {
+            ReportPoolExhausted("Filtering");
+        }
+    }
+
+    // One snapshot per frame, so every request of a burst gets its own frame
+    if (numSnapshotsRequested > 0) {
+        FrameHandle pinned = memory->gatherFrames.PinCurrent();
+        PointCloudHandle filtered = memory->pointClouds.Acquire();
+        if (pinned && filtered) {
+            // The text export wins over compression
+            PointCloudFileFormat format = saveTextPointClouds ? POINTCLOUD_FORMAT_TEXT :
+                                          compressPointClouds ? POINTCLOUD_FORMAT_COMPRESSED : POINTCLOUD_FORMAT_BINARY;
+            if (!theSnapshotQueue.Submit(pinned, filtered, this, NeighborSearch(useDepthGridNeighborhoods), format)) {
+                ui->statusBar->showMessage("Could not create the snapshot directory");
+            }
+            numSnapshotsRequested--;
+        } else {
+            ReportPoolExhausted("Snapshot");
+        }
     }
 
-    if (snapshotRequested) {
-        CopyFrameBuffer(&memory->gatherBuffer, &memory->snapshotBuffer);
-        PointCloudHelpers::CreateAndStartSaveSnapshotWorker(&memory->snapshotBuffer, this);
-        snapshotRequested = false;
+    if (numPendingRequests() < numPendingBefore) {
+        lastRequestBytesCopied = PointCloudBytesCopied() - bytesCopiedBefore;
+        requestBytesCopied += lastRequestBytesCopied;
+        numRequestFrames++;
     }
+
+    DisplayFrameStatus();
+}
+
+void MainWindow::StartNormalWorker(PointCloudHandle pointCloud, bool useDepthGrid)
+{
+    normalsPointCloud = pointCloud;
+    numNormalJobs++;
+    PointCloudHelpers::CreateAndStartNormalWorker(pointCloud, this, NeighborSearch(useDepthGrid));
+}
+
+bool MainWindow::StartFilterWorker(size_t numNeighbors, float stddevMultiplier)
+{
+    PointCloudHandle filtered = memory->pointClouds.Acquire();
+    if (!filtered) { return false; }
+
+    filteredPointCloud = filtered;
+    numFilterJobs++;
+    PointCloudHelpers::CreateAndStartFilterWorker(filterSource, filtered, this,
+                                                  numNeighbors, stddevMultiplier, PointCloudHelpers::ALL_CORES,
+                                                  NeighborSearch(useDepthGridNeighborhoods));
+    return true;
+}
+
+void MainWindow::ShowInspectedPointCloud(PointCloudHandle pointCloud, bool withNormals)
+{
+    // The display keeps looking at the previous buffer until it has the new one
+    inspectionPointCloudDisplay->SetData(pointCloud.Get(), withNormals);
+    inspectedPointCloud = pointCloud;
+    loadedSnapshot.reset();
+}
+
+void MainWindow::ShowSnapshot(QString metaFileLocation)
+{
+    // Binary snapshots are displayed straight from the mapped file, text snapshots have to be parsed
+    std::unique_ptr<PointCloudHelpers::MappedPointCloud> mapped = PointCloudHelpers::MapSnapshot(metaFileLocation.toStdString());
+    if (mapped) {
+        inspectionPointCloudDisplay->SetData(mapped->Buffer(), true /* with normals */);
+        loadedSnapshot = std::move(mapped);
+        inspectedPointCloud.Reset();
+        return;
+    }
+
+    PointCloudHandle pointCloud = memory->pointClouds.Acquire();
+    if (!pointCloud) {
+        ReportPoolExhausted("Loading the snapshot");
+        return;
+    }
+    PointCloudHelpers::LoadSnapshot(metaFileLocation.toStdString(), pointCloud.Get());
+    ShowInspectedPointCloud(pointCloud, true /* with normals */);
+}
+
+void MainWindow::ReportPoolExhausted(const QString& job)
+{
+    BufferPoolCounters frames      = memory->gatherFrames.PoolCounters();
+    BufferPoolCounters pointClouds = memory->pointClouds.Counters();
+    ui->statusBar->showMessage(QString("%1 waits for a free buffer: frame pool %2 / %3, point cloud pool %4 / %5 in use")
+                                   .arg(job)
+                                   .arg(frames.inUse)
+                                   .arg(frames.capacity)
+                                   .arg(pointClouds.inUse)
+                                   .arg(pointClouds.capacity));
 }
 
 void MainWindow::DisplayColorFrame()
 {
     int width = colorDisplay->size().width();
 
-    cv::Mat captured_image = cv::Mat(COLOR_HEIGHT, COLOR_WIDTH, CV_8UC4, memory->gatherBuffer.colorBuffer);
-    cv::Mat resized;
-
-    cv::resize(captured_image, resized, cv::Size(), 0.6, 0.6);
+    // Scaled by the frame source for face tracking already. Nothing else reads it afterwards, so the landmarks
+    // are drawn right into it.
+    cv::Mat resized = cv::Mat(SCALED_COLOR_HEIGHT, SCALED_COLOR_WIDTH, CV_8UC4, memory->gatherFrames.Current()->scaledColorBuffer);
     FaceTrackingVisualization::visualise_tracking(resized, *faceTrackingModel, *faceTrackingParameters);
 
     QPixmap pixmap = QPixmap::fromImage(QImage((uchar*) resized.data,
@@ -289,7 +502,7 @@ void MainWindow::DisplayDepthFrame()
 {
     int height = depthDisplay->size().height();
 
-    QPixmap pixmap = QPixmap::fromImage(QImage((uchar*)memory->gatherBuffer.depthBuffer8,
+    QPixmap pixmap = QPixmap::fromImage(QImage((uchar*)memory->gatherFrames.Current()->depthBuffer8,
                                                DEPTH_WIDTH,
                                                DEPTH_HEIGHT,
                                                QImage::Format_Grayscale8));
@@ -298,7 +511,63 @@ void MainWindow::DisplayDepthFrame()
 
 void MainWindow::DisplayPointCloud()
 {
-    pointCloudDisplay->SetData(memory->gatherBuffer.pointCloudBuffer);
+    pointCloudDisplay->SetData(memory->gatherFrames.Current()->pointCloudBuffer);
+}
+
+void MainWindow::DisplayFrameStatus()
+{
+    FrameExchangeCounters counters = memory->gatherFrames.Counters();
+    QString status = QString("Frames dropped: %1 / %2, latency: %3 ms (avg %4 ms, max %5 ms)")
+                         .arg(counters.dropped)
+                         .arg(counters.published)
+                         .arg(counters.lastLatencyUs / 1000.0, 0, 'f', 1)
+                         .arg(counters.averageLatencyUs / 1000.0, 0, 'f', 1)
+                         .arg(counters.maxLatencyUs / 1000.0, 0, 'f', 1);
+
+    if (frameSource == kinectGrabber) {
+        CapturePipelineCounters pipeline = kinectGrabber->PipelineCounters();
+        status += QString(", acquisition avg %1 ms, queue %2 / %3 (avg %4, %5 dropped), processing avg %6 ms")
+                         .arg(pipeline.acquisition.averageLatencyUs / 1000.0, 0, 'f', 1)
+                         .arg(pipeline.queue.occupancy)
+                         .arg(pipeline.queue.capacity)
+                         .arg(pipeline.queue.averageOccupancy, 0, 'f', 1)
+                         .arg(pipeline.queue.dropped)
+                         .arg(pipeline.processing.averageLatencyUs / 1000.0, 0, 'f', 1);
+    }
+
+    BufferPoolCounters frames      = memory->gatherFrames.PoolCounters();
+    BufferPoolCounters pointClouds = memory->pointClouds.Counters();
+    status += QString(", frame pool %1 / %2 (max %3), point cloud pool %4 / %5 (max %6)")
+                     .arg(frames.inUse)
+                     .arg(frames.capacity)
+                     .arg(frames.maxInUse)
+                     .arg(pointClouds.inUse)
+                     .arg(pointClouds.capacity)
+                     .arg(pointClouds.maxInUse);
+
+    SnapshotQueueCounters snapshots = theSnapshotQueue.Counters();
+    if (snapshots.queued > 0 || numSnapshotsRequested > 0) {
+        status += QString(", snapshots queued: %1 (%2 waiting for a frame)")
+                         .arg(snapshots.queued)
+                         .arg(numSnapshotsRequested);
+    }
+
+    if (numRequestFrames > 0) {
+        status += QString(", point data copied by requests: %1 KB (avg %2 KB per frame)")
+                         .arg(lastRequestBytesCopied / 1024.0, 0, 'f', 0)
+                         .arg(requestBytesCopied / 1024.0 / numRequestFrames, 0, 'f', 0);
+    }
+
+    ThumbnailCacheCounters thumbnails = theThumbnailCache.Counters();
+    if (thumbnails.entries > 0) {
+        status += QString(", thumbnails cached: %1 (%2 / %3 MB, %4 evicted)")
+                         .arg(thumbnails.entries)
+                         .arg(thumbnails.bytes / (1024.0 * 1024.0), 0, 'f', 1)
+                         .arg(thumbnails.maxBytes / (1024 * 1024))
+                         .arg(thumbnails.evictions);
+    }
+
+    frameStatus->setText(status);
 }
 
 void MainWindow::DisplayFPS(float fps)
@@ -311,8 +580,12 @@ void MainWindow::OnFilterParamsChanged()
     int   numNeighbors     = numNeighborsLineEdit->text().toInt();
     float stddevMultiplier = stddevMultiplierLineEdit->text().toFloat();
 
-    PointCloudHelpers::CreateAndStartFilterWorker(&memory->inspectionBuffer, &memory->filterBuffer,
-                                                  this, numNeighbors, stddevMultiplier);
+    // Filters the frame of the last filter request again
+    if (!filterSource) { return; }
+
+    if (!StartFilterWorker(numNeighbors, stddevMultiplier)) {
+        ReportPoolExhausted("Filtering");
+    }
 }
 
 void MainWindow::OnDrawNormalsToggled(bool checked)
@@ -328,30 +601,103 @@ void MainWindow::OnDrawColorsToggled(bool checked)
 
 void MainWindow::OnDoFaceTrackingToggled(bool checked)
 {
-    kinectGrabber->ToggleFaceTracking();
-    // openCVGrabber->ToggleFaceTracking();
+    frameSource->ToggleFaceTracking();
+}
+
+void MainWindow::OnDepthGridNeighborhoodsToggled(bool checked)
+{
+    useDepthGridNeighborhoods = checked;
+}
+
+void MainWindow::OnFaceTrackingRoiToggled(bool checked)
+{
+    useFaceTrackingRoi = checked;
+    if (frameSource != nullptr) {
+        frameSource->SetFaceTrackingRoi(checked);
+    }
+}
+
+void MainWindow::OnSaveTextPointCloudsToggled(bool checked)
+{
+    saveTextPointClouds = checked;
+}
+
+void MainWindow::OnCompressPointCloudsToggled(bool checked)
+{
+    compressPointClouds = checked;
+}
+
+void MainWindow::OnDropOldestFramesToggled(bool checked)
+{
+    kinectGrabber->SetQueuePolicy(checked ? QUEUE_DROP_OLDEST : QUEUE_BLOCK);
+}
+
+void MainWindow::OnRecordFramesToggled(bool checked)
+{
+    if (!checked) {
+        kinectGrabber->StopRecording();
+        return;
+    }
+
+    QString recordingPath = theScanSession.getCurrentScanSession();
+    QString recordingFileName = recordingPath + "recording_" +
+                                QDateTime::currentDateTime().toString("yyyy_MM_dd_HH_mm_ss") + ".fsr";
+
+    if (!QDir().mkpath(recordingPath) || !kinectGrabber->StartRecording(recordingFileName)) {
+        ui->statusBar->showMessage("Could not create recording " + recordingFileName);
+        recordFramesAction->setChecked(false);
+        return;
+    }
+
+    ui->statusBar->showMessage("Recording to " + recordingFileName);
 }
 
 void MainWindow::OnNormalsComputed()
 {
-    inspectionPointCloudDisplay->SetData(&memory->inspectionBuffer, true /* data has normals */);
+    if (--numNormalJobs > 0) { return; }
+
+    ShowInspectedPointCloud(normalsPointCloud, true /* data has normals */);
+    normalsPointCloud.Reset();
 }
 
 void MainWindow::OnPointcloudFiltered()
 {
-    inspectionPointCloudDisplay->SetData(&memory->filterBuffer);
+    if (--numFilterJobs > 0) { return; }
+
+    ShowInspectedPointCloud(filteredPointCloud, false);
+    filteredPointCloud.Reset();
 }
 
-void MainWindow::OnSnapshotSaved(QString metaFileLocation)
+void MainWindow::OnSnapshotSaved(QString metaFileLocation, PointCloudHandle pointCloud)
 {
-    inspectionPointCloudDisplay->SetData(memory->snapshotBuffer.pointCloudBuffer, true /* with normals */);
+    SnapshotQueueCounters snapshots = theSnapshotQueue.Counters();
+    if (metaFileLocation.isEmpty()) {
+        ui->statusBar->showMessage(QString("Saving a snapshot failed, %1 failed so far").arg(snapshots.failed));
+        return;
+    }
+
+    ui->statusBar->showMessage(QString("Snapshot saved in %1 ms (avg %2 ms, max %3 ms), %4 queued")
+                                   .arg(snapshots.latency.lastLatencyUs / 1000.0, 0, 'f', 0)
+                                   .arg(snapshots.latency.averageLatencyUs / 1000.0, 0, 'f', 0)
+                                   .arg(snapshots.latency.maxLatencyUs / 1000.0, 0, 'f', 0)
+                                   .arg(snapshots.queued));
+
+    // Textures of the session's snapshots are created from this calibration, without the kinect
+    CameraCalibration calibration;
+    QString calibrationFile = QFileInfo(metaFileLocation).absoluteDir().filePath(CAMERA_CALIBRATION_FILE_NAME);
+    if (frameSource->GetCameraCalibration(&calibration) && !QFileInfo::exists(calibrationFile)) {
+        SaveCameraCalibration(calibrationFile.toStdString(), calibration);
+    }
+
+    // The point cloud that was just written, reading it back would only take longer
+    ShowInspectedPointCloud(pointCloud, true /* with normals */);
     qWarning() << "New Meta File at " << metaFileLocation;
-    snapshotGrid->addSelectableSnapshot(metaFileLocation);
+    snapshotGrid->addSelectableSnapshot(metaFileLocation, pointCloud->numPoints);
 }
 
 void MainWindow::SnapshotRequested(bool)
 {
-    snapshotRequested = true;
+    numSnapshotsRequested++;
 }
 
 void MainWindow::LoadSnapshotRequested(bool)
@@ -362,8 +708,7 @@ void MainWindow::LoadSnapshotRequested(bool)
         return;
     }
 
-    PointCloudHelpers::LoadSnapshot(loadFileName.toStdString().c_str(), memory->snapshotBuffer.pointCloudBuffer);
-    inspectionPointCloudDisplay->SetData(memory->snapshotBuffer.pointCloudBuffer, true /* with normals */);
+    ShowSnapshot(loadFileName);
 }
 
 #include "TextureDisplay.h"
@@ -374,6 +719,7 @@ void MainWindow::CreateTextureRequested(bool)
 
     if (textureDisplay != nullptr) {
         delete textureDisplay;
+        textureDisplay = nullptr;
     }
 
     QString loadFileName = QFileDialog::getOpenFileName(this, "Select Snapshot File to read", "..\\..\\data\\", "Snapshot Meta Files(*.meta)", nullptr, QFileDialog::DontUseNativeDialog);
@@ -382,11 +728,42 @@ void MainWindow::CreateTextureRequested(bool)
         return;
     }
 
-    textureDisplay = new TextureDisplay(kinectGrabber->GetCoordinateMapper(), loadFileName.toStdString());
+    // Prefer the calibration that was stored with the snapshot, it is the camera the snapshot was taken with
+    CameraCalibration calibration;
+    QString calibrationFile = QFileInfo(loadFileName).absoluteDir().filePath(CAMERA_CALIBRATION_FILE_NAME);
+    if (!LoadCameraCalibration(calibrationFile.toStdString(), &calibration) &&
+        !frameSource->GetCameraCalibration(&calibration)) {
+        ui->statusBar->showMessage(QString("No camera calibration for the snapshot, %1 is missing").arg(calibrationFile));
+        return;
+    }
+
+    textureDisplay = new TextureDisplay(calibration, loadFileName.toStdString());
     textureDisplay->show();
 
 }
 
+void MainWindow::ReplayRecordingRequested(bool)
+{
+    QString recordingFileName = QFileDialog::getOpenFileName(this, "Select Recording to replay", "..\\..\\data\\", "Frame Recordings(*.fsr)", nullptr, QFileDialog::DontUseNativeDialog);
+
+    if (recordingFileName.isNull() || recordingFileName.isEmpty()) {
+        return;
+    }
+
+    std::unique_ptr<FrameRecording> recording = FrameRecording::Open(recordingFileName.toStdString());
+    if (!recording) {
+        ui->statusBar->showMessage("Could not open recording " + recordingFileName);
+        return;
+    }
+
+    // Replays in a loop with the recorded timing, like a sensor would deliver the frames
+    ReplayFrameSource* previousReplay = replaySource;
+    replaySource = new ReplayFrameSource(&memory->gatherFrames, std::move(recording), REPLAY_RECORDED_RATE, true /* loop */,
+                                         faceTrackingModel, faceTrackingParameters);
+    SwitchFrameSource(replaySource);
+    delete previousReplay;
+}
+
 void MainWindow::OnNewScanSessionRequested(bool)
 {
     theScanSession.newScanSession();
@@ -409,11 +786,22 @@ void MainWindow::LoadScanSessionRequested(bool)
 
     scanSessionStatus->setText("Current Scan Session at: " + theScanSession.getCurrentScanSession());
 
-    QStringList ls = dir.entryList({ "*.meta" });
-    for (auto metaFile : ls) {
-        PointCloudHelpers::theSnapshotCount++;
-        snapshotGrid->addSelectableSnapshot(dir.absoluteFilePath(metaFile));
-    }
+    // New snapshots are numbered after the session's snapshots right away, their files are loaded in the background
+    PointCloudHelpers::theSnapshotCount += dir.entryList({ "*.meta" }).size();
+
+    LoadScanSessionAsync(theScanSession.getCurrentScanSession(), this);
+    ui->statusBar->showMessage("Loading scan session " + theScanSession.getCurrentScanSession());
+}
+
+void MainWindow::OnSessionSnapshotLoaded(SnapshotMetaInformation metaInfo, size_t numPoints)
+{
+    snapshotGrid->addSelectableSnapshot(metaInfo, numPoints);
+}
+
+void MainWindow::OnScanSessionLoaded(QString sessionPath, int numSnapshots, size_t numPoints)
+{
+    ui->statusBar->showMessage(QString("Loaded %1 snapshots with %2 points of %3")
+                                   .arg(numSnapshots).arg(numPoints).arg(sessionPath));
 }
 
 void MainWindow::MeshCreationRequested(bool)
@@ -434,11 +822,40 @@ void MainWindow::NormalComputationRequested(bool)
 }
 void MainWindow::NormalComputationForHemisphereRequested(bool)
 {
-    PointCloudHelpers::GenerateRandomHemiSphere(&memory->inspectionBuffer, 60000);
-    PointCloudHelpers::CreateAndStartNormalWorker(&memory->inspectionBuffer, this);
+    PointCloudHandle pointCloud = memory->pointClouds.Acquire();
+    if (!pointCloud) {
+        ReportPoolExhausted("Normal computation");
+        return;
+    }
+
+    PointCloudHelpers::GenerateRandomHemiSphere(pointCloud.Get(), 60000);
+    StartNormalWorker(pointCloud, false);
 }
 
 void MainWindow::PointCloudFilterRequested(bool)
 {
     pointCloudFilterRequested = true;
 }
+
+void MainWindow::AddBenchmark(QMenu* menu, const QString& name, BenchmarkInput input, std::function<QString(const QString&)> benchmark)
+{
+    QAction* action = menu->addAction(name);
+    connect(action, &QAction::triggered, this, [this, name, input, benchmark](bool) {
+        RunBenchmark(name, input, benchmark);
+    });
+}
+
+void MainWindow::RunBenchmark(const QString& name, BenchmarkInput input, std::function<QString(const QString&)> benchmark)
+{
+    QString recordingFileName;
+
+    if (input == ON_RECORDING) {
+        recordingFileName = QFileDialog::getOpenFileName(this, "Select Recording for " + name, "..\\..\\data\\", "Frame Recordings(*.fsr)", nullptr, QFileDialog::DontUseNativeDialog);
+
+        if (recordingFileName.isNull() || recordingFileName.isEmpty()) {
+            return;
+        }
+    }
+
+    ui->statusBar->showMessage(benchmark(recordingFileName));
+}
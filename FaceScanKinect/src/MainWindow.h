@@ -3,16 +3,27 @@
 
 #include <QMainWindow>
 
-struct MemoryPool;
+#include <functional>
+#include <memory>
+
+#include "MemoryPool.h"
+#include "SessionIndex.h"
 
 class QLabel;
 class QLineEdit;
+class QMenu;
 
+class FrameSource;
 class KinectGrabber;
+class ReplayFrameSource;
 class PointCloudDisplay;
 class TextureDisplay;
 
 
+namespace PointCloudHelpers {
+    class MappedPointCloud;
+}
+
 namespace LandmarkDetector {
     struct FaceModelParameters;
     class  CLNF;
@@ -46,9 +57,17 @@ public slots:
     void OnDrawNormalsToggled(bool);
     void OnDrawColorsToggled(bool);
     void OnDoFaceTrackingToggled(bool);
+    void OnDepthGridNeighborhoodsToggled(bool);
+    void OnFaceTrackingRoiToggled(bool);
+    void OnSaveTextPointCloudsToggled(bool);
+    void OnCompressPointCloudsToggled(bool);
+    void OnRecordFramesToggled(bool);
+    void OnDropOldestFramesToggled(bool);
     void OnNormalsComputed();
     void OnPointcloudFiltered();
-    void OnSnapshotSaved(QString metaFileLocation);
+    void OnSnapshotSaved(QString metaFileLocation, PointCloudHandle pointCloud);
+    void OnSessionSnapshotLoaded(SnapshotMetaInformation metaInfo, size_t numPoints);
+    void OnScanSessionLoaded(QString sessionPath, int numSnapshots, size_t numPoints);
 
     void SnapshotRequested(bool);
     void LoadSnapshotRequested(bool);
@@ -56,16 +75,34 @@ public slots:
     void OnNewScanSessionRequested(bool);
     void MeshCreationRequested(bool);
     void LoadScanSessionRequested(bool);
+    void ReplayRecordingRequested(bool);
 
 private:
     void DisplayColorFrame();
     void DisplayDepthFrame();
     void DisplayPointCloud();
+    void DisplayFrameStatus();
+    void SwitchFrameSource(FrameSource* source);
+
+    void StartNormalWorker(PointCloudHandle pointCloud, bool useDepthGrid);
+    bool StartFilterWorker(size_t numNeighbors, float stddevMultiplier);
+    void ShowInspectedPointCloud(PointCloudHandle pointCloud, bool withNormals);
+    void ShowSnapshot(QString metaFileLocation);
+    void ReportPoolExhausted(const QString& job);
 
     void createActions();
     void createMenus();
     void createToolBar();
 
+    //
+    // Benchmarks get the file name of a recording the user picks when they are run ON_RECORDING, an empty
+    // string otherwise, and return the summary that is shown in the status bar.
+    //
+    enum BenchmarkInput { NO_RECORDING, ON_RECORDING };
+
+    void AddBenchmark(QMenu* menu, const QString& name, BenchmarkInput input, std::function<QString(const QString&)> benchmark);
+    void RunBenchmark(const QString& name, BenchmarkInput input, std::function<QString(const QString&)> benchmark);
+
     Ui::MainWindow *ui;
 
     MemoryPool* memory;
@@ -74,6 +111,10 @@ private:
 
     KinectGrabber* kinectGrabber;
     OpenCVWebcamGrabber* openCVGrabber;
+    ReplayFrameSource* replaySource;
+
+    // The source that currently delivers frames, one of the above
+    FrameSource* frameSource;
 
     QLabel* colorDisplay;
     QLabel* depthDisplay;
@@ -89,13 +130,46 @@ private:
 
     bool normalComputationRequested;
     bool pointCloudFilterRequested;
-    bool snapshotRequested;
+
+    // Snapshot requests that did not get a frame yet, one is taken per frame
+    int numSnapshotsRequested;
 
     bool drawNormals;
+    bool useDepthGridNeighborhoods;
+    bool useFaceTrackingRoi;
+    bool saveTextPointClouds;
+    bool compressPointClouds;
+
+    // Last snapshot loaded in the binary format, the inspection display looks at its mapping
+    std::unique_ptr<PointCloudHelpers::MappedPointCloud> loadedSnapshot;
+
+    // Pooled point cloud the inspection display looks at, if it does not show loadedSnapshot
+    PointCloudHandle inspectedPointCloud;
+
+    // Frame pinned by the last filter request, filtered again when the filter parameters change
+    FrameHandle filterSource;
+
+    // Results of the newest normal and filter jobs. They are shown once every job that was started
+    // has finished, so the display never looks at a buffer that is still being written.
+    PointCloudHandle normalsPointCloud;
+    PointCloudHandle filteredPointCloud;
+    int numNormalJobs;
+    int numFilterJobs;
+
+    // Bytes of point data copied by the requests FrameReady() started (see PointCloudBytesCopied()), in the last
+    // frame that started one and in all numRequestFrames frames that did
+    uint64_t lastRequestBytesCopied;
+    uint64_t requestBytesCopied;
+    int numRequestFrames;
+
     QAction* loadSnapshotAction;
     QAction* drawNormalsAction;
     QAction* drawColoredPointCloudAction;
     QAction* faceTrackingAction;
+    QAction* faceTrackingRoiAction;
+    QAction* depthGridNeighborhoodsAction;
+    QAction* saveTextPointCloudsAction;
+    QAction* compressPointCloudsAction;
     QAction* filterPointCloudAction;
     QAction* computeNormalsAction;
     QAction* computeNormalsForHemisphereAction;
@@ -103,8 +177,12 @@ private:
     QAction* textureGenerationAction;
     QAction* createMeshesAction;
     QAction* loadScanSessionAction;
+    QAction* replayRecordingAction;
+    QAction* recordFramesAction;
+    QAction* dropOldestFramesAction;
 
     QLabel* scanSessionStatus;
+    QLabel* frameStatus;
 };
 
 #endif // MAINWINDOW_H
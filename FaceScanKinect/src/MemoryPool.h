@@ -1,8 +1,22 @@
 #ifndef MEMORYPOOL_H
 #define MEMORYPOOL_H
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <QMetaType>
+#include <QtGlobal>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
 
 #include "Types.h"
 
@@ -15,6 +29,12 @@ const int32_t NUM_COLOR_PIXELS = COLOR_WIDTH * COLOR_HEIGHT;
 const int32_t NUM_DEPTH_PIXELS = DEPTH_WIDTH * DEPTH_HEIGHT;
 
 const int32_t COLOR_BUFFER_SIZE = NUM_COLOR_PIXELS * (int32_t)sizeof(uint32_t);
+
+// Face tracking and the color display work on the color frame scaled down by this factor
+const float   FACE_TRACKING_SCALE     = 0.6f;
+const int32_t SCALED_COLOR_WIDTH      = 1152;  // COLOR_WIDTH  * FACE_TRACKING_SCALE
+const int32_t SCALED_COLOR_HEIGHT     =  648;  // COLOR_HEIGHT * FACE_TRACKING_SCALE
+const int32_t NUM_SCALED_COLOR_PIXELS = SCALED_COLOR_WIDTH * SCALED_COLOR_HEIGHT;
 const int32_t DEPTH_BUFFER8_SIZE = NUM_DEPTH_PIXELS * (int32_t)sizeof(uint8_t);
 const int32_t DEPTH_BUFFER16_SIZE = NUM_DEPTH_PIXELS * (int32_t)sizeof(uint16_t);
 
@@ -22,24 +42,148 @@ const int32_t DEPTH_BUFFER16_SIZE = NUM_DEPTH_PIXELS * (int32_t)sizeof(uint16_t)
 const int32_t MAX_POINTCLOUD_SIZE = 262144;  // 2^18
 const int32_t POINTCLOUD_BUFFER_SIZE = MAX_POINTCLOUD_SIZE * (int32_t)sizeof(Vec3f);
 
+// Planes of PointCloudPlanes are aligned to and padded to a multiple of one AVX register
+const size_t SIMD_ALIGNMENT   = 32;
+const size_t SIMD_FLOAT_WIDTH = SIMD_ALIGNMENT / sizeof(float);
+
 const int NUM_LANDMARKS = 68;
 const int LANDMARK_BUFFER_SIZE = NUM_LANDMARKS * sizeof(size_t);
 
+// Depth pixels map about three color pixels apart, so most cells of this size are hit by a point
+const int32_t COLOR_RASTER_CELL_SIZE = 4;
+const int32_t COLOR_RASTER_WIDTH     = COLOR_WIDTH  / COLOR_RASTER_CELL_SIZE;
+const int32_t COLOR_RASTER_HEIGHT    = COLOR_HEIGHT / COLOR_RASTER_CELL_SIZE;
+const int32_t NUM_COLOR_RASTER_CELLS = COLOR_RASTER_WIDTH * COLOR_RASTER_HEIGHT;
+
+namespace PointCloudHelpers {
+    struct SpatialIndex;
+}
+
+//
+// Every version of point data gets a unique generation. Two buffers with the same generation hold the same points.
+//
+inline uint64_t NextPointCloudGeneration() {
+    static std::atomic<uint64_t> nextGeneration(1);
+    return nextGeneration++;
+}
+
+//
+// Bytes of point data copied between point cloud buffers since program start, by CopyPointCloudBuffer()
+//
+inline std::atomic<uint64_t>& PointCloudBytesCopied() {
+    static std::atomic<uint64_t> bytesCopied(0);
+    return bytesCopied;
+}
+
+template<typename T>
+static void CopyPointData(T* dst, const T* src, size_t count) {
+    memcpy(dst, src, count * sizeof(T));
+    PointCloudBytesCopied() += count * sizeof(T);
+}
+
+//
+// Arrays of a PointCloudBuffer, combined to a mask
+//
+enum PointCloudArray {
+    POINTCLOUD_POINTS        = 0x1,
+    POINTCLOUD_COLORS        = 0x2,
+    POINTCLOUD_NORMALS       = 0x4,
+    POINTCLOUD_DEPTH_PIXELS  = 0x8,
+    POINTCLOUD_ALL_ARRAYS    = 0xF,
+};
+
 struct PointCloudBuffer {
 
     PointCloudBuffer() {
-        points = new Vec3f[MAX_POINTCLOUD_SIZE];
-        colors = new RGB3f[MAX_POINTCLOUD_SIZE];
-        normals = new Vec3f[MAX_POINTCLOUD_SIZE];
+        ownPoints = new Vec3f[MAX_POINTCLOUD_SIZE];
+        ownColors = new RGB3f[MAX_POINTCLOUD_SIZE];
+        ownNormals = new Vec3f[MAX_POINTCLOUD_SIZE];
+        ownDepthPixelIndices = new int32_t[MAX_POINTCLOUD_SIZE];
+        points = ownPoints;
+        colors = ownColors;
+        normals = ownNormals;
+        depthPixelIndices = ownDepthPixelIndices;
+        sharedArrays = 0;
         landmarkIndices = new size_t[NUM_LANDMARKS];
         numLandmarks = 0;
         numPoints = 0;
+        isOrganized = false;
+        ownsPointData = true;
+        generation = NextPointCloudGeneration();
+    }
+
+    //
+    // Creates a buffer that does not own its point data, e.g. to look at a memory mapped point cloud
+    // file (see PointCloudHelpers::MappedPointCloud). depthPixelIndices may be nullptr if the points are
+    // not organized. Such a buffer can be read and copied from, but must not be the destination of a copy.
+    //
+    PointCloudBuffer(Vec3f* points, RGB3f* colors, Vec3f* normals, int32_t* depthPixelIndices, size_t numPoints)
+        : points(points),
+          colors(colors),
+          normals(normals),
+          numPoints(numPoints),
+          depthPixelIndices(depthPixelIndices)
+    {
+        ownPoints = nullptr;
+        ownColors = nullptr;
+        ownNormals = nullptr;
+        ownDepthPixelIndices = nullptr;
+        sharedArrays = 0;
+        landmarkIndices = new size_t[NUM_LANDMARKS];
+        numLandmarks = 0;
+        isOrganized = depthPixelIndices != nullptr;
+        ownsPointData = false;
+        generation = NextPointCloudGeneration();
     }
 
     ~PointCloudBuffer() {
-        delete [] points;
-        delete [] colors;
-        delete [] normals;
+        delete [] ownPoints;
+        delete [] ownColors;
+        delete [] ownNormals;
+        delete [] ownDepthPixelIndices;
+        delete [] landmarkIndices;
+    }
+
+    PointCloudBuffer(const PointCloudBuffer&) = delete;
+    PointCloudBuffer& operator=(const PointCloudBuffer&) = delete;
+
+    //
+    // Has to be called whenever points or numPoints change. Invalidates the cached spatial index
+    // (see PointCloudHelpers::GetSpatialIndex()).
+    //
+    inline void MarkPointsModified() {
+        generation = NextPointCloudGeneration();
+    }
+
+    //
+    // Has to be called before writing to the given arrays. Arrays that are shared with the buffer this one was
+    // cloned from (see ClonePointCloudBuffer()) are switched to the storage of this buffer. Their contents are
+    // not copied, every writer overwrites the arrays it prepares completely.
+    //
+    void PrepareWrite(int arrays) {
+        int detach = sharedArrays & arrays;
+        if (detach == 0) { return; }
+
+        if (detach & POINTCLOUD_POINTS)       { points = ownPoints; }
+        if (detach & POINTCLOUD_COLORS)       { colors = ownColors; }
+        if (detach & POINTCLOUD_NORMALS)      { normals = ownNormals; }
+        if (detach & POINTCLOUD_DEPTH_PIXELS) { depthPixelIndices = ownDepthPixelIndices; }
+
+        sharedArrays &= ~detach;
+        if (sharedArrays == 0) { sharedStorage.reset(); }
+    }
+
+    //
+    // Stops sharing arrays with the buffer this one was cloned from and lets go of it. The points are gone
+    // afterwards. Called when the buffer goes back to its pool, so a free slot never keeps e.g. a frame pinned.
+    //
+    void DropSharedArrays() {
+        if (sharedArrays == 0) { return; }
+
+        PrepareWrite(POINTCLOUD_ALL_ARRAYS);
+        numPoints = 0;
+        numLandmarks = 0;
+        MarkPointsModified();
     }
 
     Vec3f* points;
@@ -48,6 +192,36 @@ struct PointCloudBuffer {
 
     size_t numPoints;
 
+    // Linear index of the depth pixel each point was created from. Only valid if isOrganized is set,
+    // i.e. for point clouds that come from the depth image (and filtered copies of those).
+    int32_t* depthPixelIndices;
+    bool isOrganized;
+
+    // False for buffers that look at memory owned by someone else
+    bool ownsPointData;
+
+    // Storage allocated by this buffer, nullptr if it does not own its point data. The arrays above point here,
+    // except for the ones in sharedArrays, which point into the buffer this one was cloned from.
+    Vec3f* ownPoints;
+    RGB3f* ownColors;
+    Vec3f* ownNormals;
+    int32_t* ownDepthPixelIndices;
+
+    int sharedArrays;
+
+    // Keeps the buffer that shared arrays point into alive, released once no array is shared anymore
+    std::shared_ptr<void> sharedStorage;
+
+    // Changes on every change to the points, see NextPointCloudGeneration(). Atomic, because the spatial index
+    // lookup of other threads reads it while the owner marks its points modified.
+    std::atomic<uint64_t> generation;
+
+    // Lazily built KD-tree over the points, shared by every stage that needs neighbors.
+    // Only valid while its generation matches the buffer's generation. The index keeps its own copy of
+    // the points, so copies of this buffer can share it.
+    std::shared_ptr<const PointCloudHelpers::SpatialIndex> spatialIndex;
+    std::mutex spatialIndexMutex;
+
     size_t* landmarkIndices;
     int numLandmarks;
 
@@ -69,28 +243,170 @@ struct PointCloudBuffer {
 
 };
 
+static void* AllocateAligned(size_t size) {
+#ifdef _MSC_VER
+    return _aligned_malloc(size, SIMD_ALIGNMENT);
+#else
+    void* result = nullptr;
+    if (posix_memalign(&result, SIMD_ALIGNMENT, size) != 0) { return nullptr; }
+    return result;
+#endif
+}
+
+static void FreeAligned(void* memory) {
+#ifdef _MSC_VER
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+static size_t PadToSimdWidth(size_t numFloats) {
+    return (numFloats + SIMD_FLOAT_WIDTH - 1) / SIMD_FLOAT_WIDTH * SIMD_FLOAT_WIDTH;
+}
+
+//
+// Structure of arrays storage for a point cloud. Every coordinate lives in its own plane, aligned and
+// padded to SIMD_FLOAT_WIDTH, so loops over all points can work on whole registers without a scalar
+// tail. The padding is kept at zero. Colors are packed as RGBA8 (R in the lowest byte, A = 255).
+//
+// Convert from and to a PointCloudBuffer with CopyPointCloudBufferToPlanes() and
+// CopyPlanesToPointCloudBuffer().
+//
+struct PointCloudPlanes {
+
+    PointCloudPlanes(size_t capacity = MAX_POINTCLOUD_SIZE)
+        : capacity(PadToSimdWidth(capacity)),
+          numPoints(0)
+    {
+        size_t planeSize = this->capacity * sizeof(float);
+        X       = (float*)AllocateAligned(planeSize);
+        Y       = (float*)AllocateAligned(planeSize);
+        Z       = (float*)AllocateAligned(planeSize);
+        normalX = (float*)AllocateAligned(planeSize);
+        normalY = (float*)AllocateAligned(planeSize);
+        normalZ = (float*)AllocateAligned(planeSize);
+        colors  = (uint32_t*)AllocateAligned(this->capacity * sizeof(uint32_t));
+
+        coordinates[0] = X;
+        coordinates[1] = Y;
+        coordinates[2] = Z;
+    }
+
+    ~PointCloudPlanes() {
+        FreeAligned(X);
+        FreeAligned(Y);
+        FreeAligned(Z);
+        FreeAligned(normalX);
+        FreeAligned(normalY);
+        FreeAligned(normalZ);
+        FreeAligned(colors);
+    }
+
+    PointCloudPlanes(const PointCloudPlanes&) = delete;
+    PointCloudPlanes& operator=(const PointCloudPlanes&) = delete;
+
+    // Number of points rounded up to the SIMD width, loops may run up to here
+    inline size_t PaddedSize() const { return PadToSimdWidth(numPoints); }
+
+    float* X;
+    float* Y;
+    float* Z;
+
+    float* normalX;
+    float* normalY;
+    float* normalZ;
+
+    uint32_t* colors;
+
+    // X, Y and Z, indexed by dimension
+    float* coordinates[3];
+
+    const size_t capacity;
+    size_t numPoints;
+
+    //
+    // nanoflann interface functions
+    //
+
+    inline size_t kdtree_get_point_count() const { return numPoints; }
+
+    inline float kdtree_get_pt(const size_t idx, size_t dim) const { return coordinates[dim][idx]; }
+
+    template<class BBOX>
+    bool kdtree_get_bbox(BBOX&) const { return false; }
+};
+
+inline uint32_t PackRGBA8(const RGB3f& color) {
+    uint32_t r = (uint32_t)(color.R * 255.0f + 0.5f);
+    uint32_t g = (uint32_t)(color.G * 255.0f + 0.5f);
+    uint32_t b = (uint32_t)(color.B * 255.0f + 0.5f);
+    return r | (g << 8) | (b << 16) | (0xFFu << 24);
+}
+
+inline RGB3f UnpackRGBA8(uint32_t color) {
+    return RGB3f(( color        & 0xFF) / 255.0f,
+                 ((color >>  8) & 0xFF) / 255.0f,
+                 ((color >> 16) & 0xFF) / 255.0f);
+}
+
+/**
+ * @brief The ColorPointRaster struct stores the point of a point cloud that is seen in every cell of
+ * COLOR_RASTER_CELL_SIZE x COLOR_RASTER_CELL_SIZE color pixels, i.e. the point closest to the camera.
+ *
+ * It is filled by CreatePointCloud() and answers which point lies at a color pixel without a spatial index.
+ */
+struct ColorPointRaster {
+    ColorPointRaster() {
+        pointIndices = new int32_t[NUM_COLOR_RASTER_CELLS];
+        Clear();
+    }
+
+    ~ColorPointRaster() {
+        delete [] pointIndices;
+    }
+
+    void Clear() {
+        memset(pointIndices, 0xFF, NUM_COLOR_RASTER_CELLS * sizeof(int32_t));
+    }
+
+    // Index into the point cloud, -1 for cells without a point
+    int32_t* pointIndices;
+};
+
 struct FrameBuffer {
 
     FrameBuffer() {
         colorBuffer = new uint32_t[NUM_COLOR_PIXELS];
+        scaledColorBuffer = new uint32_t[NUM_SCALED_COLOR_PIXELS];
+        scaledGrayBuffer = new uint8_t[NUM_SCALED_COLOR_PIXELS];
+        memset(scaledGrayBuffer, 0, NUM_SCALED_COLOR_PIXELS);
         depthBuffer8 = new uint8_t[NUM_DEPTH_PIXELS];
         depthBuffer16 = new uint16_t[NUM_DEPTH_PIXELS];
-        colorToCameraMapping = new Vec3f[NUM_COLOR_PIXELS];
 
         pointCloudBuffer = new PointCloudBuffer();
+        colorPointRaster = new ColorPointRaster();
+
+        frameNumber = 0;
+        publishTimeNs = 0;
     }
 
     ~FrameBuffer() {
         delete [] colorBuffer;
+        delete [] scaledColorBuffer;
+        delete [] scaledGrayBuffer;
         delete [] depthBuffer8;
         delete [] depthBuffer16;
-        delete [] colorToCameraMapping;
+        delete colorPointRaster;
     }
 
     // BGRA with 1Byte each
     uint32_t* colorBuffer;
 
-    Vec3f*    colorToCameraMapping;
+    // colorBuffer scaled by FACE_TRACKING_SCALE, shared by face tracking and the color display. The gray version
+    // is the input of the tracker, only the region it looks at is updated every frame. Neither is copied.
+    uint32_t* scaledColorBuffer;
+    uint8_t*  scaledGrayBuffer;
 
     uint16_t* depthBuffer16;
     uint8_t * depthBuffer8;
@@ -100,15 +416,113 @@ struct FrameBuffer {
     // uint16_t reserved;
 
     PointCloudBuffer* pointCloudBuffer;
+
+    // Points of pointCloudBuffer by color pixel, only needed to attach the landmarks, so it is not copied
+    ColorPointRaster* colorPointRaster;
+
+    // Set by FrameExchange::Publish()
+    uint64_t frameNumber;
+    int64_t  publishTimeNs;
 };
 
+// Same points, so dst can keep using the spatial index of src
+static void SharePointCloudIndex(PointCloudBuffer* src, PointCloudBuffer* dst) {
+    std::shared_ptr<const PointCloudHelpers::SpatialIndex> index;
+    {
+        std::lock_guard<std::mutex> lock(src->spatialIndexMutex);
+        index = src->spatialIndex;
+    }
+    {
+        std::lock_guard<std::mutex> lock(dst->spatialIndexMutex);
+        dst->spatialIndex = index;
+        dst->generation   = src->generation.load();
+    }
+}
+
 static void CopyPointCloudBuffer(PointCloudBuffer* src, PointCloudBuffer* dst) {
-    memcpy(dst->colors,  src->colors,  POINTCLOUD_BUFFER_SIZE);
-    memcpy(dst->points,  src->points,  POINTCLOUD_BUFFER_SIZE);
-    memcpy(dst->normals, src->normals, POINTCLOUD_BUFFER_SIZE);
-    memcpy(dst->landmarkIndices, src->landmarkIndices, LANDMARK_BUFFER_SIZE);
+    Q_ASSERT(dst->ownsPointData);
+    Q_ASSERT(src->numPoints <= (size_t)MAX_POINTCLOUD_SIZE);
+
+    dst->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
+
+    // Only the used part, src may be a view of a file that ends right after its points
+    CopyPointData(dst->colors,  src->colors,  src->numPoints);
+    CopyPointData(dst->points,  src->points,  src->numPoints);
+    CopyPointData(dst->normals, src->normals, src->numPoints);
+    if (src->isOrganized) {
+        CopyPointData(dst->depthPixelIndices, src->depthPixelIndices, src->numPoints);
+    }
+    dst->isOrganized = src->isOrganized;
+    memcpy(dst->landmarkIndices, src->landmarkIndices, src->numLandmarks * sizeof(size_t));
+    dst->numLandmarks = src->numLandmarks;
+    dst->numPoints = src->numPoints;
+
+    SharePointCloudIndex(src, dst);
+}
+
+//
+// Makes dst a copy of src without copying any point data: dst looks at the arrays of src until it writes to
+// them, see PointCloudBuffer::PrepareWrite(). srcOwner has to keep src alive and unchanged while dst holds it,
+// e.g. a pinned frame. Only the landmarks are copied.
+//
+static void ClonePointCloudBuffer(PointCloudBuffer* src, PointCloudBuffer* dst, std::shared_ptr<void> srcOwner) {
+    Q_ASSERT(dst->ownsPointData);
+
+    dst->points            = src->points;
+    dst->colors            = src->colors;
+    dst->normals           = src->normals;
+    dst->depthPixelIndices = src->depthPixelIndices != nullptr ? src->depthPixelIndices : dst->ownDepthPixelIndices;
+    dst->sharedArrays      = src->depthPixelIndices != nullptr ? POINTCLOUD_ALL_ARRAYS : POINTCLOUD_ALL_ARRAYS & ~POINTCLOUD_DEPTH_PIXELS;
+    dst->sharedStorage     = std::move(srcOwner);
+
+    dst->isOrganized = src->isOrganized;
+    memcpy(dst->landmarkIndices, src->landmarkIndices, src->numLandmarks * sizeof(size_t));
     dst->numLandmarks = src->numLandmarks;
     dst->numPoints = src->numPoints;
+
+    SharePointCloudIndex(src, dst);
+}
+
+static void CopyPointCloudBufferToPlanes(const PointCloudBuffer* src, PointCloudPlanes* dst) {
+    size_t numPoints = src->numPoints < dst->capacity ? src->numPoints : dst->capacity;
+
+    for (size_t i = 0; i < numPoints; ++i) {
+        dst->X[i] = src->points[i].X;
+        dst->Y[i] = src->points[i].Y;
+        dst->Z[i] = src->points[i].Z;
+
+        dst->normalX[i] = src->normals[i].X;
+        dst->normalY[i] = src->normals[i].Y;
+        dst->normalZ[i] = src->normals[i].Z;
+
+        dst->colors[i] = PackRGBA8(src->colors[i]);
+    }
+
+    size_t paddedSize = PadToSimdWidth(numPoints);
+    for (size_t i = numPoints; i < paddedSize; ++i) {
+        dst->X[i] = dst->Y[i] = dst->Z[i] = 0.0f;
+        dst->normalX[i] = dst->normalY[i] = dst->normalZ[i] = 0.0f;
+        dst->colors[i] = 0;
+    }
+
+    dst->numPoints = numPoints;
+}
+
+static void CopyPlanesToPointCloudBuffer(const PointCloudPlanes* src, PointCloudBuffer* dst) {
+    size_t numPoints = src->numPoints < (size_t)MAX_POINTCLOUD_SIZE ? src->numPoints : (size_t)MAX_POINTCLOUD_SIZE;
+
+    dst->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
+
+    for (size_t i = 0; i < numPoints; ++i) {
+        dst->points[i]  = Vec3f(src->X[i], src->Y[i], src->Z[i]);
+        dst->normals[i] = Vec3f(src->normalX[i], src->normalY[i], src->normalZ[i]);
+        dst->colors[i]  = UnpackRGBA8(src->colors[i]);
+    }
+
+    dst->numPoints    = numPoints;
+    dst->numLandmarks = 0;
+    dst->isOrganized  = false;
+    dst->MarkPointsModified();
 }
 
 static void CopyFrameBuffer(FrameBuffer* src, FrameBuffer *dst) {
@@ -118,15 +532,391 @@ static void CopyFrameBuffer(FrameBuffer* src, FrameBuffer *dst) {
     CopyPointCloudBuffer(src->pointCloudBuffer, dst->pointCloudBuffer);
 }
 
+// Slots of the frame pool: three for the FrameExchange, the rest for frames pinned by snapshot and filter jobs
+// and by point clouds cloned from a frame
+const size_t FRAME_POOL_SIZE      = 7;
+const size_t POINTCLOUD_POOL_SIZE = 6;
+
+struct BufferPoolCounters {
+    size_t capacity;
+
+    // Slots handed out right now and at most so far
+    size_t inUse;
+    size_t maxInUse;
+
+    uint64_t acquired;
+
+    // Acquire() calls that found no free slot
+    uint64_t failed;
+};
+
+template<typename T> class BufferPool;
+
+//
+// Called for a slot that goes back to its pool, to let go of everything the buffer keeps alive
+//
+template<typename T>
+inline void ReturnToPool(T*) { }
+
+inline void ReturnToPool(PointCloudBuffer* buf) { buf->DropSharedArrays(); }
+
+/**
+ * @brief The PoolHandle class is a reference to a slot of a BufferPool. The slot goes back to the pool when
+ * the last handle to it is destroyed or reset. Copying a handle adds a reference, nothing is copied.
+ *
+ * A handle must not outlive its pool. Handles can be passed to and released on any thread.
+ */
+template<typename T>
+class PoolHandle
+{
+public:
+    PoolHandle() : pool_(nullptr), slot_(0) { }
+
+    PoolHandle(const PoolHandle& other) : pool_(other.pool_), slot_(other.slot_) {
+        if (pool_ != nullptr) { pool_->AddRef(slot_); }
+    }
+
+    PoolHandle(PoolHandle&& other) : pool_(other.pool_), slot_(other.slot_) {
+        other.pool_ = nullptr;
+    }
+
+    PoolHandle& operator=(PoolHandle other) {
+        std::swap(pool_, other.pool_);
+        std::swap(slot_, other.slot_);
+        return *this;
+    }
+
+    ~PoolHandle() { Reset(); }
+
+    void Reset() {
+        if (pool_ != nullptr) { pool_->Release(slot_); }
+        pool_ = nullptr;
+    }
+
+    T* Get() const { return pool_ != nullptr ? pool_->Slot(slot_) : nullptr; }
+    T* operator->() const { return Get(); }
+
+    // False for empty handles, e.g. if the pool was exhausted
+    explicit operator bool() const { return pool_ != nullptr; }
+
+private:
+    friend class BufferPool<T>;
+
+    // Takes over a reference the pool already counted
+    PoolHandle(BufferPool<T>* pool, size_t slot) : pool_(pool), slot_(slot) { }
+
+    BufferPool<T>* pool_;
+    size_t slot_;
+};
+
+/**
+ * @brief The BufferPool class owns a fixed number of buffers that are allocated once, up front, and
+ * hands them out as reference counted PoolHandles.
+ *
+ * Besides handles, slots can be owned by index (AcquireSlot(), Share(), Recycle()). The FrameExchange
+ * owns its three frames like that, so it can pass them between threads without touching the
+ * reference counts, and pins a frame by Share() when a job wants to keep it. For every pinned frame that
+ * the exchange still owns one free slot is reserved, so the exchange can always replace it.
+ */
+template<typename T>
+class BufferPool
+{
+public:
+    BufferPool(size_t capacity)
+        : slots_(new T[capacity]),
+          refs_(capacity, 0),
+          reserved_(capacity, false),
+          capacity_(capacity),
+          numReserved_(0),
+          maxInUse_(0),
+          acquired_(0),
+          failed_(0)
+    {
+        freeSlots_.reserve(capacity);
+        for (size_t i = capacity; i > 0; --i) { freeSlots_.push_back(i - 1); }
+    }
+
+    ~BufferPool() {
+        delete [] slots_;
+    }
+
+    //
+    // Returns a handle to a free slot, an empty handle if all slots are in use
+    //
+    PoolHandle<T> Acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (freeSlots_.size() <= numReserved_) {
+            failed_++;
+            return PoolHandle<T>();
+        }
+        return PoolHandle<T>(this, TakeFreeSlot());
+    }
+
+    //
+    // Same as Acquire(), the caller owns the reference of the returned slot. Only used to set up a
+    // FrameExchange, so the pool is never exhausted here.
+    //
+    size_t AcquireSlot() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Q_ASSERT(freeSlots_.size() > numReserved_);
+        return TakeFreeSlot();
+    }
+
+    //
+    // Adds a handle to a slot the caller owns by index. Returns an empty handle if the slot is owned by
+    // nobody else yet and no free slot is left to reserve for it.
+    //
+    PoolHandle<T> Share(size_t slot) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (refs_[slot] == 1 && !reserved_[slot]) {
+            if (freeSlots_.size() <= numReserved_) {
+                failed_++;
+                return PoolHandle<T>();
+            }
+            reserved_[slot] = true;
+            numReserved_++;
+        }
+        refs_[slot]++;
+        return PoolHandle<T>(this, slot);
+    }
+
+    //
+    // Gives up the caller's reference of slot and returns a slot to write into: the same one if nobody
+    // else holds it, otherwise the free slot that was reserved when it was shared.
+    //
+    size_t Recycle(size_t slot) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (refs_[slot] == 1) { return slot; }
+
+        ClearReservation(slot);
+        refs_[slot]--;
+        return TakeFreeSlot();
+    }
+
+    void AddRef(size_t slot) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refs_[slot]++;
+    }
+
+    void Release(size_t slot) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        Q_ASSERT(refs_[slot] > 0);
+        refs_[slot]--;
+        if (refs_[slot] == 0) {
+            // Nobody can reach the slot until it is free again. What it keeps alive may be a slot of another
+            // pool, so it is let go of without holding the lock.
+            lock.unlock();
+            ReturnToPool(&slots_[slot]);
+            lock.lock();
+
+            freeSlots_.push_back(slot);
+        } else if (refs_[slot] == 1) {
+            // Only the owner by index is left, its spare is not needed anymore
+            ClearReservation(slot);
+        }
+    }
+
+    T* Slot(size_t slot) { return &slots_[slot]; }
+
+    BufferPoolCounters Counters() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        BufferPoolCounters result;
+        result.capacity = capacity_;
+        result.inUse    = capacity_ - freeSlots_.size();
+        result.maxInUse = maxInUse_;
+        result.acquired = acquired_;
+        result.failed   = failed_;
+        return result;
+    }
+
+private:
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+
+    // Caller holds the mutex and made sure there is a free slot
+    size_t TakeFreeSlot() {
+        size_t slot = freeSlots_.back();
+        freeSlots_.pop_back();
+        refs_[slot] = 1;
+
+        acquired_++;
+        size_t inUse = capacity_ - freeSlots_.size();
+        if (inUse > maxInUse_) { maxInUse_ = inUse; }
+        return slot;
+    }
+
+    void ClearReservation(size_t slot) {
+        if (reserved_[slot]) {
+            reserved_[slot] = false;
+            numReserved_--;
+        }
+    }
+
+    mutable std::mutex mutex_;
+
+    T* slots_;
+    std::vector<int> refs_;
+    std::vector<bool> reserved_;
+    std::vector<size_t> freeSlots_;
+
+    size_t capacity_;
+    size_t numReserved_;
+    size_t maxInUse_;
+    uint64_t acquired_;
+    uint64_t failed_;
+};
+
+typedef PoolHandle<FrameBuffer>      FrameHandle;
+typedef PoolHandle<PointCloudBuffer> PointCloudHandle;
+
+// Passed to the slots of listeners, see SnapshotQueue::Submit()
+Q_DECLARE_METATYPE(PointCloudHandle)
+
+struct FrameExchangeCounters {
+    uint64_t published;
+    uint64_t acquired;
+
+    // Published frames that were replaced by a newer one before the consumer acquired them
+    uint64_t dropped;
+
+    // Time from publishing a frame to acquiring it
+    int64_t lastLatencyUs;
+    int64_t maxLatencyUs;
+    int64_t averageLatencyUs;
+};
+
+/**
+ * @brief The FrameExchange class hands frames from one producer (the capture thread) to one consumer
+ * (the UI thread) without locks.
+ *
+ * It is a triple buffer: the producer always writes into its back buffer and publishes it when the frame
+ * is complete, which swaps it with the middle buffer. The consumer swaps its front buffer with the middle
+ * buffer when a new frame was published since its last acquire. Neither side ever waits for the other,
+ * the consumer always gets the newest complete frame and frames it did not pick up in time are dropped.
+ *
+ * The three frames are slots of a BufferPool. The consumer can pin its front frame (PinCurrent()) to hand it
+ * to a job without copying it. A pinned frame is not written again: when it comes back to the producer,
+ * the producer continues with a free slot of the pool instead.
+ */
+class FrameExchange {
+public:
+    FrameExchange(size_t poolSize = FRAME_POOL_SIZE)
+        : pool_(poolSize),
+          published_(0),
+          acquired_(0),
+          dropped_(0),
+          lastLatencyUs_(0),
+          maxLatencyUs_(0),
+          totalLatencyUs_(0)
+    {
+        back_   = pool_.AcquireSlot();
+        middle_ = (int)pool_.AcquireSlot();
+        front_  = pool_.AcquireSlot();
+    }
+
+    //
+    // Producer: the buffer to write the next frame into
+    //
+    FrameBuffer* BackBuffer() { return pool_.Slot(back_); }
+
+    //
+    // Producer: makes the back buffer the newest frame and continues with another buffer
+    //
+    void Publish() {
+        FrameBuffer* frame = pool_.Slot(back_);
+        frame->frameNumber = published_.load(std::memory_order_relaxed) + 1;
+        frame->publishTimeNs = NowNs();
+
+        int previous = middle_.exchange((int)back_ | FRESH_FRAME, std::memory_order_acq_rel);
+        if (previous & FRESH_FRAME) { dropped_++; }
+
+        // A frame the consumer pinned is handed over to the pool and replaced by a free one
+        back_ = pool_.Recycle(previous & FRAME_INDEX_MASK);
+        published_++;
+    }
+
+    //
+    // Consumer: returns the newest published frame, nullptr if nothing was published since the last call.
+    // The frame stays untouched by the producer until the next call.
+    //
+    FrameBuffer* AcquireLatest() {
+        if (!(middle_.load(std::memory_order_acquire) & FRESH_FRAME)) { return nullptr; }
+
+        int previous = middle_.exchange((int)front_, std::memory_order_acq_rel);
+        front_ = previous & FRAME_INDEX_MASK;
+
+        FrameBuffer* frame = pool_.Slot(front_);
+        int64_t latencyUs = (NowNs() - frame->publishTimeNs) / 1000;
+        lastLatencyUs_ = latencyUs;
+        if (latencyUs > maxLatencyUs_) { maxLatencyUs_ = latencyUs; }
+        totalLatencyUs_ += latencyUs;
+        acquired_++;
+
+        return frame;
+    }
+
+    //
+    // Consumer: the frame returned by the last successful AcquireLatest(), never nullptr.
+    // Before the first frame arrived this is an empty frame.
+    //
+    FrameBuffer* Current() { return pool_.Slot(front_); }
+
+    //
+    // Consumer: a handle to Current() that keeps the frame alive and unchanged after the consumer moved on.
+    // Empty if the pool has no slot left to replace the frame with.
+    //
+    FrameHandle PinCurrent() { return pool_.Share(front_); }
+
+    BufferPoolCounters PoolCounters() const { return pool_.Counters(); }
+
+    FrameExchangeCounters Counters() const {
+        FrameExchangeCounters result;
+        result.published        = published_.load();
+        result.acquired         = acquired_.load();
+        result.dropped          = dropped_.load();
+        result.lastLatencyUs    = lastLatencyUs_.load();
+        result.maxLatencyUs     = maxLatencyUs_.load();
+        result.averageLatencyUs = result.acquired > 0 ? totalLatencyUs_.load() / (int64_t)result.acquired : 0;
+        return result;
+    }
+
+private:
+    FrameExchange(const FrameExchange&);
+    FrameExchange& operator=(const FrameExchange&);
+
+    static int64_t NowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static const int FRAME_INDEX_MASK = 0xFF;
+    static const int FRESH_FRAME      = 0x100;
+
+    BufferPool<FrameBuffer> pool_;
+
+    size_t back_;               // Only touched by the producer
+    size_t front_;              // Only touched by the consumer
+    std::atomic<int> middle_;   // Slot of the middle buffer, FRESH_FRAME if it was not acquired yet
+
+    std::atomic<uint64_t> published_;
+    std::atomic<uint64_t> acquired_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<int64_t>  lastLatencyUs_;
+    std::atomic<int64_t>  maxLatencyUs_;
+    std::atomic<int64_t>  totalLatencyUs_;
+};
+
 struct MemoryPool {
-    FrameBuffer gatherBuffer;
-    FrameBuffer snapshotBuffer;
+    // Frames from the grabbers, see FrameExchange
+    FrameExchange gatherFrames;
 
-    PointCloudBuffer inspectionBuffer;
-    PointCloudBuffer filterBuffer;
+    // Filtered, inspected and loaded point clouds. Snapshot and filter jobs pin their frame from gatherFrames.
+    BufferPool<PointCloudBuffer> pointClouds;
 
-    // FrameBuffer displayBuffer;
-    // FrameBuffer inspectionBuffer;
+    MemoryPool()
+        : pointClouds(POINTCLOUD_POOL_SIZE)
+    { }
 };
 
 #if 0
@@ -4,7 +4,7 @@
 
 #include <QDebug>
 
-#include "KinectGrabber.h"
+#include "TaskScheduler.h"
 
 OpenCVWebcamGrabber::OpenCVWebcamGrabber(MemoryPool* memory,
                                          LandmarkDetector::CLNF* faceTrackingModel,
@@ -14,7 +14,8 @@ OpenCVWebcamGrabber::OpenCVWebcamGrabber(MemoryPool* memory,
       faceTrackingParameters_(faceTrackingParameters)
 {
     doFaceTracking = true;
-    StartStream();
+    stopRequested = false;
+    frameGrabberThreadHandle = NULL;
 }
 
 static INT32 OpenCVFrameGrabberThread(void* params) {
@@ -31,28 +32,28 @@ void OpenCVWebcamGrabber::StartFrameGrabbingLoop() {
         return;
     }
 
-    while (true) {
+    while (!stopRequested) {
         cv::Mat frame;
         cap >> frame;
 
         cv::cvtColor(frame, frame, CV_BGR2RGBA);
         cv::resize(frame, frame, cv::Size(COLOR_WIDTH, COLOR_HEIGHT));
 
-        memcpy(memory_->gatherBuffer.colorBuffer, frame.data, COLOR_BUFFER_SIZE);
+        FrameBuffer* frameBuffer = memory_->gatherFrames.BackBuffer();
+        memcpy(frameBuffer->colorBuffer, frame.data, COLOR_BUFFER_SIZE);
 
-        QThread* faceTrackingThread = nullptr;
-        if (doFaceTracking) {
-            faceTrackingThread = new FaceTrackingThread(memory_->gatherBuffer.colorBuffer,
-                                                        faceTrackingModel_,
-                                                        faceTrackingParameters_);
-            faceTrackingThread->start();
-        }
+        bool track = doFaceTracking;
+        bool useRoi = FaceTrackingRoi();
+        std::future<void> faceTracking = theTaskScheduler.Submit(PRIORITY_FACE_TRACKING, [=]() {
+            ScaleColorFrame(frameBuffer->colorBuffer, frameBuffer);
+            if (track) {
+                TrackFace(frameBuffer, faceTrackingModel_, faceTrackingParameters_, useRoi);
+            }
+        });
 
-        if (doFaceTracking) {
-            faceTrackingThread->wait();
-            faceTrackingThread->deleteLater();
-        }
+        faceTracking.wait();
 
+        memory_->gatherFrames.Publish();
         emit FrameReady();
     }
 
@@ -71,3 +72,14 @@ void OpenCVWebcamGrabber::StartStream()
                          &frameGrabberThreadID);                            // Thread ID
 
 }
+
+void OpenCVWebcamGrabber::Stop()
+{
+    if (frameGrabberThreadHandle == NULL) { return; }
+
+    stopRequested = true;
+    WaitForSingleObject(frameGrabberThreadHandle, INFINITE);
+    CloseHandle(frameGrabberThreadHandle);
+    frameGrabberThreadHandle = NULL;
+    stopRequested = false;
+}
@@ -1,14 +1,16 @@
 #ifndef OPENCV_WEBCAM_GRABBER_H
 #define OPENCV_WEBCAM_GRABBER_H
 
-#include <QObject>
+#include <atomic>
+
+#include "FrameSource.h"
 #include "MemoryPool.h"
 
 #include <LandmarkCoreIncludes.h>
 
 #include "windows.h"
 
-class OpenCVWebcamGrabber : public QObject
+class OpenCVWebcamGrabber : public FrameSource
 {
     Q_OBJECT
 public:
@@ -19,10 +21,10 @@ public:
 
     void StartFrameGrabbingLoop();
 
-    void ToggleFaceTracking() { doFaceTracking = !doFaceTracking; }
+    virtual void Start() override { StartStream(); }
+    virtual void Stop() override;
 
-signals:
-    void FrameReady();
+    virtual void ToggleFaceTracking() override { doFaceTracking = !doFaceTracking; }
 
 private:
     void StartStream();
@@ -32,6 +34,7 @@ private:
     bool doFaceTracking;
 
     // Threading variables
+    std::atomic<bool> stopRequested;
     // WAITABLE_HANDLE frameHandle;
     DWORD  frameGrabberThreadID;
     HANDLE frameGrabberThreadHandle;
@@ -1,9 +1,14 @@
 #include "PointCloud.h"
 
+#include <cfloat>
+#include <cmath>
+#include <charconv>
+#include <cstring>
 #include <iomanip>
+#include <limits>
 
 #include <QtMath>
-#include <QThread>
+#include <QMetaObject>
 #include <QElapsedTimer>
 #include <QDebug>
 #include <QDir>
@@ -13,81 +18,348 @@
 
 #include "util.h"
 #include "MemoryPool.h"
-#include "ScanSession.h"
+#include "PointCloudCompression.h"
+#include "SnapshotImages.h"
+#include "SnapshotThumbnails.h"
+#include "TaskScheduler.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define POINT_CLOUD_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 int PointCloudHelpers::theSnapshotCount = 0;
 
-void PointCloudHelpers::CreateAndStartNormalWorker(PointCloudBuffer* src, QObject* listener) {
-    QThread* thread = new QThread;
+//
+// Spatial index cache
+//
 
-    ComputeNormalWorker* worker = new ComputeNormalWorker(src);
-    worker->moveToThread(thread);
+static std::atomic<uint64_t> theSpatialIndexBuilds(0);
+static std::atomic<uint64_t> theSpatialIndexReuses(0);
+static thread_local PointCloudHelpers::SpatialIndexCounters theThreadSpatialIndexCounters = { 0, 0 };
 
-    // Setup Signal connection
+static void CountSpatialIndexBuild() {
+    theSpatialIndexBuilds++;
+    theThreadSpatialIndexCounters.builds++;
+}
 
-    // connect(worker, SIGNAL(error(QString)), this, SLOT(errorString(QString)));
-    QObject::connect(thread, SIGNAL(started()), worker, SLOT(ComputeNormals()));
-    QObject::connect(worker, SIGNAL(finished()), thread, SLOT(quit()));
-    QObject::connect(worker, SIGNAL(finished()), worker, SLOT(deleteLater()));
-    QObject::connect(worker, SIGNAL(finished()), listener, SLOT(OnNormalsComputed()));
-    QObject::connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+static void CountSpatialIndexReuse() {
+    theSpatialIndexReuses++;
+    theThreadSpatialIndexCounters.reuses++;
+}
+
+PointCloudHelpers::SpatialIndex::SpatialIndex(const PointCloudBuffer& cloud)
+    : points(cloud.points, cloud.points + cloud.numPoints),
+      generation(cloud.generation.load()),
+      tree(3, *this, nanoflann::KDTreeSingleIndexAdaptorParams())
+{
+    tree.buildIndex();
+}
 
-    // Start Work
-    thread->start();
+static bool IsUpToDate(const PointCloudHelpers::SpatialIndex* index, const PointCloudBuffer* cloud) {
+    return index != nullptr &&
+           index->generation    == cloud->generation.load() &&
+           index->points.size() == cloud->numPoints;
 }
 
-void PointCloudHelpers::CreateAndStartFilterWorker(PointCloudBuffer *src, PointCloudBuffer *dst, QObject *listener, size_t numNeighbors, float stddevMultiplier)
+std::shared_ptr<const PointCloudHelpers::SpatialIndex> PointCloudHelpers::GetSpatialIndex(PointCloudBuffer* cloud)
 {
+    std::lock_guard<std::mutex> lock(cloud->spatialIndexMutex);
 
-    QThread* thread = new QThread();
-    FilterPointcloudWorker* worker = new FilterPointcloudWorker(src, dst, numNeighbors, stddevMultiplier);
-    worker->moveToThread(thread);
+    if (IsUpToDate(cloud->spatialIndex.get(), cloud)) {
+        CountSpatialIndexReuse();
+    } else {
+        cloud->spatialIndex = std::make_shared<SpatialIndex>(*cloud);
+        CountSpatialIndexBuild();
+    }
 
-    // connect(worker, SIGNAL(error(QString)), this, SLOT(errorString(QString)));
-    QObject::connect(thread, SIGNAL(started()), worker, SLOT(FilterPointcloud()));
-    QObject::connect(worker, SIGNAL(finished()), thread, SLOT(quit()));
-    QObject::connect(worker, SIGNAL(finished()), worker, SLOT(deleteLater()));
-    QObject::connect(worker, SIGNAL(finished()), listener, SLOT(OnPointcloudFiltered()));
-    QObject::connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+    return cloud->spatialIndex;
+}
 
-    thread->start();
+PointCloudHelpers::SpatialIndexCounters PointCloudHelpers::GlobalSpatialIndexCounters()
+{
+    SpatialIndexCounters result = { theSpatialIndexBuilds.load(), theSpatialIndexReuses.load() };
+    return result;
 }
 
-void PointCloudHelpers::CreateAndStartSaveSnapshotWorker(FrameBuffer *src, QObject* listener)
+PointCloudHelpers::SpatialIndexCounters PointCloudHelpers::ThreadSpatialIndexCounters()
 {
-    QString snapshotPath = theScanSession.getCurrentScanSession();
-    bool couldCreateSnapshotDirectory = QDir().mkpath(snapshotPath);
-    if (!couldCreateSnapshotDirectory) {
-        qCritical() << "Could not create snapshot directory at " << snapshotPath;
-        return;
+    return theThreadSpatialIndexCounters;
+}
+
+std::future<void> PointCloudHelpers::CreateAndStartNormalWorker(PointCloudHandle src, QObject* listener, NeighborSearchMethod neighborSearch) {
+    // The handles are released as soon as the work is done, the future may keep the task around for longer
+    return theTaskScheduler.Submit(PRIORITY_PROCESSING, [=]() mutable {
+        ComputeNormalsWith(neighborSearch, src.Get());
+        src.Reset();
+        QMetaObject::invokeMethod(listener, "OnNormalsComputed", Qt::QueuedConnection);
+    });
+}
+
+std::future<void> PointCloudHelpers::CreateAndStartFilterWorker(FrameHandle src, PointCloudHandle dst, QObject *listener, size_t numNeighbors, float stddevMultiplier,
+                                                                int numThreads, NeighborSearchMethod neighborSearch)
+{
+    return theTaskScheduler.Submit(PRIORITY_PROCESSING, [=]() mutable {
+        FilterWith(neighborSearch, src->pointCloudBuffer, dst.Get(), numNeighbors, stddevMultiplier, numThreads);
+        src.Reset();
+        dst.Reset();
+        QMetaObject::invokeMethod(listener, "OnPointcloudFiltered", Qt::QueuedConnection);
+    });
+}
+
+//
+// Point cloud extraction
+//
+
+static inline bool IsValidPoint(Vec3f p, uint8_t bodyIndex, float cutoffHeight) {
+    bool pointBelongsToTrackedBody = (bodyIndex <= 5);
+
+    bool isInvalidMapping = std::isinf(p.X) || std::isnan(p.X) ||
+                            std::isinf(p.Y) || std::isnan(p.Y) ||
+                            std::isinf(p.Z) || std::isnan(p.Z);
+
+    return pointBelongsToTrackedBody && !isInvalidMapping && p.Y >= cutoffHeight;
+}
+
+//
+// Writes the point of a depth pixel to the end of the point cloud, with the color the pixel maps to.
+// Pixels that map outside the color image get a gray value.
+//
+static inline void AppendPoint(const uint32_t* colorBuffer, const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                               int depthPixel, PointCloudBuffer* dst, size_t numPoints, ColorPointRaster* colorPointRaster) {
+    dst->points[numPoints] = depthToCamera[depthPixel];
+
+    // Remember where the point came from for neighbor searches on the depth grid
+    dst->depthPixelIndices[numPoints] = depthPixel;
+
+    // Round floating point indices to int
+    Vec2f c = depthToColor[depthPixel];
+    int colorIndexCol = (int)(c.X + 0.5f);
+    int colorIndexRow = (int)(c.Y + 0.5f);
+
+    int colorIndex = LINEAR_INDEX(colorIndexRow, colorIndexCol, COLOR_WIDTH);
+    bool colorIndexValid = (colorIndex >= 0) && (colorIndex < NUM_COLOR_PIXELS);
+
+    // Always read a pixel and select the result, instead of branching on the mapping
+    const uint8_t* rgbx = (const uint8_t*)(colorBuffer + (colorIndexValid ? colorIndex : 0));
+    RGB3f color = {rgbx[0] / 255.0f,
+                   rgbx[1] / 255.0f,
+                   rgbx[2] / 255.0f};
+    RGB3f gray  = {0.5f, 0.5f, 0.5f};
+
+    dst->colors[numPoints] = colorIndexValid ? color : gray;
+
+    // The point closest to the camera is the one seen in the color image
+    if (colorPointRaster != nullptr &&
+        colorIndexCol >= 0 && colorIndexCol < COLOR_WIDTH &&
+        colorIndexRow >= 0 && colorIndexRow < COLOR_HEIGHT) {
+
+        int cell = LINEAR_INDEX(colorIndexRow / COLOR_RASTER_CELL_SIZE, colorIndexCol / COLOR_RASTER_CELL_SIZE, COLOR_RASTER_WIDTH);
+        int32_t& seen = colorPointRaster->pointIndices[cell];
+        if (seen < 0 || dst->points[numPoints].Z < dst->points[seen].Z) {
+            seen = (int32_t)numPoints;
+        }
     }
+}
 
-    QThread* thread = new QThread();
-    SaveSnapshotWorker* worker = new SaveSnapshotWorker(src, snapshotPath);
-    worker->moveToThread(thread);
+#ifdef POINT_CLOUD_SSE2
+static inline int LowestSetBit(int mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, (unsigned long)mask);
+    return (int)index;
+#else
+    return __builtin_ctz((unsigned int)mask);
+#endif
+}
+
+//
+// Bit i is set if depth pixel i of the four starting at points is a valid point, see IsValidPoint()
+//
+static inline int ValidPointMask(const Vec3f* points, const uint8_t* bodyIndex, __m128 cutoffHeight) {
+    // Four points are 12 floats: x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+    const float* coordinates = (const float*)points;
+    __m128 a = _mm_loadu_ps(coordinates + 0);
+    __m128 b = _mm_loadu_ps(coordinates + 4);
+    __m128 c = _mm_loadu_ps(coordinates + 8);
+
+    // v - v is 0 for finite values and NaN for infinity and NaN
+    const __m128 zero = _mm_setzero_ps();
+    int finite = _mm_movemask_ps(_mm_cmpeq_ps(_mm_sub_ps(a, a), zero))      |
+                 _mm_movemask_ps(_mm_cmpeq_ps(_mm_sub_ps(b, b), zero)) << 4 |
+                 _mm_movemask_ps(_mm_cmpeq_ps(_mm_sub_ps(c, c), zero)) << 8;
+
+    int aboveCutoff = _mm_movemask_ps(_mm_cmpge_ps(a, cutoffHeight))      |
+                      _mm_movemask_ps(_mm_cmpge_ps(b, cutoffHeight)) << 4 |
+                      _mm_movemask_ps(_mm_cmpge_ps(c, cutoffHeight)) << 8;
+
+    // Bit 3 * i: all coordinates of point i are finite and its Y coordinate is above the cutoff
+    int valid = finite & (finite >> 1) & (finite >> 2) & (aboveCutoff >> 1);
+    int mask  = (valid & 1) | ((valid >> 2) & 2) | ((valid >> 4) & 4) | ((valid >> 6) & 8);
+
+    // Tracked bodies have an index of 0 to 5
+    int32_t indices;
+    memcpy(&indices, bodyIndex, sizeof(indices));
+    __m128i body = _mm_cvtsi32_si128(indices);
+    __m128i isTrackedBody = _mm_cmpeq_epi8(_mm_min_epu8(body, _mm_set1_epi8(5)), body);
+
+    return mask & _mm_movemask_epi8(isTrackedBody) & 0xF;
+}
+#endif
 
-    // connect(worker, SIGNAL(error(QString)), this, SLOT(errorString(QString)));
-    QObject::connect(thread, SIGNAL(started()), worker, SLOT(SaveSnapshot()));
-    QObject::connect(worker, SIGNAL(finished()), thread, SLOT(quit()));
-    QObject::connect(worker, SIGNAL(finished()), worker, SLOT(deleteLater()));
-    QObject::connect(worker, SIGNAL(newMetaFile(QString)), listener, SLOT(OnSnapshotSaved(QString)));
-    QObject::connect(thread, SIGNAL(finished()), thread, SLOT(deleteLater()));
+void PointCloudHelpers::CreatePointCloud(const uint32_t* colorBuffer, const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                                         const uint8_t* bodyIndex, float cutoffHeight, PointCloudBuffer* dst,
+                                         ColorPointRaster* colorPointRaster)
+{
+    dst->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
 
-    thread->start();
+    size_t numPoints = 0;
+    int depthPixel = 0;
+
+    if (colorPointRaster != nullptr) {
+        colorPointRaster->Clear();
+    }
+
+#ifdef POINT_CLOUD_SSE2
+    // Mask of eight pixels at a time, most of the frame is background and skipped with a single test
+    const __m128 cutoff = _mm_set1_ps(cutoffHeight);
+
+    for (; depthPixel + 8 <= NUM_DEPTH_PIXELS; depthPixel += 8) {
+        int mask = ValidPointMask(depthToCamera + depthPixel,     bodyIndex + depthPixel,     cutoff) |
+                   ValidPointMask(depthToCamera + depthPixel + 4, bodyIndex + depthPixel + 4, cutoff) << 4;
+
+        // Compact the valid pixels of the mask into the point cloud
+        while (mask != 0) {
+            int i = LowestSetBit(mask);
+            mask &= mask - 1;
+
+            AppendPoint(colorBuffer, depthToCamera, depthToColor, depthPixel + i, dst, numPoints++, colorPointRaster);
+        }
+    }
+#endif
+
+    for (; depthPixel < NUM_DEPTH_PIXELS; ++depthPixel) {
+        if (IsValidPoint(depthToCamera[depthPixel], bodyIndex[depthPixel], cutoffHeight)) {
+            AppendPoint(colorBuffer, depthToCamera, depthToColor, depthPixel, dst, numPoints++, colorPointRaster);
+        }
+    }
+
+    dst->numPoints = numPoints;
+    dst->isOrganized = true;
+    dst->MarkPointsModified();
 }
 
-void PointCloudHelpers::Filter(PointCloudBuffer *src, PointCloudBuffer *dst, size_t numNeighbors, float stddevMultiplier)
+int32_t PointCloudHelpers::FindPointAtColorPixel(const ColorPointRaster* colorPointRaster, Vec2f colorPixel)
 {
-    QElapsedTimer timer;
-    timer.start();
+    // Also rejects infinity and NaN
+    if (!(colorPixel.X >= 0.0f && colorPixel.X < COLOR_WIDTH && colorPixel.Y >= 0.0f && colorPixel.Y < COLOR_HEIGHT)) {
+        return -1;
+    }
+
+    int cellCol = (int)colorPixel.X / COLOR_RASTER_CELL_SIZE;
+    int cellRow = (int)colorPixel.Y / COLOR_RASTER_CELL_SIZE;
+
+    int32_t result = colorPointRaster->pointIndices[LINEAR_INDEX(cellRow, cellCol, COLOR_RASTER_WIDTH)];
+    if (result >= 0) { return result; }
+
+    // Closest cell center of the 3x3 neighborhood
+    float nearestSquaredDistance = FLT_MAX;
+    for (int row = std::max(cellRow - 1, 0); row <= std::min(cellRow + 1, COLOR_RASTER_HEIGHT - 1); ++row) {
+        for (int col = std::max(cellCol - 1, 0); col <= std::min(cellCol + 1, COLOR_RASTER_WIDTH - 1); ++col) {
+            int32_t point = colorPointRaster->pointIndices[LINEAR_INDEX(row, col, COLOR_RASTER_WIDTH)];
+            if (point < 0) { continue; }
+
+            float dx = (col + 0.5f) * COLOR_RASTER_CELL_SIZE - colorPixel.X;
+            float dy = (row + 0.5f) * COLOR_RASTER_CELL_SIZE - colorPixel.Y;
+            float squaredDistance = dx * dx + dy * dy;
+            if (squaredDistance < nearestSquaredDistance) {
+                nearestSquaredDistance = squaredDistance;
+                result = point;
+            }
+        }
+    }
+
+    return result;
+}
+
+void PointCloudHelpers::CreatePointCloudScalar(const uint32_t* colorBuffer, const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                                               const uint8_t* bodyIndex, float cutoffHeight, PointCloudBuffer* dst)
+{
+    dst->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
+
+    Vec3f* pointCloudPoints   = dst->points;
+    RGB3f* pointCloudColors   = dst->colors;
+    int32_t* pointCloudPixels = dst->depthPixelIndices;
+    size_t numPoints = 0;
+
+    for (int depthPixel = 0; depthPixel < NUM_DEPTH_PIXELS; ++depthPixel) {
+        Vec3f p = depthToCamera[depthPixel];
+
+        bool pointBelongsToTrackedBody = (bodyIndex[depthPixel] <= 5);
+
+        bool isInvalidMapping = std::isinf(p.X) || std::isnan(p.X) ||
+                                std::isinf(p.Y) || std::isnan(p.Y) ||
+                                std::isinf(p.Z) || std::isnan(p.Z);
+
+        if (!pointBelongsToTrackedBody || isInvalidMapping || p.Y < cutoffHeight) {
+            continue;
+        }
+
+        pointCloudPoints[numPoints] = p;
+
+        // Remember where the point came from for neighbor searches on the depth grid
+        pointCloudPixels[numPoints] = depthPixel;
+
+        // Round floating point indices to int
+        Vec2f c = depthToColor[depthPixel];
+        int colorIndexCol = (int)(c.X + 0.5f);
+        int colorIndexRow = (int)(c.Y + 0.5f);
+
+        int colorIndex = LINEAR_INDEX(colorIndexRow, colorIndexCol, COLOR_WIDTH);
+        bool colorIndexInvalid = (colorIndex < 0) || (colorIndex >= NUM_COLOR_PIXELS);
+
+        // If color mapping is invalid, we just write a gray value
+        if (!colorIndexInvalid) {
+            const uint8_t* rgbx = (const uint8_t*)(colorBuffer + colorIndex);
+            pointCloudColors[numPoints] = {rgbx[0] / 255.0f,
+                                           rgbx[1] / 255.0f,
+                                           rgbx[2] / 255.0f};
+        } else {
+            pointCloudColors[numPoints] = {0.5f, 0.5f, 0.5f};
+        }
+
+        numPoints++;
+    }
+
+    dst->numPoints = numPoints;
+    dst->isOrganized = true;
+    dst->MarkPointsModified();
+}
+
+//
+// Statistical outlier filter shared by the KD-tree and the depth grid version. Neighbors are looked up
+// with findNeighbors(pointIndex, k, indices, squaredDistances) which returns the number of neighbors found.
+//
+template<typename NeighborSearch>
+static void FilterWithNeighborSearch(PointCloudBuffer *src, PointCloudBuffer *dst, size_t numNeighbors,
+                                     float stddevMultiplier, int numThreads, const NeighborSearch& findNeighbors)
+{
+    dst->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
+
     // Temporary memory, deleted at the end of the function
     float* distances = new float[src->numPoints];
 
     Vec3f* points = src->points;
     RGB3f* colors = src->colors;
+    int32_t* pixels = src->depthPixelIndices;
 
     Vec3f* dst_points = dst->points;
     RGB3f* dst_colors = dst->colors;
+    int32_t* dst_pixels = dst->depthPixelIndices;
 
     // TODO:
     // HACK to not filter out landmarks!!
@@ -97,63 +369,68 @@ void PointCloudHelpers::Filter(PointCloudBuffer *src, PointCloudBuffer *dst, siz
         size_t pointIndex = src->landmarkIndices[i];
         dst_points[numPointsInFilteredPointcloud] = points[pointIndex];
         dst_colors[numPointsInFilteredPointcloud] = colors[pointIndex];
+        dst_pixels[numPointsInFilteredPointcloud] = pixels[pointIndex];
 
         dst->landmarkIndices[i] = i;
 
         numPointsInFilteredPointcloud++;
     }
     dst->numLandmarks = src->numLandmarks;
+    dst->isOrganized  = src->isOrganized;
 
     // TODO:
     // MAKE THIS CLEARER
 
-
-
-    PointCloudHelpers::KDTree tree(3, *src, nanoflann::KDTreeSingleIndexAdaptorParams());
-    tree.buildIndex();
-
-    // Compute mean distance to k nearest neighbors for all points
-
-    size_t numResults = numNeighbors;
-    std::vector<size_t> indices(numResults);
-    std::vector<float>  squaredDistances(numResults);
+    // Compute mean distance to k nearest neighbors for all points.
+    // Every point is independent, so the points are split into chunks that are processed in parallel.
 
     size_t numPoints = src->numPoints;
-    for (size_t pointIndex = 0; pointIndex < numPoints; pointIndex++) {
+    ParallelFor(numPoints, numThreads, [&](size_t begin, size_t end, size_t) {
+        std::vector<size_t> indices(numNeighbors);
+        std::vector<float>  squaredDistances(numNeighbors);
 
-        numResults = numNeighbors;
+        for (size_t pointIndex = begin; pointIndex < end; pointIndex++) {
 
-        float distance = 0.0f;
+            float distance = 0.0f;
 
-        float* queryPoint = &(points[pointIndex].X);
-
-        tree.knnSearch(queryPoint, numResults, &indices[0], &squaredDistances[0]);
+            size_t numResults = findNeighbors(pointIndex, numNeighbors, &indices[0], &squaredDistances[0]);
 
-        for (size_t neighbor = 0; neighbor < numResults; ++neighbor) {
+            for (size_t neighbor = 0; neighbor < numResults; ++neighbor) {
 
-            // TODO: check if squared distances are also ok!
+                // TODO: check if squared distances are also ok!
 
-            distance += sqrt(squaredDistances[neighbor]);
-        }
+                distance += sqrt(squaredDistances[neighbor]);
+            }
 
-        distance /= numResults;
+            // The point finds itself, without any other neighbor it is isolated, i.e. an outlier. This only
+            // happens with the depth grid, the KD-tree always finds the nearest other points.
+            if (numResults < 2) {
+                distances[pointIndex] = std::numeric_limits<float>::infinity();
+                continue;
+            }
 
-        distances[pointIndex] = distance;
-    }
+            distances[pointIndex] = distance / numResults;
+        }
+    });
 
-    // Compute mean and stddev of all average distances
+    // Compute mean and stddev of all average distances.
+    // This stays serial: the running update depends on the summation order and the
+    // result has to be identical for every thread count.
 
+    // Isolated points are removed anyway and stay out of the statistics.
     float mean = 0.0f, stddev = 0.0f;
+    size_t numMeasured = 0;
     for (size_t pointIndex = 0; pointIndex < numPoints; pointIndex++) {
-        float n = (float)pointIndex + 1.0f;
-
         float dist = distances[pointIndex];
+        if (std::isinf(dist)) { continue; }
+
+        float n = (float)++numMeasured;
 
         float previousMean = mean;
         mean   += (dist - mean) / n;
         stddev += (dist - mean) * (dist - previousMean);
     }
-    stddev = sqrt(stddev / (float)numPoints);
+    stddev = numMeasured > 0 ? sqrt(stddev / (float)numMeasured) : 0.0f;
 
 
     // TODO:
@@ -169,26 +446,143 @@ void PointCloudHelpers::Filter(PointCloudBuffer *src, PointCloudBuffer *dst, siz
     // TODO:
 
 
-    // "Remove" points that are further than stddev_multitplier stddevs away from the mean
-    for (size_t pointIndex = 0; pointIndex < numPoints; pointIndex++) {
-        if (distances[pointIndex] < mean + stddevMultiplier * stddev) {
-            dst_points[numPointsInFilteredPointcloud] = points[pointIndex];
-            dst_colors[numPointsInFilteredPointcloud] = colors[pointIndex];
+    // "Remove" points that are further than stddev_multitplier stddevs away from the mean.
+    //
+    // Compaction runs in two parallel passes over the same chunks: the first counts the surviving
+    // points per chunk, the second writes them to their final position. The prefix sum of the
+    // counts gives each chunk its write offset, so the output order matches the serial order.
+    float threshold = mean + stddevMultiplier * stddev;
+
+    size_t numChunks = ParallelChunkCount(numPoints, numThreads);
+    std::vector<size_t> chunkOffsets(numChunks + 1, 0);
 
-            numPointsInFilteredPointcloud++;
+    ParallelFor(numPoints, numThreads, [&](size_t begin, size_t end, size_t chunk) {
+        size_t count = 0;
+        for (size_t pointIndex = begin; pointIndex < end; pointIndex++) {
+            if (distances[pointIndex] < threshold) { count++; }
         }
+        chunkOffsets[chunk + 1] = count;
+    });
+
+    chunkOffsets[0] = numPointsInFilteredPointcloud;
+    for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+        chunkOffsets[chunk + 1] += chunkOffsets[chunk];
     }
 
+    ParallelFor(numPoints, numThreads, [&](size_t begin, size_t end, size_t chunk) {
+        size_t writeIndex = chunkOffsets[chunk];
+        for (size_t pointIndex = begin; pointIndex < end; pointIndex++) {
+            if (distances[pointIndex] < threshold) {
+                dst_points[writeIndex] = points[pointIndex];
+                dst_colors[writeIndex] = colors[pointIndex];
+                dst_pixels[writeIndex] = pixels[pointIndex];
+
+                writeIndex++;
+            }
+        }
+    });
+
+    numPointsInFilteredPointcloud = chunkOffsets[numChunks];
+
     dst->numPoints = numPointsInFilteredPointcloud;
 
+    dst->MarkPointsModified();
+
     delete [] distances;
-    qInfo() << "Pointcloud filtered in " << timer.elapsed() << "ms";
 }
 
-void PointCloudHelpers::ComputeNormals(PointCloudBuffer* src)
+void PointCloudHelpers::Filter(PointCloudBuffer *src, PointCloudBuffer *dst, size_t numNeighbors, float stddevMultiplier, int numThreads)
 {
-    KDTree tree(3, *src, nanoflann::KDTreeSingleIndexAdaptorParams());
-    tree.buildIndex();
+    QElapsedTimer timer;
+    timer.start();
+
+    std::shared_ptr<const SpatialIndex> index = GetSpatialIndex(src);
+    const SpatialIndex::Tree& tree = index->tree;
+
+    Vec3f* points = src->points;
+    auto findNeighbors = [&](size_t pointIndex, size_t k, size_t* indices, float* squaredDistances) {
+        return tree.knnSearch(&(points[pointIndex].X), k, indices, squaredDistances);
+    };
+
+    FilterWithNeighborSearch(src, dst, numNeighbors, stddevMultiplier, numThreads, findNeighbors);
+
+    qInfo() << "Pointcloud filtered in " << timer.elapsed() << "ms using " << ResolveThreadCount(numThreads) << " threads";
+}
+
+void PointCloudHelpers::FilterOrganized(PointCloudBuffer *src, PointCloudBuffer *dst, size_t numNeighbors, float stddevMultiplier,
+                                        int windowRadius, int numThreads)
+{
+    Q_ASSERT(src->isOrganized);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    DepthGridNeighborhood neighborhood(src, windowRadius);
+
+    auto findNeighbors = [&](size_t pointIndex, size_t k, size_t* indices, float* squaredDistances) {
+        return neighborhood.FindNeighbors(pointIndex, k, indices, squaredDistances);
+    };
+
+    FilterWithNeighborSearch(src, dst, numNeighbors, stddevMultiplier, numThreads, findNeighbors);
+
+    qInfo() << "Pointcloud filtered on the depth grid in " << timer.elapsed() << "ms using " << ResolveThreadCount(numThreads) << " threads";
+}
+
+void PointCloudHelpers::FilterWith(NeighborSearchMethod method, PointCloudBuffer* src, PointCloudBuffer* dst,
+                                   size_t numNeighbors, float stddevMultiplier, int numThreads)
+{
+    if (method == NEIGHBORS_DEPTH_GRID && src->isOrganized) {
+        FilterOrganized(src, dst, numNeighbors, stddevMultiplier, DEFAULT_DEPTH_GRID_WINDOW_RADIUS, numThreads);
+    } else {
+        Filter(src, dst, numNeighbors, stddevMultiplier, numThreads);
+    }
+}
+
+//
+// Original normal estimation kernel. Uses a general (non-symmetric) eigen solver and copies the complex
+// eigenvectors into a dynamically sized matrix. Only kept to validate the symmetric solver against.
+//
+static Eigen::Vector3f NormalFromCovarianceGeneral(const Eigen::Matrix3f& covarianceMatrix)
+{
+    // Eigenvalues are not sorted
+    Eigen::EigenSolver<Eigen::Matrix3f> solver(covarianceMatrix, true);
+
+    // ... smallest eigenvalue corresponds to the normal vector of the plane ...
+    Eigen::Vector3f eigenValues = solver.eigenvalues().real();
+    int min;
+    eigenValues.minCoeff(&min);
+
+    auto eigenvectorsComplex = solver.eigenvectors();
+    Eigen::MatrixXf eigenvectorsReal = eigenvectorsComplex.real();
+    Eigen::Vector3f normal = eigenvectorsReal.col(min);
+
+    return normal;
+}
+
+//
+// The covariance matrix is symmetric positive semi-definite, so its eigen decomposition can be computed
+// in closed form. computeDirect() solves the characteristic cubic analytically, returns the eigenvalues in
+// increasing order and works entirely on fixed size matrices (no heap allocation).
+//
+static Eigen::Vector3f NormalFromCovarianceSymmetric(const Eigen::Matrix3f& covarianceMatrix)
+{
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver;
+    solver.computeDirect(covarianceMatrix, Eigen::ComputeEigenvectors);
+
+    // ... smallest eigenvalue (the first one) corresponds to the normal vector of the plane ...
+    return solver.eigenvectors().col(0);
+}
+
+//
+// Normal estimation shared by the KD-tree and the depth grid version. See FilterWithNeighborSearch()
+// for the findNeighbors interface.
+//
+template<typename NeighborSearch>
+static void ComputeNormalsWithNeighborSearch(PointCloudBuffer* src, PointCloudHelpers::NormalEstimationMethod method,
+                                             const NeighborSearch& findNeighbors)
+{
+    // Every normal is overwritten, a clone only needs its own array
+    src->PrepareWrite(POINTCLOUD_NORMALS);
 
     Vec3f* normals = src->normals;
     Vec3f* points  = src->points;
@@ -208,7 +602,14 @@ void PointCloudHelpers::ComputeNormals(PointCloudBuffer* src)
         float* queryPoint = &(points[pointIndex].X);
 
         // ... get nearest neighbors ...
-        numResults = tree.knnSearch(queryPoint, numResults, &indices[0], &squaredDistances[0]);
+        numResults = findNeighbors(pointIndex, numResults, &indices[0], &squaredDistances[0]);
+
+        // Fewer than 3 points do not span a plane, the covariance has no meaningful smallest eigenvector.
+        // Happens for isolated points on the depth grid.
+        if (numResults < 3) {
+            normals[pointIndex] = Vec3f(0.0f, 0.0f, 0.0f);
+            continue;
+        }
 
         // ... calculate Covariance Matrix ...
         Eigen::Vector3f centroid(0.0, 0.0, 0.0);
@@ -225,20 +626,14 @@ void PointCloudHelpers::ComputeNormals(PointCloudBuffer* src)
         covarianceMatrix /= numResults;
 
         // ... Compute eigenvalues and eigenvectors of the covariance matrix. This gives us
-        //     3 vectors that span a plane through the points ...
-
-        // Eigenvalues are not sorted
-        Eigen::EigenSolver<Eigen::Matrix3f> solver(covarianceMatrix, true);
-
-        // ... smallest eigenvalue corresponds to the normal vector of the plane ...
-        Eigen::Vector3f eigenValues = solver.eigenvalues().real();
-        int min;
-        eigenValues.minCoeff(&min);
-
-        // TODO: simplify
-        auto eigenvectorsComplex = solver.eigenvectors();
-        Eigen::MatrixXf eigenvectorsReal = eigenvectorsComplex.real();
-        Eigen::Vector3f normal = eigenvectorsReal.col(min);
+        //     3 vectors that span a plane through the points. The eigenvector of the
+        //     smallest eigenvalue is the normal ...
+        Eigen::Vector3f normal;
+        if (method == PointCloudHelpers::NORMALS_GENERAL_EIGEN) {
+            normal = NormalFromCovarianceGeneral(covarianceMatrix);
+        } else {
+            normal = NormalFromCovarianceSymmetric(covarianceMatrix);
+        }
 
         // ... 3D Sensor can only retrieve elements, that point towards it ...
         Eigen::Vector3f pointToView = zero - Eigen::Map<Eigen::Vector3f>(queryPoint);
@@ -249,8 +644,128 @@ void PointCloudHelpers::ComputeNormals(PointCloudBuffer* src)
 
         normals[pointIndex] = Vec3f(normal.data()); // [0], normal[1], normal[2]);
     }
+}
 
-    qInfo("Normals Computed");
+void PointCloudHelpers::ComputeNormals(PointCloudBuffer* src, NormalEstimationMethod method)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    Vec3f* points = src->points;
+
+    std::shared_ptr<const SpatialIndex> index = GetSpatialIndex(src);
+    const SpatialIndex::Tree& tree = index->tree;
+
+    auto findNeighbors = [&](size_t pointIndex, size_t k, size_t* indices, float* squaredDistances) {
+        return tree.knnSearch(&(points[pointIndex].X), k, indices, squaredDistances);
+    };
+
+    ComputeNormalsWithNeighborSearch(src, method, findNeighbors);
+
+    qInfo() << "Normals Computed in " << timer.elapsed() << "ms";
+}
+
+void PointCloudHelpers::ComputeNormalsOrganized(PointCloudBuffer* src, int windowRadius, NormalEstimationMethod method)
+{
+    Q_ASSERT(src->isOrganized);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    DepthGridNeighborhood neighborhood(src, windowRadius);
+
+    auto findNeighbors = [&](size_t pointIndex, size_t k, size_t* indices, float* squaredDistances) {
+        return neighborhood.FindNeighbors(pointIndex, k, indices, squaredDistances);
+    };
+
+    ComputeNormalsWithNeighborSearch(src, method, findNeighbors);
+
+    qInfo() << "Normals Computed on the depth grid in " << timer.elapsed() << "ms";
+}
+
+void PointCloudHelpers::ComputeNormalsWith(NeighborSearchMethod method, PointCloudBuffer* src)
+{
+    if (method == NEIGHBORS_DEPTH_GRID && src->isOrganized) {
+        ComputeNormalsOrganized(src);
+    } else {
+        ComputeNormals(src);
+    }
+}
+
+//
+// Depth grid neighborhood
+//
+
+PointCloudHelpers::DepthGridNeighborhood::DepthGridNeighborhood(const PointCloudBuffer* cloud, int windowRadius)
+    : cloud_(cloud)
+{
+    windowRadius_ = qBound(1, windowRadius, MAX_DEPTH_GRID_WINDOW_RADIUS);
+
+    // Inverse of cloud->depthPixelIndices. One linear pass, much cheaper than building a KD-tree.
+    pointAtPixel_ = new int32_t[NUM_DEPTH_PIXELS];
+    std::fill(pointAtPixel_, pointAtPixel_ + NUM_DEPTH_PIXELS, -1);
+
+    for (size_t pointIndex = 0; pointIndex < cloud->numPoints; ++pointIndex) {
+        int32_t pixel = cloud->depthPixelIndices[pointIndex];
+        if (0 <= pixel && pixel < NUM_DEPTH_PIXELS) {
+            pointAtPixel_[pixel] = (int32_t)pointIndex;
+        }
+    }
+}
+
+PointCloudHelpers::DepthGridNeighborhood::~DepthGridNeighborhood()
+{
+    delete [] pointAtPixel_;
+}
+
+size_t PointCloudHelpers::DepthGridNeighborhood::FindNeighbors(size_t pointIndex, size_t maxResults,
+                                                               size_t* indices, float* squaredDistances) const
+{
+    const int MAX_WINDOW_SIZE = (2 * MAX_DEPTH_GRID_WINDOW_RADIUS + 1) * (2 * MAX_DEPTH_GRID_WINDOW_RADIUS + 1);
+
+    struct Candidate {
+        float squaredDistance;
+        int32_t index;
+    };
+    Candidate candidates[MAX_WINDOW_SIZE];
+    int numCandidates = 0;
+
+    const Vec3f& query = cloud_->points[pointIndex];
+    int32_t pixel = cloud_->depthPixelIndices[pointIndex];
+    int row = pixel / DEPTH_WIDTH;
+    int col = pixel % DEPTH_WIDTH;
+
+    int minRow = std::max(0, row - windowRadius_);
+    int maxRow = std::min(DEPTH_HEIGHT - 1, row + windowRadius_);
+    int minCol = std::max(0, col - windowRadius_);
+    int maxCol = std::min(DEPTH_WIDTH - 1, col + windowRadius_);
+
+    // Gather all points in the pixel window (including the query point itself, like the KD-tree search) ...
+    for (int r = minRow; r <= maxRow; ++r) {
+        for (int c = minCol; c <= maxCol; ++c) {
+            int32_t neighbor = pointAtPixel_[LINEAR_INDEX(r, c, DEPTH_WIDTH)];
+            if (neighbor < 0) { continue; }
+
+            const Vec3f& p = cloud_->points[neighbor];
+            float dx = p.X - query.X;
+            float dy = p.Y - query.Y;
+            float dz = p.Z - query.Z;
+
+            candidates[numCandidates++] = { dx * dx + dy * dy + dz * dz, neighbor };
+        }
+    }
+
+    // ... and keep the maxResults closest ones, sorted by distance
+    size_t numResults = std::min(maxResults, (size_t)numCandidates);
+    std::partial_sort(candidates, candidates + numResults, candidates + numCandidates,
+                      [](const Candidate& a, const Candidate& b) { return a.squaredDistance < b.squaredDistance; });
+
+    for (size_t i = 0; i < numResults; ++i) {
+        indices[i] = (size_t)candidates[i].index;
+        squaredDistances[i] = candidates[i].squaredDistance;
+    }
+
+    return numResults;
 }
 
 /**
@@ -262,7 +777,10 @@ void PointCloudHelpers::ComputeNormals(PointCloudBuffer* src)
  */
 void PointCloudHelpers::GenerateRandomHemiSphere(PointCloudBuffer* dst,int numPoints, Vec3f center, float radius) {
 
+    dst->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
     dst->numPoints = numPoints;
+    dst->isOrganized = false;
+    dst->MarkPointsModified();
 
     Vec3f* points = dst->points;
     RGB3f* colors = dst->colors;
@@ -311,65 +829,177 @@ static void CopyLandmarkInformation(PointCloudBuffer* src, PointCloudBuffer *dst
     dst->numLandmarks = src->numLandmarks;
 }
 
-QString PointCloudHelpers::SaveSnapshot(FrameBuffer *frame, QString snapshotPath)
+QString PointCloudHelpers::SaveSnapshot(FrameBuffer *frame, PointCloudBuffer* filtered, QString snapshotPath, int snapshotNumber,
+                                        NeighborSearchMethod neighborSearch, PointCloudFileFormat pointCloudFormat)
+{
+    // Preprocessing
+    SpatialIndexCounters countersBefore = ThreadSpatialIndexCounters();
+
+    FilterWith(neighborSearch, frame->pointCloudBuffer, filtered, 10, 1.0f, ALL_CORES);
+    ComputeNormalsWith(neighborSearch, filtered);
+
+    SpatialIndexCounters countersAfter = ThreadSpatialIndexCounters();
+    qInfo() << "Snapshot preprocessing built" << (countersAfter.builds - countersBefore.builds)
+            << "spatial indices, avoided" << (countersAfter.reuses - countersBefore.reuses) << "builds";
+
+    return WriteSnapshot(frame, filtered, snapshotPath, snapshotNumber, pointCloudFormat);
+}
+
+QString PointCloudHelpers::WriteSnapshot(FrameBuffer* frame, PointCloudBuffer* pointCloud, QString snapshotPath, int snapshotNumber,
+                                         PointCloudFileFormat pointCloudFormat)
 {
     std::stringstream stringBuilder;
-    stringBuilder << snapshotPath.toStdString() << std::setfill('0') << std::setw(3) << theSnapshotCount++ << "_";
-    std::string snapshotDirectoryWithCountPrefix = stringBuilder.str();
-    PointCloudBuffer tmp;
+    stringBuilder << std::setfill('0') << std::setw(3) << snapshotNumber << "_";
+    std::string countPrefix = stringBuilder.str();
+    std::string snapshotDirectoryWithCountPrefix = snapshotPath.toStdString() + countPrefix;
+    PointCloudBuffer* buf = pointCloud;
 
+    // Final file names of the snapshot, the meta file refers to these
     std::string metaFile = snapshotDirectoryWithCountPrefix + "snapshot.meta";
 
     SnapshotMetaInformation metaInfo;
-    metaInfo.pointCloudFile = snapshotDirectoryWithCountPrefix + "pointcloud.pc";
-    metaInfo.colorFile      = snapshotDirectoryWithCountPrefix + "color.bmp";
-    metaInfo.depthFile      = snapshotDirectoryWithCountPrefix + "depth.bmp";
+    metaInfo.pointCloudFormat = pointCloudFormat;
+    metaInfo.pointCloudFile   = snapshotDirectoryWithCountPrefix +
+                                (pointCloudFormat == POINTCLOUD_FORMAT_BINARY     ? "pointcloud.pcb" :
+                                 pointCloudFormat == POINTCLOUD_FORMAT_COMPRESSED ? "pointcloud.pcz" : "pointcloud.pc");
+    metaInfo.colorFile      = snapshotDirectoryWithCountPrefix + "color.qoi";
+    metaInfo.depthFile      = snapshotDirectoryWithCountPrefix + "depth.png";
     metaInfo.landmarkFile   = snapshotDirectoryWithCountPrefix + "landmark_indices.txt";
     metaInfo.meshFile       = snapshotDirectoryWithCountPrefix + "mesh.obj";
+    metaInfo.thumbnailFile  = snapshotDirectoryWithCountPrefix + "thumbnail.png";
 
-    // Preprocessing
-    Filter(frame->pointCloudBuffer, &tmp);
-    ComputeNormals(&tmp);
+    // The files are written to a temporary directory next to the session's snapshots first
+    QString tempDirectory = snapshotPath + "." + QString::fromStdString(countPrefix) + "incomplete";
+    if (!QDir().mkpath(tempDirectory)) {
+        qCritical() << "Could not create temporary snapshot directory at " << tempDirectory;
+        return QString();
+    }
 
-    // Write files
-    WriteMetaFile(metaFile, metaInfo);
-    SavePointCloud(metaInfo.pointCloudFile, tmp.points, tmp.colors, tmp.normals, tmp.numPoints);
-    SaveColorImage(metaInfo.colorFile, frame->colorBuffer);
-    SaveDepthImage(metaInfo.depthFile, frame->depthBuffer8);
-    SaveLandmarks(metaInfo.landmarkFile, tmp.landmarkIndices, tmp.numLandmarks);
+    auto tempFile = [&](const std::string& finalFile) {
+        return QDir(tempDirectory).filePath(QFileInfo(QString::fromStdString(finalFile)).fileName()).toStdString();
+    };
+
+    // Moved in this order, the meta file last
+    std::string files[] = { metaInfo.pointCloudFile, metaInfo.colorFile, metaInfo.depthFile, metaInfo.landmarkFile,
+                            metaInfo.thumbnailFile, metaFile };
+    const size_t NUM_FILES = sizeof(files) / sizeof(files[0]);
+
+    // Encode every file but the meta file on its own worker
+    std::atomic<bool> filesWritten(true);
+    theTaskScheduler.RunChunks(NUM_FILES - 1, [&](size_t file) {
+        std::string fileName = tempFile(files[file]);
+        bool written = false;
+
+        switch (file) {
+        case 0:
+            if (pointCloudFormat == POINTCLOUD_FORMAT_BINARY) {
+                written = SavePointCloudBinary(fileName, buf);
+            } else if (pointCloudFormat == POINTCLOUD_FORMAT_COMPRESSED) {
+                written = SavePointCloudCompressed(fileName, buf);
+            } else {
+                written = SavePointCloud(fileName, buf->points, buf->colors, buf->normals, buf->numPoints, true);
+            }
+            break;
+        case 1: written = SaveColorImageQoi(fileName, frame->colorBuffer, COLOR_WIDTH, COLOR_HEIGHT); break;
+        case 2: written = SaveDepthImagePng16(fileName, frame->depthBuffer16, DEPTH_WIDTH, DEPTH_HEIGHT); break;
+        case 3: written = SaveLandmarks(fileName, buf->landmarkIndices, buf->numLandmarks); break;
+        case 4: written = SaveColorFrameThumbnail(fileName, frame->colorBuffer); break;
+        }
+
+        if (!written) {
+            qCritical() << "Could not write snapshot file " << QString::fromStdString(fileName);
+            filesWritten = false;
+        }
+    });
 
-    // Write back the filtered pointcloud to the inspection frame
-    CopyPointCloudBuffer(&tmp, frame->pointCloudBuffer);
+    bool complete = filesWritten && WriteMetaFile(tempFile(metaFile), metaInfo);
+
+    size_t numMoved = 0;
+    while (complete && numMoved < NUM_FILES) {
+        QString from = QString::fromStdString(tempFile(files[numMoved]));
+        QString to   = QString::fromStdString(files[numMoved]);
+
+        // QFile::rename() does not replace existing files
+        QFile::remove(to);
+        complete = QFile::rename(from, to);
+        if (complete) { ++numMoved; }
+    }
+
+    // Files of a snapshot that could not be moved completely must not stay behind in the session
+    if (!complete) {
+        for (size_t file = 0; file < numMoved; ++file) {
+            QFile::remove(QString::fromStdString(files[file]));
+        }
+    }
+
+    QDir(tempDirectory).removeRecursively();
+
+    if (!complete) {
+        qCritical() << "Could not save snapshot " << snapshotNumber << " to " << snapshotPath;
+        return QString();
+    }
 
     return QString::fromStdString(metaFile);
 }
 
+// TODO: remove this debug visualization
+static void HighlightLandmarks(PointCloudBuffer* buf) {
+    for (int i = 0; i < buf->numLandmarks; ++i) {  buf->colors[buf->landmarkIndices[i]] = {0.1f, 0.1f, 1.0f}; }
+}
+
 // TODO: change to framebuffer and load images
 void PointCloudHelpers::LoadSnapshot(const std::string snapshotMetaFileName, PointCloudBuffer* buf) {
 
     SnapshotMetaInformation metaInfo;
     LoadMetaFile(snapshotMetaFileName, &metaInfo);
 
+    if (metaInfo.pointCloudFormat == POINTCLOUD_FORMAT_BINARY) {
+        std::unique_ptr<MappedPointCloud> mapped = MapSnapshot(snapshotMetaFileName);
+        if (!mapped) {
+            qCritical() << "Could not open pointcloud file for reading";
+            return;
+        }
+
+        if (mapped->Buffer()->numPoints > (size_t)MAX_POINTCLOUD_SIZE) {
+            qCritical() << "Pointcloud file has more points than fit into a buffer";
+            return;
+        }
+
+        // Landmarks come with the copy, the mapping is already highlighted
+        CopyPointCloudBuffer(mapped->Buffer(), buf);
+        return;
+    }
+
+    // Landmarks are part of the compressed file
+    if (metaInfo.pointCloudFormat == POINTCLOUD_FORMAT_COMPRESSED) {
+        if (LoadPointCloudCompressed(metaInfo.pointCloudFile, buf) < 0) {
+            return;
+        }
+
+        HighlightLandmarks(buf);
+        return;
+    }
+
+    // The text format has no landmarks, they are added once the points are in place
+    if (LoadPointCloudText(metaInfo.pointCloudFile, buf) < 0) {
+        return;
+    }
+
     LoadLandmarks(metaInfo.landmarkFile, buf->landmarkIndices, &buf->numLandmarks);
+    HighlightLandmarks(buf);
+}
 
-    std::ifstream pointcloudFile(metaInfo.pointCloudFile);
+int PointCloudHelpers::LoadPointCloudTextStream(const std::string& pointCloudFileName, PointCloudBuffer* buf) {
+    std::ifstream pointcloudFile(pointCloudFileName);
 
     if (!pointcloudFile.is_open()) {
         qCritical() << "Could not open pointcloud file for reading";
-        return;
+        return -1;
     }
 
     int count = 0;
 
-#if 0
-    std::string line;
-
-    while (std::getline(pointcloudFile, line)) {
-        ++count;
-    }
-    pointcloudFile.close();
-    pointcloudFile.open(pointcloudFilename);
-#endif
+    buf->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
 
     Vec3f* pointData =  buf->points;
     RGB3f* colorData =  buf->colors;
@@ -382,6 +1012,11 @@ void PointCloudHelpers::LoadSnapshot(const std::string snapshotMetaFileName, Poi
     while (pointcloudFile >> x  >> y  >> z
                           >> r  >> g  >> b
                           >> nx >> ny >> nz) {
+        if (count == MAX_POINTCLOUD_SIZE) {
+            qCritical() << "Pointcloud file has more points than fit into a buffer";
+            break;
+        }
+
         Vec3f* p = pointData  + count;
         RGB3f* c = colorData  + count;
         Vec3f* n = normalData + count;
@@ -401,10 +1036,248 @@ void PointCloudHelpers::LoadSnapshot(const std::string snapshotMetaFileName, Poi
         count++;
     }
 
-    // TODO: remove this debug visualization
-    for (int i = 0; i < buf->numLandmarks; ++i) {  colorData[buf->landmarkIndices[i]] = {0.1f, 0.1f, 1.0f}; }
-
-
     buf->numPoints = count;
+    buf->isOrganized = false;
+    buf->MarkPointsModified();
     pointcloudFile.close();
+
+    return count;
+}
+
+//
+// Lines of the text format are "x y z r g b nx ny nz", separated by spaces or tabs
+//
+
+static inline bool IsLineBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* SkipLineBlanks(const char* p, const char* lineEnd) {
+    while (p < lineEnd && IsLineBlank(*p)) { ++p; }
+    return p;
+}
+
+static inline const char* FindLineEnd(const char* p, const char* end) {
+    const char* newline = (const char*)memchr(p, '\n', end - p);
+    return newline != nullptr ? newline : end;
+}
+
+//
+// Start of the first line that starts at or after offset
+//
+static inline const char* FirstLineStart(const char* data, const char* end, size_t offset) {
+    const char* p = data + offset;
+    if (offset == 0 || p[-1] == '\n') { return p; }
+
+    const char* lineEnd = FindLineEnd(p, end);
+    return lineEnd < end ? lineEnd + 1 : end;
+}
+
+template<typename T>
+static inline bool ParseTextField(const char*& p, const char* lineEnd, T* value) {
+    p = SkipLineBlanks(p, lineEnd);
+    std::from_chars_result result = std::from_chars(p, lineEnd, *value);
+    if (result.ec != std::errc()) { return false; }
+
+    // Fields need a separator, "1.0-2.0" is not two numbers
+    if (result.ptr < lineEnd && !IsLineBlank(*result.ptr)) { return false; }
+
+    p = result.ptr;
+    return true;
+}
+
+static bool ParsePointLine(const char* p, const char* lineEnd, Vec3f* point, RGB3f* color, Vec3f* normal) {
+    float x, y, z;
+    int   r, g, b;
+    float nx, ny, nz;
+
+    bool valid = ParseTextField(p, lineEnd, &x)  && ParseTextField(p, lineEnd, &y)  && ParseTextField(p, lineEnd, &z)  &&
+                 ParseTextField(p, lineEnd, &r)  && ParseTextField(p, lineEnd, &g)  && ParseTextField(p, lineEnd, &b)  &&
+                 ParseTextField(p, lineEnd, &nx) && ParseTextField(p, lineEnd, &ny) && ParseTextField(p, lineEnd, &nz) &&
+                 SkipLineBlanks(p, lineEnd) == lineEnd;
+
+    if (!valid) { return false; }
+
+    *point  = Vec3f(x, y, z);
+    *color  = RGB3f(r / 255.0f, g / 255.0f, b / 255.0f);
+    *normal = Vec3f(nx, ny, nz);
+    return true;
+}
+
+int PointCloudHelpers::LoadPointCloudText(const std::string& pointCloudFileName, PointCloudBuffer* buf, int numThreads) {
+    // Empty until the whole file is read, so every failure leaves no points or landmarks of an earlier cloud
+    buf->numPoints = 0;
+    buf->numLandmarks = 0;
+    buf->MarkPointsModified();
+
+    QFile file(QString::fromStdString(pointCloudFileName));
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCritical() << "Could not open pointcloud file for reading" << file.fileName();
+        return -1;
+    }
+
+    size_t size = (size_t)file.size();
+    const char* data = nullptr;
+    if (size > 0) {
+        data = (const char*)file.map(0, size);
+        if (data == nullptr) {
+            qCritical() << "Could not map pointcloud file" << file.fileName();
+            return -1;
+        }
+    }
+    const char* end = data + size;
+
+    // Every chunk owns the lines that start within its byte range, the same chunks in both passes
+    size_t numChunks = ParallelChunkCount(size, numThreads);
+
+    struct TextChunk {
+        size_t numLines;
+        size_t numPoints;
+        size_t firstLine;
+        size_t firstPoint;
+        size_t numMalformed;
+        size_t firstMalformedLine;
+    };
+    std::vector<TextChunk> chunks(numChunks, TextChunk());
+
+    // First pass: count the points of every chunk, blank lines are skipped
+    ParallelFor(size, numThreads, [&](size_t begin, size_t chunkEnd, size_t chunk) {
+        const char* rangeEnd = data + chunkEnd;
+        size_t numLines = 0, numPoints = 0;
+
+        for (const char* line = FirstLineStart(data, end, begin); line < rangeEnd; ) {
+            const char* lineEnd = FindLineEnd(line, end);
+            if (SkipLineBlanks(line, lineEnd) < lineEnd) { ++numPoints; }
+            ++numLines;
+            line = lineEnd + 1;
+        }
+
+        chunks[chunk].numLines  = numLines;
+        chunks[chunk].numPoints = numPoints;
+    });
+
+    size_t numPoints = 0, numLines = 0;
+    for (TextChunk& chunk : chunks) {
+        chunk.firstLine  = numLines;
+        chunk.firstPoint = numPoints;
+        numLines  += chunk.numLines;
+        numPoints += chunk.numPoints;
+    }
+
+    if (numPoints > (size_t)MAX_POINTCLOUD_SIZE) {
+        qCritical() << "Pointcloud file has" << numPoints << "points, more than the" << MAX_POINTCLOUD_SIZE
+                    << "that fit into a buffer:" << file.fileName();
+        return -1;
+    }
+
+    buf->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
+
+    // Second pass: parse every chunk straight into its part of the buffer
+    ParallelFor(size, numThreads, [&](size_t begin, size_t chunkEnd, size_t chunk) {
+        const char* rangeEnd = data + chunkEnd;
+        TextChunk& c = chunks[chunk];
+        size_t point = c.firstPoint;
+        size_t lineIndex = 0;
+
+        for (const char* line = FirstLineStart(data, end, begin); line < rangeEnd; ++lineIndex) {
+            const char* lineEnd = FindLineEnd(line, end);
+
+            if (SkipLineBlanks(line, lineEnd) < lineEnd) {
+                if (!ParsePointLine(line, lineEnd, &buf->points[point], &buf->colors[point], &buf->normals[point])) {
+                    if (c.numMalformed == 0) { c.firstMalformedLine = c.firstLine + lineIndex; }
+                    ++c.numMalformed;
+                }
+                ++point;
+            }
+
+            line = lineEnd + 1;
+        }
+    });
+
+    size_t numMalformed = 0;
+    size_t firstMalformedLine = 0;
+    for (const TextChunk& chunk : chunks) {
+        if (chunk.numMalformed > 0 && numMalformed == 0) { firstMalformedLine = chunk.firstMalformedLine; }
+        numMalformed += chunk.numMalformed;
+    }
+
+    buf->isOrganized = false;
+
+    if (numMalformed > 0) {
+        qCritical() << "Pointcloud file has" << numMalformed << "malformed lines, the first is line"
+                    << firstMalformedLine + 1 << "of" << file.fileName();
+        return -1;
+    }
+
+    buf->numPoints = numPoints;
+    buf->MarkPointsModified();
+    return (int)numPoints;
+}
+
+std::unique_ptr<PointCloudHelpers::MappedPointCloud> PointCloudHelpers::MappedPointCloud::Open(const std::string& pointCloudFileName)
+{
+    std::unique_ptr<MappedPointCloud> result(new MappedPointCloud());
+
+    result->file_.setFileName(QString::fromStdString(pointCloudFileName));
+    if (!result->file_.open(QIODevice::ReadOnly)) {
+        qCritical() << "Could not open pointcloud file for mapping" << result->file_.fileName();
+        return nullptr;
+    }
+
+    qint64 size = result->file_.size();
+    result->data_ = result->file_.map(0, size, QFileDevice::MapPrivateOption);
+    if (result->data_ == nullptr) {
+        qCritical() << "Could not map pointcloud file" << result->file_.fileName();
+        return nullptr;
+    }
+
+    PointCloudFileHeader header;
+    if (!ReadPointCloudFileHeader(result->data_, (uint64_t)size, &header)) {
+        qCritical() << "Not a valid binary pointcloud file" << result->file_.fileName();
+        return nullptr;
+    }
+
+    uchar* data = result->data_;
+    int32_t* depthPixelIndices = (header.flags & POINTCLOUD_FILE_ORGANIZED) ? (int32_t*)(data + header.depthPixelIndicesOffset) : nullptr;
+
+    result->buffer_.reset(new PointCloudBuffer((Vec3f*)(data + header.positionsOffset),
+                                               (RGB3f*)(data + header.colorsOffset),
+                                               (Vec3f*)(data + header.normalsOffset),
+                                               depthPixelIndices,
+                                               header.numPoints));
+
+    const uint64_t* landmarks = (const uint64_t*)(data + header.landmarksOffset);
+    for (uint32_t i = 0; i < header.numLandmarks; ++i) {
+        if (landmarks[i] >= header.numPoints) {
+            qCritical() << "Landmark outside of the point cloud in" << result->file_.fileName();
+            return nullptr;
+        }
+        result->buffer_->landmarkIndices[i] = (size_t)landmarks[i];
+    }
+    result->buffer_->numLandmarks = (int)header.numLandmarks;
+
+    return result;
+}
+
+PointCloudHelpers::MappedPointCloud::~MappedPointCloud()
+{
+    // The buffer looks at the mapping, so it has to go first
+    buffer_.reset();
+    if (data_ != nullptr) {
+        file_.unmap(data_);
+    }
+}
+
+std::unique_ptr<PointCloudHelpers::MappedPointCloud> PointCloudHelpers::MapSnapshot(const std::string snapshotMetaFileName)
+{
+    SnapshotMetaInformation metaInfo;
+    if (!LoadMetaFile(snapshotMetaFileName, &metaInfo) || metaInfo.pointCloudFormat != POINTCLOUD_FORMAT_BINARY) {
+        return nullptr;
+    }
+
+    std::unique_ptr<MappedPointCloud> mapped = MappedPointCloud::Open(metaInfo.pointCloudFile);
+    if (mapped) {
+        HighlightLandmarks(mapped->Buffer());
+    }
+    return mapped;
 }
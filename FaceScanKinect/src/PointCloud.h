@@ -2,11 +2,23 @@
 #define POINTCLOUD_H
 
 #include <QObject>
+#include <QFile>
+
+#include <future>
+#include <memory>
+#include <vector>
+
 #include "nanoflann.hpp"
 #include "Types.h"
+#include "util.h"
 
 struct PointCloudBuffer;
 struct FrameBuffer;
+struct ColorPointRaster;
+
+template<typename T> class PoolHandle;
+typedef PoolHandle<FrameBuffer>      FrameHandle;
+typedef PoolHandle<PointCloudBuffer> PointCloudHandle;
 
 namespace PointCloudHelpers {
 
@@ -21,130 +33,284 @@ typedef nanoflann::KDTreeSingleIndexAdaptor<
         3> KDTree;
 
 //
-// Filter Pointcloud into destination PointCloudBuffer. If a point is more than sttdevMultiplier standard deviations
-// away from its numNeighbors neighbors, then it is excluded in the filtered PointCloud.
+// KD-tree cached on a PointCloudBuffer. The index holds its own copy of the points, so it stays valid
+// when the buffer is overwritten and can be shared between buffers with the same generation.
 //
-void Filter(PointCloudBuffer* src, PointCloudBuffer* dst, size_t numNeighbors = 10, float stddevMultiplier = 1.0f);
+struct SpatialIndex {
+    SpatialIndex(const PointCloudBuffer& cloud);
+
+    //
+    // nanoflann interface functions
+    //
+
+    inline size_t kdtree_get_point_count() const { return points.size(); }
+
+    inline float kdtree_get_pt(const size_t idx, size_t dim) const { return (&points[idx].X)[dim]; }
+
+    template<class BBOX>
+    bool kdtree_get_bbox(BBOX&) const { return false; }
+
+    typedef nanoflann::KDTreeSingleIndexAdaptor<
+            nanoflann::L2_Simple_Adaptor<float, SpatialIndex>,
+            SpatialIndex,
+            3> Tree;
+
+    // Declaration order matters, the tree reads the points on construction
+    std::vector<Vec3f> points;
+    uint64_t generation;
+    Tree tree;
+};
 
 //
-// Compute Normals and store the result into the passed buffer.
+// Returns the spatial index of cloud and builds it if the points changed since it was last built.
+// Safe to call from several threads, the index is only built once.
 //
-void ComputeNormals(PointCloudBuffer* src);
+std::shared_ptr<const SpatialIndex> GetSpatialIndex(PointCloudBuffer* cloud);
 
 //
-// Save incoming frame to disk
+// Counts how often an index had to be built and how often a build was avoided because an up to date
+// index was cached on the buffer (or on the buffer it was copied from).
 //
-QString SaveSnapshot(FrameBuffer* frame, QString snapshotPath);
+struct SpatialIndexCounters {
+    uint64_t builds;
+    uint64_t reuses;
+};
 
 //
-// Load frame from disk
+// Counters of all threads since program start
 //
-void LoadSnapshot(const std::string snapshotMetaFileName, PointCloudBuffer* buf);
+SpatialIndexCounters GlobalSpatialIndexCounters();
 
 //
-// Creates a Thread and runs the normal computation asynchronously
+// Counters of the calling thread since it started. Differences of two calls give the counts of
+// the work done in between, e.g. for a single snapshot.
 //
-// The listener object needs to define a SLOT named OnNormalsComputed to be notified
-// when the thread completes.
+SpatialIndexCounters ThreadSpatialIndexCounters();
+
+//
+// Passed as numThreads to use one thread per core
 //
-void CreateAndStartNormalWorker(PointCloudBuffer* src, QObject* listener);
+const int ALL_CORES = 0;
 
 //
-// Creates a Thread and runs the filtering asynchronously.
+// Creates the colored, organized point cloud of a depth frame that is already mapped to camera space
+// (depthToCamera) and to color image coordinates (depthToColor), as done by the coordinate mapper of the
+// kinect or stored in a recording. Only pixels of tracked bodies (bodyIndex 0 to 5) with a height of at
+// least cutoffHeight are kept. Independent of the kinect SDK.
 //
-// The listener object needs to define a SLOT named OnPointcloudFiltered
+// The validity of eight pixels at a time is tested with SIMD, the valid ones are then compacted into dst.
+//
+// If colorPointRaster is given, it is filled with the point seen in every cell of the color image.
 //
-void CreateAndStartFilterWorker(PointCloudBuffer* src, PointCloudBuffer* dst, QObject* listener,
-                                size_t numNeighbors = 10, float stddevMultiplier = 1.0f);
+void CreatePointCloud(const uint32_t* colorBuffer, const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                      const uint8_t* bodyIndex, float cutoffHeight, PointCloudBuffer* dst,
+                      ColorPointRaster* colorPointRaster = nullptr);
 
 //
-// Creates a Thread and runs snapshot saving asynchronously.
+// Returns the index of the point that the raster holds for the cell of colorPixel. If that cell is empty,
+// the point of the neighboring cell closest to colorPixel is taken. Returns -1 if there is none.
 //
-// The listener object needs to define a SLOT named OnSnapshotSaved(QString)
+int32_t FindPointAtColorPixel(const ColorPointRaster* colorPointRaster, Vec2f colorPixel);
+
 //
-void CreateAndStartSaveSnapshotWorker(FrameBuffer* src, QObject* listener);
+// Same result as CreatePointCloud(), testing and branching on one pixel at a time. Kept as the reference
+// for the benchmark.
+//
+void CreatePointCloudScalar(const uint32_t* colorBuffer, const Vec3f* depthToCamera, const Vec2f* depthToColor,
+                            const uint8_t* bodyIndex, float cutoffHeight, PointCloudBuffer* dst);
 
 //
-// Generates random points on a hemisphere and stores the result into the passed buffer
+// Filter Pointcloud into destination PointCloudBuffer. If a point is more than sttdevMultiplier standard deviations
+// away from its numNeighbors neighbors, then it is excluded in the filtered PointCloud.
 //
-void GenerateRandomHemiSphere(PointCloudBuffer* dst,int numPoints, Vec3f center = Vec3f(0.0f, 0.0f, 1.0f), float radius = 0.1f);
+// The neighbor search and the compaction are split across numThreads threads. The result is identical
+// to the single threaded version for any thread count.
+//
+void Filter(PointCloudBuffer* src, PointCloudBuffer* dst, size_t numNeighbors = 10, float stddevMultiplier = 1.0f,
+            int numThreads = 1);
 
+//
+// Largest supported window radius for depth grid neighborhoods, i.e. at most 11x11 pixels are searched
+//
+const int MAX_DEPTH_GRID_WINDOW_RADIUS = 5;
+const int DEFAULT_DEPTH_GRID_WINDOW_RADIUS = 3;
 
 //
-// Wrapper class for running normal computation in a worker thread
+// Same as Filter(), but for point clouds that still know their depth pixels (src->isOrganized).
+// Neighbors are taken from a (2 * windowRadius + 1)^2 pixel window instead of a KD-tree. Points without
+// another point in their window are always removed.
 //
-class ComputeNormalWorker : public QObject
-{
-    Q_OBJECT
+void FilterOrganized(PointCloudBuffer* src, PointCloudBuffer* dst, size_t numNeighbors = 10, float stddevMultiplier = 1.0f,
+                     int windowRadius = DEFAULT_DEPTH_GRID_WINDOW_RADIUS, int numThreads = 1);
 
-public:
-    ComputeNormalWorker(PointCloudBuffer* src) : pc(src) {}
-    ~ComputeNormalWorker() {}
+//
+// Eigen solver used for estimating the normal from the covariance matrix of a point's neighborhood
+//
+enum NormalEstimationMethod {
+    NORMALS_SYMMETRIC_3X3,  // Closed form solver for symmetric 3x3 matrices, no heap allocations (default)
+    NORMALS_GENERAL_EIGEN,  // General Eigen::EigenSolver, kept for validating the symmetric solver
+};
 
-public slots:
-    void ComputeNormals() { PointCloudHelpers::ComputeNormals(pc); emit finished(); }
+//
+// Compute Normals and store the result into the passed buffer.
+//
+void ComputeNormals(PointCloudBuffer* src, NormalEstimationMethod method = NORMALS_SYMMETRIC_3X3);
 
-signals:
-    void finished();
+//
+// Same as ComputeNormals(), but neighbors are taken from a pixel window on the depth grid (src->isOrganized).
+// Points with fewer than 3 points in their window get a zero normal.
+//
+void ComputeNormalsOrganized(PointCloudBuffer* src, int windowRadius = DEFAULT_DEPTH_GRID_WINDOW_RADIUS,
+                             NormalEstimationMethod method = NORMALS_SYMMETRIC_3X3);
 
-private:
-    PointCloudBuffer* pc;
+//
+// Neighbor search used by filtering, normal computation and snapshot saving
+//
+enum NeighborSearchMethod {
+    NEIGHBORS_KDTREE,      // nanoflann KD-tree, works for every point cloud
+    NEIGHBORS_DEPTH_GRID,  // Pixel window on the depth grid, falls back to the KD-tree for unorganized clouds
 };
 
 //
-// Wrapper Class for running PointCloudFiltering in a worker thread
+// Runs Filter() or FilterOrganized() depending on method and on whether src is organized
 //
-class FilterPointcloudWorker : public QObject
-{
-    Q_OBJECT
+void FilterWith(NeighborSearchMethod method, PointCloudBuffer* src, PointCloudBuffer* dst,
+                size_t numNeighbors = 10, float stddevMultiplier = 1.0f, int numThreads = 1);
 
-public:
-    FilterPointcloudWorker(PointCloudBuffer* src, PointCloudBuffer* dst, size_t numNeighbors, float stddevMultiplier)
-        : src_(src), dst_(dst), numNeighbors_(numNeighbors), stddevMultiplier_(stddevMultiplier) {}
-    ~FilterPointcloudWorker() {}
+//
+// Runs ComputeNormals() or ComputeNormalsOrganized() depending on method and on whether src is organized
+//
+void ComputeNormalsWith(NeighborSearchMethod method, PointCloudBuffer* src);
 
-public slots:
-    void FilterPointcloud() { PointCloudHelpers::Filter(src_, dst_, numNeighbors_, stddevMultiplier_); emit finished(); }
+//
+// Neighborhoods on the depth image grid. Every point of an organized point cloud remembers the depth pixel
+// it was created from, so its neighbors can be found in a small pixel window around that pixel without
+// building a spatial index.
+//
+class DepthGridNeighborhood {
+public:
+    DepthGridNeighborhood(const PointCloudBuffer* cloud, int windowRadius = DEFAULT_DEPTH_GRID_WINDOW_RADIUS);
+    ~DepthGridNeighborhood();
 
-signals:
-    void finished();
+    //
+    // Finds up to maxResults points within the pixel window around pointIndex (including the point itself),
+    // sorted by their 3D distance. Returns the number of neighbors written to indices and squaredDistances.
+    //
+    size_t FindNeighbors(size_t pointIndex, size_t maxResults, size_t* indices, float* squaredDistances) const;
 
 private:
-    PointCloudBuffer* src_;
-    PointCloudBuffer* dst_;
+    DepthGridNeighborhood(const DepthGridNeighborhood&);
+    DepthGridNeighborhood& operator=(const DepthGridNeighborhood&);
+
+    const PointCloudBuffer* cloud_;
+    int windowRadius_;
 
-    size_t numNeighbors_;
-    float  stddevMultiplier_;
+    // Point index for every depth pixel, -1 if the pixel has no point
+    int32_t* pointAtPixel_;
 };
 
 //
-// Wrapper Class for running SnapShot-Saving in a worker thread
+// Save incoming frame to disk. The point cloud of frame is filtered into filtered, which gets the normals
+// and is written instead, frame is not modified. The point cloud is written in the binary format by default,
+// the compressed format (see PointCloudCompression.h) is several times smaller, the text format is kept as
+// an export option for external tools. Usually run by theSnapshotQueue.
 //
-class SaveSnapshotWorker : public QObject
-{
-    Q_OBJECT
+QString SaveSnapshot(FrameBuffer* frame, PointCloudBuffer* filtered, QString snapshotPath, int snapshotNumber,
+                     NeighborSearchMethod neighborSearch = NEIGHBORS_KDTREE,
+                     PointCloudFileFormat pointCloudFormat = POINTCLOUD_FORMAT_BINARY);
+
+//
+// Writes the images of frame and pointCloud, which is already filtered and has normals, i.e. the last step
+// of SaveSnapshot(). The files are prefixed with snapshotNumber. Returns the meta file, an empty string if
+// a file could not be written.
+//
+// Every file is encoded on its own worker into a temporary directory. The files are moved into snapshotPath
+// once all of them are complete, the meta file last, so a snapshot with a meta file is always complete. If a
+// file cannot be moved, the files moved before it are removed again.
+//
+QString WriteSnapshot(FrameBuffer* frame, PointCloudBuffer* pointCloud, QString snapshotPath, int snapshotNumber,
+                      PointCloudFileFormat pointCloudFormat = POINTCLOUD_FORMAT_BINARY);
+
+//
+// Load frame from disk. Reads all point cloud formats, depending on the entry in the meta file.
+//
+void LoadSnapshot(const std::string snapshotMetaFileName, PointCloudBuffer* buf);
 
+//
+// Reads a point cloud in the text format (see SavePointCloud()) into buf and returns the number of points.
+// The format has no landmarks, buf has none afterwards.
+//
+// The file is mapped into memory and split into chunks at line starts, which are parsed on numThreads
+// threads with std::from_chars, independent of the locale. Returns -1 and leaves buf empty if the file
+// cannot be read, has more than MAX_POINTCLOUD_SIZE points or has malformed lines, the first of which is
+// reported with its line number.
+//
+int LoadPointCloudText(const std::string& pointCloudFileName, PointCloudBuffer* buf, int numThreads = ALL_CORES);
+
+//
+// Same as LoadPointCloudText(), reading the file with std::ifstream. Stops at the first line it cannot read.
+// Kept as the reference for the benchmark.
+//
+int LoadPointCloudTextStream(const std::string& pointCloudFileName, PointCloudBuffer* buf);
+
+//
+// Binary point cloud file mapped into memory. Buffer() points directly into the file, nothing is parsed
+// or copied. The mapping is private, so writes to the buffer never reach the file.
+// The buffer is valid as long as this object lives.
+//
+class MappedPointCloud
+{
 public:
-    SaveSnapshotWorker(FrameBuffer* src, QString snapshotPath) :
-        src_(src), snapshotPath_(snapshotPath) {}
-    ~SaveSnapshotWorker() {}
+    //
+    // Returns nullptr if the file cannot be mapped or is not a valid binary point cloud file
+    //
+    static std::unique_ptr<MappedPointCloud> Open(const std::string& pointCloudFileName);
 
-public slots:
-    void SaveSnapshot() {
-        QString metaFile = PointCloudHelpers::SaveSnapshot(src_, snapshotPath_);
-        emit newMetaFile(metaFile);
-        emit finished();
-    }
+    ~MappedPointCloud();
 
-signals:
-    void finished();
-    void newMetaFile(QString metaFileLocation);
+    PointCloudBuffer* Buffer() { return buffer_.get(); }
 
 private:
-    FrameBuffer* src_;
-    QString snapshotPath_;
+    MappedPointCloud() : data_(nullptr) {}
+    MappedPointCloud(const MappedPointCloud&);
+    MappedPointCloud& operator=(const MappedPointCloud&);
+
+    QFile file_;
+    uchar* data_;
+    std::unique_ptr<PointCloudBuffer> buffer_;
 };
 
+//
+// Maps the point cloud of a snapshot, including its landmarks. Returns nullptr if the snapshot was saved
+// in the text or the compressed format or cannot be mapped, use LoadSnapshot() then.
+//
+std::unique_ptr<MappedPointCloud> MapSnapshot(const std::string snapshotMetaFileName);
+
+//
+// Runs the normal computation asynchronously on theTaskScheduler. The task holds on to src until it is done.
+//
+// The listener object needs to define a SLOT named OnNormalsComputed to be notified
+// when the task completes.
+//
+std::future<void> CreateAndStartNormalWorker(PointCloudHandle src, QObject* listener,
+                                             NeighborSearchMethod neighborSearch = NEIGHBORS_KDTREE);
+
+//
+// Runs the filtering of the point cloud of src asynchronously on theTaskScheduler. The task holds on to
+// src and dst until it is done, so src can be a frame pinned from a FrameExchange.
+//
+// The listener object needs to define a SLOT named OnPointcloudFiltered
+//
+std::future<void> CreateAndStartFilterWorker(FrameHandle src, PointCloudHandle dst, QObject* listener,
+                                             size_t numNeighbors = 10, float stddevMultiplier = 1.0f,
+                                             int numThreads = ALL_CORES, NeighborSearchMethod neighborSearch = NEIGHBORS_KDTREE);
+
+//
+// Generates random points on a hemisphere and stores the result into the passed buffer
+//
+void GenerateRandomHemiSphere(PointCloudBuffer* dst,int numPoints, Vec3f center = Vec3f(0.0f, 0.0f, 1.0f), float radius = 0.1f);
+
+
 }
 
 #endif //POINTCLOUD_H
@@ -0,0 +1,470 @@
+#include "PointCloudCompression.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QtMath>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <vector>
+
+#include "PointCloud.h"
+#include "TaskScheduler.h"
+#include "util.h"
+
+// Octahedral code of zero normals, outside of the [-127, 127] of unit normals
+static const int8_t ZERO_NORMAL_CODE = -128;
+
+static float Coordinate(const Vec3f& p, int axis) {
+    return axis == 0 ? p.X : (axis == 1 ? p.Y : p.Z);
+}
+
+static void SetCoordinate(Vec3f* p, int axis, float value) {
+    if      (axis == 0) { p->X = value; }
+    else if (axis == 1) { p->Y = value; }
+    else                { p->Z = value; }
+}
+
+static uint64_t RawSectionSize(int section, uint64_t numPoints, uint32_t numLandmarks, uint32_t flags) {
+    switch (section) {
+    case POINTCLOUD_SECTION_POSITIONS:
+        return numPoints * 3 * ((flags & POINTCLOUD_COMPRESSED_WIDE_POSITIONS) ? sizeof(uint32_t) : sizeof(uint16_t));
+    case POINTCLOUD_SECTION_COLORS:              return numPoints * 3;
+    case POINTCLOUD_SECTION_NORMALS:             return numPoints * 2;
+    case POINTCLOUD_SECTION_LANDMARKS:           return numLandmarks * sizeof(uint32_t);
+    case POINTCLOUD_SECTION_DEPTH_PIXEL_INDICES: return (flags & POINTCLOUD_COMPRESSED_ORGANIZED) ? numPoints * sizeof(int32_t) : 0;
+    }
+    return 0;
+}
+
+//
+// Writes the differences of consecutive values with their bytes split into planes, the lowest bytes of all
+// values first. The differences wrap around, so every sequence is restored exactly.
+//
+template<typename T, typename Value>
+static void StoreDeltaPlanes(size_t count, Value value, uint8_t* out) {
+    T previous = 0;
+    for (size_t i = 0; i < count; ++i) {
+        T current = value(i);
+        T delta = (T)(current - previous);
+        previous = current;
+
+        for (size_t b = 0; b < sizeof(T); ++b) { out[b * count + i] = (uint8_t)(delta >> (8 * b)); }
+    }
+}
+
+template<typename T, typename Store>
+static void LoadDeltaPlanes(size_t count, const uint8_t* in, Store store) {
+    T current = 0;
+    for (size_t i = 0; i < count; ++i) {
+        T delta = 0;
+        for (size_t b = 0; b < sizeof(T); ++b) { delta |= (T)((T)in[b * count + i] << (8 * b)); }
+
+        current = (T)(current + delta);
+        store(i, current);
+    }
+}
+
+static uint8_t QuantizeColor(float c) {
+    if (!(c > 0.0f)) { return 0; }
+    return (uint8_t)std::lround(std::min(c, 1.0f) * 255.0f);
+}
+
+static float SignNotZero(float v) {
+    return v < 0.0f ? -1.0f : 1.0f;
+}
+
+static void EncodeOctahedralNormal(const Vec3f& n, int8_t* u, int8_t* v) {
+    float l1 = std::fabs(n.X) + std::fabs(n.Y) + std::fabs(n.Z);
+    if (!(l1 > 0.0f) || !std::isfinite(l1)) {
+        *u = ZERO_NORMAL_CODE;
+        *v = ZERO_NORMAL_CODE;
+        return;
+    }
+
+    float x = n.X / l1;
+    float y = n.Y / l1;
+
+    // The lower half of the octahedron is folded over the edges of the upper half into the corners of the square
+    if (n.Z < 0.0f) {
+        float foldedX = (1.0f - std::fabs(y)) * SignNotZero(x);
+        float foldedY = (1.0f - std::fabs(x)) * SignNotZero(y);
+        x = foldedX;
+        y = foldedY;
+    }
+
+    *u = (int8_t)std::lround(std::min(std::max(x, -1.0f), 1.0f) * 127.0f);
+    *v = (int8_t)std::lround(std::min(std::max(y, -1.0f), 1.0f) * 127.0f);
+}
+
+static Vec3f DecodeOctahedralNormal(int8_t u, int8_t v) {
+    if (u == ZERO_NORMAL_CODE) { return Vec3f(0.0f, 0.0f, 0.0f); }
+
+    float x = u / 127.0f;
+    float y = v / 127.0f;
+    float z = 1.0f - std::fabs(x) - std::fabs(y);
+
+    if (z < 0.0f) {
+        float unfoldedX = (1.0f - std::fabs(y)) * SignNotZero(x);
+        float unfoldedY = (1.0f - std::fabs(x)) * SignNotZero(y);
+        x = unfoldedX;
+        y = unfoldedY;
+    }
+
+    float length = std::sqrt(x * x + y * y + z * z);
+    return Vec3f(x / length, y / length, z / length);
+}
+
+bool ReadCompressedPointCloudHeader(const uchar* data, uint64_t size, CompressedPointCloudFileHeader* header)
+{
+    if (size < sizeof(CompressedPointCloudFileHeader)) { return false; }
+
+    memcpy(header, data, sizeof(CompressedPointCloudFileHeader));
+
+    if (memcmp(header->magic, POINTCLOUD_COMPRESSED_FILE_MAGIC, sizeof(header->magic)) != 0) { return false; }
+    if (header->version > POINTCLOUD_COMPRESSED_FILE_VERSION) { return false; }
+    if (header->numLandmarks > NUM_LANDMARKS) { return false; }
+
+    // Keeps the section sizes from overflowing, zlib does not shrink anything by more than about 1000:1
+    if (header->numPoints > size * 1024) { return false; }
+
+    if (!(header->gridStep > 0.0f) || !std::isfinite(header->gridStep)) { return false; }
+    for (float origin : header->origin) {
+        if (!std::isfinite(origin)) { return false; }
+    }
+
+    bool entropyCoded = (header->flags & POINTCLOUD_COMPRESSED_ENTROPY_CODED) != 0;
+    uint64_t remaining = size - sizeof(CompressedPointCloudFileHeader);
+
+    for (int section = 0; section < NUM_POINTCLOUD_SECTIONS; ++section) {
+        uint64_t stored = header->sectionSizes[section];
+        uint64_t raw    = RawSectionSize(section, header->numPoints, header->numLandmarks, header->flags);
+
+        if (stored > remaining) { return false; }
+        if ((!entropyCoded || raw == 0) && stored != raw) { return false; }
+        remaining -= stored;
+    }
+
+    return true;
+}
+
+bool EncodeCompressedPointCloud(const PointCloudBuffer* buf, bool entropyCoding, QByteArray* encoded)
+{
+    size_t n = buf->numPoints;
+
+    // Bounding box, every chunk looks at its own points first
+    size_t numChunks = ParallelChunkCount(n, PointCloudHelpers::ALL_CORES);
+    std::vector<float> chunkBounds(numChunks * 6);
+    std::vector<uint8_t> chunkFinite(numChunks, 1);
+
+    ParallelFor(n, PointCloudHelpers::ALL_CORES, [&](size_t begin, size_t end, size_t chunk) {
+        float* lower = &chunkBounds[chunk * 6];
+        float* upper = lower + 3;
+        for (int axis = 0; axis < 3; ++axis) {
+            lower[axis] =  std::numeric_limits<float>::infinity();
+            upper[axis] = -std::numeric_limits<float>::infinity();
+        }
+
+        for (size_t i = begin; i < end; ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                float c = Coordinate(buf->points[i], axis);
+                if (!std::isfinite(c)) { chunkFinite[chunk] = 0; }
+                lower[axis] = std::min(lower[axis], c);
+                upper[axis] = std::max(upper[axis], c);
+            }
+        }
+    });
+
+    float lower[3] = { 0.0f, 0.0f, 0.0f };
+    float upper[3] = { 0.0f, 0.0f, 0.0f };
+
+    for (size_t chunk = 0; n > 0 && chunk < numChunks; ++chunk) {
+        if (!chunkFinite[chunk]) {
+            qCritical() << "Cannot compress a point cloud with points that are not finite";
+            return false;
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            lower[axis] = chunk == 0 ? chunkBounds[axis]     : std::min(lower[axis], chunkBounds[chunk * 6 + axis]);
+            upper[axis] = chunk == 0 ? chunkBounds[axis + 3] : std::max(upper[axis], chunkBounds[chunk * 6 + axis + 3]);
+        }
+    }
+
+    CompressedPointCloudFileHeader header;
+    memcpy(header.magic, POINTCLOUD_COMPRESSED_FILE_MAGIC, sizeof(header.magic));
+    header.version      = POINTCLOUD_COMPRESSED_FILE_VERSION;
+    header.flags        = 0;
+    header.numLandmarks = (uint32_t)buf->numLandmarks;
+    header.numPoints    = n;
+    header.gridStep     = POINTCLOUD_GRID_STEP;
+
+    double maxSteps = 0.0;
+    for (int axis = 0; axis < 3; ++axis) {
+        header.origin[axis] = lower[axis];
+        maxSteps = std::max(maxSteps, std::ceil(((double)upper[axis] - lower[axis]) / POINTCLOUD_GRID_STEP));
+    }
+
+    if (maxSteps > std::numeric_limits<uint32_t>::max()) {
+        qCritical() << "Point cloud is too large to compress";
+        return false;
+    }
+
+    bool wide = maxSteps > std::numeric_limits<uint16_t>::max();
+    bool organized = buf->isOrganized && buf->depthPixelIndices != nullptr;
+
+    if (wide)          { header.flags |= POINTCLOUD_COMPRESSED_WIDE_POSITIONS; }
+    if (organized)     { header.flags |= POINTCLOUD_COMPRESSED_ORGANIZED; }
+    if (entropyCoding) { header.flags |= POINTCLOUD_COMPRESSED_ENTROPY_CODED; }
+
+    QByteArray sections[NUM_POINTCLOUD_SECTIONS];
+    for (int section = 0; section < NUM_POINTCLOUD_SECTIONS; ++section) {
+        sections[section] = QByteArray((int)RawSectionSize(section, n, header.numLandmarks, header.flags), Qt::Uninitialized);
+    }
+
+    auto quantize = [&](size_t i, int axis) {
+        double steps = std::floor(((double)Coordinate(buf->points[i], axis) - header.origin[axis]) / POINTCLOUD_GRID_STEP + 0.5);
+        return (uint32_t)std::min(std::max(steps, 0.0), maxSteps);
+    };
+
+    // Positions and depth pixel indices are differences along the points, one sequence per worker
+    uint8_t* positions = (uint8_t*)sections[POINTCLOUD_SECTION_POSITIONS].data();
+    theTaskScheduler.RunChunks(organized ? 4 : 3, [&](size_t plane) {
+        if (plane == 3) {
+            StoreDeltaPlanes<uint32_t>(n, [&](size_t i) { return (uint32_t)buf->depthPixelIndices[i]; },
+                                       (uint8_t*)sections[POINTCLOUD_SECTION_DEPTH_PIXEL_INDICES].data());
+            return;
+        }
+
+        int axis = (int)plane;
+        if (wide) {
+            StoreDeltaPlanes<uint32_t>(n, [&](size_t i) { return quantize(i, axis); }, positions + axis * n * sizeof(uint32_t));
+        } else {
+            StoreDeltaPlanes<uint16_t>(n, [&](size_t i) { return (uint16_t)quantize(i, axis); }, positions + axis * n * sizeof(uint16_t));
+        }
+    });
+
+    uint8_t* colors  = (uint8_t*)sections[POINTCLOUD_SECTION_COLORS].data();
+    uint8_t* normals = (uint8_t*)sections[POINTCLOUD_SECTION_NORMALS].data();
+
+    ParallelFor(n, PointCloudHelpers::ALL_CORES, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            colors[i]         = QuantizeColor(buf->colors[i].R);
+            colors[n + i]     = QuantizeColor(buf->colors[i].G);
+            colors[2 * n + i] = QuantizeColor(buf->colors[i].B);
+
+            EncodeOctahedralNormal(buf->normals[i], (int8_t*)&normals[i], (int8_t*)&normals[n + i]);
+        }
+    });
+
+    uint8_t* landmarks = (uint8_t*)sections[POINTCLOUD_SECTION_LANDMARKS].data();
+    for (uint32_t l = 0; l < header.numLandmarks; ++l) {
+        uint32_t landmark = (uint32_t)buf->landmarkIndices[l];
+        memcpy(landmarks + l * sizeof(uint32_t), &landmark, sizeof(uint32_t));
+    }
+
+    if (entropyCoding) {
+        theTaskScheduler.RunChunks(NUM_POINTCLOUD_SECTIONS, [&](size_t section) {
+            if (sections[section].size() > 0) {
+                sections[section] = qCompress(sections[section], 1);
+            }
+        });
+    }
+
+    uint64_t total = sizeof(header);
+    for (int section = 0; section < NUM_POINTCLOUD_SECTIONS; ++section) {
+        header.sectionSizes[section] = (uint64_t)sections[section].size();
+        total += header.sectionSizes[section];
+    }
+
+    *encoded = QByteArray((int)total, Qt::Uninitialized);
+    uint8_t* out = (uint8_t*)encoded->data();
+
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    for (int section = 0; section < NUM_POINTCLOUD_SECTIONS; ++section) {
+        memcpy(out, sections[section].constData(), sections[section].size());
+        out += sections[section].size();
+    }
+
+    return true;
+}
+
+bool DecodeCompressedPointCloud(const uchar* data, uint64_t size, PointCloudBuffer* buf)
+{
+    buf->numPoints = 0;
+    buf->numLandmarks = 0;
+    buf->isOrganized = false;
+    buf->MarkPointsModified();
+
+    CompressedPointCloudFileHeader header;
+    if (!ReadCompressedPointCloudHeader(data, size, &header)) { return false; }
+
+    if (header.numPoints > (uint64_t)MAX_POINTCLOUD_SIZE) {
+        qCritical() << "Pointcloud file has more points than fit into a buffer";
+        return false;
+    }
+
+    size_t n = (size_t)header.numPoints;
+    bool wide      = (header.flags & POINTCLOUD_COMPRESSED_WIDE_POSITIONS) != 0;
+    bool organized = (header.flags & POINTCLOUD_COMPRESSED_ORGANIZED) != 0;
+
+    const uint8_t* sections[NUM_POINTCLOUD_SECTIONS];
+    const uint8_t* section = data + sizeof(header);
+    for (int s = 0; s < NUM_POINTCLOUD_SECTIONS; ++s) {
+        sections[s] = section;
+        section += header.sectionSizes[s];
+    }
+
+    // The streams carry the size they decompress to in front, big endian
+    QByteArray decompressed[NUM_POINTCLOUD_SECTIONS];
+    if (header.flags & POINTCLOUD_COMPRESSED_ENTROPY_CODED) {
+        std::atomic<bool> intact(true);
+
+        theTaskScheduler.RunChunks(NUM_POINTCLOUD_SECTIONS, [&](size_t s) {
+            uint64_t raw = RawSectionSize((int)s, header.numPoints, header.numLandmarks, header.flags);
+            if (raw == 0) { return; }
+
+            const uint8_t* stream = sections[s];
+            uint64_t expected = header.sectionSizes[s] < 4 ? 0 : ((uint64_t)stream[0] << 24) | ((uint64_t)stream[1] << 16) |
+                                                                 ((uint64_t)stream[2] << 8)  |  (uint64_t)stream[3];
+            if (expected != raw) {
+                intact = false;
+                return;
+            }
+
+            decompressed[s] = qUncompress(stream, (int)header.sectionSizes[s]);
+            if ((uint64_t)decompressed[s].size() != raw) { intact = false; }
+        });
+
+        if (!intact) { return false; }
+
+        for (int s = 0; s < NUM_POINTCLOUD_SECTIONS; ++s) {
+            sections[s] = (const uint8_t*)decompressed[s].constData();
+        }
+    }
+
+    uint32_t landmarks[NUM_LANDMARKS];
+    for (uint32_t l = 0; l < header.numLandmarks; ++l) {
+        memcpy(&landmarks[l], sections[POINTCLOUD_SECTION_LANDMARKS] + l * sizeof(uint32_t), sizeof(uint32_t));
+        if (landmarks[l] >= header.numPoints) {
+            qCritical() << "Landmark outside of the point cloud";
+            return false;
+        }
+    }
+
+    buf->PrepareWrite(POINTCLOUD_ALL_ARRAYS);
+
+    const uint8_t* positions = sections[POINTCLOUD_SECTION_POSITIONS];
+    theTaskScheduler.RunChunks(organized ? 4 : 3, [&](size_t plane) {
+        if (plane == 3) {
+            LoadDeltaPlanes<uint32_t>(n, sections[POINTCLOUD_SECTION_DEPTH_PIXEL_INDICES],
+                                      [&](size_t i, uint32_t index) { buf->depthPixelIndices[i] = (int32_t)index; });
+            return;
+        }
+
+        int axis = (int)plane;
+        double origin = header.origin[axis];
+        double step   = header.gridStep;
+        auto store = [&](size_t i, uint32_t steps) { SetCoordinate(&buf->points[i], axis, (float)(origin + steps * step)); };
+
+        if (wide) {
+            LoadDeltaPlanes<uint32_t>(n, positions + axis * n * sizeof(uint32_t), store);
+        } else {
+            LoadDeltaPlanes<uint16_t>(n, positions + axis * n * sizeof(uint16_t), store);
+        }
+    });
+
+    const uint8_t* colors  = sections[POINTCLOUD_SECTION_COLORS];
+    const uint8_t* normals = sections[POINTCLOUD_SECTION_NORMALS];
+
+    ParallelFor(n, PointCloudHelpers::ALL_CORES, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            buf->colors[i]  = RGB3f(colors[i] / 255.0f, colors[n + i] / 255.0f, colors[2 * n + i] / 255.0f);
+            buf->normals[i] = DecodeOctahedralNormal((int8_t)normals[i], (int8_t)normals[n + i]);
+        }
+    });
+
+    for (uint32_t l = 0; l < header.numLandmarks; ++l) { buf->landmarkIndices[l] = landmarks[l]; }
+    buf->numLandmarks = (int)header.numLandmarks;
+    buf->isOrganized  = organized;
+    buf->numPoints    = n;
+    buf->MarkPointsModified();
+
+    return true;
+}
+
+bool SavePointCloudCompressed(const std::string& filename, const PointCloudBuffer* buf, bool entropyCoding)
+{
+    QByteArray encoded;
+    if (!EncodeCompressedPointCloud(buf, entropyCoding, &encoded)) { return false; }
+
+    std::ofstream resultFile(filename, std::ios::binary);
+    if (!resultFile.is_open()) {
+        qCritical() << "Cannot open point cloud file for writing to " << QString::fromStdString(filename);
+        return false;
+    }
+
+    resultFile.write(encoded.constData(), encoded.size());
+    resultFile.close();
+    return !resultFile.fail();
+}
+
+int LoadPointCloudCompressed(const std::string& filename, PointCloudBuffer* buf)
+{
+    QFile file(QString::fromStdString(filename));
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCritical() << "Could not open pointcloud file for reading" << file.fileName();
+        return -1;
+    }
+
+    qint64 size = file.size();
+    const uchar* data = size > 0 ? file.map(0, size) : nullptr;
+    if (data == nullptr) {
+        qCritical() << "Could not map pointcloud file" << file.fileName();
+        return -1;
+    }
+
+    if (!DecodeCompressedPointCloud(data, (uint64_t)size, buf)) {
+        qCritical() << "Not a valid compressed pointcloud file" << file.fileName();
+        return -1;
+    }
+
+    return (int)buf->numPoints;
+}
+
+PointCloudCompressionError MeasureCompressionError(const PointCloudBuffer* original, const PointCloudBuffer* decoded)
+{
+    PointCloudCompressionError error = { 0.0f, 0.0f, 0.0f };
+
+    for (size_t i = 0; i < original->numPoints && i < decoded->numPoints; ++i) {
+        const Vec3f& p = original->points[i];
+        const Vec3f& q = decoded->points[i];
+        error.maxPositionError = std::max({ error.maxPositionError,
+                                            std::fabs(p.X - q.X), std::fabs(p.Y - q.Y), std::fabs(p.Z - q.Z) });
+
+        const RGB3f& c = original->colors[i];
+        const RGB3f& d = decoded->colors[i];
+        error.maxColorError = std::max({ error.maxColorError,
+                                         std::fabs(c.R - d.R), std::fabs(c.G - d.G), std::fabs(c.B - d.B) });
+
+        const Vec3f& a = original->normals[i];
+        const Vec3f& b = decoded->normals[i];
+        float lengthA = std::sqrt(a.X * a.X + a.Y * a.Y + a.Z * a.Z);
+        float lengthB = std::sqrt(b.X * b.X + b.Y * b.Y + b.Z * b.Z);
+
+        // Zero normals have to stay zero
+        float degrees = 0.0f;
+        if (lengthA > 0.0f && lengthB > 0.0f) {
+            float cosine = (a.X * b.X + a.Y * b.Y + a.Z * b.Z) / (lengthA * lengthB);
+            degrees = qRadiansToDegrees(std::acos(std::min(std::max(cosine, -1.0f), 1.0f)));
+        } else if (lengthA > 0.0f || lengthB > 0.0f) {
+            degrees = 180.0f;
+        }
+        error.maxNormalErrorDegrees = std::max(error.maxNormalErrorDegrees, degrees);
+    }
+
+    return error;
+}
@@ -0,0 +1,115 @@
+#ifndef POINTCLOUDCOMPRESSION_H
+#define POINTCLOUDCOMPRESSION_H
+
+#include <QByteArray>
+
+#include <cstdint>
+#include <string>
+
+#include "MemoryPool.h"
+
+//
+// Compressed point cloud format
+//
+// Stores a point in 11 bytes instead of the 36 of the binary format, at a precision far below the noise
+// of the kinect:
+//   positions  3 * uint16_t  steps of POINTCLOUD_GRID_STEP from the lower corner of the bounding box,
+//                            3 * uint32_t for clouds that span more than 65535 steps
+//   colors     3 * uint8_t
+//   normals    2 * int8_t    octahedral encoding, a point on the unit octahedron folded into a square
+//
+// A CompressedPointCloudFileHeader is followed by the sections in the order of CompressedPointCloudSection.
+// Every array is stored as planes, e.g. all X before all Y, positions and depth pixel indices as differences
+// to the previous point and with their bytes split into planes as well. Neighboring points come from
+// neighboring depth pixels, so the planes are mostly small, repeating bytes, which the optional entropy
+// coding (zlib at its fastest level, each section on its own worker) shrinks considerably.
+//
+// Decoded points stay within these bounds of the original ones:
+//   positions  half a grid step per coordinate, 0.05 mm, plus float rounding below a micrometer
+//   colors     half an 8-bit step, for colors in [0, 1]
+//   normals    POINTCLOUD_MAX_NORMAL_ERROR_DEGREES, zero normals stay zero
+//
+// Readers reject files with a newer version, older versions have to stay readable.
+//
+const char     POINTCLOUD_COMPRESSED_FILE_MAGIC[4] = { 'F', 'S', 'P', 'Z' };
+const uint32_t POINTCLOUD_COMPRESSED_FILE_VERSION = 1;
+
+// Camera space is in meters, 0.1 mm
+const float POINTCLOUD_GRID_STEP = 0.0001f;
+
+const float POINTCLOUD_MAX_POSITION_ERROR      = 0.5f * POINTCLOUD_GRID_STEP + 1e-6f;
+const float POINTCLOUD_MAX_COLOR_ERROR         = 0.5f / 255.0f + 1e-6f;
+const float POINTCLOUD_MAX_NORMAL_ERROR_DEGREES = 1.0f;
+
+enum CompressedPointCloudFlags {
+    POINTCLOUD_COMPRESSED_ORGANIZED      = 1 << 0,
+    POINTCLOUD_COMPRESSED_ENTROPY_CODED  = 1 << 1,
+    POINTCLOUD_COMPRESSED_WIDE_POSITIONS = 1 << 2,
+};
+
+enum CompressedPointCloudSection {
+    POINTCLOUD_SECTION_POSITIONS,
+    POINTCLOUD_SECTION_COLORS,
+    POINTCLOUD_SECTION_NORMALS,
+    POINTCLOUD_SECTION_LANDMARKS,           // uint32_t per landmark
+    POINTCLOUD_SECTION_DEPTH_PIXEL_INDICES, // Empty unless POINTCLOUD_COMPRESSED_ORGANIZED is set
+
+    NUM_POINTCLOUD_SECTIONS
+};
+
+struct CompressedPointCloudFileHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t numLandmarks;
+    uint64_t numPoints;
+
+    // Lower corner of the bounding box and the step of the position grid
+    float    origin[3];
+    float    gridStep;
+
+    // Bytes of every section in the file, as zlib stream if POINTCLOUD_COMPRESSED_ENTROPY_CODED is set
+    uint64_t sectionSizes[NUM_POINTCLOUD_SECTIONS];
+};
+
+static_assert(sizeof(CompressedPointCloudFileHeader) == 80, "CompressedPointCloudFileHeader is part of the file format");
+
+//
+// Checks that data of the given size starts with a header this version can read and that all sections lie
+// within the data.
+//
+bool ReadCompressedPointCloudHeader(const uchar* data, uint64_t size, CompressedPointCloudFileHeader* header);
+
+//
+// Encodes the points, colors, normals, landmarks and, for organized clouds, the depth pixel indices of buf
+// into encoded. Returns false if a position is not finite.
+//
+bool EncodeCompressedPointCloud(const PointCloudBuffer* buf, bool entropyCoding, QByteArray* encoded);
+
+//
+// Decodes a compressed point cloud into buf. Returns false and leaves buf empty if the data is damaged or
+// has more than MAX_POINTCLOUD_SIZE points.
+//
+bool DecodeCompressedPointCloud(const uchar* data, uint64_t size, PointCloudBuffer* buf);
+
+bool SavePointCloudCompressed(const std::string& filename, const PointCloudBuffer* buf, bool entropyCoding = true);
+
+//
+// Reads a compressed point cloud file into buf and returns the number of points, -1 if the file cannot be
+// read, like PointCloudHelpers::LoadPointCloudText().
+//
+int LoadPointCloudCompressed(const std::string& filename, PointCloudBuffer* buf);
+
+//
+// Largest deviation of decoded from original, which have to have the same number of points, to be checked
+// against the bounds above
+//
+struct PointCloudCompressionError {
+    float maxPositionError;
+    float maxColorError;
+    float maxNormalErrorDegrees;
+};
+
+PointCloudCompressionError MeasureCompressionError(const PointCloudBuffer* original, const PointCloudBuffer* decoded);
+
+#endif // POINTCLOUDCOMPRESSION_H
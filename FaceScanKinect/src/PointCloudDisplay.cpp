@@ -89,6 +89,19 @@ void PointCloudDisplay::SetData(PointCloudBuffer *pointcloudBuffer, bool normals
     }
 }
 
+void PointCloudDisplay::SetData(const PointCloudPlanes* planes)
+{
+    planePoints.resize(planes->numPoints);
+    planeColors.resize(planes->numPoints);
+
+    for (size_t i = 0; i < planes->numPoints; ++i) {
+        planePoints[i] = Vec3f(planes->X[i], planes->Y[i], planes->Z[i]);
+        planeColors[i] = UnpackRGBA8(planes->colors[i]);
+    }
+
+    SetData(planePoints.data(), planeColors.data(), planes->numPoints);
+}
+
 void PointCloudDisplay::Redraw(bool drawNormals)
 {
     if (drawNormals) {
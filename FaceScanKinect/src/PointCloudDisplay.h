@@ -9,6 +9,8 @@
 #include <QOpenGLShaderProgram>
 #include <QMatrix4x4>
 
+#include <vector>
+
 #include "util.h"
 #include "MemoryPool.h"
 
@@ -19,6 +21,7 @@ class PointCloudDisplay : public QOpenGLWidget
 public:
     PointCloudDisplay();
     void SetData(PointCloudBuffer* pointcloudBuffer,  bool normalsComputed = false);
+    void SetData(const PointCloudPlanes* planes);
     void Redraw(bool drawNormals = false);
 
 public slots:
@@ -49,6 +52,10 @@ private:
     RGB3f* colorBackup;
     Vec3f* currentNormals;
 
+    // Interleaved copy of data set from PointCloudPlanes, the shaders expect vec3 attributes
+    std::vector<Vec3f> planePoints;
+    std::vector<RGB3f> planeColors;
+
     bool drawColoredPoints;
     bool drawNormals;
 
@@ -0,0 +1,131 @@
+#include "ReplayFrameSource.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+#include <LandmarkCoreIncludes.h>
+
+#include <chrono>
+#include <future>
+
+#include "MemoryPool.h"
+#include "TaskScheduler.h"
+#include "util.h"
+
+ReplayFrameSource::ReplayFrameSource(FrameExchange* frames,
+                                     std::unique_ptr<FrameRecording> recording,
+                                     float framesPerSecond,
+                                     bool loop,
+                                     LandmarkDetector::CLNF* faceTrackingModel,
+                                     LandmarkDetector::FaceModelParameters* faceTrackingParameters)
+    : frames_(frames),
+      recording_(std::move(recording)),
+      framesPerSecond_(framesPerSecond),
+      loop_(loop),
+      faceTrackingModel_(faceTrackingModel),
+      faceTrackingParameters_(faceTrackingParameters),
+      doFaceTracking_(true),
+      quit_(false)
+{
+}
+
+ReplayFrameSource::~ReplayFrameSource()
+{
+    Stop();
+}
+
+void ReplayFrameSource::Start()
+{
+    if (replayThread_.joinable()) { return; }
+
+    quit_ = false;
+    replayThread_ = std::thread(&ReplayFrameSource::ReplayLoop, this);
+}
+
+void ReplayFrameSource::Stop()
+{
+    quit_ = true;
+    if (replayThread_.joinable()) {
+        replayThread_.join();
+    }
+}
+
+void ReplayFrameSource::ReplayLoop()
+{
+    typedef std::chrono::steady_clock Clock;
+
+    size_t numFrames = recording_->NumFrames();
+    if (numFrames == 0) {
+        qWarning("Recording has no frames to replay");
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    uint64_t numReplayed = 0;
+
+    Clock::time_point passStart = Clock::now();
+    size_t frameIndex = 0;
+
+    while (!quit_) {
+        if (frameIndex == numFrames) {
+            if (!loop_) { break; }
+            frameIndex = 0;
+            passStart = Clock::now();
+        }
+
+        RecordedFrame recorded = recording_->Frame(frameIndex);
+
+        // Wait until the frame is due, the first frame of every pass is due immediately
+        if (framesPerSecond_ > 0.0f) {
+            std::this_thread::sleep_until(passStart + std::chrono::microseconds((int64_t)(frameIndex * 1e6 / framesPerSecond_)));
+        } else if (framesPerSecond_ == REPLAY_RECORDED_RATE) {
+            uint64_t sinceFirstFrameUs = recorded.header.timestampUs - recording_->Frame(0).header.timestampUs;
+            std::this_thread::sleep_until(passStart + std::chrono::microseconds(sinceFirstFrameUs));
+        }
+
+        ReplayFrame(recorded);
+
+        frames_->Publish();
+        emit FrameReady();
+
+        ++frameIndex;
+        ++numReplayed;
+    }
+
+    qint64 elapsed = timer.elapsed();
+    qInfo() << "Replayed" << numReplayed << "frames in" << elapsed << "ms,"
+            << (elapsed > 0 ? numReplayed * 1000.0 / elapsed : 0.0) << "fps";
+}
+
+void ReplayFrameSource::ReplayFrame(const RecordedFrame& recorded)
+{
+    // The UI never looks at the back buffer, so it can be filled without synchronization
+    FrameBuffer* frameBuffer = frames_->BackBuffer();
+
+    // Scale and track the recorded image while the point cloud is created, loading the frame does not touch
+    // the scaled buffers
+    bool doFaceTracking = doFaceTracking_;
+    std::future<void> faceTracking;
+    {
+        const uint32_t* colors = recorded.colorBuffer;
+        bool useRoi = FaceTrackingRoi();
+        LandmarkDetector::CLNF* model = faceTrackingModel_;
+        LandmarkDetector::FaceModelParameters* parameters = faceTrackingParameters_;
+        faceTracking = theTaskScheduler.Submit(PRIORITY_FACE_TRACKING, [=]() {
+            ScaleColorFrame(colors, frameBuffer);
+            if (doFaceTracking) {
+                TrackFace(frameBuffer, model, parameters, useRoi);
+            }
+        });
+    }
+
+    CalibrateFrom(recorded.depthToCamera, recorded.depthToColor);
+    LoadRecordedFrame(recorded, frameBuffer);
+
+    faceTracking.wait();
+
+    if (!doFaceTracking) { return; }
+
+    AttachLandmarks(faceTrackingModel_, frameBuffer->colorPointRaster, frameBuffer->pointCloudBuffer);
+}
@@ -0,0 +1,69 @@
+#ifndef REPLAYFRAMESOURCE_H
+#define REPLAYFRAMESOURCE_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "FrameSource.h"
+#include "FrameRecording.h"
+
+class FrameExchange;
+
+//
+// Passed as framesPerSecond to replay frames as fast as they can be processed
+//
+const float REPLAY_AS_FAST_AS_POSSIBLE = 0.0f;
+
+//
+// Passed as framesPerSecond to replay frames with the timing they were recorded with
+//
+const float REPLAY_RECORDED_RATE = -1.0f;
+
+/**
+ * @brief The ReplayFrameSource class streams the frames of a recording into a FrameExchange.
+ *
+ * Every frame goes through the same steps as a live kinect frame (point cloud creation, face tracking and
+ * landmark lookup), so the rest of the application cannot tell the difference. Neither the sensor nor the
+ * kinect SDK are needed.
+ */
+class ReplayFrameSource : public FrameSource
+{
+    Q_OBJECT
+
+public:
+    //
+    // framesPerSecond > 0 replays at that rate, see above for the special values. With loop, the replay
+    // starts over after the last frame, otherwise the source stops there.
+    //
+    ReplayFrameSource(FrameExchange* frames,
+                      std::unique_ptr<FrameRecording> recording,
+                      float framesPerSecond,
+                      bool loop,
+                      LandmarkDetector::CLNF* faceTrackingModel,
+                      LandmarkDetector::FaceModelParameters* faceTrackingParameters);
+    ~ReplayFrameSource();
+
+    virtual void Start() override;
+    virtual void Stop() override;
+
+    virtual void ToggleFaceTracking() override { doFaceTracking_ = !doFaceTracking_; }
+
+private:
+    void ReplayLoop();
+    void ReplayFrame(const RecordedFrame& recorded);
+
+    FrameExchange* frames_;
+    std::unique_ptr<FrameRecording> recording_;
+    float framesPerSecond_;
+    bool loop_;
+
+    LandmarkDetector::CLNF* faceTrackingModel_;
+    LandmarkDetector::FaceModelParameters* faceTrackingParameters_;
+    std::atomic<bool> doFaceTracking_;
+
+    std::thread replayThread_;
+    std::atomic<bool> quit_;
+};
+
+#endif // REPLAYFRAMESOURCE_H
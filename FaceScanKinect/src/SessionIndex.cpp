@@ -0,0 +1,255 @@
+#include "SessionIndex.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QMetaObject>
+#include <QSaveFile>
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include "PointCloudCompression.h"
+#include "SnapshotImages.h"
+#include "SnapshotThumbnails.h"
+#include "TaskScheduler.h"
+
+static const char* const SESSION_INDEX_MAGIC = "FaceScanSessionIndex";
+static const int SESSION_INDEX_VERSION = 1;
+
+// Written in place of an empty thumbnail file name
+static const char* const NO_THUMBNAIL = "-";
+
+// Serializes all index updates, the snapshot queue and session loading may update the same index
+static std::mutex sessionIndexMutex;
+
+bool LoadSessionIndex(const QString& sessionPath, std::vector<SessionIndexEntry>* entries)
+{
+    entries->clear();
+
+    std::ifstream indexFile(QDir(sessionPath).filePath(SESSION_INDEX_FILE_NAME).toStdString());
+    if (!indexFile.is_open()) { return false; }
+
+    std::string magic;
+    int version = 0;
+    if (!(indexFile >> magic >> version) || magic != SESSION_INDEX_MAGIC || version > SESSION_INDEX_VERSION) {
+        qWarning() << "Ignoring damaged session index in" << sessionPath;
+        return false;
+    }
+
+    SessionIndexEntry entry;
+    while (indexFile >> entry.metaFile >> entry.numPoints >> entry.thumbnailFile) {
+        if (entry.thumbnailFile == NO_THUMBNAIL) { entry.thumbnailFile.clear(); }
+        entries->push_back(entry);
+    }
+
+    if (!indexFile.eof()) {
+        qWarning() << "Ignoring damaged session index in" << sessionPath;
+        entries->clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool UpdateSessionIndex(const QString& sessionPath, const std::vector<SessionIndexEntry>& entries)
+{
+    std::lock_guard<std::mutex> lock(sessionIndexMutex);
+
+    std::vector<SessionIndexEntry> existing;
+    LoadSessionIndex(sessionPath, &existing);
+
+    // Sorted by meta file name, i.e. by snapshot number
+    std::map<std::string, SessionIndexEntry> merged;
+    for (const SessionIndexEntry& entry : existing) { merged[entry.metaFile] = entry; }
+    for (const SessionIndexEntry& entry : entries)  { merged[entry.metaFile] = entry; }
+
+    std::ostringstream contents;
+    contents << SESSION_INDEX_MAGIC << " " << SESSION_INDEX_VERSION << "\n";
+    for (const auto& item : merged) {
+        const SessionIndexEntry& entry = item.second;
+        contents << entry.metaFile << " " << entry.numPoints << " "
+                 << (entry.thumbnailFile.empty() ? NO_THUMBNAIL : entry.thumbnailFile) << "\n";
+    }
+    std::string indexData = contents.str();
+
+    // Readers that do not take the mutex see either the previous or the new index, never none
+    QString indexFileName = QDir(sessionPath).filePath(SESSION_INDEX_FILE_NAME);
+    QSaveFile indexFile(indexFileName);
+    if (!indexFile.open(QIODevice::WriteOnly)) {
+        qCritical() << "Cannot open session index for writing to " << indexFileName;
+        return false;
+    }
+
+    indexFile.write(indexData.data(), (qint64)indexData.size());
+    if (!indexFile.commit()) {
+        qCritical() << "Could not write session index " << indexFileName;
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Number of points of a snapshot without loading its point cloud: from the header of a binary or compressed
+// point cloud, by counting the non blank lines of a text point cloud. Returns 0 if the point cloud cannot be read.
+//
+static size_t ReadSnapshotPointCount(const SnapshotMetaInformation& metaInfo)
+{
+    std::ifstream pointCloudFile(metaInfo.pointCloudFile, std::ios::binary);
+    if (!pointCloudFile.is_open()) { return 0; }
+
+    if (metaInfo.pointCloudFormat == POINTCLOUD_FORMAT_BINARY) {
+        uchar headerBytes[sizeof(PointCloudFileHeader)];
+        if (!pointCloudFile.read((char*)headerBytes, sizeof(headerBytes))) { return 0; }
+
+        uint64_t fileSize = (uint64_t)QFileInfo(QString::fromStdString(metaInfo.pointCloudFile)).size();
+
+        PointCloudFileHeader header;
+        return ReadPointCloudFileHeader(headerBytes, fileSize, &header) ? (size_t)header.numPoints : 0;
+    }
+
+    if (metaInfo.pointCloudFormat == POINTCLOUD_FORMAT_COMPRESSED) {
+        uchar headerBytes[sizeof(CompressedPointCloudFileHeader)];
+        if (!pointCloudFile.read((char*)headerBytes, sizeof(headerBytes))) { return 0; }
+
+        uint64_t fileSize = (uint64_t)QFileInfo(QString::fromStdString(metaInfo.pointCloudFile)).size();
+
+        CompressedPointCloudFileHeader header;
+        return ReadCompressedPointCloudHeader(headerBytes, fileSize, &header) ? (size_t)header.numPoints : 0;
+    }
+
+    std::vector<char> block(1 << 20);
+    size_t numPoints = 0;
+    bool lineHasPoint = false;
+
+    while (pointCloudFile.read(block.data(), block.size()) || pointCloudFile.gcount() > 0) {
+        std::streamsize n = pointCloudFile.gcount();
+        for (std::streamsize i = 0; i < n; ++i) {
+            char c = block[i];
+            if (c == '\n') {
+                if (lineHasPoint) { ++numPoints; }
+                lineHasPoint = false;
+            } else if (c != ' ' && c != '\t' && c != '\r') {
+                lineHasPoint = true;
+            }
+        }
+    }
+
+    return lineHasPoint ? numPoints + 1 : numPoints;
+}
+
+//
+// Creates the missing thumbnail of a snapshot saved before thumbnails existed from its color image and caches
+// it. Returns false if the color image cannot be read, the thumbnail is still cached if it cannot be saved.
+//
+static bool CreateSnapshotThumbnail(const SnapshotMetaInformation& metaInfo, const QString& thumbnailFile)
+{
+    QImage colorImage = LoadSnapshotColorImage(metaInfo.colorFile);
+    if (colorImage.isNull()) {
+        qWarning() << "Cannot read color image " << QString::fromStdString(metaInfo.colorFile);
+        return false;
+    }
+
+    QImage thumbnail = CreateThumbnail(colorImage);
+    if (!thumbnail.save(thumbnailFile, "PNG")) {
+        qWarning() << "Cannot save thumbnail " << thumbnailFile;
+    }
+
+    theThumbnailCache.Insert(thumbnailFile, thumbnail);
+    return true;
+}
+
+void LoadScanSessionAsync(const QString& sessionPath, QObject* listener)
+{
+    theTaskScheduler.Submit(PRIORITY_SNAPSHOT_IO, [=]() {
+        QDir sessionDirectory(sessionPath);
+
+        std::vector<SessionIndexEntry> indexed;
+        LoadSessionIndex(sessionPath, &indexed);
+
+        std::map<std::string, SessionIndexEntry> known;
+        for (const SessionIndexEntry& entry : indexed) { known[entry.metaFile] = entry; }
+
+        // Listing the meta files also finds snapshots saved before the session had an index
+        QStringList metaFiles = sessionDirectory.entryList({ "*.meta" }, QDir::Files, QDir::Name);
+        size_t numSnapshots = (size_t)metaFiles.size();
+
+        enum SnapshotState : uint8_t { SNAPSHOT_PENDING, SNAPSHOT_LOADED, SNAPSHOT_FAILED };
+
+        std::vector<SnapshotMetaInformation> metaInfos(numSnapshots);
+        std::vector<size_t> pointCounts(numSnapshots, 0);
+        std::vector<SnapshotState> states(numSnapshots, SNAPSHOT_PENDING);
+
+        std::mutex deliveryMutex;
+        size_t nextDelivery = 0;
+        int numDelivered = 0;
+        size_t numPointsDelivered = 0;
+        std::vector<SessionIndexEntry> newEntries;
+
+        theTaskScheduler.RunChunks(numSnapshots, [&](size_t snapshot) {
+            std::string metaFile = metaFiles[(int)snapshot].toStdString();
+            SnapshotMetaInformation& metaInfo = metaInfos[snapshot];
+
+            bool valid = LoadMetaFile(sessionDirectory.filePath(metaFiles[(int)snapshot]).toStdString(), &metaInfo);
+
+            SessionIndexEntry entry;
+            bool entryChanged = false;
+
+            if (valid) {
+                auto indexEntry = known.find(metaFile);
+                if (indexEntry != known.end()) {
+                    entry = indexEntry->second;
+                } else {
+                    entry.metaFile  = metaFile;
+                    entry.numPoints = ReadSnapshotPointCount(metaInfo);
+                    entryChanged = true;
+                }
+
+                if (entry.thumbnailFile.empty()) {
+                    if (!metaInfo.thumbnailFile.empty()) {
+                        entry.thumbnailFile = QFileInfo(QString::fromStdString(metaInfo.thumbnailFile)).fileName().toStdString();
+                    } else {
+                        // Only done once, the index remembers the thumbnail
+                        std::string thumbnailFile = SnapshotThumbnailFileName(metaFile);
+                        if (CreateSnapshotThumbnail(metaInfo, sessionDirectory.filePath(QString::fromStdString(thumbnailFile)))) {
+                            entry.thumbnailFile = thumbnailFile;
+                        }
+                    }
+                    entryChanged = true;
+                }
+
+                if (metaInfo.thumbnailFile.empty() && !entry.thumbnailFile.empty()) {
+                    metaInfo.thumbnailFile = sessionDirectory.filePath(QString::fromStdString(entry.thumbnailFile)).toStdString();
+                }
+
+                pointCounts[snapshot] = entry.numPoints;
+            }
+
+            std::lock_guard<std::mutex> lock(deliveryMutex);
+
+            states[snapshot] = valid ? SNAPSHOT_LOADED : SNAPSHOT_FAILED;
+            if (entryChanged) { newEntries.push_back(entry); }
+
+            // Hand out every snapshot whose predecessors are done, so the grid keeps the order of the session
+            for (; nextDelivery < numSnapshots && states[nextDelivery] != SNAPSHOT_PENDING; ++nextDelivery) {
+                if (states[nextDelivery] != SNAPSHOT_LOADED) { continue; }
+
+                QMetaObject::invokeMethod(listener, "OnSessionSnapshotLoaded", Qt::QueuedConnection,
+                                          Q_ARG(SnapshotMetaInformation, metaInfos[nextDelivery]),
+                                          Q_ARG(size_t, pointCounts[nextDelivery]));
+                ++numDelivered;
+                numPointsDelivered += pointCounts[nextDelivery];
+            }
+        });
+
+        if (!newEntries.empty()) {
+            UpdateSessionIndex(sessionPath, newEntries);
+        }
+
+        QMetaObject::invokeMethod(listener, "OnScanSessionLoaded", Qt::QueuedConnection,
+                                  Q_ARG(QString, sessionPath), Q_ARG(int, numDelivered), Q_ARG(size_t, numPointsDelivered));
+    });
+}
@@ -0,0 +1,64 @@
+#ifndef SESSIONINDEX_H
+#define SESSIONINDEX_H
+
+#include <QObject>
+#include <QString>
+
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+//
+// Index of the snapshots of a scan session, stored as SESSION_INDEX_FILE_NAME in the session directory.
+// It lets a session be loaded without opening every point cloud and without decoding the full color images:
+//
+//   FaceScanSessionIndex 1
+//   <meta file> <number of points> <thumbnail file or ->
+//   ...
+//
+// File names are relative to the session directory, one line per snapshot, sorted by meta file name.
+// The snapshot queue adds every saved snapshot, loading a session adds snapshots the index misses.
+//
+const char* const SESSION_INDEX_FILE_NAME = "session.index";
+
+struct SessionIndexEntry {
+    std::string metaFile;
+    size_t numPoints;
+
+    // Empty if the snapshot has no thumbnail yet
+    std::string thumbnailFile;
+};
+
+//
+// Reads the index of the session in sessionPath. Returns false if there is no index or it is damaged,
+// entries is empty then.
+//
+bool LoadSessionIndex(const QString& sessionPath, std::vector<SessionIndexEntry>* entries);
+
+//
+// Merges entries into the index of the session in sessionPath, replacing entries of the same meta file.
+// Safe to call from several threads, updates are serialized and the index is replaced atomically, so
+// LoadSessionIndex() always finds a complete index.
+//
+bool UpdateSessionIndex(const QString& sessionPath, const std::vector<SessionIndexEntry>& entries);
+
+//
+// Loads the snapshots of the session in sessionPath on theTaskScheduler and returns right away.
+//
+// Snapshots the index knows only need their meta file, their thumbnails are decoded later by
+// theThumbnailCache. Snapshots missing from the index are read once in parallel, snapshots saved before
+// thumbnails existed get one from their color image, and the index is updated, so the next load is fast.
+//
+// listener needs to define the SLOTs
+//   OnSessionSnapshotLoaded(SnapshotMetaInformation, size_t), called with the meta information and the number
+//                                                             of points of every snapshot in the order of the
+//                                                             index, as soon as it and all before it are loaded, and
+//   OnScanSessionLoaded(QString, int, size_t), called with sessionPath, the number of loaded snapshots and
+//                                              their total number of points at the end.
+//
+// Several sessions can be loaded at the same time.
+//
+void LoadScanSessionAsync(const QString& sessionPath, QObject* listener);
+
+#endif // SESSIONINDEX_H
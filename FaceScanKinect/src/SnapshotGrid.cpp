@@ -6,7 +6,10 @@
 #include <QMouseEvent>
 #include <QMenu>
 #include <QAction>
+#include <QDir>
+#include <QFileInfo>
 
+#include "SnapshotThumbnails.h"
 #include "util.h"
 
 
@@ -33,14 +36,27 @@ SnapshotGrid::SnapshotGrid(QWidget *parent)
     connect(this, &QWidget::customContextMenuRequested, this, &SnapshotGrid::onContextMenuRequested);
 }
 
-void SnapshotGrid::addSelectableSnapshot(QString metaFileLocation)
+void SnapshotGrid::addSelectableSnapshot(QString metaFileLocation, size_t numPoints)
 {
     SnapshotMetaInformation metaInf;
     bool validMetaFile = LoadMetaFile(metaFileLocation.toStdString(), &metaInf);
 
     if (!validMetaFile) { return; }
 
-    SelectableSnapshot* snapshot = new SelectableSnapshot(this, metaInf);
+    // Snapshots saved before thumbnails existed may have one from loading their session
+    if (metaInf.thumbnailFile.empty()) {
+        QFileInfo metaFile(metaFileLocation);
+        metaInf.thumbnailFile = metaFile.absoluteDir().filePath(
+                    QString::fromStdString(SnapshotThumbnailFileName(metaFile.fileName().toStdString()))).toStdString();
+    }
+
+    addSelectableSnapshot(metaInf, numPoints);
+}
+
+void SnapshotGrid::addSelectableSnapshot(SnapshotMetaInformation metaInfo, size_t numPoints)
+{
+    SelectableSnapshot* snapshot = new SelectableSnapshot(this, metaInfo);
+    snapshot->setToolTip(QString("%1 points").arg(numPoints));
     snapshots.append(snapshot);
 
     grid->addWidget(snapshot, layoutRow, layoutColumn++);
@@ -106,6 +122,17 @@ void SnapshotGrid::RemoveAll(bool)
 
 }
 
+void SnapshotGrid::OnThumbnailReady(QString thumbnailFile, QImage thumbnail)
+{
+    if (thumbnail.isNull()) { return; }
+
+    for (auto snapshot : snapshots) {
+        if (snapshot->ThumbnailKey() == thumbnailFile) {
+            snapshot->SetThumbnail(thumbnail);
+        }
+    }
+}
+
 void SnapshotGrid::Remove(SelectableSnapshot *snapshot)
 {
     grid->removeWidget(snapshot);
@@ -129,6 +156,17 @@ SelectableSnapshot::SelectableSnapshot(SnapshotGrid* parent, SnapshotMetaInforma
     Initialize();
 }
 
+QString SelectableSnapshot::ThumbnailKey() const
+{
+    // Snapshots without a thumbnail file get theirs from the color image
+    return QString::fromStdString(meta.thumbnailFile.empty() ? meta.colorFile : meta.thumbnailFile);
+}
+
+void SelectableSnapshot::SetThumbnail(const QImage& thumbnail)
+{
+    this->setPixmap(QPixmap::fromImage(thumbnail).scaledToWidth(this->width()));
+}
+
 void SelectableSnapshot::mousePressEvent(QMouseEvent *event)
 {
     QLabel::mousePressEvent(event);
@@ -177,7 +215,13 @@ void SelectableSnapshot::Initialize()
     //
     // TODO: Resize pixmap on widget resize??
     //
-    this->setPixmap(QPixmap::fromImage(QImage(QString::fromStdString(meta.colorFile))).scaledToWidth(this->width()));
+    // The grid sets the thumbnail once it is decoded, the widget stays empty until then
+    QImage thumbnail = theThumbnailCache.Find(ThumbnailKey());
+    if (!thumbnail.isNull()) {
+        SetThumbnail(thumbnail);
+    } else {
+        theThumbnailCache.RequestAsync(ThumbnailKey(), meta.colorFile, parent_);
+    }
 
     this->selected = true;
     this->setStyleSheet(enabledStyle);
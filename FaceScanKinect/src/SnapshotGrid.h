@@ -3,6 +3,7 @@
 
 #include <QWidget>
 #include <QLabel>
+#include <QImage>
 #include <QVector>
 
 #include "util.h"
@@ -23,7 +24,16 @@ public:
     SnapshotGrid(QWidget* parent);
     ~SnapshotGrid() { }
 
-    void addSelectableSnapshot(QString metaFileLocation);
+    //
+    // numPoints of the snapshot's point cloud is shown in its tooltip
+    //
+    void addSelectableSnapshot(QString metaFileLocation, size_t numPoints);
+
+    //
+    // Adds a snapshot that is already loaded, e.g. by LoadScanSessionAsync(). Its thumbnail shows up once
+    // theThumbnailCache has it.
+    //
+    void addSelectableSnapshot(SnapshotMetaInformation metaInfo, size_t numPoints);
     void Remove(SelectableSnapshot* snapshot);
 
     QVector<SnapshotMetaInformation*> selectedSnapshots();
@@ -34,6 +44,8 @@ public slots:
     void RemoveAllDeselected(bool);
     void RemoveAll(bool);
 
+    void OnThumbnailReady(QString thumbnailFile, QImage thumbnail);
+
 private:
     QGridLayout* grid;
     QVector<SelectableSnapshot*> snapshots;
@@ -59,6 +71,12 @@ public:
     bool IsSelected() { return selected; }
     SnapshotMetaInformation* MetaInfo() { return &meta; }
 
+    //
+    // Identifies the thumbnail in theThumbnailCache
+    //
+    QString ThumbnailKey() const;
+    void SetThumbnail(const QImage& thumbnail);
+
 public slots:
     virtual void mousePressEvent(QMouseEvent* event) override;
     virtual void mouseReleaseEvent(QMouseEvent* event) override;
@@ -0,0 +1,409 @@
+#include "SnapshotImages.h"
+
+#include <QByteArray>
+#include <QDebug>
+
+#include <cstring>
+#include <fstream>
+
+//
+// File helpers
+//
+
+static bool WriteWholeFile(const std::string& filename, const uint8_t* data, size_t size) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) { return false; }
+
+    file.write((const char*)data, size);
+    file.close();
+    return !file.fail();
+}
+
+static bool ReadWholeFile(const std::string& filename, std::vector<uint8_t>* data) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) { return false; }
+
+    std::streamoff size = file.tellg();
+    if (size < 0) { return false; }
+
+    data->resize((size_t)size);
+    file.seekg(0);
+    file.read((char*)data->data(), size);
+    return !file.fail();
+}
+
+static inline void PutBigEndian32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >>  8);
+    p[3] = (uint8_t)(value);
+}
+
+static inline uint32_t GetBigEndian32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+//
+// QOI
+//
+
+static const uint8_t QOI_OP_INDEX = 0x00;
+static const uint8_t QOI_OP_DIFF  = 0x40;
+static const uint8_t QOI_OP_LUMA  = 0x80;
+static const uint8_t QOI_OP_RUN   = 0xC0;
+static const uint8_t QOI_OP_RGB   = 0xFE;
+static const uint8_t QOI_OP_RGBA  = 0xFF;
+static const uint8_t QOI_MASK_2   = 0xC0;
+
+static const size_t QOI_HEADER_SIZE = 14;
+static const uint8_t QOI_END_MARKER[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+// Pixels are packed like the color frame: R in the lowest byte, A in the highest
+static inline int QoiHash(uint32_t pixel) {
+    uint32_t r =  pixel        & 0xFF;
+    uint32_t g = (pixel >>  8) & 0xFF;
+    uint32_t b = (pixel >> 16) & 0xFF;
+    uint32_t a =  pixel >> 24;
+    return (int)((r * 3 + g * 5 + b * 7 + a * 11) % 64);
+}
+
+bool SaveColorImageQoi(const std::string& filename, const uint32_t* colors, int width, int height) {
+    size_t numPixels = (size_t)width * height;
+
+    // Worst case is one RGBA op per pixel
+    std::vector<uint8_t> encoded(QOI_HEADER_SIZE + numPixels * 5 + sizeof(QOI_END_MARKER));
+    uint8_t* out = encoded.data();
+
+    memcpy(out, "qoif", 4);
+    PutBigEndian32(out + 4, (uint32_t)width);
+    PutBigEndian32(out + 8, (uint32_t)height);
+    out[12] = 4;  // RGBA
+    out[13] = 0;  // sRGB with linear alpha
+    out += QOI_HEADER_SIZE;
+
+    uint32_t index[64];
+    memset(index, 0, sizeof(index));
+
+    uint32_t previous = 0xFF000000u;
+    int run = 0;
+
+    for (size_t i = 0; i < numPixels; ++i) {
+        uint32_t pixel = colors[i];
+
+        if (pixel == previous) {
+            run++;
+            if (run == 62 || i == numPixels - 1) {
+                *out++ = QOI_OP_RUN | (uint8_t)(run - 1);
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            *out++ = QOI_OP_RUN | (uint8_t)(run - 1);
+            run = 0;
+        }
+
+        int hash = QoiHash(pixel);
+        if (index[hash] == pixel) {
+            *out++ = QOI_OP_INDEX | (uint8_t)hash;
+            previous = pixel;
+            continue;
+        }
+        index[hash] = pixel;
+
+        if ((pixel >> 24) == (previous >> 24)) {
+            int8_t dr = (int8_t)((pixel       & 0xFF) - (previous       & 0xFF));
+            int8_t dg = (int8_t)((pixel >>  8 & 0xFF) - (previous >>  8 & 0xFF));
+            int8_t db = (int8_t)((pixel >> 16 & 0xFF) - (previous >> 16 & 0xFF));
+
+            int8_t dgr = dr - dg;
+            int8_t dgb = db - dg;
+
+            if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                *out++ = QOI_OP_DIFF | (uint8_t)((dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dgr > -9 && dgr < 8 && dg > -33 && dg < 32 && dgb > -9 && dgb < 8) {
+                *out++ = QOI_OP_LUMA | (uint8_t)(dg + 32);
+                *out++ = (uint8_t)((dgr + 8) << 4 | (dgb + 8));
+            } else {
+                *out++ = QOI_OP_RGB;
+                *out++ = (uint8_t)(pixel);
+                *out++ = (uint8_t)(pixel >> 8);
+                *out++ = (uint8_t)(pixel >> 16);
+            }
+        } else {
+            *out++ = QOI_OP_RGBA;
+            *out++ = (uint8_t)(pixel);
+            *out++ = (uint8_t)(pixel >> 8);
+            *out++ = (uint8_t)(pixel >> 16);
+            *out++ = (uint8_t)(pixel >> 24);
+        }
+
+        previous = pixel;
+    }
+
+    memcpy(out, QOI_END_MARKER, sizeof(QOI_END_MARKER));
+    out += sizeof(QOI_END_MARKER);
+
+    return WriteWholeFile(filename, encoded.data(), out - encoded.data());
+}
+
+static bool QoiEndsEarly(const std::string& filename) {
+    qCritical() << "QOI file ends early:" << QString::fromStdString(filename);
+    return false;
+}
+
+bool LoadColorImageQoi(const std::string& filename, std::vector<uint32_t>* colors, int* width, int* height) {
+    std::vector<uint8_t> encoded;
+    if (!ReadWholeFile(filename, &encoded)) { return false; }
+
+    if (encoded.size() < QOI_HEADER_SIZE + sizeof(QOI_END_MARKER) || memcmp(encoded.data(), "qoif", 4) != 0) {
+        qCritical() << "Not a QOI file:" << QString::fromStdString(filename);
+        return false;
+    }
+
+    uint32_t w = GetBigEndian32(&encoded[4]);
+    uint32_t h = GetBigEndian32(&encoded[8]);
+    if (w == 0 || h == 0 || (uint64_t)w * h > (1u << 28)) {
+        qCritical() << "QOI file has an invalid size:" << QString::fromStdString(filename);
+        return false;
+    }
+
+    size_t numPixels = (size_t)w * h;
+    colors->resize(numPixels);
+    uint32_t* pixels = colors->data();
+
+    uint32_t index[64];
+    memset(index, 0, sizeof(index));
+
+    const uint8_t* in  = encoded.data() + QOI_HEADER_SIZE;
+    const uint8_t* end = encoded.data() + encoded.size() - sizeof(QOI_END_MARKER);
+
+    uint32_t pixel = 0xFF000000u;
+    int run = 0;
+
+    for (size_t i = 0; i < numPixels; ++i) {
+        if (run > 0) {
+            run--;
+        } else if (in < end) {
+            uint8_t op = *in++;
+
+            if (op == QOI_OP_RGB) {
+                if (end - in < 3) { return QoiEndsEarly(filename); }
+                pixel = (pixel & 0xFF000000u) | in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16;
+                in += 3;
+            } else if (op == QOI_OP_RGBA) {
+                if (end - in < 4) { return QoiEndsEarly(filename); }
+                pixel = in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+                in += 4;
+            } else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+                pixel = index[op];
+            } else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+                uint8_t r = (uint8_t)(pixel      ) + ((op >> 4) & 0x03) - 2;
+                uint8_t g = (uint8_t)(pixel >>  8) + ((op >> 2) & 0x03) - 2;
+                uint8_t b = (uint8_t)(pixel >> 16) + ( op       & 0x03) - 2;
+                pixel = (pixel & 0xFF000000u) | r | (uint32_t)g << 8 | (uint32_t)b << 16;
+            } else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+                if (end - in < 1) { return QoiEndsEarly(filename); }
+                int dg = (op & 0x3F) - 32;
+                uint8_t next = *in++;
+                uint8_t r = (uint8_t)(pixel      ) + dg - 8 + ((next >> 4) & 0x0F);
+                uint8_t g = (uint8_t)(pixel >>  8) + dg;
+                uint8_t b = (uint8_t)(pixel >> 16) + dg - 8 + (next & 0x0F);
+                pixel = (pixel & 0xFF000000u) | r | (uint32_t)g << 8 | (uint32_t)b << 16;
+            } else {
+                run = op & 0x3F;
+            }
+
+            index[QoiHash(pixel)] = pixel;
+        } else {
+            return QoiEndsEarly(filename);
+        }
+
+        pixels[i] = pixel;
+    }
+
+    *width  = (int)w;
+    *height = (int)h;
+    return true;
+}
+
+//
+// 16-bit grayscale PNG
+//
+
+static uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool tableInitialized = [] {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) { c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1; }
+            table[n] = c;
+        }
+        return true;
+    }();
+    (void)tableInitialized;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void AppendPngChunk(std::vector<uint8_t>* png, const char type[4], const uint8_t* data, size_t size) {
+    size_t start = png->size();
+    png->resize(start + 12 + size);
+    uint8_t* chunk = png->data() + start;
+
+    PutBigEndian32(chunk, (uint32_t)size);
+    memcpy(chunk + 4, type, 4);
+    if (size > 0) { memcpy(chunk + 8, data, size); }
+    PutBigEndian32(chunk + 8 + size, Crc32(chunk + 4, 4 + size));
+}
+
+static const uint8_t PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+static const uint8_t PNG_FILTER_SUB = 1;
+static const int PNG_BYTES_PER_PIXEL = 2;
+
+bool SaveDepthImagePng16(const std::string& filename, const uint16_t* depth, int width, int height) {
+    // Big endian samples, every row filtered with the difference to the pixel on the left, which turns the
+    // smooth depth of a surface into small values that zlib compresses well
+    size_t rowSize = (size_t)width * PNG_BYTES_PER_PIXEL + 1;
+    QByteArray rows((int)(rowSize * height), Qt::Uninitialized);
+    uint8_t* out = (uint8_t*)rows.data();
+
+    for (int y = 0; y < height; ++y) {
+        const uint16_t* row = depth + (size_t)y * width;
+        *out++ = PNG_FILTER_SUB;
+
+        uint16_t left = 0;
+        for (int x = 0; x < width; ++x) {
+            // Sub filters bytes, the carry from the low byte is not propagated into the high byte
+            uint8_t high = (uint8_t)(row[x] >> 8) - (uint8_t)(left >> 8);
+            uint8_t low  = (uint8_t)(row[x])      - (uint8_t)(left);
+            *out++ = high;
+            *out++ = low;
+            left = row[x];
+        }
+    }
+
+    // qCompress() puts the uncompressed size in front of the zlib stream
+    QByteArray compressed = qCompress(rows, 1);
+    if (compressed.size() <= 4) { return false; }
+
+    uint8_t header[13];
+    PutBigEndian32(header,     (uint32_t)width);
+    PutBigEndian32(header + 4, (uint32_t)height);
+    header[8]  = 16;  // Bit depth
+    header[9]  = 0;   // Grayscale
+    header[10] = 0;   // Deflate
+    header[11] = 0;   // Adaptive filtering
+    header[12] = 0;   // Not interlaced
+
+    std::vector<uint8_t> png(PNG_SIGNATURE, PNG_SIGNATURE + sizeof(PNG_SIGNATURE));
+    png.reserve(compressed.size() + 64);
+    AppendPngChunk(&png, "IHDR", header, sizeof(header));
+    AppendPngChunk(&png, "IDAT", (const uint8_t*)compressed.constData() + 4, compressed.size() - 4);
+    AppendPngChunk(&png, "IEND", nullptr, 0);
+
+    return WriteWholeFile(filename, png.data(), png.size());
+}
+
+bool LoadDepthImagePng16(const std::string& filename, std::vector<uint16_t>* depth, int* width, int* height) {
+    std::vector<uint8_t> png;
+    if (!ReadWholeFile(filename, &png)) { return false; }
+
+    if (png.size() < sizeof(PNG_SIGNATURE) || memcmp(png.data(), PNG_SIGNATURE, sizeof(PNG_SIGNATURE)) != 0) {
+        qCritical() << "Not a PNG file:" << QString::fromStdString(filename);
+        return false;
+    }
+
+    uint32_t w = 0, h = 0;
+    QByteArray zlibStream;
+
+    size_t offset = sizeof(PNG_SIGNATURE);
+    while (offset + 12 <= png.size()) {
+        uint32_t size = GetBigEndian32(&png[offset]);
+        if (offset + 12 + size > png.size()) { break; }
+
+        const uint8_t* type = &png[offset + 4];
+        const uint8_t* data = &png[offset + 8];
+
+        if (memcmp(type, "IHDR", 4) == 0 && size == 13) {
+            w = GetBigEndian32(data);
+            h = GetBigEndian32(data + 4);
+            if (data[8] != 16 || data[9] != 0 || data[12] != 0) {
+                qCritical() << "Only 16-bit grayscale PNG files are supported:" << QString::fromStdString(filename);
+                return false;
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            zlibStream.append((const char*)data, size);
+        }
+
+        offset += 12 + size;
+    }
+
+    if (w == 0 || h == 0 || (uint64_t)w * h > (1u << 28)) {
+        qCritical() << "PNG file has an invalid size:" << QString::fromStdString(filename);
+        return false;
+    }
+
+    size_t rowSize = (size_t)w * PNG_BYTES_PER_PIXEL + 1;
+
+    // qUncompress() expects the size in front, like qCompress() writes it
+    uint8_t sizePrefix[4];
+    PutBigEndian32(sizePrefix, (uint32_t)(rowSize * h));
+    zlibStream.prepend((const char*)sizePrefix, 4);
+
+    QByteArray rows = qUncompress(zlibStream);
+    if ((size_t)rows.size() != rowSize * h) {
+        qCritical() << "PNG file is damaged:" << QString::fromStdString(filename);
+        return false;
+    }
+
+    depth->resize((size_t)w * h);
+    const uint8_t* in = (const uint8_t*)rows.constData();
+
+    for (uint32_t y = 0; y < h; ++y) {
+        uint8_t filter = *in++;
+        if (filter != 0 && filter != PNG_FILTER_SUB) {
+            qCritical() << "Unsupported PNG filter in" << QString::fromStdString(filename);
+            return false;
+        }
+
+        uint16_t* row = depth->data() + (size_t)y * w;
+        uint8_t leftHigh = 0, leftLow = 0;
+        for (uint32_t x = 0; x < w; ++x) {
+            uint8_t high = *in++;
+            uint8_t low  = *in++;
+            if (filter == PNG_FILTER_SUB) {
+                high += leftHigh;
+                low  += leftLow;
+            }
+            row[x] = (uint16_t)(high << 8 | low);
+            leftHigh = high;
+            leftLow  = low;
+        }
+    }
+
+    *width  = (int)w;
+    *height = (int)h;
+    return true;
+}
+
+QImage LoadSnapshotColorImage(const std::string& filename) {
+    size_t extension = filename.rfind('.');
+    if (extension == std::string::npos || filename.compare(extension, std::string::npos, ".qoi") != 0) {
+        return QImage(QString::fromStdString(filename));
+    }
+
+    std::vector<uint32_t> colors;
+    int width, height;
+    if (!LoadColorImageQoi(filename, &colors, &width, &height)) {
+        return QImage();
+    }
+
+    // Deep copy, the pixels of colors are gone after returning
+    return QImage((const uchar*)colors.data(), width, height, QImage::Format_RGBA8888).copy();
+}
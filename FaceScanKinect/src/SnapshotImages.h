@@ -0,0 +1,44 @@
+#ifndef SNAPSHOTIMAGES_H
+#define SNAPSHOTIMAGES_H
+
+#include <QImage>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// Lossless image files of a snapshot, encoded straight from the frame buffers without QPixmap, so they can be
+// written on any thread.
+//
+// The color image is stored as QOI ("Quite OK Image" format, https://qoiformat.org): a single pass over the
+// pixels that only looks at the previous pixel and a small table of recent colors. It encodes several times
+// faster than PNG and is a fraction of a BMP for camera images. Neither Qt nor OpenCV read QOI, use
+// LoadSnapshotColorImage() to read color images of snapshots.
+//
+// The depth image is the raw 16-bit depth in millimeters as a grayscale PNG, compressed with the fastest
+// zlib level. It keeps the full range the 8-bit depth BMP threw away.
+//
+
+bool SaveColorImageQoi(const std::string& filename, const uint32_t* colors, int width, int height);
+
+//
+// Reads a QOI file into colors (packed like the color frame, R in the lowest byte). Returns false if the file
+// cannot be read or is not a valid QOI file.
+//
+bool LoadColorImageQoi(const std::string& filename, std::vector<uint32_t>* colors, int* width, int* height);
+
+bool SaveDepthImagePng16(const std::string& filename, const uint16_t* depth, int width, int height);
+
+//
+// Reads a depth image written by SaveDepthImagePng16(). Other PNG files are not supported.
+//
+bool LoadDepthImagePng16(const std::string& filename, std::vector<uint16_t>* depth, int* width, int* height);
+
+//
+// Color image of a snapshot as QImage, for QOI files as well as the BMP files of older snapshots.
+// Returns a null image if the file cannot be read.
+//
+QImage LoadSnapshotColorImage(const std::string& filename);
+
+#endif // SNAPSHOTIMAGES_H
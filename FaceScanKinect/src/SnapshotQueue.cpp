@@ -0,0 +1,70 @@
+#include "SnapshotQueue.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QMetaObject>
+
+#include "ScanSession.h"
+#include "SessionIndex.h"
+#include "SnapshotThumbnails.h"
+#include "TaskScheduler.h"
+
+SnapshotQueue theSnapshotQueue;
+
+SnapshotQueue::SnapshotQueue()
+    : queued_(0),
+      failed_(0)
+{
+}
+
+bool SnapshotQueue::Submit(FrameHandle frame, PointCloudHandle filtered, QObject* listener,
+                           PointCloudHelpers::NeighborSearchMethod neighborSearch, PointCloudFileFormat pointCloudFormat)
+{
+    QString snapshotPath = theScanSession.getCurrentScanSession();
+    if (!QDir().mkpath(snapshotPath)) {
+        qCritical() << "Could not create snapshot directory at " << snapshotPath;
+        return false;
+    }
+
+    int snapshotNumber = PointCloudHelpers::theSnapshotCount++;
+    int64_t submitTimeNs = PipelineNowNs();
+    queued_++;
+
+    theTaskScheduler.Submit(PRIORITY_SNAPSHOT_IO, [=]() mutable {
+        QString metaFile = PointCloudHelpers::SaveSnapshot(frame.Get(), filtered.Get(), snapshotPath, snapshotNumber,
+                                                           neighborSearch, pointCloudFormat);
+
+        // The pinned frame goes back to its pool before the listener hears about it, the point cloud is handed
+        // over so the listener can show it without reading the files back
+        frame.Reset();
+
+        if (metaFile.isEmpty()) {
+            failed_++;
+            filtered.Reset();
+        } else {
+            SessionIndexEntry entry;
+            entry.metaFile      = QFileInfo(metaFile).fileName().toStdString();
+            entry.numPoints     = filtered->numPoints;
+            entry.thumbnailFile = SnapshotThumbnailFileName(entry.metaFile);
+            UpdateSessionIndex(snapshotPath, { entry });
+
+            latency_.Record(submitTimeNs, PipelineNowNs());
+        }
+        queued_--;
+
+        QMetaObject::invokeMethod(listener, "OnSnapshotSaved", Qt::QueuedConnection,
+                                  Q_ARG(QString, metaFile), Q_ARG(PointCloudHandle, filtered));
+    });
+
+    return true;
+}
+
+SnapshotQueueCounters SnapshotQueue::Counters() const
+{
+    SnapshotQueueCounters result;
+    result.queued  = queued_.load();
+    result.failed  = failed_.load();
+    result.latency = latency_.Counters();
+    return result;
+}
@@ -0,0 +1,66 @@
+#ifndef SNAPSHOTQUEUE_H
+#define SNAPSHOTQUEUE_H
+
+#include <QObject>
+#include <QString>
+
+#include <atomic>
+
+#include "CapturePipeline.h"
+#include "MemoryPool.h"
+#include "PointCloud.h"
+
+struct SnapshotQueueCounters {
+    // Submitted snapshots that are not written yet
+    size_t queued;
+
+    uint64_t failed;
+
+    // Time from submitting a snapshot until all of its files are in place
+    PipelineStageCounters latency;
+};
+
+/**
+ * @brief The SnapshotQueue class saves snapshots in the background.
+ *
+ * Every snapshot is a job on theTaskScheduler with the lowest priority. It keeps its pinned frame and
+ * point cloud buffer until it is done, so bursts of snapshots never overwrite each other. Free workers
+ * pick up the next snapshot while the previous one is still written, and the files of a snapshot are
+ * encoded in parallel (see PointCloudHelpers::WriteSnapshot()). Snapshots are numbered in the order they
+ * were submitted, but they may be complete and reported in a different order.
+ *
+ * Use the application wide instance theSnapshotQueue.
+ */
+class SnapshotQueue
+{
+public:
+    SnapshotQueue();
+
+    //
+    // Queues a snapshot of frame into the current scan session. The point cloud of frame is filtered into
+    // filtered, which gets the normals. The snapshot number is taken right away, so the numbers follow the
+    // order of submission.
+    //
+    // listener needs to define a SLOT named OnSnapshotSaved(QString, PointCloudHandle), it gets the meta file
+    // and filtered, as it was written, once the snapshot is complete, or an empty string and an empty handle if
+    // writing failed. A later snapshot may be reported first. Returns false if the snapshot directory could not
+    // be created, nothing was queued then.
+    //
+    bool Submit(FrameHandle frame, PointCloudHandle filtered, QObject* listener,
+                PointCloudHelpers::NeighborSearchMethod neighborSearch = PointCloudHelpers::NEIGHBORS_KDTREE,
+                PointCloudFileFormat pointCloudFormat = POINTCLOUD_FORMAT_BINARY);
+
+    SnapshotQueueCounters Counters() const;
+
+private:
+    SnapshotQueue(const SnapshotQueue&);
+    SnapshotQueue& operator=(const SnapshotQueue&);
+
+    std::atomic<size_t>   queued_;
+    std::atomic<uint64_t> failed_;
+    PipelineStageMetrics  latency_;
+};
+
+extern SnapshotQueue theSnapshotQueue;
+
+#endif // SNAPSHOTQUEUE_H
@@ -0,0 +1,153 @@
+#include "SnapshotThumbnails.h"
+
+#include <QDebug>
+#include <QMetaObject>
+
+#include "MemoryPool.h"
+#include "SnapshotImages.h"
+#include "TaskScheduler.h"
+
+ThumbnailCache theThumbnailCache;
+
+std::string SnapshotThumbnailFileName(const std::string& metaFileName)
+{
+    const std::string metaSuffix = "snapshot.meta";
+
+    if (metaFileName.size() >= metaSuffix.size() &&
+        metaFileName.compare(metaFileName.size() - metaSuffix.size(), metaSuffix.size(), metaSuffix) == 0) {
+        return metaFileName.substr(0, metaFileName.size() - metaSuffix.size()) + "thumbnail.png";
+    }
+
+    return metaFileName + ".thumbnail.png";
+}
+
+QImage CreateThumbnail(const QImage& image)
+{
+    return image.scaledToWidth(SNAPSHOT_THUMBNAIL_WIDTH, Qt::SmoothTransformation);
+}
+
+bool SaveColorFrameThumbnail(const std::string& thumbnailFile, const uint32_t* colors)
+{
+    QImage frame((const uchar*)colors, COLOR_WIDTH, COLOR_HEIGHT, QImage::Format_RGBA8888);
+    return CreateThumbnail(frame).save(QString::fromStdString(thumbnailFile), "PNG");
+}
+
+ThumbnailCache::ThumbnailCache(size_t maxBytes)
+    : bytes_(0),
+      maxBytes_(maxBytes),
+      hits_(0),
+      misses_(0),
+      evictions_(0)
+{
+}
+
+QImage ThumbnailCache::Find(const QString& thumbnailFile)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto found = index_.find(thumbnailFile.toStdString());
+    if (found == index_.end()) {
+        ++misses_;
+        return QImage();
+    }
+
+    ++hits_;
+    entries_.splice(entries_.begin(), entries_, found->second);
+    return found->second->thumbnail;
+}
+
+void ThumbnailCache::Insert(const QString& thumbnailFile, const QImage& thumbnail)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    InsertLocked(thumbnailFile.toStdString(), thumbnail);
+}
+
+void ThumbnailCache::InsertLocked(const std::string& file, const QImage& thumbnail)
+{
+    if (thumbnail.isNull()) { return; }
+
+    auto found = index_.find(file);
+    if (found != index_.end()) {
+        bytes_ -= (size_t)found->second->thumbnail.sizeInBytes();
+        entries_.erase(found->second);
+        index_.erase(found);
+    }
+
+    Entry entry;
+    entry.file = file;
+    entry.thumbnail = thumbnail;
+    entries_.push_front(entry);
+    index_[file] = entries_.begin();
+    bytes_ += (size_t)thumbnail.sizeInBytes();
+
+    // The newest thumbnail stays, even if it alone is larger than the cache
+    while (bytes_ > maxBytes_ && entries_.size() > 1) {
+        const Entry& oldest = entries_.back();
+        bytes_ -= (size_t)oldest.thumbnail.sizeInBytes();
+        index_.erase(oldest.file);
+        entries_.pop_back();
+        ++evictions_;
+    }
+}
+
+void ThumbnailCache::RequestAsync(const QString& thumbnailFile, const std::string& fallbackColorFile, QObject* listener)
+{
+    std::string file = thumbnailFile.toStdString();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        auto found = index_.find(file);
+        if (found != index_.end()) {
+            ++hits_;
+            entries_.splice(entries_.begin(), entries_, found->second);
+            QMetaObject::invokeMethod(listener, "OnThumbnailReady", Qt::QueuedConnection,
+                                      Q_ARG(QString, thumbnailFile), Q_ARG(QImage, found->second->thumbnail));
+            return;
+        }
+
+        ++misses_;
+
+        std::vector<QObject*>& listeners = pending_[file];
+        listeners.push_back(listener);
+        if (listeners.size() > 1) { return; }
+    }
+
+    theTaskScheduler.Submit(PRIORITY_PROCESSING, [=]() {
+        QImage thumbnail(thumbnailFile);
+
+        if (thumbnail.isNull() && !fallbackColorFile.empty()) {
+            QImage colorImage = LoadSnapshotColorImage(fallbackColorFile);
+            if (!colorImage.isNull()) {
+                thumbnail = CreateThumbnail(colorImage);
+            }
+        }
+
+        if (thumbnail.isNull()) {
+            qWarning() << "Cannot read thumbnail " << thumbnailFile;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        InsertLocked(file, thumbnail);
+
+        for (QObject* waiting : pending_[file]) {
+            QMetaObject::invokeMethod(waiting, "OnThumbnailReady", Qt::QueuedConnection,
+                                      Q_ARG(QString, thumbnailFile), Q_ARG(QImage, thumbnail));
+        }
+        pending_.erase(file);
+    });
+}
+
+ThumbnailCacheCounters ThumbnailCache::Counters() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    ThumbnailCacheCounters result;
+    result.entries   = entries_.size();
+    result.bytes     = bytes_;
+    result.maxBytes  = maxBytes_;
+    result.hits      = hits_;
+    result.misses    = misses_;
+    result.evictions = evictions_;
+    return result;
+}
@@ -0,0 +1,120 @@
+#ifndef SNAPSHOTTHUMBNAILS_H
+#define SNAPSHOTTHUMBNAILS_H
+
+#include <QImage>
+#include <QObject>
+#include <QString>
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//
+// Small previews of snapshots for the SnapshotGrid. Every snapshot writes one next to its files, so the
+// grid never has to decode a full color image.
+//
+
+//
+// Width of the thumbnails, the widest a snapshot is shown in the SnapshotGrid
+//
+const int SNAPSHOT_THUMBNAIL_WIDTH = 200;
+
+//
+// Decoded thumbnails kept in memory, about 700 thumbnails of 16:9 color images
+//
+const size_t THUMBNAIL_CACHE_BYTES = 64 * 1024 * 1024;
+
+//
+// Name of the thumbnail of a snapshot, "000_snapshot.meta" gets "000_thumbnail.png"
+//
+std::string SnapshotThumbnailFileName(const std::string& metaFileName);
+
+//
+// Scales image down to the thumbnail width
+//
+QImage CreateThumbnail(const QImage& image);
+
+//
+// Writes the thumbnail of a color frame (COLOR_WIDTH x COLOR_HEIGHT, packed like the color frame) as PNG.
+// Safe to call on any thread.
+//
+bool SaveColorFrameThumbnail(const std::string& thumbnailFile, const uint32_t* colors);
+
+struct ThumbnailCacheCounters {
+    size_t entries;
+    size_t bytes;
+    size_t maxBytes;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+/**
+ * @brief The ThumbnailCache class decodes thumbnails on theTaskScheduler and keeps the most recently used
+ * ones in memory, up to maxBytes of pixels.
+ *
+ * Thumbnails are identified by their file. Use the application wide instance theThumbnailCache.
+ */
+class ThumbnailCache
+{
+public:
+    ThumbnailCache(size_t maxBytes = THUMBNAIL_CACHE_BYTES);
+
+    //
+    // Returns the cached thumbnail of thumbnailFile and marks it as the most recently used one, a null image
+    // if it is not cached
+    //
+    QImage Find(const QString& thumbnailFile);
+
+    //
+    // Caches thumbnail for thumbnailFile, evicting the least recently used thumbnails if the cache is full
+    //
+    void Insert(const QString& thumbnailFile, const QImage& thumbnail);
+
+    //
+    // Decodes thumbnailFile on a worker and caches it. If it cannot be read, e.g. for snapshots saved before
+    // thumbnails existed, a thumbnail is created from fallbackColorFile instead (and not saved).
+    //
+    // listener needs to define a SLOT named OnThumbnailReady(QString, QImage), it gets thumbnailFile and the
+    // thumbnail, a null image if neither file could be read. A thumbnail that is already cached is handed
+    // out right away through the same slot. Requests for a thumbnail that is still being decoded are merged.
+    //
+    void RequestAsync(const QString& thumbnailFile, const std::string& fallbackColorFile, QObject* listener);
+
+    ThumbnailCacheCounters Counters() const;
+
+private:
+    ThumbnailCache(const ThumbnailCache&);
+    ThumbnailCache& operator=(const ThumbnailCache&);
+
+    struct Entry {
+        std::string file;
+        QImage thumbnail;
+    };
+
+    void InsertLocked(const std::string& file, const QImage& thumbnail);
+
+    mutable std::mutex mutex_;
+
+    // Most recently used first
+    std::list<Entry> entries_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+
+    // Listeners waiting for thumbnails that are being decoded
+    std::unordered_map<std::string, std::vector<QObject*>> pending_;
+
+    size_t bytes_;
+    size_t maxBytes_;
+
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t evictions_;
+};
+
+extern ThumbnailCache theThumbnailCache;
+
+#endif // SNAPSHOTTHUMBNAILS_H
@@ -0,0 +1,163 @@
+#include "TaskScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include <QThread>
+
+TaskScheduler theTaskScheduler;
+
+// Priority of the task the current worker runs, threads outside of the pool count as capture
+static thread_local TaskPriority theCurrentPriority = PRIORITY_CAPTURE;
+
+TaskScheduler::TaskScheduler(int numWorkers)
+    : quit_(false)
+    , draining_(false)
+{
+    if (numWorkers <= 0) {
+        numWorkers = std::max(2, QThread::idealThreadCount());
+    }
+
+    workers_.reserve(numWorkers);
+    for (int i = 0; i < numWorkers; ++i) {
+        workers_.emplace_back(&TaskScheduler::WorkerLoop, this);
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+
+        // Tasks that did not start yet are dropped, their futures report a broken promise.
+        // They may refer to objects that are already gone when the application shuts down.
+        for (auto& queue : queues_) { queue.clear(); }
+    }
+    taskAvailable_.notify_all();
+
+    for (auto& worker : workers_) {
+        if (worker.joinable()) { worker.join(); }
+    }
+}
+
+void TaskScheduler::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        draining_ = true;
+    }
+    taskAvailable_.notify_all();
+
+    for (auto& worker : workers_) {
+        if (worker.joinable()) { worker.join(); }
+    }
+
+    // Tasks queued after the last worker left
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+    for (auto& queue : queues_) { queue.clear(); }
+}
+
+void TaskScheduler::Enqueue(TaskPriority priority, std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // After a shutdown no worker would ever run it
+        if (quit_) { return; }
+
+        queues_[priority].push_back(std::move(task));
+    }
+    taskAvailable_.notify_one();
+}
+
+void TaskScheduler::WorkerLoop()
+{
+    while (true) {
+        std::function<void()> task;
+        TaskPriority priority = PRIORITY_CAPTURE;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            auto findQueue = [&]() {
+                for (int p = 0; p < NUM_TASK_PRIORITIES; ++p) {
+                    if (!queues_[p].empty()) { priority = (TaskPriority)p; return true; }
+                }
+                return false;
+            };
+
+            bool found = false;
+            taskAvailable_.wait(lock, [&]() { found = findQueue(); return found || quit_ || draining_; });
+
+            // While draining, workers only leave once every queue is empty
+            if (quit_ || !found) { return; }
+
+            task = std::move(queues_[priority].front());
+            queues_[priority].pop_front();
+        }
+
+        theCurrentPriority = priority;
+        task();
+        theCurrentPriority = PRIORITY_CAPTURE;
+    }
+}
+
+TaskPriority TaskScheduler::CurrentPriority()
+{
+    return theCurrentPriority;
+}
+
+void TaskScheduler::RunChunks(size_t numChunks, const std::function<void(size_t)>& work)
+{
+    if (numChunks == 0) { return; }
+    if (numChunks == 1) { work(0); return; }
+
+    //
+    // Every chunk is claimed exactly once, either by a worker or by the calling thread. Tasks of chunks
+    // the caller already ran stay in the queue and return immediately, so the state is shared with them.
+    //
+    struct ChunkState {
+        ChunkState(size_t numChunks) : claimed(new std::atomic<bool>[numChunks]), remaining(numChunks) {
+            for (size_t i = 0; i < numChunks; ++i) { claimed[i] = false; }
+        }
+
+        bool Claim(size_t chunk) { return !claimed[chunk].exchange(true); }
+
+        void Finish() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--remaining == 0) { allDone.notify_all(); }
+        }
+
+        std::unique_ptr<std::atomic<bool>[]> claimed;
+        std::mutex mutex;
+        std::condition_variable allDone;
+        size_t remaining;
+    };
+
+    std::shared_ptr<ChunkState> state = std::make_shared<ChunkState>(numChunks);
+    const std::function<void(size_t)>* sharedWork = &work;
+
+    // The caller waits for these, so they inherit its priority
+    TaskPriority priority = CurrentPriority();
+    for (size_t chunk = 1; chunk < numChunks; ++chunk) {
+        Enqueue(priority, [state, sharedWork, chunk]() {
+            // work is only touched after a successful claim, i.e. while the caller still waits
+            if (state->Claim(chunk)) {
+                (*sharedWork)(chunk);
+                state->Finish();
+            }
+        });
+    }
+
+    for (size_t chunk = 0; chunk < numChunks; ++chunk) {
+        if (state->Claim(chunk)) {
+            work(chunk);
+            state->Finish();
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->allDone.wait(lock, [&]() { return state->remaining == 0; });
+}
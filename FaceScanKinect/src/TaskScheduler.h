@@ -0,0 +1,100 @@
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//
+// Priorities of scheduled tasks, lower values run first. Tasks are not preempted, a priority only
+// decides which queued task a free worker picks next.
+//
+enum TaskPriority {
+    PRIORITY_CAPTURE,           // Work the capture loop waits for
+    PRIORITY_FACE_TRACKING,
+    PRIORITY_PROCESSING,        // Filtering and normals requested from the UI
+    PRIORITY_SNAPSHOT_IO,
+
+    NUM_TASK_PRIORITIES
+};
+
+/**
+ * @brief The TaskScheduler class runs tasks on a fixed pool of worker threads.
+ *
+ * The workers are started once and live as long as the scheduler, so submitting a task costs a
+ * queue insertion instead of a thread creation. Use the application wide instance theTaskScheduler.
+ */
+class TaskScheduler
+{
+public:
+    //
+    // numWorkers <= 0 means one worker per core, but at least two, so a long task (e.g. saving a
+    // snapshot) never blocks face tracking completely.
+    //
+    TaskScheduler(int numWorkers = 0);
+
+    //
+    // Lets the workers finish the tasks they are running and joins them. Tasks that did not start yet
+    // are dropped, their futures report a broken promise. Call Shutdown() before the objects tasks refer
+    // to go away.
+    //
+    ~TaskScheduler();
+
+    //
+    // Runs all queued tasks, including the ones they queue, to completion and joins the workers. Tasks
+    // submitted afterwards are dropped like in the destructor.
+    //
+    void Shutdown();
+
+    //
+    // Queues task and returns a future for its result
+    //
+    template<typename Task>
+    std::future<std::invoke_result_t<Task>> Submit(TaskPriority priority, Task task) {
+        typedef std::invoke_result_t<Task> Result;
+
+        auto packagedTask = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+        std::future<Result> result = packagedTask->get_future();
+        Enqueue(priority, [packagedTask]() { (*packagedTask)(); });
+        return result;
+    }
+
+    //
+    // Calls work(chunk) for every chunk in [0, numChunks) and returns when all calls are done.
+    // The calling thread takes part and runs every chunk no worker has started yet itself, so this
+    // can safely be called from within a task.
+    //
+    void RunChunks(size_t numChunks, const std::function<void(size_t)>& work);
+
+    int NumWorkers() const { return (int)workers_.size(); }
+
+    //
+    // Priority of the task running on the calling thread, PRIORITY_CAPTURE outside of the pool
+    //
+    static TaskPriority CurrentPriority();
+
+private:
+    TaskScheduler(const TaskScheduler&);
+    TaskScheduler& operator=(const TaskScheduler&);
+
+    void Enqueue(TaskPriority priority, std::function<void()> task);
+    void WorkerLoop();
+
+    std::mutex mutex_;
+    std::condition_variable taskAvailable_;
+    std::deque<std::function<void()>> queues_[NUM_TASK_PRIORITIES];
+    bool quit_;
+    bool draining_;
+
+    std::vector<std::thread> workers_;
+};
+
+extern TaskScheduler theTaskScheduler;
+
+#endif // TASKSCHEDULER_H
@@ -7,6 +7,8 @@
 #include <QOpenGLFunctions>
 #include <QElapsedTimer>
 
+#include "SnapshotImages.h"
+
 // TODO: Factor out load functionality and only deal with
 //       OpenGL display here!!
 
@@ -16,8 +18,8 @@ const std::string data_directory = "..\\..\\data\\";
 // TODO: which texture size is appropriate
 const int TEXTURE_SIZE = 2048 * 2;
 
-TextureDisplay::TextureDisplay(ICoordinateMapper* coordinateMapper, std::string metaFileLocation) :
-    coordinateMapper_(coordinateMapper)
+TextureDisplay::TextureDisplay(const CameraCalibration& calibration, std::string metaFileLocation) :
+    coordinateMapper_(calibration)
 {
     LoadMetaFile(metaFileLocation, &meta);
 
@@ -30,6 +32,7 @@ TextureDisplay::TextureDisplay(ICoordinateMapper* coordinateMapper, std::string
     cameraToColorMapping = new float2[vertices.size()];
 
     // loadMappingFile();
+    MapVerticesToColorSpace();
     fill_cpu_buffers();
 
     pixels = new uint32_t[TEXTURE_SIZE * TEXTURE_SIZE];
@@ -47,22 +50,31 @@ TextureDisplay::~TextureDisplay()
     delete program;
 }
 
-bool TextureDisplay::MapCameraToColorSpace(float3 pos, float2& out) {
-    CameraSpacePoint p = {pos.x, pos.y, pos.z};
-    ColorSpacePoint c;
-
-    HRESULT hr = coordinateMapper_->MapCameraPointToColorSpace(p, &c);
+//
+// Color image of a snapshot in the BGR layout of cv::imread(), which cannot read the QOI files of snapshots
+//
+static cv::Mat ReadSnapshotColorImage(const std::string& colorFile) {
+    QImage image = LoadSnapshotColorImage(colorFile).convertToFormat(QImage::Format_RGBA8888);
+    if (image.isNull()) {
+        qWarning() << "Could not read color image " << QString::fromStdString(colorFile);
+        return cv::Mat();
+    }
 
-    out.u = c.X / 1920.f;
-    out.v = c.Y / 1080.f;
+    cv::Mat bgr;
+    cv::cvtColor(cv::Mat(image.height(), image.width(), CV_8UC4, image.bits(), image.bytesPerLine()), bgr, CV_RGBA2BGR);
+    return bgr;
+}
 
-    bool result = (SUCCEEDED(hr)    &&
-                   !std::isinf(c.X) &&
-                   !std::isinf(c.Y) &&
-                   c.X > 0          &&
-                   c.Y > 0);
+static_assert(sizeof(float3) == sizeof(Vec3f) && sizeof(float2) == sizeof(Vec2f),
+              "Mesh vertices are passed to the coordinate mapper as they are");
 
-    return result;
+//
+// Fills the mapping table with the color coordinates of all mesh vertices in one pass,
+// instead of going through the mapper once for every corner of every face
+//
+void TextureDisplay::MapVerticesToColorSpace() {
+    coordinateMapper_.MapCameraPointsToColorSpace((const Vec3f*)vertices.data(), vertices.size(),
+                                                   (Vec2f*)cameraToColorMapping);
 }
 
 //
@@ -84,10 +96,7 @@ float3 inline TextureDisplay::UVToNormalizedDeviceCoordinate(float2 uv) {
 
 //
 // Maps from 3D camera space to 2D color coordinates.
-// This function uses a pre-saved mapping table.
-//
-// TODO: Do we want this to stay this way and save out the mapping when creating the snapshot?
-//       Or do we want to use the KINECT API here instead? (probably slower)
+// This function uses the mapping table filled by MapVerticesToColorSpace().
 //
 bool inline TextureDisplay::map_camera_to_color_space(int indexStartingAtOne, float2* out) {
     float2 result = cameraToColorMapping[indexStartingAtOne - 1];
@@ -97,7 +106,10 @@ bool inline TextureDisplay::map_camera_to_color_space(int indexStartingAtOne, fl
     out->u = result.u / 1920.f;
     out->v = result.v / 1080.f;
 
-    return !(result.u == 0 && result.v == 0);
+    return (std::isfinite(result.u) &&
+            std::isfinite(result.v) &&
+            result.u > 0            &&
+            result.v > 0);
 }
 
 inline float DotProduct(float3 a, float3 b) {
@@ -140,7 +152,7 @@ void TextureDisplay::fill_cpu_buffers() {
 
     size_t count = 0;
 
-    cv::Mat im = cv::imread(meta.colorFile);
+    cv::Mat im = ReadSnapshotColorImage(meta.colorFile);
 
 
     for (size_t i = 0; i < numFaces; ++i) {
@@ -157,17 +169,9 @@ void TextureDisplay::fill_cpu_buffers() {
         bool success = true;
         float2 uv1, uv2, uv3;
 
-        // This is the version that uses KINECT API
-
-        success = success && MapCameraToColorSpace(v1, uv1);
-        success = success && MapCameraToColorSpace(v2, uv2);
-        success = success && MapCameraToColorSpace(v3, uv3);
-
-        // Uses a pre-saved table for the mapping
-
-        // success = success && map_camera_to_color_space(face.v1, &uv1);
-        // success = success && map_camera_to_color_space(face.v2, &uv2);
-        // success = success && map_camera_to_color_space(face.v3, &uv3);
+        success = success && map_camera_to_color_space(face.v1, &uv1);
+        success = success && map_camera_to_color_space(face.v2, &uv2);
+        success = success && map_camera_to_color_space(face.v3, &uv3);
 
         float3 n1  = getNormal(face.v1);
         float3 n2  = getNormal(face.v2);
@@ -385,7 +389,7 @@ void TextureDisplay::initializeGL()
     f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     f->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
-    cv::Mat cv_tex = cv::imread(meta.colorFile);
+    cv::Mat cv_tex = ReadSnapshotColorImage(meta.colorFile);
     cv::cvtColor(cv_tex, cv_tex, CV_BGR2BGRA);
 
     f->glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA, cv_tex.cols, cv_tex.rows, 0, GL_BGRA, GL_UNSIGNED_BYTE, cv_tex.ptr());
@@ -1,12 +1,11 @@
 #ifndef TEXTURE_DISPLAY_H
 #define TEXTURE_DISPLAY_H
 
-#include <Kinect.h>
-
 #include <QOpenGLWidget>
 #include <QOpenGLShaderProgram>
 #include <opencv2/opencv.hpp>
 
+#include "CoordinateMapper.h"
 #include "util.h"
 
 struct float3 {
@@ -27,7 +26,7 @@ class TextureDisplay : public QOpenGLWidget
 {
     Q_OBJECT
 public:
-    TextureDisplay(ICoordinateMapper* coordinateMapper, std::string metaFileLocation);
+    TextureDisplay(const CameraCalibration& calibration, std::string metaFileLocation);
     virtual ~TextureDisplay();
 
 
@@ -41,13 +40,13 @@ private:
     void load_obj(std::string objFile);
     void fill_cpu_buffers();
     void loadMappingFile();
-    bool MapCameraToColorSpace(float3 pos, float2& out);
+    void MapVerticesToColorSpace();
     bool map_camera_to_color_space(int index, float2* out);
     float3 UVToNormalizedDeviceCoordinate(float2 uv);
 
     SnapshotMetaInformation meta;
 
-    ICoordinateMapper* coordinateMapper_;
+    CoordinateMapper coordinateMapper_;
 
     float2 getTexCoord(int indexStartingAtOne);
     float3 getVertex(int indexStartingAtOne);
@@ -3,6 +3,17 @@
 
 #include <cstdint>
 
+struct Vec2f {
+    Vec2f () {}
+
+    Vec2f (float x, float y) {
+        X = x;
+        Y = y;
+    }
+
+    float X, Y;
+};
+
 struct Vec3f {
     Vec3f () {}
 
@@ -9,6 +9,10 @@
 
 #include <LandmarkCoreIncludes.h>
 
+#include "MemoryPool.h"
+#include "TaskScheduler.h"
+#include "util.h"
+
 std::string readStyleSheet() {
 
     std::ifstream stylesheetFile("..\\..\\data\\stylesheet.txt");
@@ -31,8 +35,6 @@ std::string readStyleSheet() {
  */
 Q_DECLARE_METATYPE(size_t)
 
-#include "MemoryPool.h"
-
 int main(int argc, char *argv[])
 {
 
@@ -40,6 +42,8 @@ int main(int argc, char *argv[])
      * Register types, so that they can be used in Qt's Signal/Slot - Mechanism
      */
     qRegisterMetaType<size_t>("size_t");
+    qRegisterMetaType<SnapshotMetaInformation>("SnapshotMetaInformation");
+    qRegisterMetaType<PointCloudHandle>("PointCloudHandle");
 
     /*
      * Set the Format for OpenGL.
@@ -85,5 +89,13 @@ int main(int argc, char *argv[])
     //
     // Qt Main Loop
     //
-    return a.exec();
+    int result = a.exec();
+
+    //
+    // Finish queued work, e.g. snapshots that are still being saved, while the window and the buffers
+    // it refers to still exist
+    //
+    theTaskScheduler.Shutdown();
+
+    return result;
 }
@@ -2,16 +2,23 @@
 #define UTIL_H
 
 #include <random>
+#include <algorithm>
 #include <stdint.h>
+#include <charconv>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include <QPixmap>
 #include <QDebug>
 #include <QFileInfo>
+#include <QMetaType>
+#include <QThread>
 
+#include "DepthConversion.h"
 #include "MemoryPool.h"
+#include "TaskScheduler.h"
 
 #include "Types.h"
 
@@ -30,30 +37,172 @@ static int LinearIndex(int row, int col, int width) {
     return result;
 }
 
-static uint8_t SafeTruncateTo8Bit(int32_t val) {
-    uint8_t result = val;
-    if (val > 255) {
-        result = 255;
-    } else if (val < 0) {
-        result = 0;
+//
+// Number of threads to use for a requested thread count. Values <= 0 mean "all cores".
+//
+static int ResolveThreadCount(int numThreads) {
+    if (numThreads <= 0) {
+        numThreads = QThread::idealThreadCount();
     }
-    return result;
+    return numThreads < 1 ? 1 : numThreads;
+}
+
+//
+// Number of chunks ParallelFor() splits count items into. Callers that keep per-chunk state
+// size their arrays with this.
+//
+static size_t ParallelChunkCount(size_t count, int numThreads) {
+    size_t numChunks = (size_t)ResolveThreadCount(numThreads);
+    if (numChunks > count) { numChunks = count > 0 ? count : 1; }
+    return numChunks;
+}
+
+//
+// ParallelFor splits [0, count) into numThreads contiguous chunks and calls work(begin, end, chunk)
+// once per chunk. The partition only depends on count and numThreads, so two calls with the same
+// arguments see the same chunks. The chunks run on the workers of theTaskScheduler, the calling
+// thread takes part.
+//
+template<typename Work>
+static void ParallelFor(size_t count, int numThreads, Work work) {
+    size_t numChunks = ParallelChunkCount(count, numThreads);
+    size_t chunkSize = (count + numChunks - 1) / numChunks;
+
+    theTaskScheduler.RunChunks(numChunks, [&](size_t chunk) {
+        size_t begin = std::min(count, chunk * chunkSize);
+        size_t end   = std::min(count, begin + chunkSize);
+        work(begin, end, chunk);
+    });
+}
+
+//
+// Text point cloud format: one "x y z r g b nx ny nz" line per point, colors in [0, 255]
+//
+// Lines are formatted with std::to_chars into blocks of POINTCLOUD_TEXT_BLOCK_POINTS points, each block is
+// written with a single call. Floats get the shortest representation that reads back to the same value,
+// so LoadPointCloudText() restores positions and normals exactly.
+//
+
+const size_t POINTCLOUD_TEXT_BLOCK_POINTS = 16384;
+
+// Longest to_chars output of a float ("-1.17549435e-38") and of an int, plus separator
+const size_t POINTCLOUD_TEXT_FLOAT_FIELD = 16;
+const size_t POINTCLOUD_TEXT_INT_FIELD   = 12;
+const size_t MAX_POINTCLOUD_TEXT_LINE    = 6 * POINTCLOUD_TEXT_FLOAT_FIELD + 3 * POINTCLOUD_TEXT_INT_FIELD;
+
+template<typename T>
+static inline char* AppendTextField(char* out, T value, char separator) {
+    out = std::to_chars(out, out + POINTCLOUD_TEXT_FLOAT_FIELD, value).ptr;
+    *out++ = separator;
+    return out;
+}
+
+static inline char* FormatTextPoint(char* out, float x, float y, float z, int r, int g, int b, float nx, float ny, float nz) {
+    out = AppendTextField(out, x,  ' ');
+    out = AppendTextField(out, y,  ' ');
+    out = AppendTextField(out, z,  ' ');
+    out = AppendTextField(out, r,  ' ');
+    out = AppendTextField(out, g,  ' ');
+    out = AppendTextField(out, b,  ' ');
+    out = AppendTextField(out, nx, ' ');
+    out = AppendTextField(out, ny, ' ');
+    out = AppendTextField(out, nz, '\n');
+    return out;
+}
+
+//
+// Writes numPoints lines, formatPoint(i, out) formats point i to out and returns the end of the line.
+// With writeInBackground, every block is written on a worker while the next block is formatted.
+//
+template<typename FormatPoint>
+static bool WritePointCloudText(const std::string& filename, size_t numPoints, FormatPoint formatPoint,
+                                bool writeInBackground) {
+    std::ofstream resultFile(filename, std::ios::binary);
+
+    if (!resultFile.is_open()) {
+        return false;
+    }
+
+    // Kept for the next file written on this thread. Workers see their own thread_local, so the chunks
+    // below use the buffers of the calling thread through this pointer.
+    static thread_local std::vector<char> threadBlocks[2];
+    std::vector<char>* blocks = threadBlocks;
+    blocks[0].resize(POINTCLOUD_TEXT_BLOCK_POINTS * MAX_POINTCLOUD_TEXT_LINE);
+    blocks[1].resize(POINTCLOUD_TEXT_BLOCK_POINTS * MAX_POINTCLOUD_TEXT_LINE);
+    size_t blockSize[2] = { 0, 0 };
+
+    auto formatBlock = [&](size_t block) {
+        size_t begin = block * POINTCLOUD_TEXT_BLOCK_POINTS;
+        size_t end   = std::min(numPoints, begin + POINTCLOUD_TEXT_BLOCK_POINTS);
+
+        char* start = blocks[block % 2].data();
+        char* out   = start;
+        for (size_t i = begin; i < end; ++i) {
+            out = formatPoint(i, out);
+        }
+        blockSize[block % 2] = out - start;
+    };
+
+    auto writeBlock = [&](size_t block) {
+        resultFile.write(blocks[block % 2].data(), blockSize[block % 2]);
+    };
+
+    size_t numBlocks = (numPoints + POINTCLOUD_TEXT_BLOCK_POINTS - 1) / POINTCLOUD_TEXT_BLOCK_POINTS;
+
+    if (writeInBackground) {
+        for (size_t block = 0; block <= numBlocks; ++block) {
+            theTaskScheduler.RunChunks(2, [&](size_t chunk) {
+                if (chunk == 0 && block < numBlocks) { formatBlock(block); }
+                if (chunk == 1 && block > 0)         { writeBlock(block - 1); }
+            });
+        }
+    } else {
+        for (size_t block = 0; block < numBlocks; ++block) {
+            formatBlock(block);
+            writeBlock(block);
+        }
+    }
+
+    resultFile.close();
+    return !resultFile.fail();
 }
 
-static uint8_t FloatToUINT8(float val) {
-    // Round to integer
-    int32_t iVal = (int32_t)floorf(val);
-    // 0 to 255
-    return SafeTruncateTo8Bit(iVal);
+static bool SavePointCloud(std::string filename, const Vec3f* points, const RGB3f* colors, const Vec3f* normals,
+                           size_t numPoints, bool writeInBackground = false) {
+    return WritePointCloudText(filename, numPoints, [=](size_t i, char* out) {
+        const Vec3f& point  = points[i];
+        const RGB3f& color  = colors[i];
+        const Vec3f& normal = normals[i];
+
+        return FormatTextPoint(out, point.X, point.Y, point.Z,
+                               (int)(color.R * 255.0f), (int)(color.G * 255.0f), (int)(color.B * 255.0f),
+                               normal.X, normal.Y, normal.Z);
+    }, writeInBackground);
 }
 
+//
+// Writes the same text format as above from structure of arrays storage
+//
+static bool SavePointCloud(std::string filename, const PointCloudPlanes* planes, bool writeInBackground = false) {
+    return WritePointCloudText(filename, planes->numPoints, [=](size_t i, char* out) {
+        uint32_t color = planes->colors[i];
+
+        return FormatTextPoint(out, planes->X[i], planes->Y[i], planes->Z[i],
+                               (int)(color & 0xFF), (int)((color >> 8) & 0xFF), (int)((color >> 16) & 0xFF),
+                               planes->normalX[i], planes->normalY[i], planes->normalZ[i]);
+    }, writeInBackground);
+}
 
-static void SavePointCloud(std::string filename, Vec3f* points, RGB3f* colors, Vec3f* normals, size_t numPoints) {
+//
+// Previous text writer, formatting through iostreams and flushing every line. Its floats keep only six
+// significant digits. Kept as the reference for the benchmark.
+//
+static bool SavePointCloudStream(std::string filename, Vec3f* points, RGB3f* colors, Vec3f* normals, size_t numPoints) {
     std::ofstream resultFile;
     resultFile.open(filename);
 
     if (!resultFile.is_open()) {
-        return;
+        return false;
     }
 
     for (size_t i = 0; i < numPoints; ++i) {
@@ -74,23 +223,197 @@ static void SavePointCloud(std::string filename, Vec3f* points, RGB3f* colors, V
     }
 
     resultFile.close();
+    return !resultFile.fail();
+}
+
+//
+// Binary point cloud format
+//
+// A PointCloudFileHeader followed by raw blocks in the in-memory layout of PointCloudBuffer
+// (native byte order, i.e. little endian):
+//   positions           numPoints    * Vec3f
+//   colors              numPoints    * RGB3f
+//   normals             numPoints    * Vec3f
+//   landmarks           numLandmarks * uint64_t
+//   depth pixel indices numPoints    * int32_t   (only if POINTCLOUD_FILE_ORGANIZED is set)
+//
+// Blocks start at the offsets stored in the header and are aligned to POINTCLOUD_FILE_BLOCK_ALIGNMENT,
+// so a reader can map the file and use the blocks in place (see PointCloudHelpers::MappedPointCloud).
+// Readers reject files with a newer version, older versions have to stay readable.
+//
+const char     POINTCLOUD_FILE_MAGIC[4] = { 'F', 'S', 'P', 'C' };
+const uint32_t POINTCLOUD_FILE_VERSION = 1;
+const uint64_t POINTCLOUD_FILE_BLOCK_ALIGNMENT = 64;
+
+enum PointCloudFileFlags {
+    POINTCLOUD_FILE_ORGANIZED = 1 << 0,
+};
+
+struct PointCloudFileHeader {
+    char     magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t numLandmarks;
+    uint64_t numPoints;
+
+    // Byte offsets from the start of the file, 0 for blocks that are not present
+    uint64_t positionsOffset;
+    uint64_t colorsOffset;
+    uint64_t normalsOffset;
+    uint64_t landmarksOffset;
+    uint64_t depthPixelIndicesOffset;
+};
+
+static_assert(sizeof(PointCloudFileHeader) == 64, "PointCloudFileHeader is part of the file format");
+static_assert(sizeof(Vec3f) == 3 * sizeof(float) && sizeof(RGB3f) == 3 * sizeof(float),
+              "The binary point cloud format stores Vec3f and RGB3f as they are laid out in memory");
+
+static uint64_t AlignToPointCloudBlock(uint64_t offset) {
+    return (offset + POINTCLOUD_FILE_BLOCK_ALIGNMENT - 1) / POINTCLOUD_FILE_BLOCK_ALIGNMENT * POINTCLOUD_FILE_BLOCK_ALIGNMENT;
+}
+
+static PointCloudFileHeader MakePointCloudFileHeader(uint64_t numPoints, uint32_t numLandmarks, uint32_t flags) {
+    PointCloudFileHeader header;
+    memcpy(header.magic, POINTCLOUD_FILE_MAGIC, sizeof(header.magic));
+    header.version      = POINTCLOUD_FILE_VERSION;
+    header.flags        = flags;
+    header.numLandmarks = numLandmarks;
+    header.numPoints    = numPoints;
+
+    uint64_t offset = AlignToPointCloudBlock(sizeof(PointCloudFileHeader));
+    header.positionsOffset = offset;  offset = AlignToPointCloudBlock(offset + numPoints * sizeof(Vec3f));
+    header.colorsOffset    = offset;  offset = AlignToPointCloudBlock(offset + numPoints * sizeof(RGB3f));
+    header.normalsOffset   = offset;  offset = AlignToPointCloudBlock(offset + numPoints * sizeof(Vec3f));
+    header.landmarksOffset = offset;  offset = AlignToPointCloudBlock(offset + numLandmarks * sizeof(uint64_t));
+    header.depthPixelIndicesOffset = (flags & POINTCLOUD_FILE_ORGANIZED) ? offset : 0;
+
+    return header;
+}
+
+//
+// Checks that data of the given size starts with a header this version can read and that all blocks
+// lie within the data.
+//
+static bool ReadPointCloudFileHeader(const uchar* data, uint64_t size, PointCloudFileHeader* header) {
+    if (size < sizeof(PointCloudFileHeader)) { return false; }
+
+    memcpy(header, data, sizeof(PointCloudFileHeader));
+
+    if (memcmp(header->magic, POINTCLOUD_FILE_MAGIC, sizeof(header->magic)) != 0) { return false; }
+    if (header->version > POINTCLOUD_FILE_VERSION) { return false; }
+    if (header->numPoints > size || header->numLandmarks > NUM_LANDMARKS) { return false; }
+
+    auto blockFits = [&](uint64_t offset, uint64_t blockSize) {
+        return offset % POINTCLOUD_FILE_BLOCK_ALIGNMENT == 0 && offset <= size && blockSize <= size - offset;
+    };
+
+    uint64_t n = header->numPoints;
+    if (!blockFits(header->positionsOffset, n * sizeof(Vec3f)))                         { return false; }
+    if (!blockFits(header->colorsOffset,    n * sizeof(RGB3f)))                         { return false; }
+    if (!blockFits(header->normalsOffset,   n * sizeof(Vec3f)))                         { return false; }
+    if (!blockFits(header->landmarksOffset, header->numLandmarks * sizeof(uint64_t)))   { return false; }
+    if ((header->flags & POINTCLOUD_FILE_ORGANIZED) &&
+        !blockFits(header->depthPixelIndicesOffset, n * sizeof(int32_t)))               { return false; }
+
+    return true;
+}
+
+static void WritePointCloudBlock(std::ofstream& file, uint64_t offset, const void* data, uint64_t size) {
+    static const char zeros[POINTCLOUD_FILE_BLOCK_ALIGNMENT] = {};
+    uint64_t position = (uint64_t)file.tellp();
+    file.write(zeros, offset - position);
+    file.write((const char*)data, size);
+}
+
+static bool SavePointCloudBinary(std::string filename, const PointCloudBuffer* buf) {
+    std::ofstream resultFile(filename, std::ios::binary);
+
+    if (!resultFile.is_open()) {
+        qCritical() << "Cannot open point cloud file for writing to " << QString::fromStdString(filename);
+        return false;
+    }
+
+    uint32_t flags = buf->isOrganized ? POINTCLOUD_FILE_ORGANIZED : 0;
+    PointCloudFileHeader header = MakePointCloudFileHeader(buf->numPoints, buf->numLandmarks, flags);
+
+    uint64_t landmarks[NUM_LANDMARKS];
+    for (int i = 0; i < buf->numLandmarks; ++i) { landmarks[i] = buf->landmarkIndices[i]; }
+
+    resultFile.write((const char*)&header, sizeof(header));
+    WritePointCloudBlock(resultFile, header.positionsOffset, buf->points,  buf->numPoints * sizeof(Vec3f));
+    WritePointCloudBlock(resultFile, header.colorsOffset,    buf->colors,  buf->numPoints * sizeof(RGB3f));
+    WritePointCloudBlock(resultFile, header.normalsOffset,   buf->normals, buf->numPoints * sizeof(Vec3f));
+    WritePointCloudBlock(resultFile, header.landmarksOffset, landmarks,    buf->numLandmarks * sizeof(uint64_t));
+    if (buf->isOrganized) {
+        WritePointCloudBlock(resultFile, header.depthPixelIndicesOffset, buf->depthPixelIndices, buf->numPoints * sizeof(int32_t));
+    }
+
+    resultFile.close();
+    return !resultFile.fail();
+}
+
+//
+// Writes the binary format from structure of arrays storage. The planes carry no landmarks.
+//
+static bool SavePointCloudBinary(std::string filename, const PointCloudPlanes* planes) {
+    std::ofstream resultFile(filename, std::ios::binary);
+
+    if (!resultFile.is_open()) {
+        qCritical() << "Cannot open point cloud file for writing to " << QString::fromStdString(filename);
+        return false;
+    }
+
+    PointCloudFileHeader header = MakePointCloudFileHeader(planes->numPoints, 0, 0);
+    resultFile.write((const char*)&header, sizeof(header));
+
+    // Interleave the planes in chunks
+    const size_t chunkSize = 4096;
+    std::vector<Vec3f> points(chunkSize);
+    std::vector<RGB3f> colors(chunkSize);
+
+    for (size_t begin = 0; begin < planes->numPoints; begin += chunkSize) {
+        size_t end = std::min(planes->numPoints, begin + chunkSize);
+        for (size_t i = begin; i < end; ++i) { points[i - begin] = Vec3f(planes->X[i], planes->Y[i], planes->Z[i]); }
+        WritePointCloudBlock(resultFile, header.positionsOffset + begin * sizeof(Vec3f), points.data(), (end - begin) * sizeof(Vec3f));
+    }
+
+    for (size_t begin = 0; begin < planes->numPoints; begin += chunkSize) {
+        size_t end = std::min(planes->numPoints, begin + chunkSize);
+        for (size_t i = begin; i < end; ++i) { colors[i - begin] = UnpackRGBA8(planes->colors[i]); }
+        WritePointCloudBlock(resultFile, header.colorsOffset + begin * sizeof(RGB3f), colors.data(), (end - begin) * sizeof(RGB3f));
+    }
+
+    for (size_t begin = 0; begin < planes->numPoints; begin += chunkSize) {
+        size_t end = std::min(planes->numPoints, begin + chunkSize);
+        for (size_t i = begin; i < end; ++i) { points[i - begin] = Vec3f(planes->normalX[i], planes->normalY[i], planes->normalZ[i]); }
+        WritePointCloudBlock(resultFile, header.normalsOffset + begin * sizeof(Vec3f), points.data(), (end - begin) * sizeof(Vec3f));
+    }
+
+    // Empty landmark block, keeps the file size consistent with the header
+    WritePointCloudBlock(resultFile, header.landmarksOffset, nullptr, 0);
+
+    resultFile.close();
+    return !resultFile.fail();
 }
 
+//
+// Snapshot images are written on workers, where QPixmap must not be used, so they are saved from a QImage
+//
 static bool SaveColorImage(std::string filename, uint32_t* colors) {
-    QPixmap pixmap = QPixmap::fromImage(QImage((uchar*)colors,
-                                               COLOR_WIDTH,
-                                               COLOR_HEIGHT,
-                                               QImage::Format_RGBA8888));
+    QImage image((uchar*)colors,
+                 COLOR_WIDTH,
+                 COLOR_HEIGHT,
+                 QImage::Format_RGBA8888);
 
-    return pixmap.save(QString::fromStdString(filename), "BMP");
+    return image.save(QString::fromStdString(filename), "BMP");
 }
 
 static bool SaveDepthImage(std::string filename, uint8_t* depth) {
-    QPixmap pixmap = QPixmap::fromImage(QImage((uchar*)depth,
-                                               DEPTH_WIDTH,
-                                               DEPTH_HEIGHT,
-                                               QImage::Format_Grayscale8));
-    return pixmap.save(QString::fromStdString(filename), "BMP");
+    QImage image((uchar*)depth,
+                 DEPTH_WIDTH,
+                 DEPTH_HEIGHT,
+                 QImage::Format_Grayscale8);
+    return image.save(QString::fromStdString(filename), "BMP");
 }
 
 static void LoadDepthImage() {
@@ -136,20 +459,43 @@ static bool LoadLandmarks(std::string landmarkIndicesFilename, size_t* landmarks
     return true;
 }
 
+enum PointCloudFileFormat {
+    POINTCLOUD_FORMAT_TEXT,
+    POINTCLOUD_FORMAT_BINARY,
+    POINTCLOUD_FORMAT_COMPRESSED,  // See PointCloudCompression.h
+};
+
+static const char* PointCloudFileFormatName(PointCloudFileFormat format) {
+    switch (format) {
+    case POINTCLOUD_FORMAT_BINARY:     return "binary";
+    case POINTCLOUD_FORMAT_COMPRESSED: return "compressed";
+    default:                           return "text";
+    }
+}
+
 struct SnapshotMetaInformation {
     std::string pointCloudFile;
     std::string landmarkFile;
     std::string colorFile;
     std::string depthFile;
     std::string meshFile;
+
+    // Meta files written before the binary format existed have no format entry and are text
+    PointCloudFileFormat pointCloudFormat = POINTCLOUD_FORMAT_TEXT;
+
+    // Empty for snapshots saved before thumbnails existed
+    std::string thumbnailFile;
 };
 
-static void WriteMetaFile(std::string metaFile, SnapshotMetaInformation metaInfo) {
+// Passed to the slots of listeners, see LoadScanSessionAsync()
+Q_DECLARE_METATYPE(SnapshotMetaInformation)
+
+static bool WriteMetaFile(std::string metaFile, SnapshotMetaInformation metaInfo) {
     std::ofstream resultFile(metaFile);
 
     if (!resultFile.is_open()) {
         qCritical() << "Cannot open meta File for writing to " << QString::fromStdString(metaFile);
-        return;
+        return false;
     }
 
     resultFile << metaInfo.pointCloudFile << std::endl;
@@ -157,8 +503,13 @@ static void WriteMetaFile(std::string metaFile, SnapshotMetaInformation metaInfo
     resultFile << metaInfo.depthFile      << std::endl;
     resultFile << metaInfo.landmarkFile   << std::endl;
     resultFile << metaInfo.meshFile       << std::endl;
+    resultFile << PointCloudFileFormatName(metaInfo.pointCloudFormat) << std::endl;
+    if (!metaInfo.thumbnailFile.empty()) {
+        resultFile << metaInfo.thumbnailFile << std::endl;
+    }
 
     resultFile.close();
+    return !resultFile.fail();
 }
 
 static bool LoadMetaFile(std::string metaFile, SnapshotMetaInformation* metaInfo) {
@@ -175,6 +526,21 @@ static bool LoadMetaFile(std::string metaFile, SnapshotMetaInformation* metaInfo
     if (!(resultFile >> metaInfo->landmarkFile))   { return false; }
     if (!(resultFile >> metaInfo->meshFile))       { return false; }
 
+    // Optional
+    std::string pointCloudFormat;
+    if (resultFile >> pointCloudFormat && pointCloudFormat == "binary") {
+        metaInfo->pointCloudFormat = POINTCLOUD_FORMAT_BINARY;
+    } else if (pointCloudFormat == "compressed") {
+        metaInfo->pointCloudFormat = POINTCLOUD_FORMAT_COMPRESSED;
+    } else {
+        metaInfo->pointCloudFormat = POINTCLOUD_FORMAT_TEXT;
+    }
+
+    // Optional, follows the format entry
+    if (!(resultFile >> metaInfo->thumbnailFile)) {
+        metaInfo->thumbnailFile.clear();
+    }
+
     return true;
 }
 
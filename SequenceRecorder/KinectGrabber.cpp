@@ -3,6 +3,8 @@
 
 #include <iostream>
 
+#include "../FaceScanKinect/src/DepthConversion.h"
+
 /**
  * Template function for Releasing various resources from the Kinect API
  */
@@ -249,23 +251,6 @@ inline UINT16 Clamp(UINT16 val, UINT16 min, UINT16 max) {
 }
 */
 
-inline UINT8 SafeTruncateTo8Bit(INT32 val) {
-    UINT8 result = val;
-    if (val > 255) {
-        result = 255;
-    } else if (val < 0) {
-        result = 0;
-    }
-    return result;
-}
-
-inline UINT8 FloatToUINT8(float val) {
-    // Round to integer
-    INT32 iVal = (INT32)floorf(val);
-    // 0 to 255
-    return SafeTruncateTo8Bit(iVal);
-}
-
 /**
  * @brief KinectGrabber::ProcessDepth converts 16bit depth to 8bit and copy to internal buffer
  * @return true on success
@@ -286,15 +271,7 @@ bool KinectGrabber::ProcessDepth() {
         // hr = depthFrame->AccessUnderlyingBuffer(&depthBufferSize, &depthBuffer);
         hr = depthFrame->CopyFrameDataToArray(depthBufferSize, depthBuffer);
         if (SUCCEEDED(hr) && minDistanceAvailabe && maxDistanceAvailable) {
-            float scale = 255.0f / (maxDistance - minDistance);
-            int numPixels = DEPTH_HEIGHT * DEPTH_WIDTH;
-
-            for (int pixel = 0; pixel < numPixels; ++pixel) {
-                INT32 depth = (INT32)depthBuffer[pixel];
-                depth -= (INT32)minDistance;
-                float val = depth * scale;
-                depthBuffer8Bit[pixel] = FloatToUINT8(val);
-            }
+            ConvertDepthTo8Bit(depthBuffer, depthBuffer8Bit, DEPTH_HEIGHT * DEPTH_WIDTH, minDistance, maxDistance);
 
             succeeded = true;
             // emit DepthFrameAvailable((uchar*) depthBuffer8Bit);
@@ -30,6 +30,7 @@ SOURCES += main.cpp\
 HEADERS  += mainwindow.h\
          KinectGrabber.h\
          util.h\
+         ../FaceScanKinect/src/DepthConversion.h\
 
 FORMS    += mainwindow.ui
 